@@ -0,0 +1,99 @@
+
+/** \file array.cpp
+  * \author Peter Wagener
+  * \brief Benchmark of APPEND growth and of loading large .obj meshes.
+  *
+  * First appends as many vertices as meshes of the given face counts
+  * produce, once growing the array by a single element per realloc, as
+  * APPEND did before tracking capacity, and once through APPEND.
+  *
+  * Then generates .obj grids of the same face counts and times
+  * StaticMesh::loadOBJ on them. The figures from before APPEND tracked
+  * capacity are obtained by running this against a library built from
+  * before that change.
+  *
+  * Usage: array [faces ...], defaulting to 1M and 10M faces.
+  */
+
+#define TITLE "diyyma array benchmark"
+#include "bench.h"
+
+struct bench_vertex_t {
+  float p[3], n[3], uv[2];
+};
+
+/** \brief APPEND as it was before the capacity was tracked. */
+#define BENCH_APPEND_OLD(n,o) { \
+  n##_v=(decltype(n##_v))realloc( \
+    (void*)(n##_v), \
+    sizeof(decltype(*n##_v))*((n##_n)+1)); \
+  n##_v[n##_n++]=o; \
+}
+
+static void bench_append(size_t faces) {
+  ARRAY(bench_vertex_t,vertices);
+  bench_vertex_t v;
+  size_t i, count=faces*3;
+  double t0, tOld, tNew;
+  
+  memset(&v,0,sizeof(v));
+  
+  ARRAY_INIT(vertices);
+  t0=clock_seconds();
+  for(i=0;i<count;i++) {
+    v.p[0]=(float)i;
+    BENCH_APPEND_OLD(vertices,v);
+  }
+  tOld=clock_seconds()-t0;
+  ARRAY_DESTROY(vertices);
+  
+  ARRAY_INIT(vertices);
+  t0=clock_seconds();
+  for(i=0;i<count;i++) {
+    v.p[0]=(float)i;
+    APPEND(vertices,v);
+  }
+  tNew=clock_seconds()-t0;
+  ARRAY_DESTROY(vertices);
+  
+  printf("append %10lu vertices: realloc per element %8.3fs, "
+    "APPEND %8.3fs\n",
+    (unsigned long)count,tOld,tNew);
+}
+
+static void bench_load(size_t faces) {
+  StaticMesh *mesh;
+  char *code;
+  size_t cc;
+  double t0, t;
+  
+  code=bench_grid(faces,&cc);
+  
+  mesh=new StaticMesh();
+  mesh->grab();
+  t0=clock_seconds();
+  mesh->loadOBJ(code);
+  glFinish();
+  t=clock_seconds()-t0;
+  mesh->drop();
+  
+  printf("loadOBJ %10lu faces (%lu MB): %8.3fs\n",
+    (unsigned long)faces,(unsigned long)(cc>>20),t);
+  
+  free((void*)code);
+}
+
+int init(int argn, char **argv) {
+  const size_t defaults[2]={1000000, 10000000};
+  int i;
+  
+  if (argn>1) {
+    for(i=1;i<argn;i++) bench_append(strtoul(argv[i],0,10));
+    for(i=1;i<argn;i++) bench_load(strtoul(argv[i],0,10));
+  } else {
+    for(i=0;i<2;i++) bench_append(defaults[i]);
+    for(i=0;i<2;i++) bench_load(defaults[i]);
+  }
+  
+  return 1;
+}
@@ -0,0 +1,76 @@
+/** \file bench.h
+  * \author Peter Wagener
+  * \brief Common setup of benchmarks needing an OpenGL context.
+  *
+  * Sets up DIYYMA_MAIN with a small window. The benchmark runs in init, 
+  * which has to be defined by the including file; the main loop is left 
+  * right after.
+  */
+
+#ifndef _DIYYMA_BENCH_H
+#define _DIYYMA_BENCH_H
+
+#ifndef TITLE
+#define TITLE "diyyma benchmark"
+#endif
+#define WINDOW_WIDTH  64
+#define WINDOW_HEIGHT 64
+#define GL_MAJOR 3
+#define GL_MINOR 3
+#define ITERATE_TIMEOUT 0
+#define AUTORENDER 0
+
+#define DIYYMA_MAIN 1
+#include "diyyma/diyyma.h"
+
+/** \brief Writes an .obj grid of at least faces triangles. */
+static char *bench_grid(size_t faces, size_t *cc) {
+  size_t w, h, x, y, cb, a, b, c, d;
+  char *code, *p;
+  
+  for(w=1;2*w*w<faces;w++) ;
+  h=(faces+2*w-1)/(2*w);
+  
+  cb=(w+1)*(h+1)*96+w*h*2*64+1;
+  p=code=(char*)malloc(cb);
+  
+  for(y=0;y<=h;y++) for(x=0;x<=w;x++) {
+    p+=sprintf(p,"v %lu %lu 0\nvt %f %f\n",
+      (unsigned long)x,(unsigned long)y,(float)x/w,(float)y/h);
+  }
+  p+=sprintf(p,"vn 0 0 1\n");
+  
+  for(y=0;y<h;y++) for(x=0;x<w;x++) {
+    a=y*(w+1)+x+1;
+    b=a+1;
+    c=a+w+1;
+    d=c+1;
+    p+=sprintf(p,"f %lu/%lu/1 %lu/%lu/1 %lu/%lu/1\n",
+      (unsigned long)a,(unsigned long)a,(unsigned long)b,
+      (unsigned long)b,(unsigned long)d,(unsigned long)d);
+    p+=sprintf(p,"f %lu/%lu/1 %lu/%lu/1 %lu/%lu/1\n",
+      (unsigned long)a,(unsigned long)a,(unsigned long)d,
+      (unsigned long)d,(unsigned long)c,(unsigned long)c);
+  }
+
+  *cc=p-code;
+  return code;
+}
+
+void render_pre() {
+}
+
+void render_post() {
+}
+
+void iterate(double dt, double time) {
+  quit();
+}
+
+void event(const SDL_Event *ev) {
+}
+
+void cleanup() {
+}
+
+#endif
@@ -0,0 +1,231 @@
+
+/** \file preprocessor.cpp
+  * \author Peter Wagener
+  * \brief Benchmark of preprocessing shaders with many includes.
+  *
+  * Generates a set of include files and a shader including all of them.
+  * The shader is preprocessed
+  * - with Shader::_preprocess as it was before ShaderPreprocessor, which
+  *   copies the source, reads included files for every shader and splits
+  *   its piece arrays with realloc for every #include,
+  * - with ShaderPreprocessor and its file cache cleared before each run,
+  * - with ShaderPreprocessor reusing the cache, as for every shader after
+  *   the first one including the same files.
+  *
+  * Only #include is ported from the previous preprocessor, so the shader
+  * has no pragmas.
+  *
+  * Usage: preprocessor [files [lines [repeat]]], defaulting to 32 files of
+  * 200 lines, preprocessed 200 times.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diyyma/preprocessor.h"
+#include "diyyma/util.h"
+
+#define BENCH_DIR "preprocessor_bench/"
+
+/** \brief Shader::_preprocess as it was, without pragmas. */
+static int bench_preprocessOld(
+  int subject_idx,
+  void ***code_v, size_t **code_cb_v, char ***files_v, size_t *code_n) {
+  char *fn_new=0, *p, *e, *fn_start, *fn;
+  char *subject, *include_start, *include_end;
+  size_t cb_new, cc_fn, i, cc=(*code_cb_v)[subject_idx];
+  void *data_new;
+  int n_added=0;
+  
+  subject=(char*)(*code_v)[subject_idx];
+  p=subject;
+  e=subject+cc;
+  
+  while(p+11<e) {
+    if ((*p<' ')&&(*p!='\t')&&(p[1]=='#')
+    && (strncmp(p+2,"include ",8)==0)) {
+      include_start=p+1;
+      p+=9;
+      while((p<e)&&((*p==' ')||(*p=='\t'))) p++;
+      
+      fn_start=p;
+      while((p<e)&&(*p>' ')) p++;
+      if ((p>=e) || (p==fn_start)) continue;
+      include_end=p;
+      cc_fn=(size_t)include_end-(size_t)fn_start;
+      
+      fn=(char*)malloc(cc_fn+1);
+      memcpy(fn,fn_start,cc_fn);
+      fn[cc_fn]=0;
+      
+      for(i=0;i<*code_n;i++)
+        if ((*files_v)[i]&&strcmp((*files_v)[i],fn)==0) goto finalize_stmt;
+      
+      if (!(fn_new=vfs_locate(fn,REPOSITORY_MASK_SHADER)))
+        goto finalize_stmt;
+      if (!readFile(fn_new,&data_new,&cb_new)) {
+        free((void*)fn_new);
+        goto finalize_stmt;
+      }
+      
+      (*code_n)+=2;
+      n_added+=2;
+      
+      *code_v   =(void** )realloc((void*)*code_v,(*code_n)*sizeof(void*));
+      *code_cb_v=(size_t*)realloc((void*)*code_cb_v,
+        (*code_n)*sizeof(size_t*));
+      *files_v  =(char** )realloc((void*)*files_v,(*code_n)*sizeof(char*));
+      
+      for(i=*code_n-1;i>(size_t)subject_idx+1;i--) {
+        (*code_v   )[i]=(*code_v   )[i-2];
+        (*code_cb_v)[i]=(*code_cb_v)[i-2];
+        (*files_v  )[i]=(*files_v  )[i-2];
+      }
+      
+      (*code_cb_v)[subject_idx]=(size_t)include_start-(size_t)subject;
+      
+      (*code_v   )[subject_idx+1]=data_new;
+      (*code_cb_v)[subject_idx+1]=cb_new;
+      (*files_v  )[subject_idx+1]=fn_new;
+      
+      (*code_v   )[subject_idx+2]=include_end;
+      (*code_cb_v)[subject_idx+2]=(size_t)e-(size_t)include_end;
+      (*files_v  )[subject_idx+2]=0;
+      
+      subject=include_end;
+      subject_idx+=2;
+      
+      subject_idx+=bench_preprocessOld(
+        subject_idx-1,code_v,code_cb_v,files_v,code_n);
+      
+      finalize_stmt:
+      memset(include_start,' ',(size_t)include_end-(size_t)include_start);
+      free((void*)fn);
+      p--;
+    }
+    p++;
+  }
+  
+  return n_added;
+}
+
+/** \brief Preprocesses code the previous way, freeing everything again.
+  *
+  * \return Number of pieces.
+  */
+static size_t bench_runOld(const char *code) {
+  void **code_v;
+  size_t *code_cb_v, code_n=1, i;
+  char **files_v;
+  
+  code_v   =(void** )malloc(sizeof(void*));
+  code_cb_v=(size_t*)malloc(sizeof(size_t*));
+  files_v  =(char** )malloc(sizeof(char*));
+  code_v[0]   =(void*)strdup(code);
+  code_cb_v[0]=strlen(code);
+  files_v[0]  =0;
+  
+  bench_preprocessOld(0,&code_v,&code_cb_v,&files_v,&code_n);
+  
+  free(code_v[0]);
+  for(i=1;i<code_n;i++) if (files_v[i]) {
+    free((void*)code_v[i]);
+    free((void*)files_v[i]);
+  }
+  free((void*)code_v);
+  free((void*)code_cb_v);
+  free((void*)files_v);
+  
+  return code_n;
+}
+
+/** \brief Writes the include files and returns the shader including all
+  * of them.
+  */
+static char *bench_files(int files, int lines) {
+  ARRAY(char,text);
+  char path[256], line[128];
+  char *code;
+  int f, l, cc;
+  
+  ARRAY_INIT(text);
+  dir_create(BENCH_DIR);
+  
+  for(f=0;f<files;f++) {
+    text_n=0;
+    for(l=0;l<lines;l++) {
+      cc=snprintf(line,sizeof(line),
+        "float lib%i_%i(float x) { return x*%i.0+%i.0; }\n",f,l,f,l);
+      ARRAY_SETSIZE(text,text_n+cc);
+      memcpy(text_v+text_n-cc,line,cc);
+    }
+    snprintf(path,sizeof(path),BENCH_DIR "lib%i.glsl",f);
+    writeFile(path,text_v,text_n);
+  }
+  
+  // the previous preprocessor only found directives after a line break
+  text_n=0;
+  cc=snprintf(line,sizeof(line),"#version 330\n");
+  ARRAY_SETSIZE(text,text_n+cc);
+  memcpy(text_v+text_n-cc,line,cc);
+  for(f=0;f<files;f++) {
+    cc=snprintf(line,sizeof(line),"#include lib%i.glsl\n",f);
+    ARRAY_SETSIZE(text,text_n+cc);
+    memcpy(text_v+text_n-cc,line,cc);
+  }
+  cc=snprintf(line,sizeof(line),
+    "void main(void) {\n  gl_Position=vec4(0.0);\n}\n");
+  ARRAY_SETSIZE(text,text_n+cc+1);
+  memcpy(text_v+text_n-cc-1,line,cc+1);
+  
+  code=strdup(text_v);
+  ARRAY_DESTROY(text);
+  
+  return code;
+}
+
+int main(int argn, char **argv) {
+  int files=32, lines=200, repeat=200, r;
+  ShaderPreprocessor pp;
+  size_t pieces=0, segments=0;
+  double t0, tOld, tCold, tWarm;
+  char *code;
+  
+  if (argn>1) files=atoi(argv[1]);
+  if (argn>2) lines=atoi(argv[2]);
+  if (argn>3) repeat=atoi(argv[3]);
+  if (files<1 || lines<1 || repeat<1) return 1;
+  
+  vfs_registerPath(BENCH_DIR,REPOSITORY_MASK_SHADER);
+  code=bench_files(files,lines);
+  
+  t0=clock_seconds();
+  for(r=0;r<repeat;r++) pieces=bench_runOld(code);
+  tOld=clock_seconds()-t0;
+  
+  t0=clock_seconds();
+  for(r=0;r<repeat;r++) {
+    preprocessor_cache_clear();
+    segments=pp.run(code,0,"main");
+  }
+  tCold=clock_seconds()-t0;
+  
+  t0=clock_seconds();
+  for(r=0;r<repeat;r++) segments=pp.run(code,0,"main");
+  tWarm=clock_seconds()-t0;
+  
+  printf("%i files of %i lines, %lu characters, %lu pieces before, "
+    "%lu segments now\n",
+    files,lines,(unsigned long)pp.cc(),(unsigned long)pieces,
+    (unsigned long)segments);
+  printf("before:             %8.3f ms/shader\n",tOld*1e3/repeat);
+  printf("uncached:           %8.3f ms/shader\n",tCold*1e3/repeat);
+  printf("cached:             %8.3f ms/shader\n",tWarm*1e3/repeat);
+  
+  pp.clear();
+  preprocessor_cache_clear();
+  free((void*)code);
+  
+  return 0;
+}
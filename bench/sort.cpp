@@ -0,0 +1,156 @@
+
+/** \file sort.cpp
+  * \author Peter Wagener
+  * \brief Benchmark of sorting nodes by float keys.
+  *
+  * Sorts node indices by distance-like float keys with the recursive
+  * quicksort sortByKeys used before, with the current sortByKeys and with
+  * sortByFloatKeys. Keys come in three orders:
+  * - random,
+  * - coherent: the order of the previous frame, with every key moved by a
+  *   little, as when the camera moves,
+  * - sorted.
+  *
+  * Usage: sort [keys ...], defaulting to 1k, 100k and 1M keys.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diyyma/util.h"
+
+#define BENCH_ORDERS 3
+#define BENCH_METHODS 3
+
+/** \brief sortByKeys as it was before, recursing on both partitions.
+  *
+  * The left recursion is guarded, the original underflowed its size_t
+  * bound for an empty left partition at index 0.
+  */
+template<class T, class K> static void bench_quickSort(
+  T *objects, K *keys,
+  size_t l, size_t r) {
+  size_t s, i;
+  K pr;
+  
+  if (r<=l) return;
+  
+  s=(l+r)/2;
+  
+  if (keys[l]<keys[r]) {
+    if (keys[s]<keys[l]) s=l;
+    else if (keys[r]<keys[s]) s=r;
+  } else {
+    if (keys[s]<keys[r]) s=r;
+    else if (keys[l]<keys[s]) s=l;
+  }
+  
+  pr=keys[s];
+  { T t=objects[s]; objects[s]=objects[r]; objects[r]=t; }
+  { K t=keys[s]; keys[s]=keys[r]; keys[r]=t; }
+  
+  s=l;
+  for(i=l;i<r;i++) if (keys[i]<pr) {
+    { T t=objects[i]; objects[i]=objects[s]; objects[s]=t; }
+    { K t=keys[i]; keys[i]=keys[s]; keys[s]=t; }
+    s++;
+  }
+  { T t=objects[s]; objects[s]=objects[r]; objects[r]=t; }
+  { K t=keys[s]; keys[s]=keys[r]; keys[r]=t; }
+  
+  if (s>l) bench_quickSort<T,K>(objects,keys,l,s-1);
+  bench_quickSort<T,K>(objects,keys,s+1,r);
+}
+
+/** \brief Fills keys in one of the benchmarked orders. */
+static void bench_keys(float *keys, size_t n, int order) {
+  size_t i;
+  
+  for(i=0;i<n;i++) {
+    switch(order) {
+      case 0: keys[i]=(float)randf()*1000.0f; break;
+      case 1: keys[i]=(float)i+(float)randf()*4.0f; break;
+      default: keys[i]=(float)i; break;
+    }
+  }
+}
+
+/** \brief Sorts n keys repeat times, returning the time per sort in
+  * milliseconds.
+  */
+static double bench_sort(
+  int method, const float *input, size_t n, int repeat) {
+  float *keys;
+  size_t *objects, *tmpObjects, i;
+  u_int32_t *tmpKeys;
+  double t0, t=0;
+  int r;
+  
+  keys=(float*)malloc(sizeof(float)*n);
+  objects=(size_t*)malloc(sizeof(size_t)*n);
+  tmpObjects=(size_t*)malloc(sizeof(size_t)*n);
+  tmpKeys=(u_int32_t*)malloc(sizeof(u_int32_t)*2*n);
+  
+  for(r=0;r<repeat;r++) {
+    memcpy(keys,input,sizeof(float)*n);
+    for(i=0;i<n;i++) objects[i]=i;
+    
+    t0=clock_seconds();
+    switch(method) {
+      case 0: bench_quickSort<size_t,float>(objects,keys,0,n-1); break;
+      case 1: sortByKeys<size_t,float>(objects,keys,n); break;
+      default:
+        sortByFloatKeys<size_t>(objects,keys,n,tmpObjects,tmpKeys);
+        break;
+    }
+    t+=clock_seconds()-t0;
+    
+    for(i=1;i<n;i++) if (keys[i-1]>keys[i]) {
+      printf("WARNING: method %i left keys unsorted\n",method);
+      break;
+    }
+  }
+  
+  free((void*)keys);
+  free((void*)objects);
+  free((void*)tmpObjects);
+  free((void*)tmpKeys);
+  
+  return t*1e3/repeat;
+}
+
+static void bench_run(size_t n) {
+  const char *orders[BENCH_ORDERS]={ "random", "coherent", "sorted" };
+  float *input;
+  int order, method, repeat;
+  
+  if (n<1) return;
+  repeat=n<=1000?1000:n<=100000?20:5;
+  input=(float*)malloc(sizeof(float)*n);
+  
+  for(order=0;order<BENCH_ORDERS;order++) {
+    bench_keys(input,n,order);
+    printf("%8lu keys, %-8s:",(unsigned long)n,orders[order]);
+    for(method=0;method<BENCH_METHODS;method++)
+      printf(" %10.4f",bench_sort(method,input,n,repeat));
+    printf(" ms\n");
+  }
+  
+  free((void*)input);
+}
+
+int main(int argn, char **argv) {
+  const size_t defaults[3]={1000, 100000, 1000000};
+  int i;
+  
+  printf("%24s %10s %10s %10s\n",
+    "","quicksort","sortByKeys","float keys");
+  if (argn>1) {
+    for(i=1;i<argn;i++) bench_run(strtoul(argv[i],0,10));
+  } else {
+    for(i=0;i<3;i++) bench_run(defaults[i]);
+  }
+  
+  return 0;
+}
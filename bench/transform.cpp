@@ -0,0 +1,115 @@
+
+/** \file transform.cpp
+  * \author Peter Wagener
+  * \brief Benchmark of absolute transformations of animated scene nodes.
+  *
+  * Builds a hierarchy of nodes with four children each and animates every
+  * node each frame. The absolute transformations of all nodes are then
+  * obtained by:
+  * - walking up to the root for every node, as absTransform did before it
+  *   cached its result,
+  * - scene_update_transforms followed by ISceneNode::absTransform,
+  * - TransformStore::update, with all nodes attached to the store.
+  *
+  * Usage: transform [nodes [frames]], defaulting to 100k nodes and 20
+  * frames.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "diyyma/scenegraph.h"
+#include "diyyma/util.h"
+
+#define BENCH_CHILDREN 4
+
+/** \brief Creates count nodes, parents preceding their children. */
+static STSceneNode **bench_tree(size_t count) {
+  STSceneNode **nodes;
+  size_t idx;
+  
+  nodes=(STSceneNode**)malloc(sizeof(STSceneNode*)*count);
+  nodes[0]=new STSceneNode(0);
+  nodes[0]->grab();
+  for(idx=1;idx<count;idx++)
+    nodes[idx]=new STSceneNode(nodes[(idx-1)/BENCH_CHILDREN]);
+  
+  return nodes;
+}
+
+static Matrixf bench_animation(size_t idx, int frame) {
+  float a=(float)(idx%97)*0.01f+(float)frame*0.02f;
+  float c=cosf(a), s=sinf(a);
+  return Matrixf(
+    c,-s,0,0.5f,
+    s, c,0,0.0f,
+    0, 0,1,0.1f,
+    0, 0,0,1);
+}
+
+/** \brief Absolute transformation without any caching. */
+static Matrixf bench_walk(ISceneNode *node) {
+  Matrixf M=node->transform();
+  ISceneNode *p;
+  for(p=node->parent();p;p=p->parent()) M=p->transform()*M;
+  return M;
+}
+
+int main(int argn, char **argv) {
+  size_t count=100000, idx;
+  int frames=20, frame;
+  STSceneNode **nodes;
+  TransformStore *store;
+  double t0, tWalk, tCached, tStore;
+  float sum=0;
+  
+  if (argn>1) count=strtoul(argv[1],0,10);
+  if (argn>2) frames=atoi(argv[2]);
+  if (count<1 || frames<1) return 1;
+  
+  nodes=bench_tree(count);
+  
+  t0=clock_seconds();
+  for(frame=0;frame<frames;frame++) {
+    for(idx=0;idx<count;idx++)
+      nodes[idx]->staticTransform=bench_animation(idx,frame);
+    for(idx=0;idx<count;idx++) sum+=bench_walk(nodes[idx]).a14;
+  }
+  tWalk=clock_seconds()-t0;
+  
+  t0=clock_seconds();
+  for(frame=0;frame<frames;frame++) {
+    for(idx=0;idx<count;idx++)
+      nodes[idx]->staticTransform=bench_animation(idx,frame);
+    scene_update_transforms();
+    for(idx=0;idx<count;idx++) sum+=nodes[idx]->absTransform().a14;
+  }
+  tCached=clock_seconds()-t0;
+  
+  store=new TransformStore();
+  store->grab();
+  for(idx=0;idx<count;idx++) nodes[idx]->attachTransformStore(store);
+  
+  t0=clock_seconds();
+  for(frame=0;frame<frames;frame++) {
+    for(idx=0;idx<count;idx++)
+      store->local(nodes[idx]->transformStoreHandle())=
+        bench_animation(idx,frame);
+    store->update();
+    for(idx=0;idx<count;idx++) sum+=nodes[idx]->absTransform().a14;
+  }
+  tStore=clock_seconds()-t0;
+  
+  printf("%lu nodes, %i frames (checksum %g)\n",
+    (unsigned long)count,frames,sum);
+  printf("walk to root:            %8.3f ms/frame\n",tWalk*1e3/frames);
+  printf("scene_update_transforms: %8.3f ms/frame\n",tCached*1e3/frames);
+  printf("TransformStore:          %8.3f ms/frame\n",tStore*1e3/frames);
+  
+  nodes[0]->drop();
+  store->drop();
+  free((void*)nodes);
+  
+  return 0;
+}
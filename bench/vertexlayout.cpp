@@ -0,0 +1,152 @@
+
+/** \file vertexlayout.cpp
+  * \author Peter Wagener
+  * \brief Benchmark of separate versus interleaved vertex buffers.
+  *
+  * Loads the same .obj grid once with one buffer per attribute and once
+  * with STATICMESH_LOAD_INTERLEAVED, both indexed and optimized alike.
+  *
+  * Vertex fetch is measured on the GPU with GL_TIME_ELAPSED, drawing the
+  * full mesh repeatedly with the rasterizer discarding all primitives, so
+  * vertex fetch and shading dominate. Submission is measured on the CPU,
+  * binding and drawing a small mesh many times; with vertex array objects
+  * both layouts take the same calls, without them the interleaved layout
+  * binds its buffer once instead of once per attribute.
+  *
+  * Usage: vertexlayout [faces [repeat]], defaulting to 1M faces drawn 50
+  * times.
+  */
+
+#define TITLE "diyyma vertex layout benchmark"
+#include "bench.h"
+
+static const char *bench_vsd=
+  "#version 330\n"
+  "uniform mat4 u_MVP;\n"
+  "layout(location=0) in vec3 v_position;\n"
+  "layout(location=1) in vec3 v_normal;\n"
+  "layout(location=2) in vec2 v_texcoord;\n"
+  "smooth out vec3 p_normal;\n"
+  "smooth out vec2 p_texcoord;\n"
+  "void main(void) {\n"
+  "  p_normal=v_normal;\n"
+  "  p_texcoord=v_texcoord;\n"
+  "  gl_Position=u_MVP*vec4(v_position,1.0);\n"
+  "}\n";
+
+static const char *bench_fsd=
+  "#version 330\n"
+  "smooth in vec3 p_normal;\n"
+  "smooth in vec2 p_texcoord;\n"
+  "out vec4 f_color;\n"
+  "void main(void) {\n"
+  "  f_color=vec4(p_normal*0.5+0.5,1.0)*p_texcoord.x;\n"
+  "}\n";
+
+#define BENCH_SMALL_FACES 128
+#define BENCH_SMALL_DRAWS 20000
+
+static StaticMesh *bench_mesh(char *code, int flags) {
+  StaticMesh *mesh;
+  
+  mesh=new StaticMesh();
+  mesh->grab();
+  mesh->loadOBJ(code,0,flags);
+  
+  return mesh;
+}
+
+/** \brief Draws mesh repeat times, returning the GPU time in seconds. */
+static double bench_fetch(StaticMesh *mesh, int repeat) {
+  GLuint query;
+  GLuint64 ns=0;
+  int i;
+  
+  glGenQueries(1,&query);
+  glEnable(GL_RASTERIZER_DISCARD);
+  
+  mesh->bind();
+  mesh->send();
+  glFinish();
+  
+  glBeginQuery(GL_TIME_ELAPSED,query);
+  for(i=0;i<repeat;i++) mesh->send();
+  glEndQuery(GL_TIME_ELAPSED);
+  mesh->unbind();
+  
+  glGetQueryObjectui64v(query,GL_QUERY_RESULT,&ns);
+  
+  glDisable(GL_RASTERIZER_DISCARD);
+  glDeleteQueries(1,&query);
+  
+  return ns*1e-9;
+}
+
+/** \brief Binds and draws mesh draws times, returning the CPU time in
+  * seconds.
+  */
+static double bench_submit(StaticMesh *mesh, int draws) {
+  double t0;
+  int i;
+  
+  glEnable(GL_RASTERIZER_DISCARD);
+  glFinish();
+  
+  t0=clock_seconds();
+  for(i=0;i<draws;i++) {
+    mesh->bind();
+    mesh->send();
+    mesh->unbind();
+  }
+  t0=clock_seconds()-t0;
+  
+  glFinish();
+  glDisable(GL_RASTERIZER_DISCARD);
+  
+  return t0;
+}
+
+int init(int argn, char **argv) {
+  const int flags[2]={
+    STATICMESH_LOAD_OPTIMIZE,
+    STATICMESH_LOAD_OPTIMIZE|STATICMESH_LOAD_INTERLEAVED
+  };
+  const char *names[2]={ "separate", "interleaved" };
+  size_t faces=1000000, cc;
+  int repeat=50, i;
+  char *code;
+  StaticMesh *mesh;
+  Shader *shd;
+  Matrixf I;
+  
+  if (argn>1) faces=strtoul(argv[1],0,10);
+  if (argn>2) repeat=atoi(argv[2]);
+  
+  shd=new Shader(bench_vsd,bench_fsd,0);
+  shd->grab();
+  shd->bind();
+  glUniformMatrix4fv(shd->locate("u_MVP"),1,0,&I.a11);
+  
+  for(i=0;i<2;i++) {
+    code=bench_grid(faces,&cc);
+    mesh=bench_mesh(code,flags[i]);
+    printf("%-12s %lu faces x %i: %8.3f ms GPU\n",
+      names[i],(unsigned long)faces,repeat,
+      bench_fetch(mesh,repeat)*1e3);
+    mesh->drop();
+    free((void*)code);
+    
+    code=bench_grid(BENCH_SMALL_FACES,&cc);
+    mesh=bench_mesh(code,flags[i]);
+    printf("%-12s %i draws: %8.3f ms CPU\n",
+      names[i],BENCH_SMALL_DRAWS,
+      bench_submit(mesh,BENCH_SMALL_DRAWS)*1e3);
+    mesh->drop();
+    free((void*)code);
+  }
+  
+  shd->unbind();
+  shd->drop();
+  
+  return 1;
+}
@@ -0,0 +1,116 @@
+/** \file bvh.h
+  * \author Peter Wagener
+  * \brief Dynamic bounding volume hierarchy.
+  *
+  * A binary tree of axis aligned bounding boxes which is kept balanced while
+  * leaves are inserted, moved and removed. Leaves are stored with a margin,
+  * so small movements do not require any change to the tree at all.
+  */
+
+#ifndef _DIYYMA_BVH_H
+#define _DIYYMA_BVH_H
+
+#include "diyyma/math.h"
+#include "diyyma/util.h"
+#include "diyyma/scenecontext.h"
+
+/** \brief Default margin by which leaf boxes are enlarged, relative to
+  * their size.
+  */
+#define BVH_MARGIN 0.1f
+
+/** \brief Number of nodes the traversal stack of a query can hold.
+  *
+  * Traversal keeps at most one node per level plus one. Rebalancing keeps
+  * the subtrees of every node within one level of each other, so a tree of
+  * n leaves is at most 1.44*log2(n+2) levels high, which is below 64 for
+  * any number of leaves an int can index.
+  */
+#define BVH_STACK_SIZE 64
+
+/** \brief Replaces an axis aligned box by the axis aligned box around it
+  * after transformation by M.
+  */
+void bvh_transform_box(const Matrixf &M, Vector3f *bmin, Vector3f *bmax);
+
+/** \brief Called for every leaf found by a query. */
+typedef void (*bvh_callback_t)(void *data, void *arg);
+
+struct bvh_node_t {
+  Vector3f bmin, bmax;
+  int      parent; ///< \brief Also links unused nodes.
+  int      child[2]; ///< \brief Both -1 for leaves.
+  int      height; ///< \brief -1 for unused nodes.
+  void    *data;
+};
+
+class BVH {
+  private:
+    ARRAY(bvh_node_t,_nodes);
+    int _root;
+    int _free;
+    size_t _leaves;
+    
+    int  _allocate();
+    void _release(int node);
+    void _insertLeaf(int leaf);
+    void _removeLeaf(int leaf);
+    int  _balance(int node);
+  
+  public:
+    BVH();
+    ~BVH();
+    
+    /** \brief Margin by which leaf boxes are enlarged, relative to their
+      * size. Defaults to BVH_MARGIN.
+      */
+    float margin;
+    
+    /** \brief Adds a leaf.
+      *
+      * \return Handle of the new leaf, which stays valid until it is
+      * removed.
+      */
+    int insert(const Vector3f &bmin, const Vector3f &bmax, void *data);
+    
+    void remove(int leaf);
+    
+    /** \brief Updates the bounds of a leaf.
+      *
+      * The tree is only changed if the new bounds are not contained in the
+      * enlarged ones the leaf was stored with.
+      *
+      * \return Non-zero if the leaf had to be reinserted.
+      */
+    int move(int leaf, const Vector3f &bmin, const Vector3f &bmax);
+    
+    void *data(int leaf);
+    void setData(int leaf, void *data);
+    
+    /** \brief Number of leaves. */
+    size_t count();
+    
+    /** \brief Number of levels below the root, -1 if the tree is empty. */
+    int height();
+    
+    /** \brief Removes all leaves. */
+    void clear();
+    
+    /** \brief Reports all leaves whose boxes are not outside a frustum.
+      *
+      * Subtrees found to be completely inside are reported without testing
+      * any further.
+      */
+    void queryFrustum(const Frustum &frustum, bvh_callback_t cb, void *arg);
+    
+    /** \brief Reports all leaves whose boxes intersect a sphere. */
+    void querySphere(
+      const Vector3f &center, float radius, bvh_callback_t cb, void *arg);
+    
+    /** \brief Reports all leaves whose boxes intersect a box. */
+    void queryBox(
+      const Vector3f &bmin, const Vector3f &bmax, bvh_callback_t cb,
+      void *arg);
+};
+
+#endif
@@ -123,8 +123,7 @@ struct AssetRecord {
   */
 class AssetReloader : public IComponent {
   private:
-    AssetRecord *_asset_v;
-    size_t       _asset_n;
+    ARRAY(AssetRecord,_asset);
     double       _tCheck;
   public:
     AssetReloader();
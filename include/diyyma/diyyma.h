@@ -11,6 +11,7 @@
 
 #include "diyyma/config.h"
 #include "diyyma/component.h"
+#include "diyyma/jobs.h"
 #include "diyyma/math.h"
 #include "diyyma/shader.h"
 #include "diyyma/staticmesh.h"
@@ -18,6 +19,7 @@
 #include "diyyma/util.h"
 #include "diyyma/scenegraph.h"
 #include "diyyma/renderpass.h"
+#include "diyyma/uniform.h"
 
 
 #include "SDL/SDL.h"
@@ -87,6 +89,21 @@
 #define ZBITS 24
 #endif
 
+#ifndef ASSET_FINISH_BUDGET
+/** \brief Time, in seconds, spent per iteration on finishing assets loaded
+  * asynchronously (see AssetRegistry::getAsync), per asset type.
+  */
+#define ASSET_FINISH_BUDGET 0.002
+#endif
+
+#ifndef SHADER_CACHE_PATH
+/** \brief Directory to cache program binaries in, see
+  * shader_cache_setPath. Defaults to 0, compiling shaders every time;
+  * applications define a directory, e.g. "shadercache/", to opt in.
+  */
+#define SHADER_CACHE_PATH 0
+#endif
+
 ////////////////////////////////////////////////////////////// timey-wimey stuff
 /* 
   SDL_main.h defines a makro called main for some reason, so just undef it here. 
@@ -123,6 +140,21 @@ void registerIterator(IIterator *iter) {
   APPEND(iterator,iter);
 }
 
+/** \brief Minimum number of concurrent iterators run per job. */
+#define ITERATE_GRAIN 64
+
+struct iterate_args_t {
+  double dt, t;
+};
+
+static void _iterateConcurrent(void *arg, size_t begin, size_t end) {
+  iterate_args_t *args=(iterate_args_t*)arg;
+  size_t idx;
+  for(idx=begin;idx<end;idx++) 
+    if (iterator_v[idx]->concurrent()) 
+      iterator_v[idx]->iterate(args->dt,args->t);
+}
+
 void quit() {
   _running=0;
 }
@@ -152,6 +184,7 @@ int main(int argn, char **argv) {
   
   IComponent   **pcomp;
   IIterator    **piter;
+  iterate_args_t iterArgs;
   
   rand_init();
   
@@ -211,6 +244,8 @@ int main(int argn, char **argv) {
   
   printf("OpenGL version: %i.%i\n",vMajor,vMinor);
   
+  shader_cache_setPath(SHADER_CACHE_PATH);
+  
   gSDLWindow=window;
   
   ASSERTJ(
@@ -268,18 +303,41 @@ int main(int argn, char **argv) {
     
     FOREACH(i,pcomp,component)
       if ((*pcomp)->enabled) (*pcomp)->iterate(dt,gTime);
-    FOREACH(i,piter,iterator) (*piter)->iterate(dt,gTime);
+    
+    iterArgs.dt=dt;
+    iterArgs.t =gTime;
+    job_parallel_for(iterator_n,ITERATE_GRAIN,_iterateConcurrent,&iterArgs);
+    FOREACH(i,piter,iterator) 
+      if ((*piter)->concurrent()) (*piter)->sync();
+      else (*piter)->iterate(dt,gTime);
     iterate(dt,gTime);
     
+    scene_update_transforms();
+    
+    // upload whatever the worker threads have prepared in the meantime
+    if (SDL_GL_GetCurrentContext()!=context)
+      SDL_GL_MakeCurrent(window,context);
+    r=
+      reg_mtl ()->finishPending(ASSET_FINISH_BUDGET)+
+      reg_mesh()->finishPending(ASSET_FINISH_BUDGET)+
+      reg_tex ()->finishPending(ASSET_FINISH_BUDGET)+
+      reg_shd ()->finishPending(ASSET_FINISH_BUDGET);
+    if (r) interval(0);
+    
+    // shaders are otherwise resolved when first bound, see Shader::resolve
+    shader_resolve_pending(ASSET_FINISH_BUDGET);
+    
     #if !AUTORENDER
       if(_doRender) {
     #endif
     if (SDL_GL_GetCurrentContext()!=context)
       SDL_GL_MakeCurrent(window,context);
+    uniform_frame_begin();
     render_pre();
     FOREACH(i,pcomp,component) 
       if ((*pcomp)->enabled) (*pcomp)->render();
     render_post();
+    uniform_frame_end();
     SDL_GL_SwapWindow(window);
     #if !AUTORENDER
         _doRender=0;
@@ -300,6 +358,10 @@ int main(int argn, char **argv) {
   reg_tex_free();
   reg_mesh_free();
   reg_mtl_free();
+  uniform_ring_free();
+  shader_cache_setPath(0);
+  
+  jobs_shutdown();
   
   FOREACH(i,pcomp,component) {
     #ifdef DIYYMA_DEBUG
@@ -0,0 +1,105 @@
+/** \file jobs.h
+  * \author Peter Wagener
+  * \brief Minimal worker thread pool.
+  *
+  * Jobs are plain function pointers with a single argument, submitted
+  * against a JobCounter. Waiting on a counter blocks until all jobs
+  * submitted against it have finished; the waiting thread executes pending
+  * jobs itself in the meantime.
+  *
+  * Every worker thread queues the jobs it submits itself, running the 
+  * newest first, and steals the oldest jobs of other threads once it runs
+  * out. Threads outside the pool share a single queue.
+  *
+  * Jobs must not touch the OpenGL context, as it is bound to the main
+  * thread only.
+  */
+
+#ifndef _DIYYMA_JOBS_H
+#define _DIYYMA_JOBS_H
+
+#include "SDL/SDL.h"
+
+typedef void (*job_func_t)(void *arg);
+
+/** \brief Processes the elements [begin,end) of a job_parallel_for. */
+typedef void (*job_range_func_t)(void *arg, size_t begin, size_t end);
+
+/** \brief Number of outstanding jobs submitted against it.
+  *
+  * Must be zero-initialized before its first use.
+  */
+struct JobCounter {
+  SDL_atomic_t pending;
+};
+
+/** \brief Starts the worker threads.
+  *
+  * This is done implicitly on the first submission, so calling it is only
+  * required to specify the number of worker threads.
+  *
+  * \param threads Number of worker threads to create. If less than one,
+  * one thread less than the number of logical CPUs is created.
+  */
+void jobs_init(int threads=0);
+
+/** \brief Finishes all pending jobs and stops the worker threads. */
+void jobs_shutdown();
+
+/** \brief Returns the number of worker threads, not counting the calling
+  * thread.
+  */
+int jobs_thread_count();
+
+/** \brief Queues a job for execution on any worker thread.
+  *
+  * \param counter Counter to increment until the job is done. May be null.
+  */
+void job_submit(job_func_t fn, void *arg, JobCounter *counter);
+
+/** \brief Blocks until all jobs submitted against a counter are finished.
+  */
+void job_wait(JobCounter *counter);
+
+/** \brief Returns the number of jobs still outstanding on a counter.
+  *
+  * Once this returns zero, everything written by the jobs is visible to the
+  * calling thread.
+  */
+int job_pending(JobCounter *counter);
+
+/** \brief Calls fn on disjoint ranges covering [0,n), spread over the 
+  * worker threads, and returns once all of them are done.
+  *
+  * The calling thread processes a range itself. Nothing is queued if n is
+  * at most grain or there are no worker threads.
+  *
+  * \param grain Minimum number of elements per range.
+  */
+void job_parallel_for(
+  size_t n, size_t grain, job_range_func_t fn, void *arg);
+
+/** \brief Global lock guarding the list of used files (see file_list_append) */
+#define JOB_LOCK_FILE_LIST 0
+/** \brief Global lock guarding the image library, which is not reentrant. */
+#define JOB_LOCK_IMAGE     1
+/** \brief Global lock guarding the included files kept in memory by
+  * ShaderPreprocessor.
+  */
+#define JOB_LOCK_PREPROCESSOR 2
+/** \brief Global lock guarding the nodes deferred by 
+  * scene_update_transforms.
+  */
+#define JOB_LOCK_SCENE     3
+
+#define JOB_LOCK_COUNT     4
+
+/** \brief Acquires one of the global JOB_LOCK_* locks.
+  *
+  * The locks only exist while the worker threads are running. Before that,
+  * locking is a no-op, as there is no one to race against.
+  */
+void job_lock(int lock);
+void job_unlock(int lock);
+
+#endif
@@ -30,6 +30,11 @@
   */
 #define MATLIB_LOAD_UPDATE 0x01
 
+/** \brief Material library loading flag causing referenced textures to be
+  * loaded asynchronously (see AssetRegistry::getAsync).
+  */
+#define MATLIB_LOAD_ASYNC 0x02
+
 class Material : public RCObject,
   public IShaderReferrer,
   public ITextureReferrer<MAX_MATERIAL_TEXTURES>
@@ -69,7 +74,12 @@ struct NamedMaterial {
 class MaterialLibrary : public IAsset {
   private:
     ARRAY(NamedMaterial,_materials);
+    StringIndex _index;
     char *_filename;
+    
+    char  *_preparedFilename;
+    void  *_preparedData;
+    size_t _preparedCb;
   
   public:
     MaterialLibrary();
@@ -84,6 +94,10 @@ class MaterialLibrary : public IAsset {
     virtual void reload();
     virtual timestamp_t filesTimestamp();
     virtual int load(const char *fn, int flags);
+    
+    /** \brief Reads the library file, which is parsed in finish. */
+    virtual int prepare(const char *fn, int flags);
+    virtual int finish(const char *fn, int flags);
 };
 
 AssetRegistry<MaterialLibrary> *reg_mtl();
@@ -0,0 +1,113 @@
+/** \file meshopt.h
+  * \author Peter Wagener
+  * \brief Index and vertex buffer reordering for faster rendering.
+  *
+  * All functions operate on indexed triangle lists with 32 bit indices.
+  * Typically, triangles are first reordered for the post-transform vertex
+  * cache, then clustered and sorted to reduce overdraw, and finally vertices
+  * are reordered to match the order they are first referenced in.
+  */
+
+#ifndef _DIYYMA_MESHOPT_H
+#define _DIYYMA_MESHOPT_H
+
+#include <stdlib.h>
+
+#include "diyyma/math.h"
+#include "diyyma/util.h"
+
+/** \brief Number of entries in the cache modelled by
+  * meshopt_optimize_vertex_cache.
+  */
+#define MESHOPT_CACHE_SIZE 32
+
+/** \brief FIFO cache size assumed when judging and reporting cache
+  * efficiency, close to what actual hardware does.
+  */
+#define MESHOPT_FIFO_SIZE 16
+
+/** \brief Default for the threshold of meshopt_optimize_overdraw. */
+#define MESHOPT_OVERDRAW_THRESHOLD 1.05f
+
+/** \brief Reorders triangles to improve post-transform vertex cache hits.
+  *
+  * Implements Tom Forsyth's linear-speed vertex cache optimisation.
+  *
+  * \param dst Receives index_count indices. May be the same as indices.
+  * \param vertex_count Number of vertices, all indices must be less.
+  */
+void meshopt_optimize_vertex_cache(
+  u_int32_t *dst, const u_int32_t *indices, size_t index_count,
+  size_t vertex_count);
+
+/** \brief Reorders clusters of triangles so that outward facing ones are
+  * drawn first, reducing overdraw.
+  *
+  * The input should already be optimized for the vertex cache. It is split
+  * into clusters wherever the cache is restarted, and further wherever
+  * doing so keeps the cache miss ratio of the cluster within threshold times
+  * the original one. Clusters are then sorted by how far out they face
+  * relative to the centroid of the mesh.
+  *
+  * \param dst Receives index_count indices. May be the same as indices.
+  * \param positions Vertex positions, vertex_count entries.
+  * \param threshold Allowed degradation of the cache miss ratio, e.g. 1.05.
+  */
+void meshopt_optimize_overdraw(
+  u_int32_t *dst, const u_int32_t *indices, size_t index_count,
+  const Vector3f *positions, size_t vertex_count, float threshold);
+
+/** \brief Renumbers vertices in the order they are first referenced.
+  *
+  * The indices are rewritten in place. Vertices which are not referenced at
+  * all are moved to the end.
+  *
+  * \param remap Receives vertex_count entries, the new position of each
+  * vertex. Vertex data has to be moved accordingly.
+  * \return Number of referenced vertices.
+  */
+size_t meshopt_optimize_vertex_fetch(
+  u_int32_t *remap, u_int32_t *indices, size_t index_count,
+  size_t vertex_count);
+
+/** \brief Simulates a FIFO vertex cache over an index buffer.
+  *
+  * \param acmr Receives the average cache miss ratio, i.e. the number of
+  * transformed vertices per triangle (0.5 at best, 3 at worst).
+  * \param atvr Receives the average transformed vertex ratio, i.e. the
+  * number of transformed vertices per vertex (1 at best).
+  */
+void meshopt_analyze_vertex_cache(
+  const u_int32_t *indices, size_t index_count, size_t vertex_count,
+  int cache_size, float *acmr, float *atvr);
+
+/** \brief Reduces the number of triangles by collapsing edges in the order
+  * of least quadric error (Garland and Heckbert).
+  *
+  * Vertices are only ever moved onto one of their neighbours, so the 
+  * result references the same vertices as the input. Vertices on open 
+  * borders stay in place, as do those where a collapse would flip a 
+  * triangle.
+  *
+  * Two distinct vertices sharing a position form an attribute seam. They
+  * only move along the seam, both at once onto the vertices at the same
+  * position on either side, so the seam stays closed. Positions shared by
+  * more than two vertices, such as the corners of flat shaded meshes or
+  * where seams meet, stay in place. Flat shaded meshes therefore do not 
+  * simplify unless they are smoothed first. All of this may keep the 
+  * target from being reached.
+  *
+  * \param dst Receives up to index_count indices. May be the same as 
+  * indices.
+  * \param positions Vertex positions, vertex_count entries.
+  * \param target_index_count Number of indices to stop at.
+  * \param result_error If non-null, receives the largest error of any 
+  * collapse, approximately the distance of the result to the input surface.
+  * \return Number of indices written to dst.
+  */
+size_t meshopt_simplify(
+  u_int32_t *dst, const u_int32_t *indices, size_t index_count,
+  const Vector3f *positions, size_t vertex_count, size_t target_index_count,
+  float *result_error);
+
+#endif
@@ -0,0 +1,113 @@
+/** \file occlusion.h
+  * \author Peter Wagener
+  * \brief Occlusion culling against a software rasterized depth buffer.
+  *
+  * A few large occluders are rasterized on the CPU into a small depth
+  * buffer, from which a hierarchical-Z pyramid of farthest depths is built.
+  * Bounding boxes are then tested against the pyramid level where they
+  * cover only a handful of texels. None of this touches the GL, so results
+  * are available before any draw call is made.
+  */
+
+#ifndef _DIYYMA_OCCLUSION_H
+#define _DIYYMA_OCCLUSION_H
+
+#include "diyyma/math.h"
+#include "diyyma/util.h"
+
+/** \brief Default width of the depth buffer of an OcclusionCuller. */
+#define OCCLUSION_WIDTH 256
+/** \brief Default height of the depth buffer of an OcclusionCuller. */
+#define OCCLUSION_HEIGHT 128
+
+/** \brief Maximum number of levels of the hierarchical-Z pyramid. */
+#define OCCLUSION_MAX_LEVELS 16
+
+/** \brief Counts of the last frame of an OcclusionCuller. */
+struct occlusion_stats_t {
+  size_t occluders;
+  size_t triangles; ///< \brief Occluder triangles rasterized.
+  size_t tested;    ///< \brief Boxes tested against the pyramid.
+  size_t culled;    ///< \brief Boxes found to be hidden.
+};
+
+class OcclusionCuller {
+  private:
+    int _width, _height;
+    
+    /** \brief All levels of the pyramid, level 0 being the depth buffer. */
+    ARRAY(float,_depth);
+    int    _levels;
+    int    _levelWidth[OCCLUSION_MAX_LEVELS];
+    int    _levelHeight[OCCLUSION_MAX_LEVELS];
+    size_t _levelOffset[OCCLUSION_MAX_LEVELS];
+    
+    /** \brief Clip space vertices of the current occluder. */
+    ARRAY(float,_clip);
+    
+    Matrixf _VP;
+    occlusion_stats_t _stats;
+    
+    void _rasterize(const float *const *v, int n);
+    void _clipPolygon(const float *const *v, int n);
+  
+  public:
+    OcclusionCuller();
+    ~OcclusionCuller();
+    
+    /** \brief Sets the resolution of the depth buffer.
+      *
+      * The width is rounded up to a multiple of four. Defaults to
+      * OCCLUSION_WIDTH by OCCLUSION_HEIGHT.
+      */
+    void resize(int width, int height);
+    
+    int width();
+    int height();
+    
+    /** \brief Clears the depth buffer and resets the statistics.
+      *
+      * \param VP Transformation from world space into clip space.
+      */
+    void begin(const Matrixf &VP);
+    
+    /** \brief Rasterizes the triangles of an occluder.
+      *
+      * Both sides of each triangle are drawn, so the winding does not
+      * matter. Only pixels covered entirely are written, with the farthest
+      * depth within them. Pixels along edges shared by two triangles are
+      * covered by neither, unless the two are consecutive and form a flat
+      * quad, so occluders are best built from quads. Occluders should still
+      * not extend beyond the geometry they stand for, or visible objects
+      * may be culled.
+      *
+      * \param M Transformation from the space of positions into world
+      * space.
+      */
+    void addOccluder(const Matrixf &M, const Vector3f *positions,
+      const u_int32_t *indices, size_t indexCount);
+    
+    /** \brief Builds the hierarchical-Z pyramid from the depth buffer. Has
+      * to be called after all occluders were added, before any test.
+      */
+    void end();
+    
+    /** \brief Tests whether a box may be visible.
+      *
+      * Boxes crossing the near plane or lying off screen are always
+      * considered visible.
+      *
+      * \param M Transformation from the space of the box into world space.
+      * \return Zero if the box is hidden behind the occluders.
+      */
+    int test(const Matrixf &M, const Vector3f &bmin, const Vector3f &bmax);
+    
+    /** \brief Returns the level 0 depth buffer, rows from bottom to top,
+      * holding normalized device depth.
+      */
+    const float *depth();
+    
+    const occlusion_stats_t &stats();
+};
+
+#endif
@@ -0,0 +1,131 @@
+/** \file preprocessor.h
+  * \author Peter Wagener
+  * \brief Preprocessing of GLSL sources, independent of the GL.
+  *
+  * The following directives are handled, each on a line of its own:
+  * - #include name: inserts the file located through vfs_locate, once per
+  *   program.
+  * - #pragma loop-begin count / #pragma loop-end: repeats the lines in
+  *   between count times. Loops may be nested.
+  * - #pragma TFB mode separate|interleaved and #pragma TFB varying name:
+  *   collected for Shader to set up transform feedback.
+  *
+  * The result is a list of segments pointing into the original code and
+  * into included files, which are read once and kept in memory for as long
+  * as they do not change on disk. Nothing is copied, so the list is passed
+  * to glShaderSource as is. The content of a file a ShaderPreprocessor
+  * refers to is kept until its output is cleared, even if the file changes
+  * or the cache is cleared in the meantime.
+  *
+  * Included files are given source string numbers starting with 1, the
+  * code passed to ShaderPreprocessor::run being 0. #line directives are
+  * emitted wherever the code changes files or lines were dropped, so that
+  * compiler messages of the form "n(line)" refer to ShaderPreprocessor::file
+  * n and the line in that file.
+  */
+
+#ifndef _DIYYMA_PREPROCESSOR_H
+#define _DIYYMA_PREPROCESSOR_H
+
+#include "diyyma/util.h"
+
+/** \brief Maximum depth of nested #include directives. */
+#define PREPROCESSOR_MAX_DEPTH 32
+/** \brief Maximum depth of nested loops within a single file. */
+#define PREPROCESSOR_MAX_LOOPS 16
+
+#define PREPROCESSOR_TFB_UNSET       0
+#define PREPROCESSOR_TFB_SEPARATE    1
+#define PREPROCESSOR_TFB_INTERLEAVED 2
+
+struct preprocessor_buffer_t;
+
+/** \brief A piece of preprocessed code.
+  *
+  * Text generated by the preprocessor itself, such as #line directives, has
+  * a null ptr and is found at offset in the preprocessor's text buffer.
+  */
+struct preprocessor_segment_t {
+  const char *ptr;
+  size_t      offset;
+  size_t      cb;
+};
+
+class ShaderPreprocessor {
+  private:
+    int _mask;
+    
+    ARRAY(preprocessor_segment_t,_segments);
+    ARRAY(char,_text);
+    
+    ARRAY(const char*,_strings);
+    ARRAY(int,_lengths);
+    
+    /** \brief Source file names, by source string number. */
+    ARRAY(char*,_files);
+    /** \brief Contents of the included files the segments point into. */
+    ARRAY(preprocessor_buffer_t*,_buffers);
+    
+    int _tfbMode;
+    ARRAY(char*,_varyings);
+    
+    void _emit(const char *p, size_t cb);
+    void _emitText(const char *fmt, ...);
+    void _process(const char *p, const char *e, int file, int depth);
+    void _pragma(const char *q, const char *eol, int file, unsigned line);
+    int  _include(const char *name, size_t cc, int depth);
+  
+  public:
+    /** \param mask REPOSITORY_MASK_* flags of the repositories included
+      * files are located in.
+      */
+    ShaderPreprocessor(int mask=REPOSITORY_MASK_SHADER);
+    ~ShaderPreprocessor();
+    
+    /** \brief Discards the output of the last run, releasing the included
+      * files it refers to.
+      */
+    void clear();
+    
+    /** \brief Preprocesses code, replacing the output of any previous run.
+      *
+      * The output refers to code, so code must not be changed or freed
+      * while it is used.
+      *
+      * \param cc Number of characters of code, or 0 to use strlen.
+      * \param name File name of code, used in messages. May be null.
+      * \return Number of segments in the output.
+      */
+    size_t run(const char *code, size_t cc, const char *name);
+    
+    /** \brief Number of segments, as passed to glShaderSource. */
+    size_t count();
+    const char *const *strings();
+    const int *lengths();
+    
+    /** \brief Total number of characters of all segments. */
+    size_t cc();
+    
+    /** \brief Number of source strings, i.e. the code itself plus each
+      * included file.
+      */
+    size_t fileCount();
+    /** \brief Name of a source string as used in #line directives. */
+    const char *file(size_t idx);
+    
+    /** \brief Transform feedback mode requested, one of
+      * PREPROCESSOR_TFB_*.
+      */
+    int tfbMode();
+    size_t varyingCount();
+    const char *varying(size_t idx);
+};
+
+/** \brief Frees all included files kept in memory.
+  *
+  * Files still referred to by the output of a ShaderPreprocessor are freed
+  * once that is cleared.
+  */
+void preprocessor_cache_clear();
+
+#endif
@@ -0,0 +1,48 @@
+
+/** \file quantize.h
+  * \author Peter Wagener
+  * \brief Conversion of vertex attributes into compact formats.
+  *
+  * Each function produces a value as the GL expects it for a vertex
+  * attribute of the corresponding type, so all but the octahedral encoding
+  * are decoded by the GL itself.
+  */
+
+#ifndef _DIYYMA_QUANTIZE_H
+#define _DIYYMA_QUANTIZE_H
+
+#include <stdlib.h>
+
+#include "diyyma/math.h"
+#include "diyyma/util.h"
+
+/** \brief Rounds f, clamped to [0,1], to a normalized unsigned short. */
+u_int16_t quantize_unorm16(float f);
+
+/** \brief Rounds f, clamped to [-1,1], to a normalized signed short.
+  *
+  * -32768 is never produced, as the GL maps it to -1 just like -32767.
+  */
+int16_t quantize_snorm16(float f);
+
+/** \brief Converts f to a half float (GL_HALF_FLOAT), rounding to the
+  * nearest value, ties away from zero.
+  *
+  * Values too small for the smallest denormal become zero of the same
+  * sign, values too large become infinity. NaN stays NaN.
+  */
+u_int16_t quantize_half(float f);
+
+/** \brief Packs a vector, clamped to [-1,1], into GL_INT_2_10_10_10_REV
+  * with w=0.
+  */
+u_int32_t quantize_1010102(const Vector3f &v);
+
+/** \brief Octahedral encoding of a unit vector into two normalized signed
+  * shorts, see STATICMESH_LOAD_OCTAHEDRAL for decoding.
+  *
+  * The zero vector is encoded as (0,0).
+  */
+void quantize_octahedral(const Vector3f &v, int16_t *e);
+
+#endif
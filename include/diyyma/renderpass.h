@@ -16,6 +16,9 @@
 #include "diyyma/texture.h"
 #include "diyyma/util.h"
 #include "diyyma/math.h"
+#include "diyyma/bvh.h"
+#include "diyyma/renderqueue.h"
+#include "diyyma/occlusion.h"
 
 #include "SDL/SDL.h"
 
@@ -109,7 +112,165 @@
 
 #define RP_CLEAR (RP_CLEAR_COLOR|RP_CLEAR_DEPTH)
 
+/** \brief Causes the render pass to skip nodes whose bounds lie outside
+  * the view frustum.
+  *
+  * Nodes without bounds (see IRenderableSceneNode::bounds) are always 
+  * rendered. Shaders displacing vertices beyond the bounds of a mesh should
+  * not be used with this.
+  *
+  * The world space bounds of all nodes are kept in a BVH (see NodeCuller),
+  * so only the visible part of the scene is visited. With RP_SORT_NODES, 
+  * only the visible nodes are sorted.
+  */
+#define RP_FRUSTUM_CULL 0x8000
+
+/** \brief Causes an InstanceRenderPass to draw all its nodes in as few draw
+  * calls as possible.
+  *
+  * Instead of setting u_MV and u_MVP per node, the model matrix of each 
+  * node (including StaticMesh::positionTransform) is passed as a mat4 
+  * attribute at BUFIDX_INSTANCE_TRANSFORM, while u_MV and u_MVP only
+  * hold the view part. A vertex shader would read
+  *
+  *      layout(location=8) in mat4 a_M;
+  *      ...
+  *      gl_Position=u_MVP*a_M*vec4(a_position,1);
+  *
+  * Matrices are uploaded in batches of up to INSTANCE_BATCH_SIZE nodes. 
+  * Without OpenGL 3.3, the attribute is set per node instead, so the same 
+  * shader can still be used.
+  */
+#define RP_INSTANCED 0x10000
+
+/** \brief Maximum number of instances drawn in a single call with 
+  * RP_INSTANCED. 
+  */
+#define INSTANCE_BATCH_SIZE 16384
+
+/** \brief Causes a SceneNodeRenderPass without a shader of its own to 
+  * collect the draw calls of its nodes in a RenderQueue, sorted by 
+  * render state.
+  *
+  * Draw order is no longer the order nodes were added in, but front to
+  * back within each state (or back to front with RP_TRANSLUCENT). Nodes 
+  * which do not implement IRenderableSceneNode::enqueue are rendered 
+  * first, in their original order.
+  */
+#define RP_SORT_STATE 0x20000
+
+/** \brief Causes a SceneNodeRenderPass to pick the level of detail of each
+  * visible node from its projected size (see 
+  * IRenderableSceneNode::selectLOD and lodPixelError).
+  *
+  * The level is kept by the node, so passes without this flag, such as 
+  * shadow passes, draw whatever level was picked last.
+  */
+#define RP_LOD 0x40000
 
+/** \brief Causes a SceneNodeRenderPass to skip nodes hidden behind the
+  * geometry of its occluder nodes (see IRenderableSceneNode::occluder).
+  *
+  * Occluders are rasterized into a small depth buffer on the CPU, which the
+  * bounds of all nodes are tested against (see OcclusionCuller). This is
+  * done after frustum culling, if enabled, so only occluders within the
+  * frustum are drawn.
+  */
+#define RP_OCCLUSION_CULL 0x80000
+
+
+
+/** \brief Minimum number of nodes per job when transforming bounds in
+  * NodeCuller::end.
+  */
+#define CULL_GRAIN 1024
+
+/** \brief Entry of the list of visible nodes of a NodeCuller. */
+struct culled_node_t {
+  size_t index; ///< \brief Index of the node in the render pass.
+  double key;   ///< \brief Sort key, initially the index.
+};
+
+/** \brief Bounds of a node recorded by NodeCuller::refit. */
+struct culled_box_t {
+  Matrixf  M;
+  Vector3f bmin, bmax; ///< \brief Object space, world space after end.
+  int      bounded;
+};
+
+/** \brief Keeps the world space bounds of the nodes of a render pass in a
+  * BVH for frustum culling.
+  *
+  * Nodes are identified by their index. Bounds are only refit when the 
+  * number of nodes, any absolute transformation (scene_transform_version) 
+  * or any mesh (StaticMesh::BoundsGeneration) changed since the last time,
+  * and the tree itself only changes for nodes which left the margin they 
+  * were inserted with.
+  *
+  * World space bounds are computed on the worker threads, while the tree
+  * is updated on the calling thread.
+  */
+class NodeCuller {
+  private:
+    BVH _bvh;
+    ARRAY(int,_leaves);
+    ARRAY(culled_box_t,_boxes);
+    ARRAY(size_t,_unbounded);
+    ARRAY(culled_node_t,_visible);
+    ARRAY(int,_reorder);
+    size_t _nodeCount;
+    unsigned _transformVersion;
+    unsigned _boundsGeneration;
+    int _valid;
+    
+    static void _collect(void *data, void *arg);
+    static void _transformBoxes(void *arg, size_t begin, size_t end);
+  
+  public:
+    NodeCuller();
+    ~NodeCuller();
+    
+    /** \brief Starts updating the bounds of n nodes.
+      *
+      * \return Non-zero if bounds may be outdated. In that case, refit has
+      * to be called for every node, followed by end.
+      */
+    int begin(size_t n);
+    
+    /** \brief Sets the bounds of a node.
+      *
+      * \param M Absolute transformation of the node.
+      * \param bmin,bmax Object space bounds. If null, the node is considered
+      * to be visible all the time.
+      */
+    void refit(size_t idx, const Matrixf &M, 
+      const Vector3f *bmin, const Vector3f *bmax);
+    
+    /** \brief Applies the bounds set by refit to the tree. */
+    void end();
+    
+    /** \brief Forces all bounds to be refit. */
+    void invalidate();
+    
+    /** \brief Follows a reordering of the nodes without touching the tree.
+      *
+      * \param order Previous index of the node now at each index.
+      */
+    void reorder(const size_t *order, size_t n);
+    
+    /** \brief Collects the nodes not outside the frustum of a 
+      * view-projection matrix, in ascending order of their indices.
+      *
+      * \return Number of visible nodes.
+      */
+    size_t query(const Matrixf &VP);
+    
+    /** \brief Result of the last query. */
+    culled_node_t *visible();
+    
+    /** \brief Sorts the result of the last query by key. */
+    void sortVisible();
+};
 
 class IRenderPass : public IComponent {
   protected:
@@ -170,7 +331,15 @@ class SceneNodeRenderPass :
   public IShaderReferrer {
   private:
     ARRAY(IRenderableSceneNode*,_nodes);
-    ARRAY(double,_distance);
+    ARRAY(float,_distance);
+    ARRAY(IRenderableSceneNode*,_sortNodes);
+    ARRAY(u_int32_t,_sortKeys);
+    ARRAY(size_t,_order);
+    ARRAY(size_t,_sortOrder);
+    NodeCuller _culler;
+    RenderQueue _queue;
+    OcclusionCuller _occlusion;
+    ARRAY(culled_node_t,_unoccluded);
     
     GLint _u_MVP;
     GLint _u_MV;
@@ -180,7 +349,10 @@ class SceneNodeRenderPass :
     GLint _u_time;
     GLint _u_camPos_w;
     
-    
+    size_t _occludeNodes(
+      const culled_node_t *visible, size_t count, const Matrixf &MVP);
+  
+  
   public:
     SceneNodeRenderPass();
     ~SceneNodeRenderPass();
@@ -188,6 +360,11 @@ class SceneNodeRenderPass :
     Matrixf transformLeft;
     Matrixf transformRight;
     
+    /** \brief Largest simplification error in pixels accepted with RP_LOD.
+      * Defaults to 1.
+      */
+    float lodPixelError;
+    
     void sortByDistance(const Vector3f &center);
     /** \brief sorts by distance to the camera, taken from context()->MV.
       */
@@ -195,6 +372,19 @@ class SceneNodeRenderPass :
     
     void operator+=(IRenderableSceneNode *node);
     
+    /** \brief Bind counts of the last frame rendered with RP_SORT_STATE.*/
+    const renderqueue_stats_t &queueStats();
+    
+    /** \brief The culler used with RP_OCCLUSION_CULL, e.g. to change its
+      * resolution.
+      */
+    OcclusionCuller *occlusionCuller();
+    
+    /** \brief Cull counts of the last frame rendered with 
+      * RP_OCCLUSION_CULL.
+      */
+    const occlusion_stats_t &occlusionStats();
+    
     virtual void updateUniforms();
     virtual void applyUniforms(SceneContext ctx);
     
@@ -214,7 +404,15 @@ class InstanceRenderPass :
   public ILightControllerReferrer {
   private:
     ARRAY(ISceneNode*,_nodes);
-    ARRAY(double,_distance);
+    ARRAY(float,_distance);
+    ARRAY(ISceneNode*,_sortNodes);
+    ARRAY(u_int32_t,_sortKeys);
+    ARRAY(size_t,_order);
+    ARRAY(size_t,_sortOrder);
+    NodeCuller _culler;
+    StaticMesh *_culledMesh;
+    ARRAY(Matrixf,_instances);
+    GLuint _b_instances;
     
     GLint _u_MVP;
     GLint _u_MV;
@@ -224,6 +422,8 @@ class InstanceRenderPass :
     GLint _u_time;
     GLint _u_camPos_w;
     
+    void _sendInstanced(size_t count, const culled_node_t *visible);
+  
   public:
     InstanceRenderPass();
     ~InstanceRenderPass();
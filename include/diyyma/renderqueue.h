@@ -0,0 +1,131 @@
+/** \file renderqueue.h
+  * \author Peter Wagener
+  * \brief Ordering of draw calls by render state.
+  *
+  * Renderable scene nodes describe their draw calls as items holding the
+  * shader, textures and mesh they need (see IRenderableSceneNode::enqueue).
+  * The queue sorts all items by a 64 bit key derived from that state and
+  * submits them, skipping any bind whose state is already current.
+  */
+
+#ifndef _DIYYMA_RENDERQUEUE_H
+#define _DIYYMA_RENDERQUEUE_H
+
+#include "diyyma/util.h"
+#include "diyyma/math.h"
+#include "diyyma/shader.h"
+#include "diyyma/texture.h"
+#include "diyyma/staticmesh.h"
+#include "diyyma/scenegraph.h"
+#include "diyyma/scenecontext.h"
+
+/** \brief Number of textures per item, each bound to the slot of its
+  * index.
+  */
+#define RENDERQUEUE_TEXTURES TEXTURE_SLOTS
+
+/** \brief A single draw call in a RenderQueue. */
+struct render_item_t {
+  u_int64_t   key;
+  
+  Shader     *shader;
+  Texture    *textures[RENDERQUEUE_TEXTURES];
+  GLint       textureLocs[RENDERQUEUE_TEXTURES];
+  StaticMesh *mesh;
+  int         slice; ///< \brief Material slice to send, -1 for all faces.
+  int         lod;   ///< \brief Level of detail of the mesh to send.
+  
+  /** \brief Model matrix, including the geometry transform. */
+  Matrixf     M;
+  
+  /** \brief Node receiving IRenderableSceneNode::applyQueued. */
+  IRenderableSceneNode *node;
+  /** \brief Passed back to the node along with the item. */
+  void       *data;
+};
+
+/** \brief Bind counts of the last RenderQueue::submit.
+  *
+  * Each item would have bound its shader, textures and mesh without the
+  * queue, so binds plus avoided binds is the number of items.
+  */
+struct renderqueue_stats_t {
+  size_t items;
+  size_t custom; ///< \brief Items rendered by IRenderableSceneNode::render.
+  size_t shaderBinds, shaderBindsAvoided;
+  size_t textureBinds, textureBindsAvoided;
+  size_t meshBinds, meshBindsAvoided;
+};
+
+struct renderqueue_entry_t {
+  u_int64_t key;
+  size_t    index;
+};
+
+class RenderQueue {
+  private:
+    ARRAY(render_item_t,_items);
+    ARRAY(renderqueue_entry_t,_order);
+    ARRAY(renderqueue_entry_t,_swap);
+    
+    Shader     *_shader;
+    Texture    *_textures[RENDERQUEUE_TEXTURES];
+    StaticMesh *_mesh;
+    
+    renderqueue_stats_t _stats;
+    
+    void _reset();
+  
+  public:
+    RenderQueue();
+    ~RenderQueue();
+    
+    /** \brief Removes all items. */
+    void clear();
+    
+    /** \brief Adds an item to be filled in by the caller.
+      *
+      * All pointers are cleared, slice and texture locations are set to -1,
+      * lod to 0 and M to the identity. The pointer is valid until the next 
+      * call to add.
+      */
+    render_item_t *add(IRenderableSceneNode *node);
+    
+    /** \brief Adds a node which renders itself.
+      *
+      * Such nodes are rendered before all others, in the order they were
+      * added.
+      */
+    void addCustom(IRenderableSceneNode *node);
+    
+    /** \brief Computes the keys of all items and sorts them.
+      *
+      * Items are grouped by shader, then textures, then mesh, and front to
+      * back within each group. If translucent is non-zero, they are sorted
+      * back to front first.
+      *
+      * Keys are computed on the worker threads (see job_parallel_for).
+      *
+      * \param MV The view part of the model-view matrix.
+      */
+    void sort(const Matrixf &MV, int translucent);
+    
+    /** \brief Renders all items in sorted order.
+      *
+      * Shader, textures and mesh are only bound if they differ from the
+      * previous item's. Everything is unbound afterwards.
+      */
+    void submit(SceneContext ctx);
+    
+    size_t count();
+    
+    /** \brief Returns the item submit renders at position idx, in the
+      * order of the last sort.
+      */
+    render_item_t *sorted(size_t idx);
+    
+    /** \brief Returns the bind counts of the last submit. */
+    const renderqueue_stats_t &stats();
+};
+
+#endif
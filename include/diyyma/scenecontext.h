@@ -40,6 +40,31 @@ struct SceneContext {
   
 };
 
+/** \brief The six planes bounding the volume visible through a 
+  * model-view-projection matrix, in the model space of that matrix.
+  *
+  * Planes face inwards, i.e. a point p is inside if 
+  * planes[i].x*p.x+planes[i].y*p.y+planes[i].z*p.z+planes[i].w>=0 
+  * for all planes.
+  */
+struct Frustum {
+  Vector4f planes[6];
+  
+  /** \brief Extracts the planes from a model-view-projection matrix. */
+  void set(const Matrixf &MVP);
+  
+  /** \brief Returns non-zero if an axis aligned box lies completely
+    * outside.
+    *
+    * This is conservative: boxes near the edges of the frustum may be 
+    * reported as visible although they are not.
+    */
+  int cullBox(const Vector3f &bmin, const Vector3f &bmax) const;
+  
+  /** \brief Returns non-zero if a sphere lies completely outside. */
+  int cullSphere(const Vector3f &center, float radius) const;
+};
+
 /** \brief Interface for a source of a scene context, usually something
   * like a camera or an offscreen render pass.
   *
@@ -54,6 +79,15 @@ class ISceneContextSource : public virtual IRCObject {
     virtual SceneContext context() =0;
 };
 
+/** \brief Writes P, V, camPos_w and time of a context into the
+  * UNIFORM_BINDING_FRAME block and binds it.
+  *
+  * Render passes call this once their context is final, so shaders
+  * declaring the block get these values without any node setting them.
+  * Passes with the same context in the same frame share the data.
+  */
+void scene_context_bind(const SceneContext &ctx);
+
 class ISceneContextReferrer {
   protected:
     ISceneContextSource *_contextSource;
@@ -25,14 +25,29 @@
 #include "diyyma/math.h"
 #include "diyyma/bezier.h"
 #include "diyyma/scenecontext.h"
+#include "diyyma/uniform.h"
+#include "diyyma/bvh.h"
 
 class LightSceneNode;
+class RenderQueue;
+struct render_item_t;
 
 class ILightController : public virtual RCObject {
   public:
     virtual ~ILightController() { }
     virtual void activate(Shader *shd, SceneContext ctx)=0;
     
+    /** \brief Like activate, but only for the lights reaching an object.
+      *
+      * \param bmin,bmax World space bounds of the object.
+      *
+      * Defaults to activating all lights.
+      */
+    virtual void activate(Shader *shd, SceneContext ctx, 
+      const Vector3f& /*bmin*/, const Vector3f& /*bmax*/) {
+      activate(shd,ctx);
+    }
+    
 };
 
 class ILightControllerReferrer {
@@ -48,12 +63,23 @@ class ILightControllerReferrer {
     
 };
 
+struct light_locations_t;
+
 /** \brief Controller for one or more light sources to be applied on a shader.
   *
   * The controller requires a context source to perform world->view
   * translation of camera coordinates.
   * This is done so that coordinate transformation does not have to be done
   * in the shader.
+  *
+  * Uniform locations are looked up once per shader and link (see 
+  * Shader::linkId). Shaders declaring the UNIFORM_BINDING_LIGHTS block
+  * instead share a copy of the lights written once per frame.
+  *
+  * Lights with a range (see LightParams::range) are kept in a BVH, which 
+  * is refit at most once per frame. Objects activating the controller with
+  * their bounds get the lights without a range, followed by those whose 
+  * range reaches their bounds, up to MAX_LIGHTS.
   */
 class SimpleLightController : 
   public ILightController,
@@ -61,17 +87,111 @@ class SimpleLightController :
   
   private:
     ARRAY(LightSceneNode*, _nodes);
+    ARRAY(light_locations_t,_locations);
+    
+    UniformBlock _block;
+    unsigned _u_lightCount, _u_light;
+    unsigned _blockFrame;
+    size_t   _blockOffset;
+    
+    BVH _bvh;
+    ARRAY(int,_leaves); ///< \brief Leaf of each light, -1 without range.
+    ARRAY(LightSceneNode*,_unlimited);
+    ARRAY(LightSceneNode*,_selected);
+    Vector3f _selectMin, _selectMax;
+    unsigned _bvhVersion;
+    double   _bvhTime;
+    int      _bvhValid;
+    
+    const light_locations_t *_locate(Shader *shd);
+    void _fillBlock(const Matrixf &V, LightSceneNode **lights, size_t n);
+    void _bindBlock();
+    void _apply(
+      Shader *shd, const Matrixf &V, LightSceneNode **lights, size_t n);
+    void _refit(double time);
+    
+    static void _select(void *data, void *arg);
   public:
     SimpleLightController();
     ~SimpleLightController();
     
     /** \brief Transmits all the lighting information handled by us
       * to a shader by setting a bunch of uniforms.
+      *
+      * If there are more than MAX_LIGHTS lights, the ones added first are
+      * used.
       */
     virtual void activate(Shader *shd, SceneContext ctx);
     
+    /** \brief Transmits the lights reaching an object.
+      *
+      * Without any lights with a range, this is the same as activating all
+      * lights.
+      */
+    virtual void activate(Shader *shd, SceneContext ctx, 
+      const Vector3f &bmin, const Vector3f &bmax);
+    
     void operator+=(LightSceneNode *node);
+  
+};
+
+
+/** \brief Flat storage of a transformation hierarchy.
+  *
+  * Parent indices, local and absolute matrices are kept in contiguous 
+  * arrays, sorted breadth-first so that parents always precede their 
+  * children. Absolute matrices are then computed in a single linear sweep.
+  *
+  * Entries are referred to by handles which stay valid while entries are
+  * reordered. Scene nodes can be attached to a store (see 
+  * ISceneNode::attachTransformStore), but it can also be used on its own.
+  */
+class TransformStore : public RCObject {
+  private:
+    ARRAY(Matrixf,_local);
+    ARRAY(Matrixf,_world);
+    ARRAY(int32_t,_parent); ///< \brief slot of the parent, -1 for roots
+    ARRAY(int32_t,_handle); ///< \brief handle of a slot, -1 if removed
+    ARRAY(int32_t,_slot);   ///< \brief slot of a handle, -1 if unused
+    ARRAY(int32_t,_free);
+    int _dirty;
+    int _unsorted;
+    
+    void _sort();
+  
+  public:
+    TransformStore();
+    virtual ~TransformStore();
+    
+    /** \brief Adds an entry with identity transformation.
+      *
+      * \param parent Handle of the parent entry, or -1 for a root.
+      * \return Handle of the new entry.
+      */
+    int add(int parent);
     
+    /** \brief Removes an entry. Its children become roots. */
+    void remove(int handle);
+    
+    /** \brief Number of entries. */
+    size_t count();
+    
+    /** \brief Grants access to the local transformation of an entry and 
+      * marks the absolute ones for recomputation.
+      *
+      * The reference is invalidated by add and update.
+      */
+    Matrixf &local(int handle);
+    
+    /** \brief Returns the absolute transformation of an entry, updating all
+      * of them first if necessary.
+      */
+    const Matrixf &world(int handle);
+    
+    /** \brief Restores breadth-first order if entries were added or
+      * removed and recomputes all absolute transformations.
+      */
+    void update();
 };
 
 
@@ -85,23 +205,111 @@ class ISceneNode;
   *
   * Note that children are not explicitly added but a parent-child relation
   * is established through the constructor.
+  *
+  * The absolute transformation is cached. It is recomputed once per frame
+  * by scene_update_transforms for every node whose transformation changed,
+  * and in between whenever a node's transformation is invalidated.
   */
 class ISceneNode : public virtual RCObject {
   private:
     ISceneNode *_parent;
     ARRAY(ISceneNode*,_children);
+    
+    Matrixf _localTransform;
+    Matrixf _absTransform;
+    int     _transformDirty;
+    
+    TransformStore *_store;
+    int             _storeHandle;
+    
+    int  _updateTransform(int changed);
+    int  _updateSubtree(int changed);
+    int  _parentMoved();
+    Matrixf _absFromLocal(const Matrixf &local);
+    void _invalidateAbs();
+    
+    static void _updateRoots(void *arg, size_t begin, size_t end);
+    static int  _updateDeferred(size_t index);
+    
+    friend void scene_update_transforms();
+  
   public:
     ISceneNode(ISceneNode *parent);
     virtual ~ISceneNode();
     
     ISceneNode *parent();
     
-    Matrixf absTransform();
+    /** \brief Returns the transformation of this node relative to the root
+      * of its scene graph, i.e. the product of all transforms up the tree.
+      */
+    const Matrixf &absTransform();
+    
+    /** \brief Marks the cached absolute transformation of this node and all
+      * of its descendants for recomputation.
+      *
+      * Nodes whose transform changes call this themselves. Otherwise, changes
+      * (e.g. to a staticTransform) are picked up by the next 
+      * scene_update_transforms, so this only needs to be called if the 
+      * absolute transformation is queried before that.
+      */
+    void invalidateTransform();
+    
+    /** \brief Moves the transformation of this node into a TransformStore.
+      *
+      * The node has to be a root or its parent must be attached to the same
+      * store. From then on, its absolute transformation is computed by the
+      * store, and the per-frame update of scene_update_transforms skips it.
+      * Its local transformation is copied into the store here and by
+      * invalidateTransform. Subclasses may instead write it to the store
+      * directly (see transformStore), which is what makes large numbers of
+      * animated nodes cheap.
+      *
+      * \return Non-zero on success.
+      */
+    int attachTransformStore(TransformStore *store);
+    
+    /** \brief Returns the TransformStore this node is attached to, if any.
+      */
+    TransformStore *transformStore();
+    int transformStoreHandle();
     
     virtual Matrixf transform() =0;
     
+    /** \brief Reports whether transform depends on anything but this node,
+      * such as the context of a camera elsewhere in the scene.
+      *
+      * \param dependency Set to the scene node transform depends on, or 0 
+      * if there is none or it is unknown.
+      * \return Zero, the default, if transform depends on nothing else.
+      */
+    virtual int transformDependency(ISceneNode **dependency);
+  
 };
 
+/** \brief Updates the cached absolute transformations of all scene nodes
+  * in a single top-down pass.
+  *
+  * Nodes whose transform did not change and whose ancestors did not change
+  * are skipped. This is called once per frame, after iterating and before
+  * rendering.
+  *
+  * Subtrees not sharing any node are updated in parallel on the worker
+  * threads (see job_parallel_for), so ISceneNode::transform must not 
+  * modify anything shared with other nodes. Nodes reporting a 
+  * transformDependency are skipped there, along with their subtrees. They
+  * are updated afterwards on the calling thread, each one after the node 
+  * it depends on, so they see its transformation of the same frame.
+  */
+void scene_update_transforms();
+
+/** \brief Returns a counter incremented whenever the absolute transformation
+  * of any scene node may have changed.
+  *
+  * If it is the same as when last checked, any results derived from
+  * absolute transformations are still valid.
+  */
+unsigned scene_transform_version();
+
 
 /** \brief Abstract class for renderable scene nodes.
   *
@@ -113,6 +321,11 @@ class IRenderableSceneNode : public ISceneNode {
     IRenderableSceneNode(ISceneNode *parent);
     virtual ~IRenderableSceneNode();
     
+    /** \brief If non-zero, the node's occluder geometry hides other nodes
+      * in render passes using RP_OCCLUSION_CULL. Zero by default.
+      */
+    int occluder;
+    
     /** \brief Renders whatever the implementing scene node represents.
       *
       * \param ctx SceneContext representing the current scene information,
@@ -123,6 +336,50 @@ class IRenderableSceneNode : public ISceneNode {
     /** \brief Just sends the geometry without applying any transformation
       * or setting any parameters.*/
     virtual void sendGeometry() =0;
+    
+    /** \brief Transformation to apply to the geometry sent by sendGeometry
+      * on top of absTransform, e.g. StaticMesh::positionTransform.
+      *
+      * Defaults to the identity.
+      */
+    virtual Matrixf geometryTransform();
+    
+    /** \brief Retrieves the bounding box of the node's geometry in the
+      * space of absTransform, for culling.
+      *
+      * \return Zero if the bounds are unknown, which is the default.
+      */
+    virtual int bounds(Vector3f *bmin, Vector3f *bmax);
+    
+    /** \brief Picks the level of detail used by subsequent renders, see
+      * StaticMesh::selectLOD. Does nothing by default.
+      *
+      * \param pixelScale Half the viewport height in pixels.
+      * \param pixelError Largest acceptable error, in pixels.
+      */
+    virtual void selectLOD(SceneContext ctx, float pixelScale, 
+      float pixelError);
+    
+    /** \brief Retrieves triangles to rasterize for occlusion culling, in the
+      * space of absTransform (see StaticMesh::occluder).
+      *
+      * \return Zero if there are none, which is the default.
+      */
+    virtual int occluderGeometry(const Vector3f **positions, 
+      const u_int32_t **indices, size_t *indexCount);
+    
+    /** \brief Adds the draw calls of this node to a RenderQueue.
+      *
+      * By default, the node is added to be rendered by render.
+      */
+    virtual void enqueue(RenderQueue *queue);
+    
+    /** \brief Sets everything an item added by enqueue needs besides its
+      * shader, textures and mesh, which are already bound.
+      *
+      * \param ctx Context with the model matrix of the item applied.
+      */
+    virtual void applyQueued(const render_item_t *item, SceneContext ctx);
 };
 
 
@@ -151,6 +408,11 @@ class CameraFollowerSceneNode :
     virtual ~CameraFollowerSceneNode();
     
     virtual Matrixf transform();
+    
+    /** \brief Depends on the context source, which is reported if it is a
+      * scene node such as a CameraSceneNode.
+      */
+    virtual int transformDependency(ISceneNode **dependency);
   
 };
 
@@ -181,8 +443,13 @@ class LissajousSceneNode : public ISceneNode, public IIterator {
     
     virtual Matrixf transform();
     
-    /** \brief Iterates the animation. Without this no animation is performed.*/
+    /** \brief Iterates the animation. Without this no animation is performed.
+      *
+      * The new transformation is only applied by sync.
+      */
     virtual void iterate(double dt, double t);
+    virtual int concurrent();
+    virtual void sync();
   
 };
 
@@ -215,6 +482,13 @@ class CubicBezierSceneNode :
     
     BezierPath *_path;
     
+    #ifdef DEBUG_DIYYMA_SPLINES
+    
+    unsigned _debugLinkId;
+    GLint    _u_MVP;
+    
+    #endif
+  
   public:
     CubicBezierSceneNode(ISceneNode *parent);
     virtual ~CubicBezierSceneNode();
@@ -253,8 +527,13 @@ class CubicBezierSceneNode :
     
     virtual Matrixf transform();
     
-    /** \brief Iterates the animation. Without this no animation is performed.*/
+    /** \brief Iterates the animation. Without this no animation is performed.
+      *
+      * The new transformation is only applied by sync.
+      */
     virtual void iterate(double dt, double t);
+    virtual int concurrent();
+    virtual void sync();
     
     #ifdef DEBUG_DIYYMA_SPLINES
     
@@ -312,6 +591,8 @@ class STSTMSceneNode :
     GLint _u_P;
     GLint _u_time;
     GLint _u_camPos_w;
+    
+    int _lod;
   
   public:
     STSTMSceneNode(ISceneNode *parent);
@@ -323,6 +604,14 @@ class STSTMSceneNode :
     
     virtual void render(SceneContext ctx);
     virtual void sendGeometry();
+    virtual Matrixf geometryTransform();
+    virtual int bounds(Vector3f *bmin, Vector3f *bmax);
+    virtual void selectLOD(SceneContext ctx, float pixelScale, 
+      float pixelError);
+    virtual int occluderGeometry(const Vector3f **positions, 
+      const u_int32_t **indices, size_t *indexCount);
+    virtual void enqueue(RenderQueue *queue);
+    virtual void applyQueued(const render_item_t *item, SceneContext ctx);
     
     virtual Matrixf transform();
     
@@ -340,6 +629,8 @@ class STMMSceneNode :
   public IRenderableSceneNode,
   public IStaticMeshReferrer,
   public ILightControllerReferrer {
+  private:
+    int _lod;
   
   public:
     STMMSceneNode(ISceneNode *parent);
@@ -349,6 +640,14 @@ class STMMSceneNode :
     
     virtual void render(SceneContext ctx);
     virtual void sendGeometry();
+    virtual Matrixf geometryTransform();
+    virtual int bounds(Vector3f *bmin, Vector3f *bmax);
+    virtual void selectLOD(SceneContext ctx, float pixelScale, 
+      float pixelError);
+    virtual int occluderGeometry(const Vector3f **positions, 
+      const u_int32_t **indices, size_t *indexCount);
+    virtual void enqueue(RenderQueue *queue);
+    virtual void applyQueued(const render_item_t *item, SceneContext ctx);
     
     virtual Matrixf transform();
     
@@ -379,6 +678,12 @@ struct LightParams {
   
   u_int32_t flags;
   
+  /** \brief Distance beyond which objects are not lit, used to assign 
+    * lights to objects (see SimpleLightController). Zero, the default, 
+    * lights everything.
+    */
+  float    range;
+  
 };
 
 /** \brief Light source to be put into a scene graph.
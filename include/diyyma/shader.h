@@ -17,6 +17,7 @@
 #include "GL/glew.h"
 
 #include "diyyma/util.h"
+#include "diyyma/preprocessor.h"
 
 
 #define SHADER_PROGRAM_COUNT 3
@@ -37,6 +38,72 @@
   idx==2?GL_FRAGMENT_SHADER:\
   -1)
 
+/** \brief An active uniform of a linked Shader.
+  *
+  * Arrays are listed by their first element, by their plain name and by 
+  * each further element, with size counting the elements from there on.
+  */
+struct ShaderUniform {
+  char  *name;
+  GLint  location;
+  GLenum type; ///< \brief GL type, e.g. GL_FLOAT_VEC3.
+  GLint  size;
+};
+
+/** \brief Returns the location of a uniform of a program, see
+  * ShaderUniforms::add.
+  */
+typedef GLint (*shader_locate_t)(const char *name, void *arg);
+
+/** \brief The active uniforms of a linked Shader, looked up by name.
+  *
+  * Shader fills the table when linking. The table itself does not call the
+  * GL, locations of array elements are asked for through a callback.
+  */
+class ShaderUniforms {
+  private:
+    ARRAY(ShaderUniform,_uniforms);
+    StringIndex _index;
+    
+    void _add(const char *name, GLint location, GLenum type, GLint size);
+  
+  public:
+    ShaderUniforms();
+    ~ShaderUniforms();
+    
+    /** \brief Removes all uniforms. */
+    void clear();
+    
+    /** \brief Adds an active uniform as reported by glGetActiveUniform.
+      *
+      * Arrays are reported as name[0]. They are also added by their plain
+      * name and by each further element.
+      *
+      * \param locate Called for the location of the uniform and of each
+      * further array element.
+      */
+    void add(const char *name, GLenum type, GLint size,
+      shader_locate_t locate, void *arg);
+    
+    /** \brief Returns the location of a uniform, or -1 if it is not
+      * active.
+      */
+    GLint locate(const char *id);
+    
+    /** \brief Returns the location of a uniform of a GL type, or -1 if it
+      * is not active.
+      *
+      * A uniform of a different type is reported once and treated as 
+      * inactive from then on.
+      */
+    GLint locate(const char *id, GLenum type);
+    
+    /** \brief Returns an active uniform, or null. */
+    const ShaderUniform *find(const char *id);
+    
+    size_t count();
+};
+
 /** \brief Representation of a single OpenGL shader program consisting of
   * fragment, vertex and / or geometry shaders.
   */
@@ -52,19 +119,38 @@ class Shader : public IAsset {
     
     int
       _linked;
+    int _pending;
+    u_int64_t _pendingKey;
+    unsigned _linkId;
+    unsigned _blocks;
+    
+    ShaderUniforms _uniforms;
     
     char *_sourceFiles[SHADER_PROGRAM_COUNT];
+    // source string names of a pending compile, for its messages
+    char *_lineFiles[SHADER_PROGRAM_COUNT];
     
-    int _preprocess(
-      int subject_idx, 
-      void ***code_v, size_t **code_cb_v, char ***files_v, size_t *code_n,
-      int repositoryMask);
+    // sources read and preprocessed by prepare, to be compiled in finish.
+    // The preprocessed code points into them.
+    char  *_preparedFiles[SHADER_PROGRAM_COUNT];
+    void  *_preparedCode[SHADER_PROGRAM_COUNT];
+    ShaderPreprocessor _preprocessed[SHADER_PROGRAM_COUNT];
     
-    void _preprocess(
-      const char *subject, size_t cc, 
-      void ***code_v, size_t **code_cb_v, char ***files_v, size_t *code_n,
-      int repositoryMask);
+    void _introspect();
+    void _bindBlocks();
+    void _onLinked();
+    void _submitLink();
+    int  _linkStatus();
+    int  _compileStatus(int idx);
+    void _cancel();
+    void _releasePrepared();
     
+    void _applyPragmas(ShaderPreprocessor *pp);
+    int _compile(int idx, ShaderPreprocessor *pp, int wait);
+    u_int64_t _cacheKey(ShaderPreprocessor *pp);
+    int  _loadBinary(u_int64_t key);
+    void _storeBinary(u_int64_t key);
+  
   public:
     /** \brief Creates an empty, unlinked shader program. */
     Shader();
@@ -89,10 +175,43 @@ class Shader : public IAsset {
     
     /** \brief Getter for the OpenGL program object name. */
     GLuint program();
-    /** \brief Calls glGetUniformLocation for this shader and the specified
-      * identifier.*/
+    /** \brief Returns the location of a uniform, or -1 if it is not
+      * active.
+      *
+      * All active uniforms are queried once when linking, so this is a hash
+      * lookup rather than a call to glGetUniformLocation. Still, callers
+      * setting uniforms every frame should keep the location (see linkId).
+      */
     GLint locate(const char *id);
     
+    /** \brief Returns the location of a uniform of a GL type, e.g. 
+      * GL_FLOAT_VEC3, or -1 if it is not active.
+      *
+      * A uniform of a different type is reported once and treated as 
+      * inactive, so it is never set with the wrong glUniform* call.
+      */
+    GLint locate(const char *id, GLenum type);
+    
+    /** \brief Returns an active uniform, or null. */
+    const ShaderUniform *uniform(const char *id);
+    
+    /** \brief Identifies the last successful link, unique across all 
+      * shaders and never 0.
+      *
+      * Locations are only valid for the link they were obtained from, so 
+      * anything caching them per shader compares this to find out whether
+      * they have to be looked up again.
+      */
+    unsigned linkId();
+    
+    /** \brief Returns non-zero if the program declares the uniform block
+      * reserved for a binding point, e.g. UNIFORM_BINDING_LIGHTS.
+      *
+      * Such blocks are bound to their points when linking, see 
+      * uniform_block_binding.
+      */
+    int usesBlock(GLuint binding);
+    
     /** \brief Attaches shader code to this program if the specified
       * mode was not already attached.
       *
@@ -119,6 +238,24 @@ class Shader : public IAsset {
       */
     int link();
     
+    /** \brief Checks the outcome of a compile and link submitted by 
+      * finish, reporting errors and reading the linked program's uniforms.
+      *
+      * Called by anything depending on the linked program, such as bind and
+      * locate, so it rarely has to be called directly. Blocks until the 
+      * driver is done compiling, see ready.
+      *
+      * \return 1 if the program is linked, 0 otherwise.
+      */
+    int resolve();
+    
+    /** \brief Returns non-zero if resolve would not block.
+      *
+      * Without KHR_parallel_shader_compile, there is no way of telling, so
+      * this returns 0 until the program is resolved.
+      */
+    int ready();
+    
     /** \brief Activates this shader for use in rendering. */
     void bind();
     /** \brief Deactivates this shader after use in rendering. */
@@ -133,6 +270,29 @@ class Shader : public IAsset {
     /** \brief behaves exactly like creating a new shader, specifying 
       * fn as sole argument. */
     virtual int load(const char *fn, int flags);
+    
+    /** \brief Reads and preprocesses the shader source files, without
+      * touching the GL. Compilation takes place in finish.
+      *
+      * \return 0 if a stage is empty after preprocessing.
+      */
+    virtual int prepare(const char *fn, int flags);
+    
+    /** \brief Compiles and links the stages preprocessed by prepare.
+      *
+      * If the shader cache is enabled (see shader_cache_setPath), a program
+      * binary stored for the same preprocessed code and driver is loaded 
+      * instead, and binaries of newly linked programs are stored.
+      *
+      * Compiling and linking are only submitted to the driver, their status
+      * is not queried until the program is first used (see resolve). This 
+      * way, drivers may compile the programs of several shaders loaded in a
+      * row in parallel, on threads of their own, while the loading goes on.
+      *
+      * \return 0 if no stage was prepared. Compile and link errors are
+      * returned by resolve.
+      */
+    virtual int finish(const char *fn, int flags);
 };
 
 
@@ -156,4 +316,33 @@ class IShaderReferrer {
 AssetRegistry<Shader> *reg_shd();
 void reg_shd_free();
 
+/** \brief Resolves shaders whose compilation submitted by Shader::finish
+  * completed, see Shader::ready.
+  *
+  * Meant to be called regularly from the main thread, so shaders are 
+  * resolved while the driver's work is done rather than when first bound.
+  *
+  * \param budget Time, in seconds, to spend. If negative, this blocks until
+  * all pending shaders are resolved.
+  * \return Number of shaders still pending.
+  */
+int shader_resolve_pending(double budget=-1);
+
+/** \brief Sets the directory program binaries are cached in, or null to
+  * disable the cache.
+  *
+  * The cache is disabled until a directory is set, which DIYYMA_MAIN does
+  * with SHADER_CACHE_PATH if the application defines one.
+  *
+  * \param path Directory, ending on a path delimiter. It is created if it
+  * does not exist.
+  */
+void shader_cache_setPath(const char *path);
+const char *shader_cache_path();
+
+/** \brief Returns non-zero if a cache path is set and the driver supports
+  * program binaries.
+  */
+int shader_cache_enabled();
+
 #endif
\ No newline at end of file
@@ -29,6 +29,11 @@
 #define BUFIDX_BINORMALS 4 ///< \brief layout index for binormal data streams
 #define BUFIDX_TANGENTS 5 ///< \brief layout index for tangent data streams
 
+/** \brief First of four consecutive layout indices receiving a per-instance
+  * model matrix, one column each (see RP_INSTANCED).
+  */
+#define BUFIDX_INSTANCE_TRANSFORM 8
+
 /** \brief Universally unique token identifying DIYYMA object sub-format
   * in XCO trees. */
 #define XCO_DIYYMA_OBJECT 0x4f594944
@@ -36,7 +41,133 @@
 #define XCO_DIYYMA_OBJECT_ARRAY  0x00010001
 /** \brief Locally unique token identifying DIYYMA object material slices */
 #define XCO_DIYYMA_OBJECT_MATERIAL_SLICE  0x00010002
+/** \brief Locally unique token identifying DIYYMA object element arrays */
+#define XCO_DIYYMA_OBJECT_INDICES  0x00010003
+/** \brief Locally unique token identifying DIYYMA object bounds */
+#define XCO_DIYYMA_OBJECT_BOUNDS  0x00010004
+/** \brief Locally unique token identifying DIYYMA object interleaved arrays
+  */
+#define XCO_DIYYMA_OBJECT_INTERLEAVED  0x00010005
+/** \brief Locally unique token identifying DIYYMA object levels of detail
+  */
+#define XCO_DIYYMA_OBJECT_LOD  0x00010006
+/** \brief Locally unique token identifying DIYYMA object occluder meshes
+  */
+#define XCO_DIYYMA_OBJECT_OCCLUDER  0x00010007
+
+/** \brief Static mesh loading flag. Causes .obj face corners to be 
+  * deduplicated into unique vertices which are referenced by an element
+  * array buffer.
+  *
+  * Material slices then denote ranges of indices instead of ranges of
+  * vertices.
+  */
+#define STATICMESH_LOAD_INDEXED 0x01
+
+/** \brief Static mesh loading flag. Material libraries referenced by .obj
+  * files load their textures asynchronously (see MATLIB_LOAD_ASYNC).
+  */
+#define STATICMESH_LOAD_ASYNC 0x02
+
+/** \brief Static mesh loading flag. Reorders the triangles of each material
+  * slice for the post-transform vertex cache and to reduce overdraw, and
+  * the vertices in the order they are fetched (see meshopt.h).
+  *
+  * Implies STATICMESH_LOAD_INDEXED. The reordered data is what gets written
+  * to the output .dof file, so the work is only done once per mesh.
+  */
+#define STATICMESH_LOAD_OPTIMIZE 0x04
+
+/** \brief Static mesh loading flag. Stores vertex arrays in compact formats
+  * instead of floats.
+  *
+  * Positions become normalized unsigned shorts relative to the bounding box
+  * of the mesh, see StaticMesh::positionTransform. Normals, binormals and 
+  * tangents are packed into GL_INT_2_10_10_10_REV, texture coordinates
+  * become normalized unsigned shorts if they lie within [0,1] and half
+  * floats otherwise. None of this requires changes to shaders.
+  */
+#define STATICMESH_LOAD_QUANTIZE 0x08
+
+/** \brief Static mesh loading flag. In addition to STATICMESH_LOAD_QUANTIZE,
+  * normals, binormals and tangents are octahedral encoded into two
+  * normalized shorts (marked by DOF_ARRAY_OCTAHEDRAL).
+  *
+  * Shaders have to decode these themselves, e.g.
+  *
+  *   vec3 octDecode(vec2 e) {
+  *     vec3 n=vec3(e,1.0-abs(e.x)-abs(e.y));
+  *     if (n.z<0.0) n.xy=(1.0-abs(n.yx))*sign(n.xy);
+  *     return normalize(n);
+  *   }
+  */
+#define STATICMESH_LOAD_OCTAHEDRAL 0x10
+
+/** \brief Static mesh loading flag. Stores all vertex attributes
+  * interleaved in a single array buffer rather than one buffer per 
+  * attribute.
+  *
+  * This improves locality of vertex fetches and takes a single
+  * glBindBuffer per bind. Written to .dof files as one interleaved array 
+  * chunk.
+  */
+#define STATICMESH_LOAD_INTERLEAVED 0x20
+
+/** \brief Static mesh loading flag. Generates simplified versions of the
+  * mesh by quadric error edge collapses (see meshopt_simplify), selected
+  * with StaticMesh::selectLOD.
+  *
+  * Implies STATICMESH_LOAD_INDEXED. All levels share the vertex arrays, 
+  * their indices are appended to the element array. As with 
+  * STATICMESH_LOAD_OPTIMIZE, this is meant to be done once when writing a
+  * .dof file.
+  */
+#define STATICMESH_LOAD_LOD 0x40
+
+/** \brief Static mesh loading flag. Keeps the positions and indices of the
+  * coarsest level of detail in memory, for scene nodes acting as occluders
+  * (see OcclusionCuller).
+  *
+  * Implies STATICMESH_LOAD_INDEXED. Written to .dof files as an occluder
+  * chunk, which is always loaded if present.
+  */
+#define STATICMESH_LOAD_OCCLUDER 0x80
+
+/** \brief Maximum number of levels of detail, including the full mesh. */
+#define STATICMESH_MAX_LODS 4
+
+/** \brief Fraction of the triangles of the previous level each level of
+  * detail aims for.
+  */
+#define STATICMESH_LOD_RATIO 0.5f
+
+/** \brief Levels generated with less of a reduction than this are dropped,
+  * along with all further ones.
+  */
+#define STATICMESH_LOD_MIN_REDUCTION 0.9f
+
+/** \brief Relative margin around the error threshold of 
+  * StaticMesh::selectLOD, keeping nodes close to it from switching levels 
+  * every frame.
+  */
+#define STATICMESH_LOD_HYSTERESIS 0.25f
+
+/** \brief Size, in bytes, above which mesh arrays are uploaded to the GL
+  * in multiple slices rather than at once.
+  */
+#define STATICMESH_UPLOAD_SLICE (16<<20)
+
+/** \brief The lower bits of DOFArray::index hold the attribute index. */
+#define DOF_ARRAY_INDEX_MASK 0x0000ffff
+/** \brief DOFArray::index flag. Integer data is normalized when fetched. */
+#define DOF_ARRAY_NORMALIZED 0x00010000
+/** \brief DOFArray::index flag. Unit vectors are octahedral encoded. */
+#define DOF_ARRAY_OCTAHEDRAL 0x00020000
 
+/** \brief Head of an array chunk, followed by cbData bytes of data.
+  *
+  * index combines the attribute index with DOF_ARRAY_* flags.
+  */
 struct DOFArray {
   u_int32_t index;
   u_int32_t type;
@@ -44,23 +175,115 @@ struct DOFArray {
   u_int32_t cbData;
 };
 
+/** \brief Content of a bounds chunk, the axis aligned bounding box of all 
+  * vertex positions in object space.
+  *
+  * If the position array is normalized, positions are stored relative to
+  * this box (see StaticMesh::positionTransform).
+  */
+struct DOFBounds {
+  float min[3];
+  float max[3];
+};
+
+/** \brief Head of an interleaved array chunk.
+  *
+  * Followed by attributes DOFInterleavedAttribute structures and then 
+  * cbData bytes of vertices, stride bytes each.
+  */
+struct DOFInterleaved {
+  u_int32_t attributes;
+  u_int32_t stride;
+  u_int32_t cbData;
+};
+
+/** \brief Describes one attribute of an interleaved array chunk. index and
+  * type are the same as in DOFArray.
+  */
+struct DOFInterleavedAttribute {
+  u_int32_t index;
+  u_int32_t type;
+  u_int32_t dimension;
+  u_int32_t offset;
+};
 
+/** \brief Head of an element array chunk, followed by cbData bytes of
+  * indices of the specified type (GL_UNSIGNED_SHORT or GL_UNSIGNED_INT).
+  */
+struct DOFIndexArray {
+  u_int32_t type;
+  u_int32_t cbData;
+};
+
+/** \brief Head of a level of detail chunk, followed by one pair of int32 
+  * index count and offset per material slice.
+  *
+  * Chunks appear in order of decreasing detail, after the material slices.
+  * The full mesh ends where the first level of detail starts.
+  */
+struct DOFLOD {
+  float     error;
+  u_int32_t indexOffset;
+  u_int32_t indexCount;
+  u_int32_t slices;
+};
+
+/** \brief Head of an occluder chunk, followed by vertexCount float[3] 
+  * object space positions and indexCount u_int32 indices.
+  */
+struct DOFOccluder {
+  u_int32_t vertexCount;
+  u_int32_t indexCount;
+};
+
+
+/** \brief A single vertex attribute stream.
+  *
+  * Interleaved attributes share the same handle and differ in offset.
+  */
 struct ArrayBuffer {
   GLuint handle;
   int index;
   GLenum type;
   int dimension;
+  int flags; ///< \brief DOF_ARRAY_* flags
+  int stride; ///< \brief Zero if tightly packed
+  size_t offset;
   
 };
 
+/** \brief Continuous block of faces sharing a material.
+  *
+  * If the mesh is indexed, vertexCount and vertexOffset refer to the element
+  * array rather than to the vertex arrays.
+  */
 struct MaterialSlice {
   Material *mat;
   int       vertexCount;
   int       vertexOffset;
 };
 
+/** \brief A simplified version of a mesh, see STATICMESH_LOAD_LOD. */
+struct MeshLOD {
+  /** \brief Approximate object space distance to the full mesh. */
+  float error;
+  /** \brief Range of the element array covering all material slices. */
+  int   indexOffset;
+  int   indexCount;
+};
+
+/** \brief Range of the element array holding a material slice at some 
+  * level of detail.
+  */
+struct LODSlice {
+  int vertexCount;
+  int vertexOffset;
+};
+
 #define MAX_ARRAY_BUFFERS 6
 
+struct staticmesh_data_t;
+
 /** \brief Represents a single mesh of static data.
   * 
   * This data consists of any number of array buffers of various purposes
@@ -74,10 +297,37 @@ class StaticMesh : public IAsset {
   private:
     int _vertexCount;
     ArrayBuffer _buffers[MAX_ARRAY_BUFFERS];
+    GLuint _indexBuffer;
+    GLenum _indexType;
+    int _indexCount;
+    GLuint _vao;
     char *_filename;
     int _fileFormat;
+    int _loadFlags;
     ARRAY(MaterialSlice,_materials);
+    staticmesh_data_t *_prepared;
+    Vector3f _boundsMin, _boundsMax;
+    Matrixf _positionTransform;
+    MeshLOD _lods[STATICMESH_MAX_LODS];
+    int _lodCount;
+    ARRAY(LODSlice,_lodSlices);
+    ARRAY(Vector3f,_occluderVertices);
+    ARRAY(u_int32_t,_occluderIndices);
+    
+    void _draw(int offset, int count, int instances=1);
+    void _buildLODs(
+      u_int32_t **indices, const Vector3f *positions, size_t vertexCount,
+      int optimize, const char *fn);
+    void _buildOccluder(
+      const u_int32_t *indices, size_t indexCount, 
+      const Vector3f *positions, size_t vertexCount);
+    void _bindArrays();
+    void _buildVAO();
+    void _writeXCO(XCOWriterContext *xco);
     
+    void _assembleOBJ(staticmesh_data_t *d, const char *outputDOF, int flags);
+    int _assembleDOF(staticmesh_data_t *d);
+  
   public:
     StaticMesh();
     ~StaticMesh();
@@ -85,25 +335,105 @@ class StaticMesh : public IAsset {
     size_t materialCount();
     const MaterialSlice &material(int idx);
     
+    /** \brief Retrieves the object space bounding box of all vertices. */
+    void bounds(Vector3f *bmin, Vector3f *bmax);
     
-    void loadOBJ(char *code, const char *outputDOF=0);
-    int loadOBJFile(const char *fn);
+    /** \brief Returns a counter incremented whenever the bounds of any mesh
+      * change, i.e. when it is loaded or cleared.
+      */
+    static unsigned BoundsGeneration();
+    
+    /** \brief Transformation from the stored vertex positions into object
+      * space.
+      *
+      * This is the identity, unless positions are quantized relative to the
+      * bounding box (see STATICMESH_LOAD_QUANTIZE). Whoever sets up the
+      * model matrix for rendering the mesh has to multiply it from the 
+      * right. The scale is uniform, so normals are unaffected.
+      */
+    const Matrixf &positionTransform();
+    
+    /** \brief Retrieves the triangles kept for occlusion culling (see 
+      * STATICMESH_LOAD_OCCLUDER), in object space.
+      *
+      * \return Zero if the mesh has none.
+      */
+    int occluder(const Vector3f **positions, const u_int32_t **indices,
+      size_t *indexCount);
+    
+    /** \brief Returns the number of levels of detail, at least one. */
+    int lodCount();
+    
+    /** \brief Returns the approximate object space distance of a level of 
+      * detail to the full mesh, which is level 0.
+      */
+    float lodError(int lod);
+    
+    /** \brief Selects the coarsest level of detail whose error covers less
+      * than a number of pixels on screen.
+      *
+      * The error is projected at the point of the bounding sphere closest 
+      * to the viewer. Switching away from the current level takes an error
+      * beyond the threshold by STATICMESH_LOD_HYSTERESIS.
+      *
+      * \param MVP Transformation from object space, without 
+      * positionTransform, into clip space.
+      * \param pixelScale Number of pixels per unit of normalized device 
+      * coordinates, i.e. half the viewport height.
+      * \param pixelError Largest acceptable error, in pixels.
+      * \param current Level used so far.
+      */
+    int selectLOD(const Matrixf &MVP, float pixelScale, float pixelError,
+      int current);
+    
+    
+    /** \brief Loads a wavefront object from memory.
+      *
+      * Large inputs are split at line boundaries and parsed on the worker
+      * threads (see jobs.h). Material libraries are still loaded on the
+      * calling thread.
+      *
+      * \param code Zero-terminated .obj file content.
+      * \param outputDOF If non-null, the assembled arrays are also written to
+      * a .dof file of this name.
+      * \param flags Combination of STATICMESH_LOAD_* flags.
+      */
+    void loadOBJ(char *code, const char *outputDOF=0, int flags=0);
+    int loadOBJFile(const char *fn, int flags=0);
     int loadDOFFile(const char *fn);
     
+    /** \brief Binds all arrays and the element array for sending.
+      *
+      * If vertex array objects are supported, each mesh records its
+      * bindings into one at load time, so this is a single 
+      * glBindVertexArray.
+      */
     void bind();
     void unbind();
     /** \brief Renders all faces using the currently configured material.*/
     void send();
     /** \brief Renders faces assigned with a single material using the 
       * currently configured material. */
-    void send(int idx);
+    void send(int idx, int lod=0);
+    
+    /** \brief Renders all faces of a level of detail using the currently
+      * configured material.
+      */
+    void sendLOD(int lod);
+    
+    /** \brief Renders all faces a number of times in a single draw call,
+      * using the currently configured material.
+      *
+      * Requires OpenGL 3.1.
+      */
+    void sendInstanced(int instances);
     
     /** \brief Renders all geometry using assigned materials.
       *
       * This is a compbination of bind, send and unbind, all in one call.
       *
       */
-    void render(SceneContext ctx);
+    void render(SceneContext ctx, int lod=0);
     
     void clear();
     
@@ -112,8 +442,16 @@ class StaticMesh : public IAsset {
     virtual timestamp_t filesTimestamp();
     
     /** \brief Deduces the file type by extension (lowercase .ecn or .dof)
+      *
+      * flags is passed on to loadOBJFile for .obj files.
       */
     virtual int load(const char *fn, int flags);
+    
+    /** \brief Reads the mesh file and parses .obj files. Buffers are
+      * assembled and uploaded in finish.
+      */
+    virtual int prepare(const char *fn, int flags);
+    virtual int finish(const char *fn, int flags);
 };
 
 
@@ -127,7 +465,7 @@ class IStaticMeshReferrer {
     
     StaticMesh *mesh();
     void setMesh(StaticMesh *m);
-    
+  
 };
 
 
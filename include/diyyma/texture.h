@@ -147,6 +147,7 @@ const CubemapData CUBEMAP_DATA[6] = {
   }
 };
 class Texture;
+struct texture_image_t;
 
 class Texture : public IAsset {
   private:
@@ -156,6 +157,7 @@ class Texture : public IAsset {
     int _slot;
     GLenum _target;
     int _loadHDR;
+    texture_image_t *_prepared;
     static Texture *__boundTextures[TEXTURE_SLOTS];
   public:
     Texture();
@@ -197,6 +199,12 @@ class Texture : public IAsset {
     /** \brief Behaves exactly as the constructor.
       */
     virtual int load(const char *fn, int flags);
+    
+    /** \brief Decodes a 2D texture file into memory. Cubemaps are loaded
+      * entirely in finish.
+      */
+    virtual int prepare(const char *fn, int flags);
+    virtual int finish(const char *fn, int flags);
 };
 
 AssetRegistry<Texture> *reg_tex();
@@ -235,6 +243,11 @@ template<int N> class ITextureReferrer {
       if (index>=N) return 0;
       return _textures[index];
     }
+    /** \brief Location of the sampler uniform of a texture, -1 if none.*/
+    GLint textureLocation(size_t index) {
+      if (index>=N) return -1;
+      return _texture_locs[index];
+    }
     size_t textureCount() {
       int i;
       
@@ -259,11 +272,16 @@ template<int N> class ITextureReferrer {
       return -1;
       
     }
-    int addTexture(const char *name, const char *loc) {
+    /** \brief Adds a texture from the texture registry.
+      *
+      * \param async If non-zero, the texture is loaded asynchronously
+      * (see AssetRegistry::getAsync).
+      */
+    int addTexture(const char *name, const char *loc, int async=0) {
       Texture *tex;
       int idx=-1;
       
-      tex=reg_tex()->get(name);
+      tex=async?reg_tex()->getAsync(name):reg_tex()->get(name);
       
       if (tex) {
         idx=addTexture(tex,loc);
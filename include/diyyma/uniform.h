@@ -1,15 +1,23 @@
-
-/** \file manager.h
+/** \file uniform.h
   * \author Peter Wagener
-  * \brief Management of asset loading, scene composition and modification.
+  * \brief Uniform blocks and their storage in uniform buffers.
   *
+  * A UniformBlock mirrors the memory layout GLSL gives an interface block
+  * under the std140 or std430 rules, so its data can be copied into a
+  * uniform buffer unchanged. Blocks changing every frame are written into
+  * a UniformRing, a persistently mapped buffer split into one region per
+  * frame in flight, instead of each owning a buffer object.
   *
+  * Blocks named as in UNIFORM_BINDING_FRAME and UNIFORM_BINDING_LIGHTS
+  * are bound to their binding points whenever a shader is linked, so
+  * shaders only have to declare them.
   */
 
 #ifndef _DIYYMA_UNIFORM_H
 #define _DIYYMA_UNIFORM_H
 
 #include "diyyma/util.h"
+#include "diyyma/math.h"
 #include "GL/glew.h"
 
 #define UNIFORM_BOOL 0
@@ -53,6 +61,12 @@
 
 #define UNIFORM_FORMAT_COUNT 38
 
+/** \brief Size of a single value of each format, tightly packed as
+  * passed to the glUniform* functions.
+  *
+  * This is not the size a value takes up in a uniform block, see
+  * UniformBlock.
+  */
 const size_t UNIFORM_SIZE[UNIFORM_FORMAT_COUNT]= {
   1,4,4,4,8,
   2,3,4,
@@ -72,27 +86,246 @@ const size_t UNIFORM_SIZE[UNIFORM_FORMAT_COUNT]= {
   
 };
 
+/** \brief Memory layout of std140 interface blocks, the only one
+  * available to uniform blocks before GL 4.3.
+  */
+#define UNIFORM_LAYOUT_STD140 0
+/** \brief Memory layout of std430 interface blocks, which does not round
+  * array strides up to vec4.
+  */
+#define UNIFORM_LAYOUT_STD430 1
+
+/** \brief Binding point and block name of the per-pass data.
+  *
+  * \code
+  * layout(std140) uniform DiyymaFrame {
+  *   mat4  u_P;
+  *   mat4  u_V;
+  *   vec3  u_camPos_w;
+  *   float u_time;
+  * };
+  * \endcode
+  *
+  * See scene_context_bind.
+  */
+#define UNIFORM_BINDING_FRAME 0
+#define UNIFORM_BLOCK_FRAME "DiyymaFrame"
+
+/** \brief Binding point and block name of the lights of a
+  * SimpleLightController.
+  *
+  * \code
+  * struct Light {
+  *   vec3  ambient_c;
+  *   vec3  diffuse_c;
+  *   vec3  specular_c;
+  *   vec3  position_v;
+  *   float falloff_factor;
+  *   uint  flags;
+  * };
+  * layout(std140) uniform DiyymaLights {
+  *   int   u_lightCount;
+  *   Light u_light[MAX_LIGHTS];
+  * };
+  * \endcode
+  */
+#define UNIFORM_BINDING_LIGHTS 1
+#define UNIFORM_BLOCK_LIGHTS "DiyymaLights"
+
+/** \brief Number of frames a UniformRing keeps apart, i.e. how many
+  * frames may be in flight before writing waits for the GPU.
+  */
+#define UNIFORM_RING_FRAMES 3
+/** \brief Bytes of a UniformRing available to each frame. */
+#define UNIFORM_RING_SIZE (256<<10)
+/** \brief Number of binding points whose ranges a UniformRing keeps track
+  * of to skip redundant binds.
+  */
+#define UNIFORM_RING_BINDINGS 8
+
+class UniformRing;
+
+/** \brief A uniform block laid out as under the std140 or std430 rules.
+  *
+  * Members are added in the order of their declaration in GLSL. Structs
+  * are added member by member; an array of structs needs the same number
+  * of members per element and is best added element by element, which
+  * matches GLSL as long as the first member of the struct is aligned to
+  * 16 bytes, e.g. a vec3, vec4 or matrix.
+  *
+  * \code
+  * UniformBlock block;
+  * unsigned u_V=block.add(UNIFORM_MAT4);
+  * unsigned u_time=block.add(UNIFORM_FLOAT);
+  * block.set(u_V,ctx.V);
+  * block.set(u_time,(float)ctx.time);
+  * \endcode
+  */
 class UniformBlock {
   private:
+    int _layout;
+    
     ARRAY(GLenum,_formats);
+    ARRAY(size_t,_offsets);
+    ARRAY(size_t,_strides);
+    ARRAY(unsigned,_counts);
+    
+    size_t _end;
     size_t _cb;
     void *_data;
     
     GLuint _ubo;
-    
+    size_t _uboCb;
+  
   public:
-    UniformBlock();
+    UniformBlock(int layout=UNIFORM_LAYOUT_STD140);
     ~UniformBlock();
     
+    /** \brief Appends a member, or an array of count values.
+      *
+      * \return Index of the member, or (unsigned)-1 if fmt is unknown.
+      */
+    unsigned add(GLenum fmt, unsigned count=1);
     void operator+(GLenum fmt);
+    
     GLenum operator[](unsigned int idx) const;
     size_t count() const;
+    
+    /** \brief Size of the block in bytes, as reported by
+      * GL_UNIFORM_BLOCK_DATA_SIZE.
+      */
     size_t cb() const;
     void *data() const;
     
+    /** \brief Byte offset of an element of a member from the start of the
+      * block.
+      */
+    size_t offset(unsigned idx, unsigned element=0) const;
+    /** \brief Byte distance between elements of an array member. */
+    size_t stride(unsigned idx) const;
+    /** \brief Pointer to an element of a member within data. */
+    void *member(unsigned idx, unsigned element=0) const;
+    
+    /** \brief Copies a value, tightly packed as in UNIFORM_SIZE, into an
+      * element, spreading out matrix columns as the layout requires.
+      */
+    void set(unsigned idx, const void *value, unsigned element=0);
+    void set(unsigned idx, float v, unsigned element=0);
+    void set(unsigned idx, int v, unsigned element=0);
+    void set(unsigned idx, unsigned v, unsigned element=0);
+    void set(unsigned idx, const Vector3f &v, unsigned element=0);
+    void set(unsigned idx, const Vector4f &v, unsigned element=0);
+    void set(unsigned idx, const Matrixf &m, unsigned element=0);
+    
+    /** \brief Uploads the data into a buffer object owned by the block.
+      *
+      * The buffer is only reallocated when the block grew. Meant for
+      * blocks changing rarely, see submit otherwise.
+      */
     void update();
+    /** \brief Binds the buffer filled in by update. */
     void bind(GLuint idx) const;
+    
+    /** \brief Copies the data into the current frame of a ring and binds
+      * it.
+      *
+      * \return 1 on success, 0 if the ring is full.
+      */
+    int submit(UniformRing *ring, GLuint idx) const;
 };
 
+/** \brief A uniform buffer holding transient data of the last few
+  * frames.
+  *
+  * The buffer is split into UNIFORM_RING_FRAMES regions used in turn, one
+  * per frame. Each region is fenced when its frame ends and waited for
+  * before it is written again, so data is never changed while the GPU
+  * may still read it.
+  *
+  * With GL 4.4 or ARB_buffer_storage the buffer stays mapped and writes go
+  * straight into it. Otherwise, a frame's writes are kept in system memory
+  * and each range is uploaded with glBufferSubData when it is bound.
+  */
+class UniformRing {
+  private:
+    GLuint  _ubo;
+    size_t  _frameCb;
+    size_t  _alignment;
+    
+    unsigned char *_mapped;
+    unsigned char *_shadow;
+    int     _persistent;
+    
+    GLsync  _fences[UNIFORM_RING_FRAMES];
+    int     _region;
+    size_t  _used;
+    unsigned _frame;
+    int     _full;
+    
+    size_t  _boundOffset[UNIFORM_RING_BINDINGS];
+    size_t  _boundCb[UNIFORM_RING_BINDINGS];
+  
+  public:
+    /** \brief Creates the buffer, taking cb bytes per frame. */
+    UniformRing(size_t cb=UNIFORM_RING_SIZE);
+    ~UniformRing();
+    
+    /** \brief Moves on to the next region, waiting for the GPU if it is
+      * still in use.
+      */
+    void beginFrame();
+    /** \brief Fences the region of the current frame. */
+    void endFrame();
+    
+    /** \brief Counts frames begun, starting with 1. Data written in the
+      * same frame can be bound again instead of being copied once more.
+      */
+    unsigned frame();
+    
+    /** \brief Reserves cb bytes in the current frame.
+      *
+      * The data has to be written before the range is bound, and not
+      * changed after: without a persistent mapping, bind uploads it.
+      *
+      * \param offset Receives the offset to pass to bind.
+      * \return Pointer to write the data to, or null if the frame is
+      * out of space.
+      */
+    void *alloc(size_t cb, size_t *offset);
+    
+    /** \brief Binds cb bytes at offset to a uniform buffer binding point.
+      *
+      * The ranges of the first UNIFORM_RING_BINDINGS points are remembered
+      * for the rest of the frame and not bound or uploaded again, so these
+      * points must not be bound by other means in between.
+      */
+    void bind(GLuint idx, size_t offset, size_t cb);
+    
+    GLuint buffer();
+};
+
+/** \brief Returns the ring shared by all uniform blocks, creating it on
+  * first use, or null if uniform buffers are not supported.
+  */
+UniformRing *uniform_ring();
+
+/** \brief Deletes the shared ring. Has to be called while the GL
+  * context still exists.
+  */
+void uniform_ring_free();
+
+/** \brief Calls UniformRing::beginFrame on the shared ring.
+  *
+  * Main loops not using DIYYMA_MAIN have to call this before rendering a
+  * frame and uniform_frame_end after.
+  */
+void uniform_frame_begin();
+void uniform_frame_end();
+
+/** \brief Returns the binding point reserved for a block name, or -1.
+  *
+  * Used by Shader when linking to bind the blocks it declares.
+  */
+int uniform_block_binding(const char *name);
 
-#endif
\ No newline at end of file
+#endif
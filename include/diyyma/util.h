@@ -14,6 +14,8 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "diyyma/jobs.h"
+
 #define SDL_ASSERT_WARN(r,name) { \
   if (!(r)) { \
     LOG_WARNING("WARNING: %s failed (%s)\n",name,SDL_GetError()); \
@@ -78,33 +80,86 @@
 #define ERROR(...) { LOG_ERROR(__VA_ARGS__); return 0; }
 #define ERRORJ(lbl,...) { LOG_ERROR(__VA_ARGS__); goto lbl; }
 
-#define APPEND(n,o) \
-  (n##_v=(decltype(n##_v))realloc( \
-    (void*)(n##_v), \
-    sizeof(decltype(*n##_v))*((n##_n)+1)))[(n##_n)++]=o;
+/** \brief Initial capacity of an array grown by APPEND. */
+#define ARRAY_MIN_CAPACITY 8
+
+/** \brief Appends an element to an array, doubling its capacity if it is
+  * exhausted.
+  */
+#define APPEND(n,o) { \
+  if (n##_n>=n##_s) \
+    ARRAY_RESERVE(n,n##_s?n##_s*2:ARRAY_MIN_CAPACITY) \
+  n##_v[n##_n++]=o; \
+}
 
+/** \brief Declares a dynamic array n_v of n_n elements of type t, with
+  * storage for n_s elements.
+  */
 #define ARRAY(t,n) \
   t *n##_v; \
-  size_t n##_n; 
-  
+  size_t n##_n; \
+  size_t n##_s;
+
+/** \brief Declares an array as ARRAY does, with internal linkage. Meant for
+  * arrays at file scope, which start out empty.
+  */
+#define ARRAY_STATIC(t,n) \
+  static t *n##_v; \
+  static size_t n##_n; \
+  static size_t n##_s;
+
 #define ARRAY_INIT(n) \
   n##_v=0; \
-  n##_n=0;
+  n##_n=0; \
+  n##_s=0;
 
 #define ARRAY_INIT2(n) \
   n##_v(0), \
-  n##_n(0)
+  n##_n(0), \
+  n##_s(0)
 
 #define ARRAY_DESTROY(n) \
   if (n##_v) { \
     free((void*)n##_v); \
     n##_v=0; \
     n##_n=0; \
+    n##_s=0; \
   }
-#define ARRAY_SETSIZE(n,o) \
-  n##_v=(decltype(n##_v))realloc( \
-    (void*)(n##_v), \
-    sizeof(decltype(*n##_v))*(++(n##_n)));
+
+/** \brief Ensures storage for at least c elements without changing the
+  * array size.
+  */
+#define ARRAY_RESERVE(n,c) { \
+  if ((size_t)(c)>n##_s) { \
+    n##_s=(size_t)(c); \
+    n##_v=(decltype(n##_v))realloc( \
+      (void*)(n##_v), \
+      sizeof(decltype(*n##_v))*n##_s); \
+  } \
+}
+
+/** \brief Resizes an array to o elements. New elements are uninitialized.
+  */
+#define ARRAY_SETSIZE(n,o) { \
+  ARRAY_RESERVE(n,o) \
+  n##_n=(o); \
+}
+
+/** \brief Releases any storage not used by the array's current elements.
+  */
+#define ARRAY_SHRINK(n) { \
+  if (n##_s>n##_n) { \
+    n##_s=n##_n; \
+    if (n##_n) { \
+      n##_v=(decltype(n##_v))realloc( \
+        (void*)(n##_v), \
+        sizeof(decltype(*n##_v))*n##_n); \
+    } else { \
+      free((void*)n##_v); \
+      n##_v=0; \
+    } \
+  } \
+}
 
 #define FOREACH(i,o,n) \
   for((i)=0,(o)=(n##_v);(i)<(n##_n);(i)++,(o)++)
@@ -170,6 +225,37 @@ struct SubString {
   */
 int readFile(const char *fn,void **data, size_t *cb);
 
+/** \brief Writes a buffer to a file, replacing its content.
+  *
+  * \return 1 on success, 0 on error.
+  */
+int writeFile(const char *fn, const void *data, size_t cb);
+
+/** \brief Creates a directory unless it exists already.
+  *
+  * Parent directories are not created.
+  *
+  * \return 1 if the directory exists afterwards, 0 otherwise.
+  */
+int dir_create(const char *path);
+
+/** \brief Maps the whole of a specified file into memory, read-only.
+  *
+  * In contrast to readFile, no heap memory is allocated and pages are only
+  * loaded as they are accessed. The content is not zero-terminated.
+  * The mapping must be released with unmapFile.
+  *
+  * \param fn File name to map.
+  * \param data Reference to a pointer receiving the mapped content.
+  * \param cb Reference to a size_t receiving the size of the file.
+  * \return 1 on success, 0 on error or if the file is empty.
+  */
+int mapFile(const char *fn, const void **data, size_t *cb);
+
+/** \brief Releases a mapping obtained through mapFile.
+  */
+void unmapFile(const void *data, size_t cb);
+
 /** \brief Checks if a given file exists.
   *
   * \return 1 if it does, 0 otherwise.
@@ -195,6 +281,12 @@ void file_list_print(FILE *f);
   */
 timestamp_t file_timestamp(const char *fn);
 
+/** \brief Returns a monotonic time, in seconds, of arbitrary origin.
+  *
+  * Only differences between two calls are meaningful.
+  */
+double clock_seconds();
+
 #define REPOSITORY_TEXTURE 0
 #define REPSOITORY_MESH    1
 #define REPOSITORY_SHADER  2
@@ -352,6 +444,28 @@ class IAsset : public RCObject {
       */
     virtual int load(const char *fn, int flags) =0;
     
+    /** \brief First stage of an asynchronous load, see 
+      * AssetRegistry::getAsync.
+      *
+      * This is executed on a worker thread and should perform all the file
+      * I/O and decoding work that does not require the OpenGL context.
+      * It must neither touch the OpenGL context, nor any asset registry, nor
+      * reference counts. Whatever it prepares is consumed by finish.
+      *
+      * The default implementation does nothing, deferring everything to
+      * finish.
+      *
+      * \return 1 on success, 0 otherwise. On failure, finish is not called.
+      */
+    virtual int prepare(const char * /*fn*/, int /*flags*/) { return 1; }
+    
+    /** \brief Second stage of an asynchronous load, executed on the main
+      * thread after prepare has succeeded.
+      *
+      * The default implementation simply calls load.
+      */
+    virtual int finish(const char *fn, int flags) { return load(fn,flags); }
+  
 };
 
 /** \brief requests the game loop to iterate again no less than a specified
@@ -371,15 +485,24 @@ class IIterator {
   public:
     virtual ~IIterator() { }
     virtual void iterate(double dt, double t) =0;
+    
+    /** \brief Returns non-zero if iterate may run on a worker thread.
+      *
+      * Such iterators are run concurrently with each other, before all
+      * others. Their iterate must only modify the iterator itself; anything
+      * touching shared state, like invalidating transformations, belongs in
+      * sync.
+      */
+    virtual int concurrent() { return 0; }
+    
+    /** \brief Called on the main thread once all concurrent iterators are
+      * done.
+      */
+    virtual void sync() { }
 };
 
-/** \brief It's always nice to implement a sorting algorithm. */
-template<class T, class K> void sortByKeys(T *objects, K *keys, size_t n);
-
-template<class T, class K> void quickSort(
-  T *objects, K *keys, 
-  size_t l, size_t r);
-
+/** \brief Partitions of at most this size are sorted by insertion. */
+#define SORT_INSERTION_THRESHOLD 24
 
 template<class T, class K> void qs_swap(
   T *objects, K *keys, 
@@ -388,41 +511,184 @@ template<class T, class K> void qs_swap(
   { K t=keys[a]; keys[a]=keys[b]; keys[b]=t; }
 }
 
+/** \brief Stable insertion sort of objects[l..r) by keys.
+  *
+  * \param budget Maximum number of element moves, or 0 for no limit.
+  * \return Zero if the budget was exceeded, leaving the range partially
+  * sorted.
+  */
+template<class T, class K> int insertionSort(
+  T *objects, K *keys, size_t l, size_t r, size_t budget=0) {
+  size_t i, j, moves=0;
+  T o;
+  K k;
+  
+  for(i=l+1;i<r;i++) {
+    if (!(keys[i]<keys[i-1])) continue;
+    o=objects[i];
+    k=keys[i];
+    for(j=i;(j>l)&&(k<keys[j-1]);j--) {
+      objects[j]=objects[j-1];
+      keys[j]=keys[j-1];
+    }
+    objects[j]=o;
+    keys[j]=k;
+    
+    moves+=i-j;
+    if (budget && (moves>budget)) return 0;
+  }
+  return 1;
+}
 
+template<class T, class K> void heapSort(
+  T *objects, K *keys, size_t l, size_t r) {
+  size_t n=r-l, i, root, child;
+  T *o=objects+l;
+  K *k=keys+l;
+  
+  for(i=n/2;i-->0;) {
+    for(root=i;(child=2*root+1)<n;root=child) {
+      if ((child+1<n)&&(k[child]<k[child+1])) child++;
+      if (!(k[root]<k[child])) break;
+      qs_swap<T,K>(o,k,root,child);
+    }
+  }
+  while(n>1) {
+    qs_swap<T,K>(o,k,0,--n);
+    for(root=0;(child=2*root+1)<n;root=child) {
+      if ((child+1<n)&&(k[child]<k[child+1])) child++;
+      if (!(k[root]<k[child])) break;
+      qs_swap<T,K>(o,k,root,child);
+    }
+  }
+}
+
+/** \brief Introsort of objects[l..r) by keys.
+  *
+  * Quicksort with median-of-three pivots, recursing only into the smaller
+  * partition. Below SORT_INSERTION_THRESHOLD elements, insertion sort takes
+  * over, and partitions still left after depth levels are heap sorted, so 
+  * this is O(n log n) on any input.
+  */
 template<class T, class K> void quickSort(
   T *objects, K *keys, 
-  size_t l, size_t r) {
-  int s;
+  size_t l, size_t r, int depth) {
+  size_t s, i, m;
   K pr;
-  int i;
-  
-  if (r<=l) return;
-  
-  s=(l+r)/2;
   
-  if (keys[l]<keys[r]) {
-    if (keys[s]<keys[l]) s=l;
-    else if (keys[r]<keys[s]) s=r;
-  } else {
-    if (keys[s]<keys[r]) s=r;
-    else if (keys[l]<keys[s]) s=l;
+  while (r-l>SORT_INSERTION_THRESHOLD) {
+    if (depth--<=0) {
+      heapSort<T,K>(objects,keys,l,r);
+      return;
+    }
+    
+    m=r-1;
+    s=l+(r-l)/2;
+    if (keys[l]<keys[m]) {
+      if (keys[s]<keys[l]) s=l;
+      else if (keys[m]<keys[s]) s=m;
+    } else {
+      if (keys[s]<keys[m]) s=m;
+      else if (keys[l]<keys[s]) s=l;
+    }
+    
+    pr=keys[s];
+    qs_swap<T,K>(objects,keys,s,m);
+    
+    s=l;
+    for(i=l;i<m;i++) if (keys[i]<pr) qs_swap<T,K>(objects,keys,i,s++);
+    qs_swap<T,K>(objects,keys,s,m);
+    
+    if (s-l<r-s) {
+      quickSort<T,K>(objects,keys,l,s,depth);
+      l=s+1;
+    } else {
+      quickSort<T,K>(objects,keys,s+1,r,depth);
+      r=s;
+    }
   }
   
-  pr=keys[s];
-  qs_swap<T,K>(objects,keys,s,r);
-  
-  s=l;
-  for(i=l;i<r;i++) if (keys[i]<pr) qs_swap<T,K>(objects,keys,i,s++);
-  qs_swap<T,K>(objects,keys,s,r);
-  
-  
-  quickSort(objects,keys,l,s-1);
-  quickSort(objects,keys,s+1,r);
+  insertionSort<T,K>(objects,keys,l,r);
 }
 
+/** \brief Sorts objects by keys, in place and without allocating. 
+  *
+  * Not stable. See sortByFloatKeys for a stable alternative.
+  */
 template<class T, class K> void sortByKeys(T *objects, K *keys, size_t n) {
+  int depth=0;
+  size_t i;
   
-  quickSort<T,K>(objects,keys,0,n-1);
+  for(i=n;i;i>>=1) depth+=2;
+  quickSort<T,K>(objects,keys,0,n,depth);
+}
+
+/** \brief Maps a float to an unsigned integer of the same order. */
+inline u_int32_t sortableFloatBits(float f) {
+  u_int32_t u;
+  memcpy(&u,&f,4);
+  return (u&0x80000000)?~u:(u|0x80000000);
+}
+
+/** \brief Stable sort of objects by float keys, for keys recomputed every 
+  * frame.
+  *
+  * If the input is close to sorted, e.g. because the objects are still in
+  * the order of the previous frame, an insertion sort with a budget of a 
+  * few moves per element finishes the job. Small inputs are sorted the same
+  * way. Anything else is LSD radix sorted on the float bits, 11 bits per
+  * pass, skipping passes over bits all keys share.
+  *
+  * NaN keys end up in no particular place.
+  *
+  * \param tmpObjects Scratch space of n elements.
+  * \param tmpKeys Scratch space of 2*n elements. 
+  */
+template<class T> void sortByFloatKeys(
+  T *objects, float *keys, size_t n, 
+  T *tmpObjects, u_int32_t *tmpKeys) {
+  size_t counts[3][2048];
+  size_t i, sum, c;
+  u_int32_t *k=tmpKeys, *kt=tmpKeys+n, u;
+  T *o=objects, *ot=tmpObjects;
+  int pass, d, shift;
+  
+  if (n<2) return;
+  if (insertionSort<T,float>(objects,keys,0,n,
+    n<=SORT_INSERTION_THRESHOLD?0:4*n)) return;
+  
+  memset(counts,0,sizeof(counts));
+  for(i=0;i<n;i++) {
+    k[i]=sortableFloatBits(keys[i]);
+    counts[0][ k[i]     &0x7ff]++;
+    counts[1][(k[i]>>11)&0x7ff]++;
+    counts[2][ k[i]>>22       ]++;
+  }
+  
+  for(pass=0;pass<3;pass++) {
+    shift=pass*11;
+    if (counts[pass][(k[0]>>shift)&0x7ff]==n) continue;
+    
+    for(d=0,sum=0;d<2048;d++) {
+      c=counts[pass][d];
+      counts[pass][d]=sum;
+      sum+=c;
+    }
+    for(i=0;i<n;i++) {
+      c=counts[pass][(k[i]>>shift)&0x7ff]++;
+      kt[c]=k[i];
+      ot[c]=o[i];
+    }
+    
+    { u_int32_t *t=k; k=kt; kt=t; }
+    { T *t=o; o=ot; ot=t; }
+  }
+  
+  for(i=0;i<n;i++) {
+    if (o!=objects) objects[i]=o[i];
+    u=(k[i]&0x80000000)?(k[i]&0x7fffffff):~k[i];
+    memcpy(keys+i,&u,4);
+  }
 }
 
 #define max(x,y) (((x)>(y))?(x):(y))
@@ -433,6 +699,85 @@ double randf();
 char *strdup(const char *str) throw();
 int strcmp_ic(const char *a, const char *b);
 
+/** \brief Parses a floating point literal from a non-terminated buffer.
+  *
+  * Works like strtod, but does not require the input to be zero-terminated
+  * and, for plain decimal literals of reasonable precision, neither copies
+  * the input nor goes through the locale-aware C library parser.
+  *
+  * \param p Beginning of the literal. No leading whitespace is skipped.
+  * \param e End of the buffer, the literal must not extend beyond it.
+  * \param endptr If non-null, receives a pointer to the first character
+  * following the literal. This is p if no literal could be read.
+  */
+double strtod_n(const char *p, const char *e, const char **endptr);
+
+/** \brief Entry of a StringIndex. Slots with a null key are empty. */
+struct StringIndexEntry {
+  const char *key;
+  size_t      length;
+  size_t      hash;
+  size_t      value;
+};
+
+/** \brief Hash index mapping strings to array indices.
+  *
+  * The index does not copy its keys: the strings passed to insert must stay
+  * valid for as long as they are in the index. This is intended for arrays
+  * which already own their names, the index only accelerates lookups.
+  *
+  * Uses open addressing with linear probing, removal shifts back following
+  * entries so no tombstones are required.
+  */
+class StringIndex {
+  private:
+    StringIndexEntry *_table;
+    size_t _mask;
+    size_t _count;
+    
+    size_t _slot(const char *key, size_t length, size_t hash) const;
+    void _grow();
+  
+  public:
+    StringIndex();
+    ~StringIndex();
+    
+    /** \brief FNV-1a hash of a string. */
+    static size_t Hash(const char *key, size_t length);
+    
+    /** \brief Looks up a key.
+      *
+      * \param value Receives the value associated with the key, if found.
+      * \return 1 if the key was found, 0 otherwise.
+      */
+    int find(const SubString &key, size_t *value) const;
+    int find(const char *key, size_t *value) const;
+    
+    /** \brief Associates a value with a key, replacing any previous value.
+      */
+    void insert(const char *key, size_t value);
+    
+    /** \brief Removes a key.
+      *
+      * \return 1 if the key was found, 0 otherwise.
+      */
+    int remove(const char *key);
+    
+    void clear();
+    
+    size_t count() const { return _count; }
+};
+
+/** \brief An asset load in progress, see AssetRegistry::getAsync.
+  */
+template<class T> struct AssetJob {
+  T          *asset;
+  const char *name;
+  int         flags;
+  int         result;
+  JobCounter  counter;
+};
+
 /** \brief Asset manager for a single type of asset. 
   *
   * Make sure T actually implements IAsset.
@@ -444,14 +789,55 @@ int strcmp_ic(const char *a, const char *b);
   *
   * At the same time, the AssetRegistry performs virtual file system lookups
   * to support multiple search paths per asset type.
+  *
+  * Assets may also be loaded asynchronously through getAsync, in which case
+  * finishPending has to be called regularly from the main thread.
   */
   
 template<class T> class AssetRegistry {
   private:
     ARRAY(T*,_assets);
     ARRAY(const char*,_names);
+    ARRAY(AssetJob<T>*,_jobs);
+    
+    StringIndex _index;
     
     int _repository_mask;
+    
+    static void _prepareJob(void *arg) {
+      AssetJob<T> *job=(AssetJob<T>*)arg;
+      job->result=job->asset->prepare(job->name,job->flags);
+    }
+    
+    /** \brief Waits for a pending load to be prepared, finishes and removes
+      * it.
+      */
+    void _finishJob(size_t idx) {
+      AssetJob<T> *job=_jobs_v[idx];
+      size_t i;
+      
+      // remove first, so finish may safely request further assets.
+      for(i=idx+1;i<_jobs_n;i++) _jobs_v[i-1]=_jobs_v[i];
+      _jobs_n--;
+      
+      job_wait(&job->counter);
+      if (!job->result || !job->asset->finish(job->name,job->flags))
+        LOG_WARNING(
+          "WARNING: asynchronous loading of '%s' failed\n",job->name);
+      
+      free((void*)job);
+    }
+    
+    /** \brief Finishes the load of an asset right away, if it is pending.
+      */
+    void _finishAsset(T *asset) {
+      size_t idx;
+      AssetJob<T> **pjob;
+      FOREACH(idx,pjob,_jobs) if ((*pjob)->asset==asset) {
+        _finishJob(idx);
+        return;
+      }
+    }
   
   public:
     /** \brief Constructor.
@@ -462,6 +848,7 @@ template<class T> class AssetRegistry {
     AssetRegistry(int repository_mask) {
       ARRAY_INIT(_assets);
       ARRAY_INIT(_names);
+      ARRAY_INIT(_jobs);
       _repository_mask=repository_mask;
     }
     
@@ -479,12 +866,15 @@ template<class T> class AssetRegistry {
       *
       * If additional information is required to load the asset correctly,
       * it can be specified through the flags parameter.
+      *
+      * If the asset is still being loaded asynchronously, this blocks until
+      * it is finished.
       */
     T *get(const char *name, int flags=0) {
-      int idx;
-      const char **pstr;
-      char *str;
-      FOREACH(idx,pstr,_names) if (strcmp(*pstr,name)==0) {
+      size_t idx;
+      char *name_tmp;
+      if (_index.find(name,&idx)) {
+        if (_jobs_n) _finishAsset(_assets_v[idx]);
         return _assets_v[idx];
       }
       
@@ -495,18 +885,19 @@ template<class T> class AssetRegistry {
         return 0;
       }
       
+      name_tmp=strdup(name);
       APPEND(_assets,res);
-      APPEND(_names,strdup(name));
+      APPEND(_names,name_tmp);
+      _index.insert(name_tmp,_names_n-1);
       
       return res;
     }
     
     T *get(const SubString &name, int flags=0) {
-      int idx;
-      const char **pstr;
-      char *str;
+      size_t idx;
       char *name_tmp;
-      FOREACH(idx,pstr,_names) if (name==*pstr) {
+      if (_index.find(name,&idx)) {
+        if (_jobs_n) _finishAsset(_assets_v[idx]);
         return _assets_v[idx];
       }
       
@@ -521,24 +912,117 @@ template<class T> class AssetRegistry {
       
       APPEND(_assets,res);
       APPEND(_names,name_tmp);
+      _index.insert(name_tmp,_names_n-1);
+      
+      return res;
+    }
+    
+    /** \brief Returns a reference to an asset of the specified base name,
+      * loading it on the worker threads if it does not exist yet.
+      *
+      * The returned asset is registered right away and can be referred to
+      * like any other, but remains empty until its load is completed by
+      * finishPending (or by calling get for the same name). Should the load
+      * fail, the asset stays registered, empty, and a warning is emitted.
+      *
+      * See IAsset::prepare and IAsset::finish for how the load is split.
+      */
+    T *getAsync(const char *name, int flags=0) {
+      size_t idx;
+      AssetJob<T> *job;
+      if (_index.find(name,&idx)) {
+        return _assets_v[idx];
+      }
+      
+      T *res=new T();
+      res->grab();
+      
+      job=(AssetJob<T>*)malloc(sizeof(AssetJob<T>));
+      job->asset =res;
+      job->name  =strdup(name);
+      job->flags =flags;
+      job->result=0;
+      memset(&job->counter,0,sizeof(job->counter));
+      
+      APPEND(_assets,res);
+      APPEND(_names,job->name);
+      APPEND(_jobs,job);
+      _index.insert(job->name,_names_n-1);
+      
+      job_submit(_prepareJob,job,&job->counter);
       
       return res;
     }
     
+    /** \brief Starts loading an asset asynchronously, see getAsync.
+      */
+    void prefetch(const char *name, int flags=0) {
+      getAsync(name,flags);
+    }
+    
+    /** \brief Checks whether an asset is still being loaded asynchronously.
+      */
+    int pending(const T *asset) {
+      size_t idx;
+      AssetJob<T> **pjob;
+      FOREACH(idx,pjob,_jobs) if ((*pjob)->asset==asset) return 1;
+      return 0;
+    }
+    
+    /** \brief Completes asynchronous loads whose preparation is done.
+      *
+      * Loads are finished in the order they were requested. To keep frame
+      * times in check, no further loads are finished once the budget is
+      * exhausted, however at least one is finished per call if any is ready.
+      *
+      * \param budget Time, in seconds, to spend. If negative, this blocks
+      * until all pending loads are finished.
+      * \return Number of loads still pending.
+      */
+    int finishPending(double budget=-1) {
+      size_t idx;
+      double t0;
+      
+      if (!_jobs_n) return 0;
+      
+      if (budget<0) {
+        while(_jobs_n) _finishJob(0);
+        return 0;
+      }
+      
+      t0=clock_seconds();
+      for(idx=0;idx<_jobs_n;) {
+        if (job_pending(&_jobs_v[idx]->counter)) {
+          idx++;
+          continue;
+        }
+        _finishJob(idx);
+        if (clock_seconds()-t0>=budget) break;
+      }
+      
+      return _jobs_n;
+    }
+    
     void clear() {
       int idx;
       const char **pstr;
       T **passet;
       
+      finishPending();
+      
       FOREACH(idx,pstr,_names) free((void*)*pstr);
       FOREACH(idx,passet,_assets) 
         (*passet)->drop();
       
       ARRAY_DESTROY(_assets);
       ARRAY_DESTROY(_names);
+      ARRAY_DESTROY(_jobs);
+      _index.clear();
     }
     
     /** \brief Drops all assets noone else is holding a reference to.
+      *
+      * Assets still being loaded asynchronously are kept.
       */
     int clearDeprecated() {
       size_t idx;
@@ -548,9 +1032,13 @@ template<class T> class AssetRegistry {
       while(n!=_assets_n) {
         n=_assets_n;
         FOREACH(idx,passet,_assets) if ((*passet)->refcount()==1) {
+          if (pending(*passet)) continue;
           (*passet)->drop();
+          _index.remove(_names_v[idx]);
+          free((void*)_names_v[idx]);
           _assets_v[idx]=_assets_v[--_assets_n];
           _names_v[idx] =_names_v[--_names_n];
+          if (idx<_names_n) _index.insert(_names_v[idx],idx);
           passet--;
           idx--;
         }
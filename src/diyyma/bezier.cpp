@@ -122,10 +122,7 @@ int BezierPath::segmentCount() {
 
 void BezierPath::setSegmentCount(int n) {
   if (n<1) return;
-  _points_n=n+1;
-  _points_v=(BezierPoint*)realloc(
-    (void*)_points_v,
-    sizeof(BezierPoint)*_points_n);
+  ARRAY_SETSIZE(_points,n+1);
 }
 
 BezierPoint *BezierPath::points() {
@@ -139,10 +136,7 @@ int BezierPath::correctionCount() {
 
 void BezierPath::setCorrectionCount(int n) {
   if (n<1) return;
-  _timePoints_n=n+1;
-  _timePoints_v=(BezierTimePoint*)realloc(
-    (void*)_timePoints_v,
-    sizeof(BezierTimePoint)*_timePoints_n);
+  ARRAY_SETSIZE(_timePoints,n+1);
 }
 
 BezierTimePoint *BezierPath::timePoints() {
@@ -0,0 +1,425 @@
+/** \file bvh.cpp
+  * \author Peter Wagener
+  * \brief Dynamic bounding volume hierarchy implementation.
+  *
+  * Insertion picks the sibling by the surface area heuristic, and the tree
+  * is kept balanced by AVL-style rotations on the way back up.
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "diyyma/bvh.h"
+
+#define BVH_NULL -1
+
+void bvh_transform_box(const Matrixf &M, Vector3f *bmin, Vector3f *bmax) {
+  Vector3f c, e;
+  
+  // the box around the transformed box has the transformed center, and 
+  // extents projected onto the absolute values of the axes.
+  c=(*bmin+*bmax)*0.5f;
+  e=(*bmax-*bmin)*0.5f;
+  c.set(
+    M.a11*c.x+M.a12*c.y+M.a13*c.z+M.a14,
+    M.a21*c.x+M.a22*c.y+M.a23*c.z+M.a24,
+    M.a31*c.x+M.a32*c.y+M.a33*c.z+M.a34);
+  e.set(
+    fabsf(M.a11)*e.x+fabsf(M.a12)*e.y+fabsf(M.a13)*e.z,
+    fabsf(M.a21)*e.x+fabsf(M.a22)*e.y+fabsf(M.a23)*e.z,
+    fabsf(M.a31)*e.x+fabsf(M.a32)*e.y+fabsf(M.a33)*e.z);
+  *bmin=c-e;
+  *bmax=c+e;
+}
+
+static inline float _area(const Vector3f &bmin, const Vector3f &bmax) {
+  Vector3f d=bmax-bmin;
+  return d.x*d.y+d.y*d.z+d.z*d.x;
+}
+
+static inline void _union(
+  Vector3f *rmin, Vector3f *rmax,
+  const Vector3f &amin, const Vector3f &amax,
+  const Vector3f &bmin, const Vector3f &bmax) {
+  rmin->set(min(amin.x,bmin.x),min(amin.y,bmin.y),min(amin.z,bmin.z));
+  rmax->set(max(amax.x,bmax.x),max(amax.y,bmax.y),max(amax.z,bmax.z));
+}
+
+static inline float _unionArea(const bvh_node_t *a, const bvh_node_t *b) {
+  Vector3f rmin, rmax;
+  _union(&rmin,&rmax,a->bmin,a->bmax,b->bmin,b->bmax);
+  return _area(rmin,rmax);
+}
+
+BVH::BVH() : margin(BVH_MARGIN) {
+  ARRAY_INIT(_nodes);
+  _root=BVH_NULL;
+  _free=BVH_NULL;
+  _leaves=0;
+}
+
+BVH::~BVH() {
+  ARRAY_DESTROY(_nodes);
+}
+
+int BVH::_allocate() {
+  bvh_node_t node, *pnode;
+  int r;
+  
+  if (_free==BVH_NULL) {
+    APPEND(_nodes,node);
+    r=_nodes_n-1;
+  } else {
+    r=_free;
+    _free=_nodes_v[r].parent;
+  }
+  
+  pnode=_nodes_v+r;
+  pnode->parent  =BVH_NULL;
+  pnode->child[0]=BVH_NULL;
+  pnode->child[1]=BVH_NULL;
+  pnode->height  =0;
+  pnode->data    =0;
+  
+  return r;
+}
+
+void BVH::_release(int node) {
+  _nodes_v[node].height=-1;
+  _nodes_v[node].parent=_free;
+  _free=node;
+}
+
+void BVH::_insertLeaf(int leaf) {
+  int index, sibling, parent, oldParent, c0, c1;
+  float area, combined, cost, inheritance, cost0, cost1;
+  bvh_node_t *n, *l;
+  
+  if (_root==BVH_NULL) {
+    _root=leaf;
+    _nodes_v[leaf].parent=BVH_NULL;
+    return;
+  }
+  
+  // descend towards the sibling that enlarges the tree the least
+  l=_nodes_v+leaf;
+  index=_root;
+  while (_nodes_v[index].child[0]!=BVH_NULL) {
+    n =_nodes_v+index;
+    c0=n->child[0];
+    c1=n->child[1];
+    
+    area    =_area(n->bmin,n->bmax);
+    combined=_unionArea(n,l);
+    
+    // cost of pairing with this node, and the minimum cost pushed down to
+    // any of its descendants
+    cost       =2*combined;
+    inheritance=2*(combined-area);
+    
+    cost0=_unionArea(_nodes_v+c0,l)+inheritance;
+    if (_nodes_v[c0].child[0]!=BVH_NULL)
+      cost0-=_area(_nodes_v[c0].bmin,_nodes_v[c0].bmax);
+    cost1=_unionArea(_nodes_v+c1,l)+inheritance;
+    if (_nodes_v[c1].child[0]!=BVH_NULL)
+      cost1-=_area(_nodes_v[c1].bmin,_nodes_v[c1].bmax);
+    
+    if ((cost<cost0)&&(cost<cost1)) break;
+    index=cost0<cost1?c0:c1;
+  }
+  sibling=index;
+  
+  // allocating may move the nodes, so no pointers are kept across this
+  oldParent=_nodes_v[sibling].parent;
+  parent=_allocate();
+  n=_nodes_v+parent;
+  n->parent=oldParent;
+  n->height=_nodes_v[sibling].height+1;
+  _union(
+    &n->bmin,&n->bmax,
+    _nodes_v[sibling].bmin,_nodes_v[sibling].bmax,
+    _nodes_v[leaf].bmin,_nodes_v[leaf].bmax);
+  n->child[0]=sibling;
+  n->child[1]=leaf;
+  _nodes_v[sibling].parent=parent;
+  _nodes_v[leaf].parent=parent;
+  
+  if (oldParent==BVH_NULL) {
+    _root=parent;
+  } else {
+    n=_nodes_v+oldParent;
+    n->child[n->child[0]==sibling?0:1]=parent;
+  }
+  
+  // refit and rebalance the ancestors
+  for(index=_nodes_v[leaf].parent;index!=BVH_NULL;index=n->parent) {
+    index=_balance(index);
+    n =_nodes_v+index;
+    c0=n->child[0];
+    c1=n->child[1];
+    n->height=1+max(_nodes_v[c0].height,_nodes_v[c1].height);
+    _union(
+      &n->bmin,&n->bmax,
+      _nodes_v[c0].bmin,_nodes_v[c0].bmax,
+      _nodes_v[c1].bmin,_nodes_v[c1].bmax);
+  }
+}
+
+void BVH::_removeLeaf(int leaf) {
+  int parent, grandParent, sibling, index, c0, c1;
+  bvh_node_t *n;
+  
+  if (leaf==_root) {
+    _root=BVH_NULL;
+    return;
+  }
+  
+  parent     =_nodes_v[leaf].parent;
+  grandParent=_nodes_v[parent].parent;
+  n=_nodes_v+parent;
+  sibling=n->child[0]==leaf?n->child[1]:n->child[0];
+  
+  _release(parent);
+  
+  if (grandParent==BVH_NULL) {
+    _root=sibling;
+    _nodes_v[sibling].parent=BVH_NULL;
+    return;
+  }
+  
+  n=_nodes_v+grandParent;
+  n->child[n->child[0]==parent?0:1]=sibling;
+  _nodes_v[sibling].parent=grandParent;
+  
+  for(index=grandParent;index!=BVH_NULL;index=n->parent) {
+    index=_balance(index);
+    n =_nodes_v+index;
+    c0=n->child[0];
+    c1=n->child[1];
+    n->height=1+max(_nodes_v[c0].height,_nodes_v[c1].height);
+    _union(
+      &n->bmin,&n->bmax,
+      _nodes_v[c0].bmin,_nodes_v[c0].bmax,
+      _nodes_v[c1].bmin,_nodes_v[c1].bmax);
+  }
+}
+
+/** \brief Rotates the taller child of a node up if its subtrees differ in
+  * height by more than one.
+  *
+  * \return Index of the node now taking the place of the given one.
+  */
+int BVH::_balance(int iA) {
+  bvh_node_t *A, *B, *C, *X, *Y;
+  int iB, iC, iX, iY, side, up;
+  
+  A=_nodes_v+iA;
+  if ((A->child[0]==BVH_NULL)||(A->height<2)) return iA;
+  
+  iB=A->child[0];
+  iC=A->child[1];
+  B=_nodes_v+iB;
+  C=_nodes_v+iC;
+  
+  if      (C->height-B->height> 1) side=1;
+  else if (C->height-B->height<-1) side=0;
+  else return iA;
+  
+  // the taller child U takes the place of A, which takes the place of the
+  // shorter grandchild below U. The other grandchild stays with U.
+  up=A->child[side];
+  X=_nodes_v+up;
+  iX=X->child[0];
+  iY=X->child[1];
+  
+  X->child[0]=iA;
+  X->parent=A->parent;
+  A->parent=up;
+  
+  if (X->parent==BVH_NULL) {
+    _root=up;
+  } else {
+    C=_nodes_v+X->parent;
+    C->child[C->child[0]==iA?0:1]=up;
+  }
+  
+  // keep the taller grandchild with U
+  if (_nodes_v[iX].height<_nodes_v[iY].height) {
+    X->child[1]=iY;
+    A->child[side]=iX;
+    _nodes_v[iX].parent=iA;
+  } else {
+    X->child[1]=iX;
+    A->child[side]=iY;
+    _nodes_v[iY].parent=iA;
+  }
+  
+  B=_nodes_v+A->child[0];
+  C=_nodes_v+A->child[1];
+  A->height=1+max(B->height,C->height);
+  _union(&A->bmin,&A->bmax,B->bmin,B->bmax,C->bmin,C->bmax);
+  
+  Y=_nodes_v+X->child[1];
+  X->height=1+max(A->height,Y->height);
+  _union(&X->bmin,&X->bmax,A->bmin,A->bmax,Y->bmin,Y->bmax);
+  
+  return up;
+}
+
+int BVH::insert(const Vector3f &bmin, const Vector3f &bmax, void *data) {
+  int leaf=_allocate();
+  Vector3f m=(bmax-bmin)*margin;
+  
+  _nodes_v[leaf].bmin=bmin-m;
+  _nodes_v[leaf].bmax=bmax+m;
+  _nodes_v[leaf].data=data;
+  
+  _insertLeaf(leaf);
+  _leaves++;
+  
+  return leaf;
+}
+
+void BVH::remove(int leaf) {
+  _removeLeaf(leaf);
+  _release(leaf);
+  _leaves--;
+}
+
+int BVH::move(int leaf, const Vector3f &bmin, const Vector3f &bmax) {
+  bvh_node_t *n=_nodes_v+leaf;
+  Vector3f m;
+  
+  if ((n->bmin.x<=bmin.x)&&(n->bmin.y<=bmin.y)&&(n->bmin.z<=bmin.z)
+  &&  (n->bmax.x>=bmax.x)&&(n->bmax.y>=bmax.y)&&(n->bmax.z>=bmax.z))
+    return 0;
+  
+  _removeLeaf(leaf);
+  
+  m=(bmax-bmin)*margin;
+  n=_nodes_v+leaf;
+  n->bmin=bmin-m;
+  n->bmax=bmax+m;
+  
+  _insertLeaf(leaf);
+  
+  return 1;
+}
+
+void *BVH::data(int leaf) { return _nodes_v[leaf].data; }
+
+void BVH::setData(int leaf, void *data) { _nodes_v[leaf].data=data; }
+
+size_t BVH::count() { return _leaves; }
+
+void BVH::clear() {
+  _nodes_n=0;
+  _root=BVH_NULL;
+  _free=BVH_NULL;
+  _leaves=0;
+}
+
+int BVH::height() { return _root==BVH_NULL?-1:_nodes_v[_root].height; }
+
+void BVH::queryFrustum(const Frustum &frustum, bvh_callback_t cb, void *arg) {
+  int stack[BVH_STACK_SIZE*2], stack_n=0;
+  const Vector4f *p;
+  bvh_node_t *n;
+  Vector3f c, e;
+  float d, r;
+  int index, mask, i;
+  
+  if (_root==BVH_NULL) return;
+  
+  // entries are pairs of node index and the mask of planes it still has to
+  // be tested against.
+  stack[stack_n++]=_root;
+  stack[stack_n++]=0x3f;
+  
+  while(stack_n) {
+    mask =stack[--stack_n];
+    index=stack[--stack_n];
+    n=_nodes_v+index;
+    
+    if (mask) {
+      c=(n->bmin+n->bmax)*0.5f;
+      e=(n->bmax-n->bmin)*0.5f;
+      for(i=0,p=frustum.planes;i<6;i++,p++) if (mask&(1<<i)) {
+        d=p->x*c.x+p->y*c.y+p->z*c.z+p->w;
+        r=fabsf(p->x)*e.x+fabsf(p->y)*e.y+fabsf(p->z)*e.z;
+        if (d+r<0) break;
+        if (d-r>=0) mask&=~(1<<i);
+      }
+      if (i<6) continue;
+    }
+    
+    if (n->child[0]==BVH_NULL) {
+      cb(n->data,arg);
+    } else {
+      stack[stack_n++]=n->child[0];
+      stack[stack_n++]=mask;
+      stack[stack_n++]=n->child[1];
+      stack[stack_n++]=mask;
+    }
+  }
+}
+
+void BVH::querySphere(
+  const Vector3f &center, float radius, bvh_callback_t cb, void *arg) {
+  int stack[BVH_STACK_SIZE], stack_n=0;
+  bvh_node_t *n;
+  Vector3f d;
+  int index;
+  
+  if (_root==BVH_NULL) return;
+  
+  stack[stack_n++]=_root;
+  
+  while(stack_n) {
+    index=stack[--stack_n];
+    n=_nodes_v+index;
+    
+    // distance from the center to the closest point of the box
+    d.set(
+      max(0.0f,max(n->bmin.x-center.x,center.x-n->bmax.x)),
+      max(0.0f,max(n->bmin.y-center.y,center.y-n->bmax.y)),
+      max(0.0f,max(n->bmin.z-center.z,center.z-n->bmax.z)));
+    if (d*d>radius*radius) continue;
+    
+    if (n->child[0]==BVH_NULL) {
+      cb(n->data,arg);
+    } else {
+      stack[stack_n++]=n->child[0];
+      stack[stack_n++]=n->child[1];
+    }
+  }
+}
+
+void BVH::queryBox(
+  const Vector3f &bmin, const Vector3f &bmax, bvh_callback_t cb,
+  void *arg) {
+  int stack[BVH_STACK_SIZE], stack_n=0;
+  bvh_node_t *n;
+  int index;
+  
+  if (_root==BVH_NULL) return;
+  
+  stack[stack_n++]=_root;
+  
+  while(stack_n) {
+    index=stack[--stack_n];
+    n=_nodes_v+index;
+    
+    if ((n->bmin.x>bmax.x)||(n->bmin.y>bmax.y)||(n->bmin.z>bmax.z)
+    ||  (n->bmax.x<bmin.x)||(n->bmax.y<bmin.y)||(n->bmax.z<bmin.z))
+      continue;
+    
+    if (n->child[0]==BVH_NULL) {
+      cb(n->data,arg);
+    } else {
+      stack[stack_n++]=n->child[0];
+      stack[stack_n++]=n->child[1];
+    }
+  }
+}
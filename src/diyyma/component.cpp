@@ -168,18 +168,18 @@ SceneContext FPSCameraComponent::context() {
 }
 
 AssetReloader::AssetReloader() : 
-  _asset_v(0), _asset_n(0), _tCheck(0), delay(1) { 
+  ARRAY_INIT2(_asset), _tCheck(0), delay(1) { 
   
 }
 AssetReloader::AssetReloader(IAsset *asset) : 
-  _asset_v(0), _asset_n(0), _tCheck(0), delay(1) {
+  ARRAY_INIT2(_asset), _tCheck(0), delay(1) {
   operator+=(asset);
 }
 AssetReloader::~AssetReloader() {
   size_t i;
   for(i=0;i<_asset_n;i++)
     _asset_v[i].asset->drop();
-  free((void*)_asset_v);
+  ARRAY_DESTROY(_asset);
 }
 
 void AssetReloader::render() { }
@@ -212,10 +212,7 @@ int AssetReloader::operator[](const IAsset *asset) const {
 
 void AssetReloader::operator+=(IAsset *asset) {
   if (operator[](asset)!=-1) { return; }
-  _asset_v=(AssetRecord*)realloc(
-    (void*)_asset_v,
-    sizeof(AssetRecord)*(_asset_n+1));
-  _asset_v[_asset_n++]=AssetRecord(asset, asset->filesTimestamp());
+  APPEND(_asset,AssetRecord(asset, asset->filesTimestamp()));
   asset->grab();
 }
 
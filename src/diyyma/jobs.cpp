@@ -0,0 +1,343 @@
+/** \file jobs.cpp
+  * \author Peter Wagener
+  * \brief Worker thread pool implementation.
+  *
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL/SDL.h"
+
+#include "diyyma/jobs.h"
+#include "diyyma/util.h"
+
+#define JOBS_MAX_THREADS 32
+
+/** \brief Number of ranges per thread job_parallel_for splits into, so
+  * threads finishing early can steal the remainder.
+  */
+#define JOBS_RANGES_PER_THREAD 4
+
+struct job_t {
+  job_func_t  fn;
+  void       *arg;
+  JobCounter *counter;
+};
+
+/** \brief Ring buffer of the jobs submitted by a thread.
+  *
+  * The owner takes the newest job, others steal the oldest one.
+  */
+struct job_deque_t {
+  SDL_mutex *mutex;
+  job_t     *v;
+  size_t     s;
+  size_t     first;
+  size_t     n;
+};
+
+struct job_range_t {
+  job_range_func_t fn;
+  void            *arg;
+  size_t           begin, end;
+};
+
+static SDL_mutex  *_jobs_mutex=0;
+static SDL_cond   *_jobs_cond=0;
+static SDL_Thread *_jobs_threads[JOBS_MAX_THREADS];
+static int         _jobs_threads_n=0;
+static int         _jobs_running=0;
+static SDL_mutex  *_jobs_locks[JOB_LOCK_COUNT];
+
+// deque 0 is shared by all threads outside the pool, worker i owns i+1.
+static job_deque_t _jobs_deques[JOBS_MAX_THREADS+1];
+static int         _jobs_deques_n=0;
+static SDL_TLSID   _jobs_tls=0;
+
+// jobs in all deques, and threads waiting on _jobs_cond for them
+static SDL_atomic_t _jobs_queued;
+static SDL_atomic_t _jobs_idle;
+
+/** \brief Returns the index of the deque owned by the calling thread. */
+static int _jobs_self() {
+  return (int)(size_t)SDL_TLSGet(_jobs_tls);
+}
+
+static void _jobs_push(int self, job_func_t fn, void *arg,
+  JobCounter *counter) {
+  job_deque_t *dq=_jobs_deques+self;
+  job_t *v;
+  size_t i, s;
+  
+  // before the job is visible, so it cannot finish first
+  if (counter) SDL_AtomicAdd(&counter->pending,1);
+  
+  SDL_LockMutex(dq->mutex);
+  
+  if (dq->n>=dq->s) {
+    s=dq->s?dq->s*2:64;
+    v=(job_t*)malloc(sizeof(job_t)*s);
+    for(i=0;i<dq->n;i++)
+      v[i]=dq->v[(dq->first+i)%dq->s];
+    if (dq->v) free((void*)dq->v);
+    dq->v=v;
+    dq->s=s;
+    dq->first=0;
+  }
+  
+  v=dq->v+(dq->first+dq->n)%dq->s;
+  v->fn     =fn;
+  v->arg    =arg;
+  v->counter=counter;
+  dq->n++;
+  
+  SDL_UnlockMutex(dq->mutex);
+  
+  SDL_AtomicAdd(&_jobs_queued,1);
+}
+
+/** \brief Wakes all threads waiting for jobs.
+  *
+  * Idle threads register before checking for jobs under the lock, so either
+  * they see the new jobs or they are counted here.
+  */
+static void _jobs_wake() {
+  if (!SDL_AtomicGet(&_jobs_idle)) return;
+  SDL_LockMutex(_jobs_mutex);
+  SDL_CondBroadcast(_jobs_cond);
+  SDL_UnlockMutex(_jobs_mutex);
+}
+
+/** \brief Takes the newest job of the calling thread's own deque, or
+  * steals the oldest job of another one.
+  */
+static int _jobs_take(int self, job_t *job) {
+  job_deque_t *dq;
+  int i;
+  
+  if (!SDL_AtomicGet(&_jobs_queued)) return 0;
+  
+  dq=_jobs_deques+self;
+  SDL_LockMutex(dq->mutex);
+  if (dq->n) {
+    dq->n--;
+    *job=dq->v[(dq->first+dq->n)%dq->s];
+    SDL_UnlockMutex(dq->mutex);
+    SDL_AtomicAdd(&_jobs_queued,-1);
+    return 1;
+  }
+  SDL_UnlockMutex(dq->mutex);
+  
+  for(i=1;i<_jobs_deques_n;i++) {
+    dq=_jobs_deques+(self+i)%_jobs_deques_n;
+    SDL_LockMutex(dq->mutex);
+    if (dq->n) {
+      *job=dq->v[dq->first];
+      dq->first=(dq->first+1)%dq->s;
+      dq->n--;
+      SDL_UnlockMutex(dq->mutex);
+      SDL_AtomicAdd(&_jobs_queued,-1);
+      return 1;
+    }
+    SDL_UnlockMutex(dq->mutex);
+  }
+  
+  return 0;
+}
+
+/** \brief Runs a job and marks it done. */
+static void _jobs_run(job_t *job) {
+  job->fn(job->arg);
+  
+  // the counter may be gone as soon as it hits zero
+  if (job->counter && (SDL_AtomicAdd(&job->counter->pending,-1)==1))
+    _jobs_wake();
+}
+
+static int _jobs_worker(void *arg) {
+  job_t job;
+  int self=(int)(size_t)arg;
+  int r;
+  
+  SDL_TLSSet(_jobs_tls,arg,0);
+  
+  while(1) {
+    if (_jobs_take(self,&job)) {
+      _jobs_run(&job);
+      continue;
+    }
+    
+    SDL_LockMutex(_jobs_mutex);
+    SDL_AtomicAdd(&_jobs_idle,1);
+    while(_jobs_running && !SDL_AtomicGet(&_jobs_queued))
+      SDL_CondWait(_jobs_cond,_jobs_mutex);
+    SDL_AtomicAdd(&_jobs_idle,-1);
+    r=_jobs_running || SDL_AtomicGet(&_jobs_queued);
+    SDL_UnlockMutex(_jobs_mutex);
+    
+    if (!r) break;
+  }
+  
+  return 0;
+}
+
+void jobs_init(int threads) {
+  int i;
+  char name[32];
+  
+  if (_jobs_mutex) return;
+  
+  if (threads<1) threads=SDL_GetCPUCount()-1;
+  if (threads>JOBS_MAX_THREADS) threads=JOBS_MAX_THREADS;
+  if (threads<0) threads=0;
+  
+  _jobs_mutex  =SDL_CreateMutex();
+  _jobs_cond   =SDL_CreateCond();
+  _jobs_tls    =SDL_TLSCreate();
+  _jobs_running=1;
+  SDL_AtomicSet(&_jobs_queued,0);
+  SDL_AtomicSet(&_jobs_idle,0);
+  
+  for(i=0;i<JOB_LOCK_COUNT;i++) _jobs_locks[i]=SDL_CreateMutex();
+  
+  // all deques exist before any thread may steal from them
+  _jobs_deques_n=threads+1;
+  for(i=0;i<_jobs_deques_n;i++) {
+    memset(_jobs_deques+i,0,sizeof(job_deque_t));
+    _jobs_deques[i].mutex=SDL_CreateMutex();
+  }
+  
+  for(i=0;i<threads;i++) {
+    _snprintf(name,sizeof(name),"diyyma-worker-%i",i);
+    _jobs_threads[_jobs_threads_n]=
+      SDL_CreateThread(_jobs_worker,name,(void*)(size_t)(i+1));
+    if (!_jobs_threads[_jobs_threads_n]) {
+      LOG_WARNING(
+        "WARNING: unable to create worker thread (%s)\n",SDL_GetError());
+      break;
+    }
+    _jobs_threads_n++;
+  }
+}
+
+void jobs_shutdown() {
+  int i;
+  job_t job;
+  
+  if (!_jobs_mutex) return;
+  
+  SDL_LockMutex(_jobs_mutex);
+  _jobs_running=0;
+  SDL_CondBroadcast(_jobs_cond);
+  SDL_UnlockMutex(_jobs_mutex);
+  
+  // without any workers, whatever is left is done here.
+  if (!_jobs_threads_n) while(_jobs_take(0,&job)) _jobs_run(&job);
+  
+  for(i=0;i<_jobs_threads_n;i++) SDL_WaitThread(_jobs_threads[i],0);
+  _jobs_threads_n=0;
+  
+  for(i=0;i<_jobs_deques_n;i++) {
+    SDL_DestroyMutex(_jobs_deques[i].mutex);
+    if (_jobs_deques[i].v) free((void*)_jobs_deques[i].v);
+    memset(_jobs_deques+i,0,sizeof(job_deque_t));
+  }
+  _jobs_deques_n=0;
+  
+  SDL_DestroyCond(_jobs_cond);
+  SDL_DestroyMutex(_jobs_mutex);
+  _jobs_mutex=0;
+  _jobs_cond=0;
+  for(i=0;i<JOB_LOCK_COUNT;i++) {
+    SDL_DestroyMutex(_jobs_locks[i]);
+    _jobs_locks[i]=0;
+  }
+}
+
+int jobs_thread_count() {
+  return _jobs_threads_n;
+}
+
+void job_submit(job_func_t fn, void *arg, JobCounter *counter) {
+  if (!_jobs_mutex) jobs_init();
+  
+  _jobs_push(_jobs_self(),fn,arg,counter);
+  _jobs_wake();
+}
+
+void job_wait(JobCounter *counter) {
+  job_t job;
+  int self;
+  
+  if (!_jobs_mutex) return;
+  
+  self=_jobs_self();
+  while(SDL_AtomicGet(&counter->pending)>0) {
+    // help out instead of idling; this also keeps nested waits from
+    // deadlocking inside worker threads.
+    if (_jobs_take(self,&job)) {
+      _jobs_run(&job);
+      continue;
+    }
+    
+    SDL_LockMutex(_jobs_mutex);
+    SDL_AtomicAdd(&_jobs_idle,1);
+    while((SDL_AtomicGet(&counter->pending)>0)
+    && !SDL_AtomicGet(&_jobs_queued))
+      SDL_CondWait(_jobs_cond,_jobs_mutex);
+    SDL_AtomicAdd(&_jobs_idle,-1);
+    SDL_UnlockMutex(_jobs_mutex);
+  }
+}
+
+int job_pending(JobCounter *counter) {
+  return SDL_AtomicGet(&counter->pending);
+}
+
+static void _jobs_range(void *arg) {
+  job_range_t *range=(job_range_t*)arg;
+  range->fn(range->arg,range->begin,range->end);
+}
+
+void job_parallel_for(
+  size_t n, size_t grain, job_range_func_t fn, void *arg) {
+  job_range_t ranges[(JOBS_MAX_THREADS+1)*JOBS_RANGES_PER_THREAD];
+  JobCounter  counter;
+  size_t      count, idx;
+  int         self;
+  
+  if (grain<1) grain=1;
+  if (n>grain && !_jobs_mutex) jobs_init();
+  
+  if ((n<=grain) || !_jobs_threads_n) {
+    if (n) fn(arg,0,n);
+    return;
+  }
+  
+  count=min((n+grain-1)/grain,
+    (size_t)_jobs_deques_n*JOBS_RANGES_PER_THREAD);
+  for(idx=0;idx<count;idx++) {
+    ranges[idx].fn   =fn;
+    ranges[idx].arg  =arg;
+    ranges[idx].begin=n*idx/count;
+    ranges[idx].end  =n*(idx+1)/count;
+  }
+  
+  memset(&counter,0,sizeof(counter));
+  self=_jobs_self();
+  for(idx=1;idx<count;idx++)
+    _jobs_push(self,_jobs_range,ranges+idx,&counter);
+  _jobs_wake();
+  
+  fn(arg,ranges[0].begin,ranges[0].end);
+  job_wait(&counter);
+}
+
+void job_lock(int lock) {
+  if (_jobs_mutex) SDL_LockMutex(_jobs_locks[lock]);
+}
+
+void job_unlock(int lock) {
+  if (_jobs_mutex) SDL_UnlockMutex(_jobs_locks[lock]);
+}
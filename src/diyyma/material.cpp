@@ -75,6 +75,8 @@ void Material::unbind() {
 MaterialLibrary::MaterialLibrary() {
   ARRAY_INIT(_materials);
   _filename=0;
+  _preparedFilename=0;
+  _preparedData=0;
 }
 
 MaterialLibrary::~MaterialLibrary() {
@@ -90,21 +92,22 @@ MaterialLibrary::~MaterialLibrary() {
   
   if (_filename)
     free((void*)_filename);
+  if (_preparedFilename) free((void*)_preparedFilename);
+  if (_preparedData) free(_preparedData);
 }
 
 int MaterialLibrary::find(const char *name, int create) {
   size_t idx;
-  NamedMaterial *pmat;
   NamedMaterial newMat;
   
-  FOREACH(idx,pmat,_materials) 
-    if (strcmp(name,pmat->name)==0) return idx;
+  if (_index.find(name,&idx)) return idx;
   
   if (create) {
     newMat.mat=new Material();
     newMat.mat->grab();
     newMat.name=strdup(name);
     APPEND(_materials,newMat);
+    _index.insert(newMat.name,_materials_n-1);
     return _materials_n-1;
   }
   return -1;
@@ -112,17 +115,16 @@ int MaterialLibrary::find(const char *name, int create) {
 
 int MaterialLibrary::find(const SubString &name, int create) {
   size_t idx;
-  NamedMaterial *pmat;
   NamedMaterial newMat;
   
-  FOREACH(idx,pmat,_materials) 
-    if (name==pmat->name) return idx;
+  if (_index.find(name,&idx)) return idx;
   
   if (create) {
     newMat.mat=new Material();
     newMat.mat->grab();
     newMat.name=name.dup();
     APPEND(_materials,newMat);
+    _index.insert(newMat.name,_materials_n-1);
     return _materials_n-1;
   }
   return -1;
@@ -159,6 +161,28 @@ timestamp_t MaterialLibrary::filesTimestamp() {
 }
 
 int MaterialLibrary::load(const char *fn, int flags) {
+  if (!prepare(fn,flags)) return 0;
+  return finish(fn,flags);
+}
+
+int MaterialLibrary::prepare(const char *fn, int /*flags*/) {
+  if (_preparedFilename) free((void*)_preparedFilename);
+  if (_preparedData) free(_preparedData);
+  _preparedData=0;
+  
+  _preparedFilename=vfs_locate(fn,REPOSITORY_MASK_MESH);
+  if (!_preparedFilename)
+    return 0;
+  
+  if (!readFile(_preparedFilename,&_preparedData,&_preparedCb)) {
+    _preparedData=0;
+    return 0;
+  }
+  
+  return 1;
+}
+
+int MaterialLibrary::finish(const char * /*fn*/, int flags) {
   char *refmask_v=0;
   int refmask_n=0;
   
@@ -179,14 +203,15 @@ int MaterialLibrary::load(const char *fn, int flags) {
   AssetRegistry<Texture> *tex=reg_tex();
   AssetRegistry<Shader> *shd=reg_shd();
   
-  // locate and read the material library file
-  if (_filename) free((void*)_filename);
-  _filename=vfs_locate(fn,REPOSITORY_MASK_MESH);
-  if (!_filename)
-    return 0;
+  // take over the file read by prepare
+  if (!_preparedData) return 0;
   
-  if (!readFile(_filename,&data,&cb))
-    return 0;
+  if (_filename) free((void*)_filename);
+  _filename=_preparedFilename;
+  data=_preparedData;
+  cb=_preparedCb;
+  _preparedFilename=0;
+  _preparedData=0;
   
   // initiate structures for handling updates
   if (flags&MATLIB_LOAD_UPDATE) {
@@ -201,6 +226,7 @@ int MaterialLibrary::load(const char *fn, int flags) {
       free((void*)pmat->name);
     }
     ARRAY_DESTROY(_materials);
+    _index.clear();
   }
   
   // scan the file
@@ -220,24 +246,24 @@ int MaterialLibrary::load(const char *fn, int flags) {
     } else if (str=="map_Ka") {
       if (!scanner->getLnString(&str)) continue;
       str_tmp=str.dup();
-      mat->addTexture(str_tmp,"s_ambient");
+      mat->addTexture(str_tmp,"s_ambient",flags&MATLIB_LOAD_ASYNC);
       free((void*)str_tmp);
     } else if (str=="map_Kd") {
       if (!scanner->getLnString(&str)) continue;
       str_tmp=str.dup();
-      mat->addTexture(str_tmp,"s_diffuse");
+      mat->addTexture(str_tmp,"s_diffuse",flags&MATLIB_LOAD_ASYNC);
       free((void*)str_tmp);
     } else if (str=="map_Ks") {
       if (!scanner->getLnString(&str)) continue;
       str_tmp=str.dup();
-      mat->addTexture(str_tmp,"s_specular");
+      mat->addTexture(str_tmp,"s_specular",flags&MATLIB_LOAD_ASYNC);
       free((void*)str_tmp);
     } else if (str=="#texture") {
       if (!scanner->getLnString(&str)) continue;
       if (!scanner->getLnString(&str1)) continue;
       str_tmp=str.dup();
       str_tmp2=str1.dup();
-      mat->addTexture(str_tmp2,str_tmp);
+      mat->addTexture(str_tmp2,str_tmp,flags&MATLIB_LOAD_ASYNC);
       free((void*)str_tmp);
       free((void*)str_tmp2);
       
@@ -260,14 +286,19 @@ int MaterialLibrary::load(const char *fn, int flags) {
   // drop materials no longer found in the file
   for(i=0,idx=0;i<refmask_n;i++)
     if (!refmask_v[i]) {
+      _index.remove(_materials_v[idx].name);
       _materials_v[idx].mat->drop();
       free((void*)_materials_v[idx].name);
       for(j=idx;j<_materials_n-1;j++)
-        _materials_v[idx]=_materials_v[idx+1];
+        _materials_v[j]=_materials_v[j+1];
       _materials_n--;
     } else
       idx++;
   
+  // materials following dropped ones have moved
+  if (refmask_n)
+    FOREACH(imat,pmat,_materials) _index.insert(pmat->name,imat);
+  
   // cleanup
   scanner->drop();
   free(data);
@@ -0,0 +1,744 @@
+
+/** \file meshopt.cpp
+  * \author Peter Wagener
+  * \brief Index and vertex buffer reordering implementation.
+  *
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "diyyma/meshopt.h"
+
+// scoring parameters as suggested by Tom Forsyth
+#define FORSYTH_DECAY_POWER    1.5f
+#define FORSYTH_LAST_TRI_SCORE 0.75f
+#define FORSYTH_VALENCE_SCALE  2.0f
+#define FORSYTH_VALENCE_POWER  0.5f
+#define FORSYTH_MAX_VALENCE    32
+
+static float _forsyth_cache_score[MESHOPT_CACHE_SIZE];
+static float _forsyth_valence_score[FORSYTH_MAX_VALENCE];
+static int   _forsyth_init=0;
+
+static void _forsythInit() {
+  int i;
+  
+  if (_forsyth_init) return;
+  
+  for(i=0;i<MESHOPT_CACHE_SIZE;i++) {
+    if (i<3)
+      _forsyth_cache_score[i]=FORSYTH_LAST_TRI_SCORE;
+    else
+      _forsyth_cache_score[i]=powf(
+        1.0f-(float)(i-3)/(float)(MESHOPT_CACHE_SIZE-3),
+        FORSYTH_DECAY_POWER);
+  }
+  
+  _forsyth_valence_score[0]=0;
+  for(i=1;i<FORSYTH_MAX_VALENCE;i++)
+    _forsyth_valence_score[i]=
+      FORSYTH_VALENCE_SCALE*powf((float)i,-FORSYTH_VALENCE_POWER);
+  
+  _forsyth_init=1;
+}
+
+static float _forsythScore(int cachePos, u_int32_t live) {
+  float r;
+  
+  // vertices without remaining triangles do not matter anymore
+  if (!live) return -1;
+  
+  r=cachePos<0?0:_forsyth_cache_score[cachePos];
+  r+=_forsyth_valence_score[min(live,(u_int32_t)FORSYTH_MAX_VALENCE-1)];
+  
+  return r;
+}
+
+void meshopt_optimize_vertex_cache(
+  u_int32_t *dst, const u_int32_t *indices, size_t index_count,
+  size_t vertex_count) {
+  size_t face_count=index_count/3;
+  u_int32_t *src;
+  u_int32_t *live, *offsets, *adj;
+  int       *cachePos;
+  float     *vscore, *tscore;
+  char      *emitted;
+  u_int32_t  cache[MESHOPT_CACHE_SIZE+3];
+  u_int32_t  cacheNew[MESHOPT_CACHE_SIZE+3];
+  size_t     cache_n=0, cacheNew_n;
+  size_t     i, j, k, f, out, cursor=0;
+  long       best;
+  float      bestScore, score, delta;
+  u_int32_t  v, *tri;
+  
+  if (!face_count) return;
+  
+  _forsythInit();
+  
+  // the output may overwrite the input
+  src=(u_int32_t*)malloc(sizeof(u_int32_t)*face_count*3);
+  memcpy(src,indices,sizeof(u_int32_t)*face_count*3);
+  
+  live    =(u_int32_t*)malloc(sizeof(u_int32_t)*vertex_count);
+  offsets =(u_int32_t*)malloc(sizeof(u_int32_t)*(vertex_count+1));
+  adj     =(u_int32_t*)malloc(sizeof(u_int32_t)*face_count*3);
+  cachePos=(int*      )malloc(sizeof(int)*vertex_count);
+  vscore  =(float*    )malloc(sizeof(float)*vertex_count);
+  tscore  =(float*    )malloc(sizeof(float)*face_count);
+  emitted =(char*     )malloc(face_count);
+  
+  // triangles adjacent to each vertex. The live ones are kept at the front
+  // of each list.
+  memset(live,0,sizeof(u_int32_t)*vertex_count);
+  for(i=0;i<face_count*3;i++) live[src[i]]++;
+  
+  offsets[0]=0;
+  for(v=0;v<vertex_count;v++) offsets[v+1]=offsets[v]+live[v];
+  
+  memset(live,0,sizeof(u_int32_t)*vertex_count);
+  for(i=0;i<face_count*3;i++) {
+    v=src[i];
+    adj[offsets[v]+live[v]++]=(u_int32_t)(i/3);
+  }
+  
+  for(v=0;v<vertex_count;v++) {
+    cachePos[v]=-1;
+    vscore[v]=_forsythScore(-1,live[v]);
+  }
+  
+  best=-1;
+  bestScore=-1;
+  for(f=0;f<face_count;f++) {
+    tri=src+f*3;
+    tscore[f]=vscore[tri[0]]+vscore[tri[1]]+vscore[tri[2]];
+    if (tscore[f]>bestScore) {
+      bestScore=tscore[f];
+      best=f;
+    }
+  }
+  memset(emitted,0,face_count);
+  
+  for(out=0;out<face_count;out++) {
+    
+    // nothing left in the cache: take the next triangle in input order
+    if (best<0) {
+      while(emitted[cursor]) cursor++;
+      best=cursor;
+    }
+    
+    tri=src+best*3;
+    memcpy(dst+out*3,tri,sizeof(u_int32_t)*3);
+    emitted[best]=1;
+    
+    // retire the triangle from its vertices' adjacency lists
+    for(i=0;i<3;i++) {
+      v=tri[i];
+      for(j=offsets[v];j<offsets[v]+live[v];j++) {
+        if (adj[j]!=(u_int32_t)best) continue;
+        adj[j]=adj[offsets[v]+live[v]-1];
+        adj[offsets[v]+live[v]-1]=best;
+        live[v]--;
+        break;
+      }
+    }
+    
+    // the triangle's vertices move to the front of the cache
+    cacheNew[0]=tri[0];
+    cacheNew[1]=tri[1];
+    cacheNew[2]=tri[2];
+    cacheNew_n=3;
+    for(i=0;i<cache_n;i++) {
+      v=cache[i];
+      if ((v!=tri[0])&&(v!=tri[1])&&(v!=tri[2])) cacheNew[cacheNew_n++]=v;
+    }
+    
+    // rescore all vertices affected, including those pushed out
+    for(i=0;i<cacheNew_n;i++) {
+      v=cacheNew[i];
+      cachePos[v]=i<MESHOPT_CACHE_SIZE?(int)i:-1;
+      score=_forsythScore(cachePos[v],live[v]);
+      delta=score-vscore[v];
+      vscore[v]=score;
+      for(j=offsets[v];j<offsets[v]+live[v];j++) tscore[adj[j]]+=delta;
+    }
+    
+    cache_n=min(cacheNew_n,(size_t)MESHOPT_CACHE_SIZE);
+    memcpy(cache,cacheNew,sizeof(u_int32_t)*cache_n);
+    
+    // the next triangle is the best one touching the cache
+    best=-1;
+    bestScore=-1;
+    for(i=0;i<cache_n;i++) {
+      v=cache[i];
+      for(j=offsets[v];j<offsets[v]+live[v];j++) {
+        k=adj[j];
+        if (tscore[k]>bestScore) {
+          bestScore=tscore[k];
+          best=k;
+        }
+      }
+    }
+  }
+  
+  free(src);
+  free(live);
+  free(offsets);
+  free(adj);
+  free(cachePos);
+  free(vscore);
+  free(tscore);
+  free(emitted);
+}
+
+/** \brief Feeds a triangle through a simulated FIFO cache.
+  *
+  * A vertex is cached if it was transformed no more than cache_size misses
+  * ago, so the cache is flushed by advancing the time by cache_size+1.
+  *
+  * \return Number of cache misses.
+  */
+static int _fifoTriangle(
+  const u_int32_t *tri, u_int32_t *stamps, u_int32_t *time, int cache_size) {
+  int i, r=0;
+  
+  for(i=0;i<3;i++) if (*time-stamps[tri[i]]>(u_int32_t)cache_size) {
+    stamps[tri[i]]=(*time)++;
+    r++;
+  }
+  
+  return r;
+}
+
+struct overdraw_cluster_t {
+  float     key;
+  u_int32_t first;
+  u_int32_t count;
+};
+
+static int _overdrawClusterCompare(const void *a, const void *b) {
+  float ka=((const overdraw_cluster_t*)a)->key;
+  float kb=((const overdraw_cluster_t*)b)->key;
+  
+  // outward facing first; ties keep the input order
+  if (ka>kb) return -1;
+  if (ka<kb) return 1;
+  return (int)((const overdraw_cluster_t*)a)->first
+    -(int)((const overdraw_cluster_t*)b)->first;
+}
+
+void meshopt_optimize_overdraw(
+  u_int32_t *dst, const u_int32_t *indices, size_t index_count,
+  const Vector3f *positions, size_t vertex_count, float threshold) {
+  size_t face_count=index_count/3;
+  u_int32_t *src;
+  u_int32_t *stamps, time;
+  char      *boundary;
+  size_t     f, i, first;
+  int        misses, clusterMisses;
+  float      acmr;
+  Vector3f   centroid, c, n, e;
+  float      area;
+  const u_int32_t *tri;
+  
+  ARRAY(overdraw_cluster_t,clusters);
+  overdraw_cluster_t cluster, *pcluster;
+  
+  if (!face_count) return;
+  
+  ARRAY_INIT(clusters);
+  
+  src=(u_int32_t*)malloc(sizeof(u_int32_t)*face_count*3);
+  memcpy(src,indices,sizeof(u_int32_t)*face_count*3);
+  
+  stamps  =(u_int32_t*)malloc(sizeof(u_int32_t)*vertex_count);
+  boundary=(char*)malloc(face_count+1);
+  
+  // hard boundaries wherever the cache is restarted, i.e. a triangle misses
+  // with all of its vertices
+  memset(stamps,0,sizeof(u_int32_t)*vertex_count);
+  time=MESHOPT_FIFO_SIZE+1;
+  for(f=0;f<face_count;f++)
+    boundary[f]=(_fifoTriangle(src+f*3,stamps,&time,MESHOPT_FIFO_SIZE)==3);
+  boundary[0]=1;
+  boundary[face_count]=1;
+  
+  // soft boundaries wherever the cluster so far is not much worse than the
+  // hard cluster it belongs to
+  for(first=0;first<face_count;first=f) {
+    time+=MESHOPT_FIFO_SIZE+1;
+    clusterMisses=0;
+    for(f=first;(f==first)||!boundary[f];f++)
+      clusterMisses+=_fifoTriangle(src+f*3,stamps,&time,MESHOPT_FIFO_SIZE);
+    acmr=(float)clusterMisses/(float)(f-first);
+    
+    time+=MESHOPT_FIFO_SIZE+1;
+    misses=0;
+    for(i=first;i<f;i++) {
+      misses+=_fifoTriangle(src+i*3,stamps,&time,MESHOPT_FIFO_SIZE);
+      if ((i+1<f) && ((float)misses<=threshold*acmr*(float)(i+1-first))) {
+        // restarting the cache here does not cost more than allowed
+        time+=MESHOPT_FIFO_SIZE+1;
+        misses=0;
+        first=i+1;
+        boundary[i+1]=1;
+      }
+    }
+  }
+  
+  // mesh centroid
+  centroid.set(0,0,0);
+  for(i=0;i<face_count*3;i++) centroid+=positions[src[i]];
+  centroid/=(float)(face_count*3);
+  
+  // sort key of each cluster: how far its area-weighted centroid lies out
+  // along its average normal
+  for(first=0;first<face_count;first=f) {
+    c.set(0,0,0);
+    n.set(0,0,0);
+    area=0;
+    for(f=first;(f==first)||!boundary[f];f++) {
+      tri=src+f*3;
+      e=(positions[tri[1]]-positions[tri[0]])%
+        (positions[tri[2]]-positions[tri[0]]);
+      n+=e;
+      c+=(positions[tri[0]]+positions[tri[1]]+positions[tri[2]])*e.length();
+      area+=e.length();
+    }
+    c=area>0?c/(area*3):positions[src[first*3]];
+    
+    cluster.key  =(c-centroid)*n.normal();
+    cluster.first=first;
+    cluster.count=f-first;
+    APPEND(clusters,cluster);
+  }
+  
+  qsort(
+    clusters_v,clusters_n,sizeof(overdraw_cluster_t),
+    _overdrawClusterCompare);
+  
+  f=0;
+  FOREACH(i,pcluster,clusters) {
+    memcpy(
+      dst+f*3,src+pcluster->first*3,sizeof(u_int32_t)*pcluster->count*3);
+    f+=pcluster->count;
+  }
+  
+  ARRAY_DESTROY(clusters);
+  free(src);
+  free(stamps);
+  free(boundary);
+}
+
+size_t meshopt_optimize_vertex_fetch(
+  u_int32_t *remap, u_int32_t *indices, size_t index_count,
+  size_t vertex_count) {
+  size_t i, r=0;
+  u_int32_t v;
+  
+  memset(remap,0xff,sizeof(u_int32_t)*vertex_count);
+  
+  for(i=0;i<index_count;i++) {
+    v=indices[i];
+    if (remap[v]==(u_int32_t)-1) remap[v]=r++;
+    indices[i]=remap[v];
+  }
+  
+  i=r;
+  for(v=0;v<vertex_count;v++) if (remap[v]==(u_int32_t)-1) remap[v]=i++;
+  
+  return r;
+}
+
+void meshopt_analyze_vertex_cache(
+  const u_int32_t *indices, size_t index_count, size_t vertex_count,
+  int cache_size, float *acmr, float *atvr) {
+  size_t face_count=index_count/3, f;
+  u_int32_t *stamps, time;
+  size_t misses=0;
+
+  *acmr=0;
+  *atvr=0;
+  if (!face_count || !vertex_count) return;
+  
+  stamps=(u_int32_t*)malloc(sizeof(u_int32_t)*vertex_count);
+  memset(stamps,0,sizeof(u_int32_t)*vertex_count);
+  time=cache_size+1;
+  
+  for(f=0;f<face_count;f++)
+    misses+=_fifoTriangle(indices+f*3,stamps,&time,cache_size);
+  
+  free(stamps);
+
+  *acmr=(float)misses/(float)face_count;
+  *atvr=(float)misses/(float)vertex_count;
+}
+
+/** \brief Sum of squared distances to a number of planes, as a symmetric
+  * 4x4 matrix.
+  */
+struct quadric_t {
+  double a00, a01, a02, a11, a12, a22;
+  double b0, b1, b2;
+  double c;
+};
+
+/** \brief Candidate collapse of vertex u onto vertex v. */
+struct collapse_t {
+  float     cost;
+  u_int32_t u, v;
+};
+
+/** \brief Triangles referencing a vertex. Dead ones are dropped lazily. */
+struct vertex_fan_t {
+  ARRAY(u_int32_t,tris);
+};
+
+static void _quadricAddPlane(quadric_t *q, const Vector3f &n, float d) {
+  q->a00+=n.x*n.x; q->a01+=n.x*n.y; q->a02+=n.x*n.z;
+  q->a11+=n.y*n.y; q->a12+=n.y*n.z;
+  q->a22+=n.z*n.z;
+  q->b0+=n.x*d; q->b1+=n.y*d; q->b2+=n.z*d;
+  q->c+=d*d;
+}
+
+static void _quadricAdd(quadric_t *q, const quadric_t *o) {
+  q->a00+=o->a00; q->a01+=o->a01; q->a02+=o->a02;
+  q->a11+=o->a11; q->a12+=o->a12;
+  q->a22+=o->a22;
+  q->b0+=o->b0; q->b1+=o->b1; q->b2+=o->b2;
+  q->c+=o->c;
+}
+
+static double _quadricEval(const quadric_t *q, const Vector3f &p) {
+  double r=
+    q->a00*p.x*p.x+q->a11*p.y*p.y+q->a22*p.z*p.z+
+    2*(q->a01*p.x*p.y+q->a02*p.x*p.z+q->a12*p.y*p.z)+
+    2*(q->b0*p.x+q->b1*p.y+q->b2*p.z)+
+    q->c;
+  return r>0?r:0;
+}
+
+static void _collapsePush(collapse_t *heap, size_t *heap_n, collapse_t c) {
+  size_t i=(*heap_n)++, parent;
+  while(i>0) {
+    parent=(i-1)/2;
+    if (heap[parent].cost<=c.cost) break;
+    heap[i]=heap[parent];
+    i=parent;
+  }
+  heap[i]=c;
+}
+
+static collapse_t _collapsePop(collapse_t *heap, size_t *heap_n) {
+  collapse_t r=heap[0], last=heap[--(*heap_n)];
+  size_t i=0, child, n=*heap_n;
+  
+  while((child=i*2+1)<n) {
+    if ((child+1<n)&&(heap[child+1].cost<heap[child].cost)) child++;
+    if (last.cost<=heap[child].cost) break;
+    heap[i]=heap[child];
+    i=child;
+  }
+  if (n) heap[i]=last;
+  
+  return r;
+}
+
+static int _compareEdges(const void *a, const void *b) {
+  u_int64_t ea=*(const u_int64_t*)a, eb=*(const u_int64_t*)b;
+  return ea<eb?-1:ea>eb?1:0;
+}
+
+#define SIMPLIFY_NONE 0xffffffffu
+
+/** \brief State shared by the steps of meshopt_simplify. */
+struct simplify_t {
+  const Vector3f *positions;
+  u_int32_t    *tris;
+  u_int32_t    *weld;     ///< \brief First vertex at the same position.
+  u_int32_t    *twin;     ///< \brief Other vertex of a seam, or none.
+  char         *locked, *dead, *removed;
+  quadric_t    *quadrics; ///< \brief Per welded vertex.
+  vertex_fan_t *fans;
+  collapse_t   *heap;
+  size_t        heap_n, heap_s;
+  size_t        live_count;
+};
+
+static double _simplifyCost(simplify_t *s, u_int32_t u, u_int32_t v) {
+  return 
+    _quadricEval(s->quadrics+s->weld[u],s->positions[v])+
+    _quadricEval(s->quadrics+s->weld[v],s->positions[v]);
+}
+
+static void _simplifyPush(simplify_t *s, u_int32_t u, u_int32_t v) {
+  collapse_t c;
+  
+  if (s->locked[u] || (s->weld[u]==s->weld[v])) return;
+  
+  c.u=u;
+  c.v=v;
+  c.cost=(float)_simplifyCost(s,u,v);
+  if (s->heap_n>=s->heap_s) {
+    s->heap_s*=2;
+    s->heap=(collapse_t*)realloc(s->heap,sizeof(collapse_t)*s->heap_s);
+  }
+  _collapsePush(s->heap,&s->heap_n,c);
+}
+
+/** \brief Checks moving u onto the position of v.
+  *
+  * \return Number of live triangles referencing both u and v, or -1 if any
+  * other triangle of u would flip.
+  */
+static int _simplifyCheck(simplify_t *s, u_int32_t u, u_int32_t v) {
+  vertex_fan_t *fu=s->fans+u;
+  u_int32_t *tri;
+  Vector3f nb, na, p[3];
+  size_t i, k;
+  int shared=0;
+  
+  for(i=0;i<fu->tris_n;i++) {
+    if (s->removed[fu->tris_v[i]]) continue;
+    tri=s->tris+fu->tris_v[i]*3;
+    if ((tri[0]==v)||(tri[1]==v)||(tri[2]==v)) {
+      shared++;
+      continue;
+    }
+    for(k=0;k<3;k++) p[k]=s->positions[tri[k]];
+    nb=(p[1]-p[0])%(p[2]-p[0]);
+    for(k=0;k<3;k++) if (tri[k]==u) p[k]=s->positions[v];
+    na=(p[1]-p[0])%(p[2]-p[0]);
+    // turning by more than about 75 degrees counts as flipping, which
+    // also catches slivers flipping over a series of collapses
+    if ((nb.sqr()>0) && (nb*na<=0.25f*sqrtf(nb.sqr()*na.sqr()))) 
+      return -1;
+  }
+  
+  return shared;
+}
+
+/** \brief Finds the vertex at the position of v which u shares a live 
+  * triangle with.
+  */
+static u_int32_t _simplifySeamTarget(
+  simplify_t *s, u_int32_t u, u_int32_t v) {
+  vertex_fan_t *fu=s->fans+u;
+  u_int32_t *tri;
+  size_t i, k;
+  
+  for(i=0;i<fu->tris_n;i++) {
+    if (s->removed[fu->tris_v[i]]) continue;
+    tri=s->tris+fu->tris_v[i]*3;
+    for(k=0;k<3;k++) 
+      if ((tri[k]!=u) && (s->weld[tri[k]]==s->weld[v])) return tri[k];
+  }
+  
+  return SIMPLIFY_NONE;
+}
+
+/** \brief Moves u onto v, removing the triangles referencing both. */
+static void _simplifyCollapse(simplify_t *s, u_int32_t u, u_int32_t v) {
+  vertex_fan_t *fu=s->fans+u, *fv=s->fans+v;
+  u_int32_t *tri, w;
+  size_t i, j, k, f;
+  
+  for(i=0;i<fu->tris_n;i++) {
+    f=fu->tris_v[i];
+    if (s->removed[f]) continue;
+    tri=s->tris+f*3;
+    if ((tri[0]==v)||(tri[1]==v)||(tri[2]==v)) {
+      s->removed[f]=1;
+      s->live_count--;
+      continue;
+    }
+    for(k=0;k<3;k++) if (tri[k]==u) tri[k]=v;
+    APPEND(fv->tris,(u_int32_t)f);
+    
+    // edges new to v, in both directions
+    for(k=0;k<6;k++) {
+      w=tri[k/2];
+      if (w==v) continue;
+      _simplifyPush(s,(k&1)?v:w,(k&1)?w:v);
+    }
+  }
+  
+  // drop what died from the fan of v, so fans stay short
+  for(i=0,j=0;i<fv->tris_n;i++)
+    if (!s->removed[fv->tris_v[i]]) fv->tris_v[j++]=fv->tris_v[i];
+  fv->tris_n=j;
+  
+  s->dead[u]=1;
+  ARRAY_DESTROY(fu->tris);
+}
+
+size_t meshopt_simplify(
+  u_int32_t *dst, const u_int32_t *indices, size_t index_count,
+  const Vector3f *positions, size_t vertex_count, size_t target_index_count,
+  float *result_error) {
+  size_t face_count=index_count/3;
+  simplify_t    s;
+  u_int32_t    *table, *tri;
+  collapse_t    c;
+  u_int64_t    *edges;
+  size_t        i, j, f, mask, h, out;
+  u_int32_t     a, b, u, v, u2, v2, w, *pt;
+  Vector3f      n;
+  double        cost, error=0;
+  
+  if (result_error) *result_error=0;
+  if (!face_count) return 0;
+  
+  s.positions=positions;
+  s.tris    =(u_int32_t* )malloc(sizeof(u_int32_t)*face_count*3);
+  s.weld    =(u_int32_t* )malloc(sizeof(u_int32_t)*vertex_count);
+  s.twin    =(u_int32_t* )malloc(sizeof(u_int32_t)*vertex_count);
+  s.locked  =(char*      )malloc(vertex_count);
+  s.dead    =(char*      )malloc(vertex_count);
+  s.removed =(char*      )malloc(face_count);
+  s.quadrics=(quadric_t* )malloc(sizeof(quadric_t)*vertex_count);
+  s.fans    =(vertex_fan_t*)malloc(sizeof(vertex_fan_t)*vertex_count);
+  s.heap_n  =0;
+  s.heap_s  =face_count*6;
+  s.heap    =(collapse_t*)malloc(sizeof(collapse_t)*s.heap_s);
+  edges     =(u_int64_t* )malloc(sizeof(u_int64_t)*face_count*3);
+  
+  memcpy(s.tris,indices,sizeof(u_int32_t)*face_count*3);
+  memset(s.twin,0xff,sizeof(u_int32_t)*vertex_count);
+  memset(s.locked,0,vertex_count);
+  memset(s.dead,0,vertex_count);
+  memset(s.removed,0,face_count);
+  memset(s.quadrics,0,sizeof(quadric_t)*vertex_count);
+  
+  // vertices sharing a position are welded onto the first of them. Two of
+  // them make an attribute seam, along which both move together. More are
+  // kept in place, as no single vertex could stand in for them.
+  for(mask=1;mask<vertex_count*2;mask<<=1);
+  table=(u_int32_t*)malloc(sizeof(u_int32_t)*mask);
+  memset(table,0xff,sizeof(u_int32_t)*mask);
+  mask--;
+  for(v=0;v<vertex_count;v++) {
+    h=0;
+    for(i=0;i<3;i++) {
+      memcpy(&a,&positions[v].x+i,4);
+      h=(h^a)*0x9e3779b1u;
+    }
+    for(h&=mask;table[h]!=SIMPLIFY_NONE;h=(h+1)&mask)
+      if (!memcmp(positions+table[h],positions+v,sizeof(Vector3f))) break;
+    if (table[h]==SIMPLIFY_NONE) {
+      table[h]=v;
+      s.weld[v]=v;
+    } else {
+      w=table[h];
+      s.weld[v]=w;
+      if ((s.twin[w]==SIMPLIFY_NONE) && !s.locked[w]) {
+        s.twin[w]=v;
+        s.twin[v]=w;
+      } else {
+        s.locked[w]=1;
+      }
+    }
+    ARRAY_INIT(s.fans[v].tris);
+  }
+  free(table);
+  
+  // edges not shared by exactly two triangles lie on a border.
+  for(f=0;f<face_count;f++) for(i=0;i<3;i++) {
+    a=s.weld[s.tris[f*3+i]];
+    b=s.weld[s.tris[f*3+(i+1)%3]];
+    edges[f*3+i]=a<b?((u_int64_t)a<<32)|b:((u_int64_t)b<<32)|a;
+  }
+  qsort(edges,face_count*3,sizeof(u_int64_t),_compareEdges);
+  for(i=0;i<face_count*3;i=j) {
+    for(j=i+1;(j<face_count*3)&&(edges[j]==edges[i]);j++);
+    if (j-i!=2) {
+      s.locked[(u_int32_t)(edges[i]>>32)]=1;
+      s.locked[(u_int32_t)edges[i]]=1;
+    }
+  }
+  free(edges);
+  for(v=0;v<vertex_count;v++) s.locked[v]=s.locked[s.weld[v]];
+  
+  // quadrics are accumulated per position, fans per vertex.
+  for(f=0;f<face_count;f++) {
+    tri=s.tris+f*3;
+    n=(positions[tri[1]]-positions[tri[0]])%
+      (positions[tri[2]]-positions[tri[0]]);
+    if (n.sqr()>0) {
+      n.normalize();
+      for(i=0;i<3;i++)
+        _quadricAddPlane(
+          s.quadrics+s.weld[tri[i]],n,-(n*positions[tri[0]]));
+    }
+    for(i=0;i<3;i++) APPEND(s.fans[tri[i]].tris,(u_int32_t)f);
+  }
+  
+  for(f=0;f<face_count;f++) for(i=0;i<3;i++) {
+    u=s.tris[f*3+i];
+    v=s.tris[f*3+(i+1)%3];
+    _simplifyPush(&s,u,v);
+    _simplifyPush(&s,v,u);
+  }
+  
+  s.live_count=face_count;
+  while((s.live_count*3>target_index_count) && s.heap_n) {
+    c=_collapsePop(s.heap,&s.heap_n);
+    u=c.u;
+    v=c.v;
+    if (s.dead[u] || s.dead[v]) continue;
+    
+    // quadrics only grow, so outdated entries are reinserted at their 
+    // actual cost.
+    cost=_simplifyCost(&s,u,v);
+    if (cost>c.cost*1.0001+1e-12) {
+      c.cost=(float)cost;
+      _collapsePush(s.heap,&s.heap_n,c);
+      continue;
+    }
+    
+    // a seam vertex may only move along the seam, i.e. onto a vertex it
+    // shares a single triangle with, and its twin has to follow onto the 
+    // vertex at the same position on the other side.
+    u2=s.twin[u];
+    v2=SIMPLIFY_NONE;
+    if (u2!=SIMPLIFY_NONE) {
+      v2=_simplifySeamTarget(&s,u2,v);
+      if ((v2==SIMPLIFY_NONE) 
+      || (_simplifyCheck(&s,u,v)!=1) || (_simplifyCheck(&s,u2,v2)!=1))
+        continue;
+    } else if (_simplifyCheck(&s,u,v)<1) {
+      continue;
+    }
+    
+    _simplifyCollapse(&s,u,v);
+    if (u2!=SIMPLIFY_NONE) _simplifyCollapse(&s,u2,v2);
+    
+    _quadricAdd(s.quadrics+s.weld[v],s.quadrics+s.weld[u]);
+    if (cost>error) error=cost;
+  }
+  
+  out=0;
+  for(f=0;f<face_count;f++) if (!s.removed[f]) {
+    pt=s.tris+f*3;
+    dst[out++]=pt[0];
+    dst[out++]=pt[1];
+    dst[out++]=pt[2];
+  }
+  
+  if (result_error) *result_error=(float)sqrt(error);
+  
+  for(v=0;v<vertex_count;v++) ARRAY_DESTROY(s.fans[v].tris);
+  free(s.fans);
+  free(s.heap);
+  free(s.quadrics);
+  free(s.removed);
+  free(s.dead);
+  free(s.locked);
+  free(s.twin);
+  free(s.weld);
+  free(s.tris);
+  
+  return out;
+}
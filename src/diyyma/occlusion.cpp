@@ -0,0 +1,402 @@
+/** \file occlusion.cpp
+  * \author Peter Wagener
+  * \brief Software occlusion culling implementation.
+  *
+  * Triangles are clipped against the near plane only, anything else is
+  * taken care of by the scissor rectangle. Spans of four pixels are
+  * rasterized at once, using SSE where available.
+  *
+  * Rasterization is conservative towards the occluder: a pixel is only
+  * written if a polygon covers all of it, and then with the farthest depth
+  * the polygon has within the pixel. Sampling at pixel centres instead
+  * would let an occluder hide a box peeking past its edge, or standing in
+  * front of it within the same pixel. Since pixels along shared edges are
+  * covered by neither side, triangulated quads are merged back into quads
+  * before rasterizing.
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "diyyma/occlusion.h"
+
+#if defined(__SSE__) || defined(_M_X64) \
+|| (defined(_M_IX86_FP) && (_M_IX86_FP>=1))
+#define OCCLUSION_SSE
+#include <xmmintrin.h>
+#endif
+
+/** \brief Clip space vertex followed by its distance to the near plane. */
+#define CLIP_STRIDE 5
+
+/** \brief Most vertices of a polygon to rasterize, a quad clipped by the
+  * near plane.
+  */
+#define CLIP_MAX_VERTICES 5
+
+static inline void _transform(
+  const Matrixf &m, const Vector3f &p, float *r) {
+  r[0]=m.a11*p.x+m.a12*p.y+m.a13*p.z+m.a14;
+  r[1]=m.a21*p.x+m.a22*p.y+m.a23*p.z+m.a24;
+  r[2]=m.a31*p.x+m.a32*p.y+m.a33*p.z+m.a34;
+  r[3]=m.a41*p.x+m.a42*p.y+m.a43*p.z+m.a44;
+  r[4]=r[2]+r[3];
+}
+
+OcclusionCuller::OcclusionCuller() : _width(0), _height(0), _levels(0) {
+  ARRAY_INIT(_depth);
+  ARRAY_INIT(_clip);
+  _VP.setIdentity();
+  memset(&_stats,0,sizeof(_stats));
+  resize(OCCLUSION_WIDTH,OCCLUSION_HEIGHT);
+}
+
+OcclusionCuller::~OcclusionCuller() {
+  ARRAY_DESTROY(_depth);
+  ARRAY_DESTROY(_clip);
+}
+
+void OcclusionCuller::resize(int width, int height) {
+  size_t idx, total=0;
+  int w, h;
+  
+  width=(max(width,4)+3)&~3;
+  height=max(height,1);
+  
+  _width=width;
+  _height=height;
+  
+  w=width;
+  h=height;
+  for(_levels=0;_levels<OCCLUSION_MAX_LEVELS;_levels++) {
+    _levelWidth[_levels]=w;
+    _levelHeight[_levels]=h;
+    _levelOffset[_levels]=total;
+    total+=w*h;
+    if ((w==1)&&(h==1)) { _levels++; break; }
+    w=(w+1)/2;
+    h=(h+1)/2;
+  }
+  
+  ARRAY_SETSIZE(_depth,total);
+  for(idx=0;idx<total;idx++) _depth_v[idx]=1;
+}
+
+int OcclusionCuller::width() {
+  return _width;
+}
+
+int OcclusionCuller::height() {
+  return _height;
+}
+
+void OcclusionCuller::begin(const Matrixf &VP) {
+  size_t idx, n=(size_t)_width*_height;
+  
+  _VP=VP;
+  memset(&_stats,0,sizeof(_stats));
+  for(idx=0;idx<n;idx++) _depth_v[idx]=1;
+}
+
+/** \brief Rasterizes a convex polygon given in clip space, in front of the
+  * near plane.
+  */
+void OcclusionCuller::_rasterize(const float *const *v, int n) {
+  float x[CLIP_MAX_VERTICES], y[CLIP_MAX_VERTICES], z[CLIP_MAX_VERTICES];
+  float a[CLIP_MAX_VERTICES], b[CLIP_MAX_VERTICES], c[CLIP_MAX_VERTICES];
+  float e[CLIP_MAX_VERTICES], area, best, dzdx, dzdy, z0, zr, px, py, t;
+  int minx, maxx, miny, maxy, i, j, k, ix, iy;
+  float *row;
+  
+  minx=miny=0x7fffffff;
+  maxx=maxy=-0x7fffffff;
+  for(i=0;i<n;i++) {
+    if (v[i][3]<=0) return;
+    x[i]=(v[i][0]/v[i][3]*0.5f+0.5f)*_width;
+    y[i]=(v[i][1]/v[i][3]*0.5f+0.5f)*_height;
+    z[i]=v[i][2]/v[i][3];
+    minx=min(minx,(int)floorf(x[i]));
+    maxx=max(maxx,(int)ceilf(x[i]));
+    miny=min(miny,(int)floorf(y[i]));
+    maxy=max(maxy,(int)ceilf(y[i]));
+  }
+  
+  // the depth plane is taken from the fan triangle of the greatest area.
+  area=0;
+  best=0;
+  k=1;
+  for(i=1;i+1<n;i++) {
+    t=(x[i]-x[0])*(y[i+1]-y[0])-(x[i+1]-x[0])*(y[i]-y[0]);
+    area+=t;
+    if (fabsf(t)>fabsf(best)) { best=t; k=i; }
+  }
+  if (fabsf(best)<1e-8f) return;
+  
+  minx=max(0,minx);
+  maxx=min(_width-1,maxx);
+  miny=max(0,miny);
+  maxy=min(_height-1,maxy);
+  if ((minx>maxx)||(miny>maxy)) return;
+  
+  // edge i runs from vertex i to vertex i+1, and is positive on the inside
+  // for either winding.
+  for(i=0;i<n;i++) {
+    j=(i+1)%n;
+    a[i]=y[i]-y[j];
+    b[i]=x[j]-x[i];
+    c[i]=x[i]*y[j]-x[j]*y[i];
+    if (area<0) { a[i]=-a[i]; b[i]=-b[i]; c[i]=-c[i]; }
+  }
+  
+  // depth is affine in screen space after the division by w.
+  j=k+1;
+  dzdx=((y[k]-y[j])*z[0]+(y[j]-y[0])*z[k]+(y[0]-y[k])*z[j])/best;
+  dzdy=((x[j]-x[k])*z[0]+(x[0]-x[j])*z[k]+(x[k]-x[0])*z[j])/best;
+  z0=z[0]-dzdx*x[0]-dzdy*y[0];
+  
+  // quads need not be perfectly flat, so the plane is moved behind all of
+  // their vertices.
+  for(i=0;i<n;i++) z0+=max(0.0f,z[i]-(z0+dzdx*x[i]+dzdy*y[i]));
+  
+  // evaluated at pixel centres, the edges turn into their least value and
+  // the depth into its greatest one over the whole pixel.
+  for(i=0;i<n;i++) c[i]-=0.5f*(fabsf(a[i])+fabsf(b[i]));
+  z0+=0.5f*(fabsf(dzdx)+fabsf(dzdy));
+  
+  minx&=~3;
+  
+  for(iy=miny;iy<=maxy;iy++) {
+    row=_depth_v+(size_t)iy*_width;
+    px=minx+0.5f;
+    py=iy+0.5f;
+    for(i=0;i<n;i++) e[i]=a[i]*px+b[i]*py+c[i];
+    zr=z0+dzdx*px+dzdy*py;
+
+#ifdef OCCLUSION_SSE
+    {
+      __m128 step=_mm_set_ps(3,2,1,0), zero=_mm_setzero_ps(), inside, d;
+      __m128 ev[CLIP_MAX_VERTICES], de[CLIP_MAX_VERTICES];
+      __m128 zv=_mm_add_ps(
+        _mm_set1_ps(zr),_mm_mul_ps(step,_mm_set1_ps(dzdx)));
+      __m128 dz=_mm_set1_ps(dzdx*4);
+      
+      for(i=0;i<n;i++) {
+        ev[i]=_mm_add_ps(
+          _mm_set1_ps(e[i]),_mm_mul_ps(step,_mm_set1_ps(a[i])));
+        de[i]=_mm_set1_ps(a[i]*4);
+      }
+      
+      for(ix=minx;ix<=maxx;ix+=4) {
+        inside=_mm_cmpge_ps(ev[0],zero);
+        for(i=1;i<n;i++)
+          inside=_mm_and_ps(inside,_mm_cmpge_ps(ev[i],zero));
+        if (_mm_movemask_ps(inside)) {
+          d=_mm_loadu_ps(row+ix);
+          d=_mm_or_ps(
+            _mm_and_ps(inside,_mm_min_ps(d,zv)),_mm_andnot_ps(inside,d));
+          _mm_storeu_ps(row+ix,d);
+        }
+        for(i=0;i<n;i++) ev[i]=_mm_add_ps(ev[i],de[i]);
+        zv=_mm_add_ps(zv,dz);
+      }
+    }
+#else
+    for(ix=minx;ix<=maxx;ix++) {
+      for(i=0;(i<n)&&(e[i]>=0);i++);
+      if ((i==n)&&(zr<row[ix])) row[ix]=zr;
+      for(i=0;i<n;i++) e[i]+=a[i];
+      zr+=dzdx;
+    }
+#endif
+  }
+  
+  _stats.triangles+=n-2;
+}
+
+/** \brief Clips a convex polygon against the near plane, z>=-w in clip
+  * space, and rasterizes whatever is left.
+  */
+void OcclusionCuller::_clipPolygon(const float *const *v, int n) {
+  float poly[CLIP_MAX_VERTICES*CLIP_STRIDE];
+  const float *clipped[CLIP_MAX_VERTICES], *p, *q;
+  float t;
+  int i, j, m=0, front=0;
+  
+  for(i=0;i<n;i++) if (v[i][4]>=0) front++;
+  if (front==n) {
+    _rasterize(v,n);
+    return;
+  }
+  if (!front) return;
+  
+  for(i=0;i<n;i++) {
+    p=v[i];
+    q=v[(i+1)%n];
+    if (p[4]>=0) {
+      memcpy(poly+m*CLIP_STRIDE,p,sizeof(float)*CLIP_STRIDE);
+      m++;
+    }
+    if ((p[4]>=0)!=(q[4]>=0)) {
+      t=p[4]/(p[4]-q[4]);
+      for(j=0;j<CLIP_STRIDE;j++)
+        poly[m*CLIP_STRIDE+j]=p[j]+(q[j]-p[j])*t;
+      m++;
+    }
+  }
+  
+  for(i=0;i<m;i++) clipped[i]=poly+i*CLIP_STRIDE;
+  _rasterize(clipped,m);
+}
+
+static inline int _samePosition(
+  const Vector3f *p, u_int32_t a, u_int32_t b) {
+  return (p[a].x==p[b].x)&&(p[a].y==p[b].y)&&(p[a].z==p[b].z);
+}
+
+/** \brief Checks whether two triangles share an edge and together form a
+  * flat, convex quad, as triangulated quads do. Vertices are compared by
+  * position, so quads split by a texture seam are found as well. If so,
+  * the vertices of the quad are written to q in order.
+  */
+static int _mergeQuad(
+  const Vector3f *p, const u_int32_t *t, u_int32_t *q) {
+  Vector3f n, e0, e1;
+  int i, j, shared=0, single=-1, other=-1;
+  
+  for(j=3;j<6;j++) {
+    for(i=0;(i<3)&&!_samePosition(p,t[i],t[j]);i++);
+    if (i<3) shared++;
+    else other=j;
+  }
+  for(i=0;i<3;i++) {
+    for(j=3;(j<6)&&!_samePosition(p,t[i],t[j]);j++);
+    if (j==6) single=i;
+  }
+  if ((shared!=2)||(single<0)||(other<0)) return 0;
+  
+  q[0]=t[single];
+  q[1]=t[(single+1)%3];
+  q[2]=t[other];
+  q[3]=t[(single+2)%3];
+  
+  n=(p[q[1]]-p[q[0]])%(p[q[3]]-p[q[0]]);
+  for(i=0;i<4;i++) {
+    e0=p[q[(i+1)%4]]-p[q[i]];
+    e1=p[q[(i+2)%4]]-p[q[(i+1)%4]];
+    if ((e0%e1)*n<=0) return 0;
+  }
+  
+  e0=p[q[2]]-p[q[0]];
+  return fabsf(n*e0)<=1e-3f*n.length()*e0.length();
+}
+
+void OcclusionCuller::addOccluder(const Matrixf &M,
+  const Vector3f *positions, const u_int32_t *indices, size_t indexCount) {
+  Matrixf MVP=_VP*M;
+  u_int32_t vertexCount=0, quad[4];
+  const float *v[4];
+  size_t idx;
+  int i;
+  
+  for(idx=0;idx<indexCount;idx++)
+    vertexCount=max(vertexCount,indices[idx]+1);
+  
+  ARRAY_SETSIZE(_clip,(size_t)vertexCount*CLIP_STRIDE);
+  for(idx=0;idx<vertexCount;idx++)
+    _transform(MVP,positions[idx],_clip_v+idx*CLIP_STRIDE);
+  
+  // adjacent triangles forming a quad are rasterized as one, leaving no
+  // uncovered pixels along their diagonal. Quads reaching behind the near
+  // plane are left as triangles, which are flat after clipping.
+  for(idx=0;idx+2<indexCount;idx+=3) {
+    if ((idx+5<indexCount)&&_mergeQuad(positions,indices+idx,quad)) {
+      for(i=0;(i<4)&&(_clip_v[quad[i]*CLIP_STRIDE+4]>=0);i++)
+        v[i]=_clip_v+quad[i]*CLIP_STRIDE;
+      if (i==4) {
+        _rasterize(v,4);
+        idx+=3;
+        continue;
+      }
+    }
+    for(i=0;i<3;i++) v[i]=_clip_v+indices[idx+i]*CLIP_STRIDE;
+    _clipPolygon(v,3);
+  }
+  
+  _stats.occluders++;
+}
+
+void OcclusionCuller::end() {
+  const float *src;
+  float *dst;
+  int level, x, y, sw, sh, x1, y1;
+  
+  for(level=1;level<_levels;level++) {
+    src=_depth_v+_levelOffset[level-1];
+    dst=_depth_v+_levelOffset[level];
+    sw=_levelWidth[level-1];
+    sh=_levelHeight[level-1];
+    for(y=0;y<_levelHeight[level];y++) {
+      y1=min(y*2+1,sh-1);
+      for(x=0;x<_levelWidth[level];x++) {
+        x1=min(x*2+1,sw-1);
+        dst[y*_levelWidth[level]+x]=max(
+          max(src[y*2*sw+x*2],src[y*2*sw+x1]),
+          max(src[y1*sw+x*2],src[y1*sw+x1]));
+      }
+    }
+  }
+}
+
+int OcclusionCuller::test(
+  const Matrixf &M, const Vector3f &bmin, const Vector3f &bmax) {
+  Matrixf MVP=_VP*M;
+  float c[CLIP_STRIDE], x0, x1, y0, y1, zmin, sx, sy;
+  const float *row;
+  int i, level, minx, maxx, miny, maxy, ix, iy, lw;
+  
+  _stats.tested++;
+  
+  x0=y0=zmin=1e30f;
+  x1=y1=-1e30f;
+  for(i=0;i<8;i++) {
+    _transform(MVP,Vector3f(
+      i&1?bmax.x:bmin.x,i&2?bmax.y:bmin.y,i&4?bmax.z:bmin.z),c);
+    if ((c[4]<0)||(c[3]<=0)) return 1;
+    sx=(c[0]/c[3]*0.5f+0.5f)*_width;
+    sy=(c[1]/c[3]*0.5f+0.5f)*_height;
+    x0=min(x0,sx); x1=max(x1,sx);
+    y0=min(y0,sy); y1=max(y1,sy);
+    zmin=min(zmin,c[2]/c[3]);
+  }
+  
+  if ((x1<0)||(y1<0)||(x0>=_width)||(y0>=_height)) return 1;
+  
+  minx=max(0,(int)floorf(x0));
+  maxx=min(_width-1,(int)floorf(x1));
+  miny=max(0,(int)floorf(y0));
+  maxy=min(_height-1,(int)floorf(y1));
+  
+  // the finest level where the box covers at most 2x2 texels
+  for(level=0;level+1<_levels;level++)
+    if (((maxx>>level)-(minx>>level)<=1)
+    &&  ((maxy>>level)-(miny>>level)<=1)) break;
+  
+  lw=_levelWidth[level];
+  for(iy=miny>>level;iy<=(maxy>>level);iy++) {
+    row=_depth_v+_levelOffset[level]+iy*lw;
+    for(ix=minx>>level;ix<=(maxx>>level);ix++)
+      if (row[ix]>=zmin) return 1;
+  }
+  
+  _stats.culled++;
+  return 0;
+}
+
+const float *OcclusionCuller::depth() {
+  return _depth_v;
+}
+
+const occlusion_stats_t &OcclusionCuller::stats() {
+  return _stats;
+}
@@ -0,0 +1,474 @@
+/** \file preprocessor.cpp
+  * \author Peter Wagener
+  * \brief Preprocessing of GLSL sources, independent of the GL.
+  *
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "diyyma/config.h"
+#include "diyyma/preprocessor.h"
+#include "diyyma/jobs.h"
+
+/** \brief Content of an included file.
+  *
+  * Referenced by the cache for as long as the file does not change on disk,
+  * and by each ShaderPreprocessor whose output points into it until that is
+  * cleared. Freed once the last reference is released.
+  */
+struct preprocessor_buffer_t {
+  int    refs;
+  char  *data;
+  size_t cb;
+};
+
+/** \brief An included file kept in memory. */
+struct preprocessor_file_t {
+  char                  *path;
+  timestamp_t            time;
+  preprocessor_buffer_t *buffer;
+};
+
+// guarded by JOB_LOCK_PREPROCESSOR
+ARRAY_STATIC(preprocessor_file_t,_preprocessor_files);
+static StringIndex _preprocessor_index;
+
+/** \brief Drops a reference to a buffer. JOB_LOCK_PREPROCESSOR has to be
+  * held.
+  */
+static void _preprocessor_release(preprocessor_buffer_t *buffer) {
+  if (--buffer->refs>0) return;
+  free((void*)buffer->data);
+  free((void*)buffer);
+}
+
+/** \brief Returns the content of a file, reading it if it is not in memory
+  * yet or changed on disk since.
+  *
+  * A buffer replaced by a newer version stays valid for as long as it is
+  * referenced.
+  *
+  * \param buffer Receives the content, referenced on behalf of the caller
+  * who has to release it.
+  * \return 1 on success, 0 if the file could not be read.
+  */
+static int _preprocessor_read(const char *path,
+  preprocessor_buffer_t **buffer) {
+  preprocessor_file_t *pf=0;
+  timestamp_t t;
+  size_t idx;
+  void *d;
+  size_t c;
+  int r=0;
+  
+  t=file_timestamp(path);
+  
+  job_lock(JOB_LOCK_PREPROCESSOR);
+  
+  if (_preprocessor_index.find(path,&idx)) {
+    pf=_preprocessor_files_v+idx;
+    // without a timestamp, there is no telling whether it changed
+    if (t && (pf->time==t)) goto done;
+  }
+  
+  if (!readFile(path,&d,&c)) goto finalize;
+  
+  if (pf) {
+    _preprocessor_release(pf->buffer);
+  } else {
+    ARRAY_SETSIZE(_preprocessor_files,_preprocessor_files_n+1);
+    pf=_preprocessor_files_v+_preprocessor_files_n-1;
+    pf->path=strdup(path);
+    _preprocessor_index.insert(pf->path,_preprocessor_files_n-1);
+  }
+  pf->time  =t;
+  pf->buffer=(preprocessor_buffer_t*)malloc(sizeof(preprocessor_buffer_t));
+  pf->buffer->refs=1;
+  pf->buffer->data=(char*)d;
+  pf->buffer->cb  =c;
+  
+  done:
+  pf->buffer->refs++;
+  *buffer=pf->buffer;
+  r=1;
+  
+  finalize:
+  job_unlock(JOB_LOCK_PREPROCESSOR);
+  
+  return r;
+}
+
+void preprocessor_cache_clear() {
+  size_t idx;
+  preprocessor_file_t *pf;
+  
+  job_lock(JOB_LOCK_PREPROCESSOR);
+  _preprocessor_index.clear();
+  FOREACH(idx,pf,_preprocessor_files) {
+    free((void*)pf->path);
+    _preprocessor_release(pf->buffer);
+  }
+  ARRAY_DESTROY(_preprocessor_files);
+  job_unlock(JOB_LOCK_PREPROCESSOR);
+}
+
+/** \brief Skips spaces and tabs. */
+static const char *_skip(const char *q, const char *e) {
+  while((q<e) && ((*q==' ') || (*q=='\t'))) q++;
+  return q;
+}
+
+/** \brief Reads a token delimited by white space.
+  *
+  * \return Number of characters of the token, 0 if there is none.
+  */
+static size_t _token(const char **q, const char *e, const char **tok) {
+  const char *p=_skip(*q,e);
+
+  *tok=p;
+  while((p<e) && ((unsigned char)*p>' ')) p++;
+  *q=p;
+  
+  return (size_t)(p-*tok);
+}
+
+static int _is(const char *tok, size_t cc, const char *str) {
+  return (strlen(str)==cc) && (memcmp(tok,str,cc)==0);
+}
+
+ShaderPreprocessor::ShaderPreprocessor(int mask) :
+  _mask(mask), _tfbMode(PREPROCESSOR_TFB_UNSET) {
+  ARRAY_INIT(_segments);
+  ARRAY_INIT(_text);
+  ARRAY_INIT(_strings);
+  ARRAY_INIT(_lengths);
+  ARRAY_INIT(_files);
+  ARRAY_INIT(_buffers);
+  ARRAY_INIT(_varyings);
+}
+
+ShaderPreprocessor::~ShaderPreprocessor() {
+  clear();
+  ARRAY_DESTROY(_segments);
+  ARRAY_DESTROY(_text);
+  ARRAY_DESTROY(_strings);
+  ARRAY_DESTROY(_lengths);
+  ARRAY_DESTROY(_files);
+  ARRAY_DESTROY(_buffers);
+  ARRAY_DESTROY(_varyings);
+}
+
+void ShaderPreprocessor::clear() {
+  size_t idx;
+  char **pstr;
+  preprocessor_buffer_t **pbuf;
+  
+  FOREACH(idx,pstr,_files) free((void*)*pstr);
+  FOREACH(idx,pstr,_varyings) free((void*)*pstr);
+  
+  if (_buffers_n) {
+    job_lock(JOB_LOCK_PREPROCESSOR);
+    FOREACH(idx,pbuf,_buffers) _preprocessor_release(*pbuf);
+    job_unlock(JOB_LOCK_PREPROCESSOR);
+  }
+  
+  _segments_n=0;
+  _text_n=0;
+  _strings_n=0;
+  _lengths_n=0;
+  _files_n=0;
+  _buffers_n=0;
+  _varyings_n=0;
+  _tfbMode=PREPROCESSOR_TFB_UNSET;
+}
+
+/** \brief Appends code, extending the last segment if it ends where the
+  * code begins.
+  */
+void ShaderPreprocessor::_emit(const char *p, size_t cb) {
+  preprocessor_segment_t seg, *last;
+  
+  if (!cb) return;
+  
+  if (_segments_n) {
+    last=_segments_v+_segments_n-1;
+    if (last->ptr && (last->ptr+last->cb==p)) {
+      last->cb+=cb;
+      return;
+    }
+  }
+  
+  seg.ptr   =p;
+  seg.offset=0;
+  seg.cb    =cb;
+  APPEND(_segments,seg);
+}
+
+/** \brief Appends text generated by the preprocessor. */
+void ShaderPreprocessor::_emitText(const char *fmt, ...) {
+  preprocessor_segment_t seg;
+  char buf[64];
+  va_list args;
+  int cc;
+  
+  va_start(args,fmt);
+  cc=vsnprintf(buf,sizeof(buf),fmt,args);
+  va_end(args);
+  if ((cc<1) || (cc>=(int)sizeof(buf))) return;
+  
+  seg.ptr   =0;
+  seg.offset=_text_n;
+  seg.cb    =cc;
+  
+  ARRAY_SETSIZE(_text,_text_n+cc);
+  memcpy(_text_v+seg.offset,buf,cc);
+  APPEND(_segments,seg);
+}
+
+int ShaderPreprocessor::_include(const char *name, size_t cc, int depth) {
+  char buf[512];
+  char *path;
+  const char *data;
+  preprocessor_buffer_t *buffer;
+  size_t idx, cb;
+  char **pstr;
+  int file;
+  
+  // quotes or angle brackets are optional
+  if ((cc>1) && (((name[0]=='"') && (name[cc-1]=='"'))
+  || ((name[0]=='<') && (name[cc-1]=='>')))) {
+    name++;
+    cc-=2;
+  }
+  if (!cc || (cc>=sizeof(buf))) {
+    LOG_WARNING("WARNING: file name expected in #include directive\n");
+    return 0;
+  }
+  memcpy(buf,name,cc);
+  buf[cc]=0;
+  
+  if (depth>=PREPROCESSOR_MAX_DEPTH) {
+    LOG_WARNING(
+      "WARNING: #include of '%s' nested too deeply (source: %s)\n",
+      buf,_files_v[0]);
+    return 0;
+  }
+  
+  if (!(path=vfs_locate(buf,_mask))) {
+    LOG_WARNING(
+      "WARNING: unable to locate #include'd file '%s'\n",
+      buf);
+    return 0;
+  }
+  
+  // include files only once
+  FOREACH(idx,pstr,_files) if (strcmp(*pstr,path)==0) {
+    free((void*)path);
+    return 0;
+  }
+  
+  if (!_preprocessor_read(path,&buffer)) {
+    LOG_WARNING(
+      "WARNING: unable to load #include'd file '%s' ('%s')\n",
+      buf,path);
+    free((void*)path);
+    return 0;
+  }
+  
+  APPEND(_files,path);
+  APPEND(_buffers,buffer);
+  file=_files_n-1;
+  data=buffer->data;
+  cb  =buffer->cb;
+  
+  _emitText("#line 1 %i\n",file);
+  _process(data,data+cb,file,depth+1);
+  if (cb && (data[cb-1]!='\n')) _emitText("\n");
+  
+  return 1;
+}
+
+void ShaderPreprocessor::_pragma(
+  const char *q, const char *eol, int file, unsigned line) {
+  const char *tok;
+  char *name;
+  size_t cc;
+  
+  cc=_token(&q,eol,&tok);
+  if (!_is(tok,cc,"TFB")) return;
+  
+  cc=_token(&q,eol,&tok);
+  if (_is(tok,cc,"mode")) {
+    cc=_token(&q,eol,&tok);
+    if (_is(tok,cc,"separate"))
+      _tfbMode=PREPROCESSOR_TFB_SEPARATE;
+    else if (_is(tok,cc,"interleaved"))
+      _tfbMode=PREPROCESSOR_TFB_INTERLEAVED;
+    else
+      LOG_WARNING(
+        "WARNING: unrecognized TFB mode '%.*s' in shader source %s:%u.\n",
+        (int)cc,tok,_files_v[file],line);
+  
+  } else if (_is(tok,cc,"varying")) {
+    if (!(cc=_token(&q,eol,&tok))) return;
+    name=(char*)malloc(cc+1);
+    memcpy(name,tok,cc);
+    name[cc]=0;
+    APPEND(_varyings,name);
+  }
+}
+
+/** \brief State of a loop while its body is being processed. */
+struct preprocessor_loop_t {
+  long     count;
+  size_t   first; ///< \brief First segment of the body.
+  unsigned line;  ///< \brief Line of the loop-begin directive.
+};
+
+void ShaderPreprocessor::_process(
+  const char *p, const char *e, int file, int depth) {
+  preprocessor_loop_t loops[PREPROCESSOR_MAX_LOOPS], *loop;
+  int n_loops=0;
+  const char *line, *eol, *next, *q, *tok, *run=p;
+  char *end;
+  size_t cc, i, n;
+  unsigned ln;
+  long k;
+  
+  for(line=p, ln=1; line<e; line=next, ln++) {
+    if ((eol=(const char*)memchr(line,'\n',e-line))) next=eol+1;
+    else next=eol=e;
+    
+    q=_skip(line,eol);
+    if ((q>=eol) || (*q!='#')) continue;
+    q++;
+    
+    cc=_token(&q,eol,&tok);
+    if (_is(tok,cc,"include")) {
+      _emit(run,line-run);
+      run=next;
+      
+      cc=_token(&q,eol,&tok);
+      if (!cc) {
+        LOG_WARNING("WARNING: file name expected in #include directive\n");
+        continue;
+      }
+      
+      if (_include(tok,cc,depth)) _emitText("#line %u %i\n",ln+1,file);
+      else _emitText("\n");
+      continue;
+    }
+    
+    if (!_is(tok,cc,"pragma")) continue;
+    
+    q=_skip(q,eol);
+    cc=_token(&q,eol,&tok);
+    if (_is(tok,cc,"loop-begin")) {
+      q=_skip(q,eol);
+      k=strtol(q,&end,10);
+      if ((end==q) || (k<1)) {
+        LOG_WARNING(
+          "WARNING: loop-begin without valid loop count (source: %s:%u)\n",
+          _files_v[file],ln);
+        continue;
+      }
+      if (n_loops>=PREPROCESSOR_MAX_LOOPS) {
+        LOG_WARNING(
+          "WARNING: pragma loops nested too deeply (source: %s:%u)\n",
+          _files_v[file],ln);
+        continue;
+      }
+      
+      _emit(run,line-run);
+      run=next;
+      
+      loop=loops+n_loops++;
+      loop->count=k;
+      loop->first=_segments_n;
+      loop->line =ln;
+      
+      // repeated along with the body, so each pass maps to its lines
+      _emitText("#line %u %i\n",ln+1,file);
+    
+    } else if (_is(tok,cc,"loop-end")) {
+      if (!n_loops) {
+        LOG_WARNING(
+          "WARNING: loop-end without loop-begin (source: %s:%u)\n",
+          _files_v[file],ln);
+        continue;
+      }
+      
+      _emit(run,line-run);
+      run=next;
+      
+      loop=loops+--n_loops;
+      n=_segments_n-loop->first;
+      
+      // the segments of the body are repeated, not the code
+      ARRAY_RESERVE(_segments,_segments_n+n*(loop->count-1));
+      for(k=1;k<loop->count;k++)
+        for(i=0;i<n;i++)
+          APPEND(_segments,_segments_v[loop->first+i]);
+      
+      _emitText("#line %u %i\n",ln+1,file);
+    
+    } else {
+      _pragma(tok,eol,file,ln);
+    }
+  }
+  
+  _emit(run,e-run);
+  
+  if (n_loops) LOG_WARNING(
+    "WARNING: loop-begin at line %u without loop-end (source: %s)\n",
+    loops[n_loops-1].line,_files_v[file]);
+}
+
+size_t ShaderPreprocessor::run(const char *code, size_t cc,
+  const char *name) {
+  size_t idx;
+  preprocessor_segment_t *seg;
+  
+  clear();
+  
+  if (!cc) cc=strlen(code);
+  APPEND(_files,strdup(name?name:""));
+  
+  _process(code,code+cc,0,0);
+  
+  // the text buffer no longer moves, so pointers into it can be taken
+  ARRAY_SETSIZE(_strings,_segments_n);
+  ARRAY_SETSIZE(_lengths,_segments_n);
+  FOREACH(idx,seg,_segments) {
+    _strings_v[idx]=seg->ptr?seg->ptr:_text_v+seg->offset;
+    _lengths_v[idx]=(int)seg->cb;
+  }
+  
+  return _segments_n;
+}
+
+size_t ShaderPreprocessor::count() { return _segments_n; }
+const char *const *ShaderPreprocessor::strings() { return _strings_v; }
+const int *ShaderPreprocessor::lengths() { return _lengths_v; }
+
+size_t ShaderPreprocessor::cc() {
+  size_t idx, r=0;
+  
+  for(idx=0;idx<_segments_n;idx++) r+=_segments_v[idx].cb;
+  
+  return r;
+}
+
+size_t ShaderPreprocessor::fileCount() { return _files_n; }
+const char *ShaderPreprocessor::file(size_t idx) {
+  return idx<_files_n?_files_v[idx]:0;
+}
+
+int ShaderPreprocessor::tfbMode() { return _tfbMode; }
+size_t ShaderPreprocessor::varyingCount() { return _varyings_n; }
+const char *ShaderPreprocessor::varying(size_t idx) {
+  return idx<_varyings_n?_varyings_v[idx]:0;
+}
@@ -0,0 +1,75 @@
+
+/** \file quantize.cpp
+  * \author Peter Wagener
+  * \brief Implementation of vertex attribute conversions.
+  *
+  */
+#include <math.h>
+
+#include "diyyma/quantize.h"
+
+u_int16_t quantize_unorm16(float f) {
+  if (!(f>0)) return 0;
+  if (f>=1) return 0xffff;
+  return (u_int16_t)(f*65535.0f+0.5f);
+}
+
+int16_t quantize_snorm16(float f) {
+  if (!(f>-1)) return -32767;
+  if (f>=1) return 32767;
+  return (int16_t)floorf(f*32767.0f+0.5f);
+}
+
+u_int16_t quantize_half(float f) {
+  union { float f; u_int32_t u; } v;
+  u_int32_t sign, mant;
+  int exp;
+  
+  v.f=f;
+  sign=(v.u>>16)&0x8000;
+  exp =(int)((v.u>>23)&0xff)-127+15;
+  mant=v.u&0x7fffff;
+  
+  // infinity and NaN, or too large
+  if (exp>=31)
+    return sign|0x7c00|(((v.u&0x7fffffff)>0x7f800000)?0x200:0);
+  
+  // denormals, or too small
+  if (exp<=0) {
+    if (exp<-10) return sign;
+    mant|=0x800000;
+    return sign|(u_int16_t)((mant>>(14-exp))+((mant>>(13-exp))&1));
+  }
+  
+  // rounding may carry into the exponent, which is what we want.
+  return sign|(u_int16_t)((((u_int32_t)exp<<10)|(mant>>13))+((mant>>12)&1));
+}
+
+u_int32_t quantize_1010102(const Vector3f &v) {
+  const float c[3]={v.x,v.y,v.z};
+  u_int32_t r=0;
+  int i, q;
+  
+  for(i=0;i<3;i++) {
+    q=(int)floorf(max(-1.0f,min(1.0f,c[i]))*511.0f+0.5f);
+    r|=((u_int32_t)q&0x3ff)<<(i*10);
+  }
+  
+  return r;
+}
+
+void quantize_octahedral(const Vector3f &v, int16_t *e) {
+  float l=fabsf(v.x)+fabsf(v.y)+fabsf(v.z);
+  float x, y, t;
+  
+  if (l<=0) { e[0]=e[1]=0; return; }
+  x=v.x/l;
+  y=v.y/l;
+  if (v.z<0) {
+    t=x;
+    x=(1-fabsf(y))*(t<0?-1:1);
+    y=(1-fabsf(t))*(y<0?-1:1);
+  }
+  e[0]=quantize_snorm16(x);
+  e[1]=quantize_snorm16(y);
+}
@@ -1,7 +1,12 @@
 
 #include "diyyma/renderpass.h"
+#include "diyyma/jobs.h"
 #include "GL/glew.h"
 
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
 IRenderPass::IRenderPass(): 
   _frameBufferObject(0),
   flags(0),
@@ -88,6 +93,174 @@ void IRenderPass::endPass() {
   }
 }
 
+NodeCuller::NodeCuller() :
+  _nodeCount(0),
+  _transformVersion(0),
+  _boundsGeneration(0),
+  _valid(0) {
+  ARRAY_INIT(_leaves);
+  ARRAY_INIT(_boxes);
+  ARRAY_INIT(_unbounded);
+  ARRAY_INIT(_visible);
+  ARRAY_INIT(_reorder);
+}
+
+NodeCuller::~NodeCuller() {
+  ARRAY_DESTROY(_leaves);
+  ARRAY_DESTROY(_boxes);
+  ARRAY_DESTROY(_unbounded);
+  ARRAY_DESTROY(_visible);
+  ARRAY_DESTROY(_reorder);
+}
+
+int NodeCuller::begin(size_t n) {
+  size_t idx;
+  
+  if (_valid && (n==_nodeCount)
+  && (_transformVersion==scene_transform_version())
+  && (_boundsGeneration==StaticMesh::BoundsGeneration()))
+    return 0;
+  
+  if (!_valid || (n!=_nodeCount)) {
+    _bvh.clear();
+    ARRAY_SETSIZE(_leaves,n);
+    for(idx=0;idx<n;idx++) _leaves_v[idx]=-1;
+    _nodeCount=n;
+  }
+  
+  ARRAY_SETSIZE(_boxes,n);
+  _unbounded_n=0;
+  return 1;
+}
+
+void NodeCuller::refit(
+  size_t idx, const Matrixf &M, const Vector3f *bmin, const Vector3f *bmax) {
+  culled_box_t *box=_boxes_v+idx;
+  
+  box->bounded=bmin && bmax;
+  if (box->bounded) {
+    box->M=M;
+    box->bmin=*bmin;
+    box->bmax=*bmax;
+  }
+}
+
+void NodeCuller::_transformBoxes(void *arg, size_t begin, size_t end) {
+  culled_box_t *box=(culled_box_t*)arg+begin;
+  size_t idx;
+  
+  for(idx=begin;idx<end;idx++,box++) 
+    if (box->bounded) bvh_transform_box(box->M,&box->bmin,&box->bmax);
+}
+
+void NodeCuller::end() {
+  size_t idx;
+  culled_box_t *box;
+  int *leaf;
+  
+  job_parallel_for(_boxes_n,CULL_GRAIN,_transformBoxes,_boxes_v);
+  
+  FOREACH(idx,box,_boxes) {
+    leaf=_leaves_v+idx;
+    
+    if (!box->bounded) {
+      if (*leaf!=-1) _bvh.remove(*leaf);
+      *leaf=-1;
+      APPEND(_unbounded,idx);
+    } else if (*leaf==-1) {
+      *leaf=_bvh.insert(box->bmin,box->bmax,(void*)idx);
+    } else {
+      _bvh.move(*leaf,box->bmin,box->bmax);
+    }
+  }
+  
+  _transformVersion=scene_transform_version();
+  _boundsGeneration=StaticMesh::BoundsGeneration();
+  _valid=1;
+}
+
+void NodeCuller::invalidate() {
+  _valid=0;
+}
+
+void NodeCuller::reorder(const size_t *order, size_t n) {
+  size_t idx;
+  int *leaf;
+  
+  if (!_valid || (n!=_nodeCount)) {
+    _valid=0;
+    return;
+  }
+  
+  ARRAY_SETSIZE(_reorder,n);
+  memcpy(_reorder_v,_leaves_v,sizeof(int)*n);
+  
+  // after end, exactly the unbounded nodes have no leaf
+  _unbounded_n=0;
+  FOREACH(idx,leaf,_leaves) {
+    *leaf=_reorder_v[order[idx]];
+    if (*leaf==-1) {
+      APPEND(_unbounded,idx);
+    } else {
+      _bvh.setData(*leaf,(void*)idx);
+    }
+  }
+}
+
+void NodeCuller::_collect(void *data, void *arg) {
+  NodeCuller *culler=(NodeCuller*)arg;
+  culled_node_t entry;
+  entry.index=(size_t)data;
+  entry.key=(double)entry.index;
+  APPEND(culler->_visible,entry);
+}
+
+static int _compareCulled(const void *a, const void *b) {
+  double ka=((const culled_node_t*)a)->key, kb=((const culled_node_t*)b)->key;
+  return ka<kb?-1:ka>kb?1:0;
+}
+
+size_t NodeCuller::query(const Matrixf &VP) {
+  Frustum frustum;
+  size_t idx;
+  size_t *pidx;
+  
+  _visible_n=0;
+  frustum.set(VP);
+  _bvh.queryFrustum(frustum,_collect,this);
+  FOREACH(idx,pidx,_unbounded) _collect((void*)*pidx,this);
+  
+  // the tree returns leaves in no particular order, the pass expects the
+  // order nodes were added in.
+  sortVisible();
+  
+  return _visible_n;
+}
+
+culled_node_t *NodeCuller::visible() { return _visible_v; }
+
+void NodeCuller::sortVisible() {
+  if (_visible_n>1)
+    qsort(_visible_v,_visible_n,sizeof(culled_node_t),_compareCulled);
+}
+
+/** \brief Sorts nodes by keys, moving the leaves of the culler along so 
+  * its tree can be kept.
+  */
+template<typename T> static void _sortCulledNodes(
+  NodeCuller *culler, T **nodes, float *keys, size_t n,
+  size_t *order, size_t *tmpOrder, T **tmpNodes, u_int32_t *tmpKeys) {
+  size_t idx;
+  
+  for(idx=0;idx<n;idx++) order[idx]=idx;
+  sortByFloatKeys<size_t>(order,keys,n,tmpOrder,tmpKeys);
+  
+  for(idx=0;idx<n;idx++) tmpNodes[idx]=nodes[order[idx]];
+  memcpy(nodes,tmpNodes,sizeof(T*)*n);
+  
+  culler->reorder(order,n);
+}
+
 SceneNodeRenderPass::SceneNodeRenderPass() :
   _u_MVP(-1),
   _u_MV(-1),
@@ -95,11 +268,18 @@ SceneNodeRenderPass::SceneNodeRenderPass() :
   _u_V(-1),
   _u_P(-1),
   _u_time(-1),
-  _u_camPos_w(-1)
+  _u_camPos_w(-1),
+  lodPixelError(1)
   {
   transformLeft.setIdentity();
   transformRight.setIdentity();
   ARRAY_INIT(_nodes);
+  ARRAY_INIT(_distance);
+  ARRAY_INIT(_sortNodes);
+  ARRAY_INIT(_sortKeys);
+  ARRAY_INIT(_order);
+  ARRAY_INIT(_sortOrder);
+  ARRAY_INIT(_unoccluded);
 }
 
 SceneNodeRenderPass::~SceneNodeRenderPass() {
@@ -109,6 +289,12 @@ SceneNodeRenderPass::~SceneNodeRenderPass() {
     (*pnode)->drop();
   }
   ARRAY_DESTROY(_nodes);
+  ARRAY_DESTROY(_distance);
+  ARRAY_DESTROY(_sortNodes);
+  ARRAY_DESTROY(_sortKeys);
+  ARRAY_DESTROY(_order);
+  ARRAY_DESTROY(_sortOrder);
+  ARRAY_DESTROY(_unoccluded);
 }
 
 
@@ -117,6 +303,18 @@ void SceneNodeRenderPass::operator+=(IRenderableSceneNode *node) {
   APPEND(_nodes,node);
 }
 
+const renderqueue_stats_t &SceneNodeRenderPass::queueStats() {
+  return _queue.stats();
+}
+
+OcclusionCuller *SceneNodeRenderPass::occlusionCuller() {
+  return &_occlusion;
+}
+
+const occlusion_stats_t &SceneNodeRenderPass::occlusionStats() {
+  return _occlusion.stats();
+}
+
 void SceneNodeRenderPass::sortByDistance(const Vector3f &origin) {
   size_t idx;
   IRenderableSceneNode **pnode;
@@ -136,8 +334,14 @@ void SceneNodeRenderPass::sortByDistance(const Vector3f &origin) {
       sorted=0;
   }
   
-  if (!sorted) 
-    sortByKeys<IRenderableSceneNode*,double>(_nodes_v,_distance_v,_nodes_n);
+  if (!sorted) {
+    ARRAY_SETSIZE(_sortNodes,_nodes_n);
+    ARRAY_SETSIZE(_sortKeys,2*_nodes_n);
+    ARRAY_SETSIZE(_order,_nodes_n);
+    ARRAY_SETSIZE(_sortOrder,_nodes_n);
+    _sortCulledNodes(&_culler,_nodes_v,_distance_v,_nodes_n,
+      _order_v,_sortOrder_v,_sortNodes_v,_sortKeys_v);
+  }
 }
 
 void SceneNodeRenderPass::sortByDistance() {
@@ -169,11 +373,102 @@ void SceneNodeRenderPass::applyUniforms(SceneContext ctx) {
 }
 
 
+static int _nodeBounds(
+  IRenderableSceneNode *node, Vector3f *bmin, Vector3f *bmax) {
+  return node->bounds(bmin,bmax);
+}
+
+/** \brief Plain scene nodes have no bounds of their own. They are only 
+  * culled by an InstanceRenderPass, which always passes its mesh, so this
+  * is never reached.
+  */
+static int _nodeBounds(
+  ISceneNode* /*node*/, Vector3f* /*bmin*/, Vector3f* /*bmax*/) {
+  return 0;
+}
+
+/** \brief Refits the bounds of all nodes of a pass if necessary, then 
+  * collects the visible ones, sorted by distance to origin if requested.
+  */
+template<typename T> static size_t _cullNodes(
+  NodeCuller *culler, T **nodes, size_t n, StaticMesh *mesh,
+  const Matrixf &MVP, int sort, const Vector3f &origin) {
+  size_t idx, count;
+  Vector3f bmin, bmax;
+  culled_node_t *visible;
+  Matrixf transform;
+  int bounded;
+  
+  if (culler->begin(n)) {
+    if (mesh) mesh->bounds(&bmin,&bmax);
+    for(idx=0;idx<n;idx++) {
+      bounded=mesh || _nodeBounds(nodes[idx],&bmin,&bmax);
+      culler->refit(idx,nodes[idx]->absTransform(),
+        bounded?&bmin:0,bounded?&bmax:0);
+    }
+    culler->end();
+  }
+  
+  count=culler->query(MVP);
+  
+  if (sort) {
+    visible=culler->visible();
+    for(idx=0;idx<count;idx++) {
+      transform=nodes[visible[idx].index]->absTransform();
+      visible[idx].key=(
+        Vector3f(transform.a14,transform.a24,transform.a34)
+        -origin).sqr();
+    }
+    culler->sortVisible();
+  }
+  
+  return count;
+}
+
+/** \brief Rasterizes the occluders among count nodes, then collects those
+  * not hidden behind them in _unoccluded, keeping their order.
+  *
+  * \param visible Nodes left by frustum culling, or null for all nodes.
+  */
+size_t SceneNodeRenderPass::_occludeNodes(
+  const culled_node_t *visible, size_t count, const Matrixf &MVP) {
+  IRenderableSceneNode *node;
+  const Vector3f *positions;
+  const u_int32_t *indices;
+  size_t idx, indexCount;
+  culled_node_t entry;
+  Vector3f bmin, bmax;
+  
+  _occlusion.begin(MVP);
+  for(idx=0;idx<count;idx++) {
+    node=_nodes_v[visible?visible[idx].index:idx];
+    if (node->occluder 
+    && node->occluderGeometry(&positions,&indices,&indexCount))
+      _occlusion.addOccluder(
+        node->absTransform(),positions,indices,indexCount);
+  }
+  _occlusion.end();
+  
+  _unoccluded_n=0;
+  for(idx=0;idx<count;idx++) {
+    entry.index=visible?visible[idx].index:idx;
+    entry.key  =visible?visible[idx].key:idx;
+    node=_nodes_v[entry.index];
+    if (node->bounds(&bmin,&bmax)
+    && !_occlusion.test(node->absTransform(),bmin,bmax)) continue;
+    APPEND(_unoccluded,entry);
+  }
+  
+  return _unoccluded_n;
+}
+
 void SceneNodeRenderPass::render() {
-  size_t idx;
-  IRenderableSceneNode **pnode;
+  size_t idx, count;
+  IRenderableSceneNode *node;
+  culled_node_t *visible=0;
   SceneContext ctx;
   Matrixf m, MV, MVP;
+  GLint vp[4];
   
   if (!_contextSource) return;
   
@@ -199,27 +494,50 @@ void SceneNodeRenderPass::render() {
     ctx.MVP*=transformRight;
   }
   
-  if (flags&RP_SORT_NODES) 
+  count=_nodes_n;
+  if (flags&RP_FRUSTUM_CULL) {
+    count=_cullNodes(&_culler,_nodes_v,_nodes_n,(StaticMesh*)0,ctx.MVP,
+      flags&RP_SORT_NODES,Vector3f(ctx.MV.a14,ctx.MV.a24,ctx.MV.a34));
+    visible=_culler.visible();
+  } else if (flags&RP_SORT_NODES) 
     sortByDistance(Vector3f(ctx.MV.a14,ctx.MV.a24,ctx.MV.a34));
+  if (flags&RP_OCCLUSION_CULL) {
+    count=_occludeNodes(visible,count,ctx.MVP);
+    visible=_unoccluded_v;
+  }
+  scene_context_bind(ctx);
   beginPass();
   
+  if (flags&RP_LOD) {
+    // the viewport is only known once the pass is active
+    glGetIntegerv(GL_VIEWPORT,vp);
+    for(idx=0;idx<count;idx++) 
+      _nodes_v[visible?visible[idx].index:idx]->selectLOD(
+        ctx,vp[3]*0.5f,lodPixelError);
+  }
   
   if (_shader) {
     MV=ctx.MV;
     MVP=ctx.MVP;
     _shader->bind();
-    FOREACH(idx,pnode,_nodes) {
-      m=(*pnode)->absTransform();
+    for(idx=0;idx<count;idx++) {
+      node=_nodes_v[visible?visible[idx].index:idx];
+      m=node->absTransform()*node->geometryTransform();
       ctx.MV=MV*m;
       ctx.MVP=MVP*m;
       applyUniforms(ctx);
-      (*pnode)->sendGeometry();
+      node->sendGeometry();
     }
     _shader->unbind();
+  } else if (flags&RP_SORT_STATE) {
+    _queue.clear();
+    for(idx=0;idx<count;idx++) 
+      _nodes_v[visible?visible[idx].index:idx]->enqueue(&_queue);
+    _queue.sort(ctx.MV,flags&RP_TRANSLUCENT);
+    _queue.submit(ctx);
   } else {
-    FOREACH(idx,pnode,_nodes) {
-      (*pnode)->render(ctx);
-    }
+    for(idx=0;idx<count;idx++) 
+      _nodes_v[visible?visible[idx].index:idx]->render(ctx);
   
   }
   
@@ -238,6 +556,8 @@ void SceneNodeRenderPass::iterate(double dt, double time) {
 
 
 InstanceRenderPass::InstanceRenderPass() :
+  _culledMesh(0),
+  _b_instances(0),
   _u_MVP(-1),
   _u_MV(-1),
   _u_M(-1),
@@ -249,6 +569,12 @@ InstanceRenderPass::InstanceRenderPass() :
   transformLeft.setIdentity();
   transformRight.setIdentity();
   ARRAY_INIT(_nodes);
+  ARRAY_INIT(_distance);
+  ARRAY_INIT(_sortNodes);
+  ARRAY_INIT(_sortKeys);
+  ARRAY_INIT(_order);
+  ARRAY_INIT(_sortOrder);
+  ARRAY_INIT(_instances);
   _shaderReferrer=this;
 }
 
@@ -259,6 +585,13 @@ InstanceRenderPass::~InstanceRenderPass() {
     (*pnode)->drop();
   }
   ARRAY_DESTROY(_nodes);
+  ARRAY_DESTROY(_distance);
+  ARRAY_DESTROY(_sortNodes);
+  ARRAY_DESTROY(_sortKeys);
+  ARRAY_DESTROY(_order);
+  ARRAY_DESTROY(_sortOrder);
+  ARRAY_DESTROY(_instances);
+  if (_b_instances) glDeleteBuffers(1,&_b_instances);
 }
 
 
@@ -286,8 +619,14 @@ void InstanceRenderPass::sortByDistance(const Vector3f &origin) {
       sorted=0;
   }
   
-  if (!sorted) 
-    sortByKeys<ISceneNode*,double>(_nodes_v,_distance_v,_nodes_n);
+  if (!sorted) {
+    ARRAY_SETSIZE(_sortNodes,_nodes_n);
+    ARRAY_SETSIZE(_sortKeys,2*_nodes_n);
+    ARRAY_SETSIZE(_order,_nodes_n);
+    ARRAY_SETSIZE(_sortOrder,_nodes_n);
+    _sortCulledNodes(&_culler,_nodes_v,_distance_v,_nodes_n,
+      _order_v,_sortOrder_v,_sortNodes_v,_sortKeys_v);
+  }
 }
 
 void InstanceRenderPass::sortByDistance() {
@@ -320,8 +659,9 @@ void InstanceRenderPass::applyUniforms(SceneContext ctx) {
 
 
 void InstanceRenderPass::render() {
-  size_t idx;
-  ISceneNode **pnode;
+  size_t idx, count;
+  ISceneNode *node;
+  culled_node_t *visible=0;
   SceneContext ctx;
   Matrixf m, MV, MVP;
   int i;
@@ -350,8 +690,17 @@ void InstanceRenderPass::render() {
     ctx.MVP*=transformRight;
   }
   
-  if (flags&RP_SORT_NODES) 
+  count=_nodes_n;
+  if (flags&RP_FRUSTUM_CULL) {
+    // all nodes share the bounds of the mesh
+    if (_mesh!=_culledMesh) _culler.invalidate();
+    _culledMesh=_mesh;
+    count=_cullNodes(&_culler,_nodes_v,_nodes_n,_mesh,ctx.MVP,
+      flags&RP_SORT_NODES,Vector3f(ctx.MV.a14,ctx.MV.a24,ctx.MV.a34));
+    visible=_culler.visible();
+  } else if (flags&RP_SORT_NODES) 
     sortByDistance(Vector3f(ctx.MV.a14,ctx.MV.a24,ctx.MV.a34));
+  scene_context_bind(ctx);
   beginPass();
   
   MV=ctx.MV;
@@ -367,8 +716,11 @@ void InstanceRenderPass::render() {
   
   _mesh->bind();
   
-  FOREACH(idx,pnode,_nodes) {
-    m=(*pnode)->absTransform();
+  if (flags&RP_INSTANCED) {
+    _sendInstanced(count,visible);
+  } else for(idx=0;idx<count;idx++) {
+    node=_nodes_v[visible?visible[idx].index:idx];
+    m=node->absTransform()*_mesh->positionTransform();
     if (-1!=_u_MV  ) { 
       ctx.MV=MV*m; 
       glUniformMatrix4fv(_u_MV ,1,0,&ctx.MV.a11); 
@@ -390,6 +742,77 @@ void InstanceRenderPass::render() {
   endPass();
   
 }
+struct instance_args_t {
+  Matrixf *instances;
+  Matrixf  positionTransform;
+};
+
+static void _applyPositionTransform(void *arg, size_t begin, size_t end) {
+  instance_args_t *args=(instance_args_t*)arg;
+  size_t idx;
+  for(idx=begin;idx<end;idx++)
+    args->instances[idx]=args->instances[idx]*args->positionTransform;
+}
+
+void InstanceRenderPass::_sendInstanced(
+  size_t count, const culled_node_t *visible) {
+  size_t idx, first, n;
+  const float *pm;
+  instance_args_t args;
+  int i;
+  
+  // absolute transformations are computed lazily, so they are only read 
+  // here.
+  ARRAY_SETSIZE(_instances,count);
+  for(idx=0;idx<count;idx++)
+    _instances_v[idx]=
+      _nodes_v[visible?visible[idx].index:idx]->absTransform();
+  
+  args.instances=_instances_v;
+  args.positionTransform=_mesh->positionTransform();
+  job_parallel_for(count,CULL_GRAIN,_applyPositionTransform,&args);
+  
+  if (!GLEW_VERSION_3_3) {
+    // attributes without an enabled array take a constant value
+    for(idx=0;idx<count;idx++) {
+      pm=&_instances_v[idx].a11;
+      for(i=0;i<4;i++) 
+        glVertexAttrib4fv(BUFIDX_INSTANCE_TRANSFORM+i,pm+i*4);
+      _mesh->send();
+    }
+    return;
+  }
+  
+  if (!_b_instances) glGenBuffers(1,&_b_instances);
+  
+  glBindBuffer(GL_ARRAY_BUFFER,_b_instances);
+  for(i=0;i<4;i++) {
+    glEnableVertexAttribArray(BUFIDX_INSTANCE_TRANSFORM+i);
+    glVertexAttribPointer(BUFIDX_INSTANCE_TRANSFORM+i,4,GL_FLOAT,0,
+      sizeof(Matrixf),(void*)(i*4*sizeof(float)));
+    glVertexAttribDivisor(BUFIDX_INSTANCE_TRANSFORM+i,1);
+  }
+  
+  for(first=0;first<count;first+=n) {
+    n=min(count-first,(size_t)INSTANCE_BATCH_SIZE);
+    
+    // orphan the storage of the previous batch instead of waiting until it
+    // has been drawn
+    glBufferData(GL_ARRAY_BUFFER,
+      INSTANCE_BATCH_SIZE*sizeof(Matrixf),0,GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER,0,n*sizeof(Matrixf),_instances_v+first);
+    _mesh->sendInstanced(n);
+  }
+  
+  // the mesh's vertex array object records these, so they are reset for
+  // ordinary use of the mesh
+  for(i=0;i<4;i++) {
+    glVertexAttribDivisor(BUFIDX_INSTANCE_TRANSFORM+i,0);
+    glDisableVertexAttribArray(BUFIDX_INSTANCE_TRANSFORM+i);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER,0);
+}
+
 int InstanceRenderPass::event(const SDL_Event *ev) {
   return 0;
 }
@@ -436,6 +859,7 @@ void ScreenQuadRenderPass::render() {
   if (_contextSource) ctx=_contextSource->context();
   else ctx.setIdentity();
   
+  scene_context_bind(ctx);
   beginPass();
   if (_shader) {
     _shader->bind();
@@ -0,0 +1,279 @@
+/** \file renderqueue.cpp
+  * \author Peter Wagener
+  * \brief Ordering of draw calls by render state.
+  */
+
+#include <string.h>
+#include <math.h>
+
+#include "diyyma/renderqueue.h"
+#include "diyyma/jobs.h"
+#include "GL/glew.h"
+
+/* Key layout, most significant bits first:
+ *
+ *    1  set for state items, clear for custom ones (sorted first)
+ *   15  shader
+ *   16  textures
+ *   16  mesh
+ *   16  depth
+ *
+ * For translucent items, depth moves right after the first bit and is
+ * inverted. State fields are hashes, so different states may share a value
+ * - this only costs binds, as submit compares the actual pointers.
+ */
+#define KEY_STATE ((u_int64_t)1<<63)
+
+static u_int64_t _hashPointer(const void *p) {
+  u_int64_t h=(u_int64_t)(size_t)p;
+  h^=h>>33;
+  h*=0xff51afd7ed558ccdULL;
+  h^=h>>33;
+  return h;
+}
+
+/** \brief Maps a non-negative distance to 16 bits, preserving order. */
+static u_int64_t _depthBits(float d) {
+  u_int32_t bits;
+  if (!(d>0)) return 0;
+  memcpy(&bits,&d,4);
+  return bits>>15;
+}
+
+RenderQueue::RenderQueue() {
+  ARRAY_INIT(_items);
+  ARRAY_INIT(_order);
+  ARRAY_INIT(_swap);
+  _shader=0;
+  _mesh=0;
+  memset(_textures,0,sizeof(_textures));
+  memset(&_stats,0,sizeof(_stats));
+}
+
+RenderQueue::~RenderQueue() {
+  ARRAY_DESTROY(_items);
+  ARRAY_DESTROY(_order);
+  ARRAY_DESTROY(_swap);
+}
+
+void RenderQueue::clear() {
+  _items_n=0;
+  _order_n=0;
+}
+
+render_item_t *RenderQueue::add(IRenderableSceneNode *node) {
+  render_item_t item, *r;
+  int i;
+  
+  APPEND(_items,item);
+  r=_items_v+_items_n-1;
+  r->key=0;
+  r->shader=0;
+  for(i=0;i<RENDERQUEUE_TEXTURES;i++) {
+    r->textures[i]=0;
+    r->textureLocs[i]=-1;
+  }
+  r->mesh=0;
+  r->slice=-1;
+  r->lod=0;
+  r->M.setIdentity();
+  r->node=node;
+  r->data=0;
+  
+  return r;
+}
+
+void RenderQueue::addCustom(IRenderableSceneNode *node) {
+  add(node);
+}
+
+/** \brief Sorts entries by key, 8 bits per pass, least significant first.
+  *
+  * Passes over digits which are the same for all entries are skipped.
+  *
+  * \return Either v or tmp, whichever holds the result.
+  */
+static renderqueue_entry_t *_radixSort(
+  renderqueue_entry_t *v, renderqueue_entry_t *tmp, size_t n) {
+  size_t counts[8][256];
+  size_t idx, sum, c;
+  renderqueue_entry_t *swap;
+  int pass, digit;
+  
+  memset(counts,0,sizeof(counts));
+  for(idx=0;idx<n;idx++)
+    for(pass=0;pass<8;pass++)
+      counts[pass][(v[idx].key>>(pass*8))&0xff]++;
+  
+  for(pass=0;pass<8;pass++) {
+    if (counts[pass][(v[0].key>>(pass*8))&0xff]==n) continue;
+    
+    for(digit=0,sum=0;digit<256;digit++) {
+      c=counts[pass][digit];
+      counts[pass][digit]=sum;
+      sum+=c;
+    }
+    
+    for(idx=0;idx<n;idx++)
+      tmp[counts[pass][(v[idx].key>>(pass*8))&0xff]++]=v[idx];
+    
+    swap=v; v=tmp; tmp=swap;
+  }
+  
+  return v;
+}
+
+/** \brief Minimum number of items per job when computing keys. */
+#define RENDERQUEUE_KEY_GRAIN 256
+
+struct renderqueue_keys_t {
+  render_item_t       *items;
+  renderqueue_entry_t *order;
+  Matrixf              MV;
+  int                  translucent;
+};
+
+static void _computeKeys(void *arg, size_t begin, size_t end) {
+  renderqueue_keys_t *args=(renderqueue_keys_t*)arg;
+  size_t idx;
+  render_item_t *pitem;
+  renderqueue_entry_t *pentry;
+  u_int64_t shader, textures, mesh, depth;
+  Matrixf M;
+  int i;
+  
+  for(idx=begin;idx<end;idx++) {
+    pitem=args->items+idx;
+    pentry=args->order+idx;
+    pentry->index=idx;
+    
+    // keeps custom items in the order they were added in
+    if (!pitem->shader) {
+      pentry->key=idx;
+      continue;
+    }
+    
+    shader=_hashPointer(pitem->shader)&0x7fff;
+    for(i=0,textures=0;i<RENDERQUEUE_TEXTURES;i++)
+      textures=_hashPointer(
+        (void*)(size_t)(textures^(size_t)pitem->textures[i]));
+    textures&=0xffff;
+    mesh=_hashPointer(pitem->mesh)&0xffff;
+    
+    M=args->MV*pitem->M;
+    depth=_depthBits(Vector3f(M.a14,M.a24,M.a34).length());
+    
+    if (args->translucent)
+      pentry->key=KEY_STATE|((0xffff-depth)<<47)|(shader<<32)|(textures<<16)
+        |mesh;
+    else
+      pentry->key=KEY_STATE|(shader<<48)|(textures<<32)|(mesh<<16)|depth;
+  }
+}
+
+void RenderQueue::sort(const Matrixf &MV, int translucent) {
+  size_t idx;
+  renderqueue_entry_t *pentry;
+  renderqueue_keys_t args;
+  
+  ARRAY_SETSIZE(_order,_items_n);
+  ARRAY_SETSIZE(_swap,_items_n);
+  
+  args.items=_items_v;
+  args.order=_order_v;
+  args.MV=MV;
+  args.translucent=translucent;
+  job_parallel_for(_items_n,RENDERQUEUE_KEY_GRAIN,_computeKeys,&args);
+  
+  if (_order_n>1) {
+    pentry=_radixSort(_order_v,_swap_v,_order_n);
+    if (pentry!=_order_v)
+      memcpy(_order_v,pentry,sizeof(renderqueue_entry_t)*_order_n);
+  }
+  
+  FOREACH(idx,pentry,_order) _items_v[pentry->index].key=pentry->key;
+}
+
+void RenderQueue::_reset() {
+  if (_mesh) _mesh->unbind();
+  _mesh=0;
+  
+  Texture::Unbind();
+  memset(_textures,0,sizeof(_textures));
+  
+  if (_shader) Shader::Unbind();
+  _shader=0;
+}
+
+void RenderQueue::submit(SceneContext ctx) {
+  size_t idx;
+  renderqueue_entry_t *pentry;
+  render_item_t *pitem;
+  Matrixf MV=ctx.MV, MVP=ctx.MVP;
+  SceneContext ictx=ctx;
+  int i, shaderChanged;
+  
+  memset(&_stats,0,sizeof(_stats));
+  _stats.items=_items_n;
+  
+  // before sort, or if there was nothing to sort
+  if (_order_n!=_items_n) {
+    ARRAY_SETSIZE(_order,_items_n);
+    for(idx=0;idx<_items_n;idx++) _order_v[idx].index=idx;
+  }
+  
+  FOREACH(idx,pentry,_order) {
+    pitem=_items_v+pentry->index;
+    
+    if (!pitem->shader) {
+      _reset();
+      pitem->node->render(ctx);
+      _stats.custom++;
+      continue;
+    }
+    
+    shaderChanged=pitem->shader!=_shader;
+    if (shaderChanged) {
+      _shader=pitem->shader;
+      _shader->bind();
+      _stats.shaderBinds++;
+    } else _stats.shaderBindsAvoided++;
+    
+    // sampler uniforms are stored per program, so they are set again for a
+    // new shader
+    if (shaderChanged 
+    || memcmp(_textures,pitem->textures,sizeof(_textures))) {
+      for(i=0;i<RENDERQUEUE_TEXTURES;i++) if (pitem->textures[i]) {
+        pitem->textures[i]->bind(i);
+        if (pitem->textureLocs[i]!=-1) glUniform1i(pitem->textureLocs[i],i);
+      }
+      memcpy(_textures,pitem->textures,sizeof(_textures));
+      _stats.textureBinds++;
+    } else _stats.textureBindsAvoided++;
+    
+    if (pitem->mesh!=_mesh) {
+      if (_mesh) _mesh->unbind();
+      _mesh=pitem->mesh;
+      _mesh->bind();
+      _stats.meshBinds++;
+    } else _stats.meshBindsAvoided++;
+    
+    ictx.M=pitem->M;
+    ictx.MV=MV*pitem->M;
+    ictx.MVP=MVP*pitem->M;
+    pitem->node->applyQueued(pitem,ictx);
+    
+    if (pitem->slice<0) _mesh->sendLOD(pitem->lod);
+    else _mesh->send(pitem->slice,pitem->lod);
+  }
+  
+  _reset();
+}
+
+size_t RenderQueue::count() { return _items_n; }
+
+render_item_t *RenderQueue::sorted(size_t idx) {
+  return _items_v+_order_v[idx].index;
+}
+
+const renderqueue_stats_t &RenderQueue::stats() { return _stats; }
@@ -1,7 +1,58 @@
 
+#include <math.h>
+#include <string.h>
+
 #include "diyyma/config.h"
 #include "diyyma/scenecontext.h"
 #include "diyyma/util.h"
+#include "diyyma/uniform.h"
+
+void Frustum::set(const Matrixf &M) {
+  int i;
+  float l;
+  
+  // Gribb/Hartmann: each plane is the last row of the matrix plus or minus 
+  // one of the others.
+  planes[0].set(M.a41+M.a11,M.a42+M.a12,M.a43+M.a13,M.a44+M.a14);
+  planes[1].set(M.a41-M.a11,M.a42-M.a12,M.a43-M.a13,M.a44-M.a14);
+  planes[2].set(M.a41+M.a21,M.a42+M.a22,M.a43+M.a23,M.a44+M.a24);
+  planes[3].set(M.a41-M.a21,M.a42-M.a22,M.a43-M.a23,M.a44-M.a24);
+  planes[4].set(M.a41+M.a31,M.a42+M.a32,M.a43+M.a33,M.a44+M.a34);
+  planes[5].set(M.a41-M.a31,M.a42-M.a32,M.a43-M.a33,M.a44-M.a34);
+  
+  // normalized, so sphere tests measure actual distances
+  for(i=0;i<6;i++) {
+    l=sqrtf(
+      planes[i].x*planes[i].x+
+      planes[i].y*planes[i].y+
+      planes[i].z*planes[i].z);
+    if (l>0) planes[i]/=l;
+  }
+}
+
+int Frustum::cullBox(const Vector3f &bmin, const Vector3f &bmax) const {
+  int i;
+  Vector3f c=(bmin+bmax)*0.5f, e=(bmax-bmin)*0.5f;
+  const Vector4f *p;
+  
+  // the box is outside if even its corner furthest along the plane normal
+  // is behind the plane.
+  for(i=0,p=planes;i<6;i++,p++)
+    if (p->x*c.x+p->y*c.y+p->z*c.z+p->w
+      +fabsf(p->x)*e.x+fabsf(p->y)*e.y+fabsf(p->z)*e.z<0) return 1;
+  
+  return 0;
+}
+
+int Frustum::cullSphere(const Vector3f &c, float radius) const {
+  int i;
+  const Vector4f *p;
+  
+  for(i=0,p=planes;i<6;i++,p++)
+    if (p->x*c.x+p->y*c.y+p->z*c.z+p->w<-radius) return 1;
+  
+  return 0;
+}
 
 ISceneContextReferrer::ISceneContextReferrer() :
   _contextSource(0) {
@@ -22,3 +73,51 @@ void ISceneContextReferrer::setContextSource(ISceneContextSource *s) {
   if (_contextSource) _contextSource->grab();
 }
 
+
+// layout of the DiyymaFrame block, see UNIFORM_BINDING_FRAME
+static UniformBlock _scene_frame_block;
+static unsigned _scene_frame_P, _scene_frame_V, _scene_frame_camPos_w,
+  _scene_frame_time;
+
+// where the last data went, to bind it again for an equal context
+static unsigned _scene_frame_last=0;
+static size_t   _scene_frame_offset;
+
+void scene_context_bind(const SceneContext &ctx) {
+  UniformRing *ring;
+  UniformBlock *block=&_scene_frame_block;
+  unsigned char last[256];
+  void *p;
+  size_t cb;
+  
+  if (!(ring=uniform_ring())) return;
+  
+  if (!block->count()) {
+    _scene_frame_P       =block->add(UNIFORM_MAT4);
+    _scene_frame_V       =block->add(UNIFORM_MAT4);
+    _scene_frame_camPos_w=block->add(UNIFORM_VEC3);
+    _scene_frame_time    =block->add(UNIFORM_FLOAT);
+  }
+  
+  cb=block->cb();
+  memcpy(last,block->data(),cb);
+  
+  block->set(_scene_frame_P,ctx.P);
+  block->set(_scene_frame_V,ctx.V);
+  block->set(_scene_frame_camPos_w,ctx.camPos_w);
+  block->set(_scene_frame_time,(float)ctx.time);
+  
+  if (_scene_frame_last && (_scene_frame_last==ring->frame())
+  && (memcmp(last,block->data(),cb)==0)) {
+    ring->bind(UNIFORM_BINDING_FRAME,_scene_frame_offset,cb);
+    return;
+  }
+  
+  if (!(p=ring->alloc(cb,&_scene_frame_offset))) {
+    _scene_frame_last=0;
+    return;
+  }
+  memcpy(p,block->data(),cb);
+  ring->bind(UNIFORM_BINDING_FRAME,_scene_frame_offset,cb);
+  _scene_frame_last=ring->frame();
+}
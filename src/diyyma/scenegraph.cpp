@@ -1,7 +1,9 @@
 
 #include "diyyma/config.h"
 #include "diyyma/scenegraph.h"
+#include "diyyma/renderqueue.h"
 #include "diyyma/util.h"
+#include "diyyma/jobs.h"
 
 
 ILightControllerReferrer::ILightControllerReferrer() :
@@ -92,9 +94,47 @@ const char *light_uniforms[][MAX_LIGHTS]={
   
 };
 
+#define LIGHT_UNIFORM_COUNT 6
 
-SimpleLightController::SimpleLightController() {
+/** \brief GL types of the light_uniforms members. */
+static const GLenum light_uniform_types[LIGHT_UNIFORM_COUNT]={
+  GL_FLOAT_VEC3, GL_FLOAT_VEC3, GL_FLOAT_VEC3, GL_FLOAT_VEC3, 
+  GL_FLOAT, GL_UNSIGNED_INT
+};
+
+/** \brief Uniform locations of a SimpleLightController for one shader. */
+struct light_locations_t {
+  Shader  *shader;
+  unsigned linkId;
+  GLint    count;
+  GLint    light[MAX_LIGHTS][LIGHT_UNIFORM_COUNT];
+};
+
+
+SimpleLightController::SimpleLightController() : 
+  _blockFrame(0),
+  _bvhVersion(0),
+  _bvhTime(0),
+  _bvhValid(0) {
+  int i;
+  
   ARRAY_INIT(_nodes);
+  ARRAY_INIT(_locations);
+  ARRAY_INIT(_leaves);
+  ARRAY_INIT(_unlimited);
+  ARRAY_INIT(_selected);
+  
+  // as each Light starts with a vec3, its members can be added one by one
+  _u_lightCount=_block.add(UNIFORM_INT);
+  _u_light=_block.count();
+  for(i=0;i<MAX_LIGHTS;i++) {
+    _block.add(UNIFORM_VEC3);
+    _block.add(UNIFORM_VEC3);
+    _block.add(UNIFORM_VEC3);
+    _block.add(UNIFORM_VEC3);
+    _block.add(UNIFORM_FLOAT);
+    _block.add(UNIFORM_UINT);
+  }
 }
 
 SimpleLightController::~SimpleLightController() {
@@ -104,54 +144,472 @@ SimpleLightController::~SimpleLightController() {
     (*pnode)->drop();
   }
   ARRAY_DESTROY(_nodes);
+  ARRAY_DESTROY(_locations);
+  ARRAY_DESTROY(_leaves);
+  ARRAY_DESTROY(_unlimited);
+  ARRAY_DESTROY(_selected);
 }
 
 void SimpleLightController::operator+=(LightSceneNode *node) {
-  if (_nodes_n>=MAX_LIGHTS) return;
   node->grab();
   APPEND(_nodes,node);
+  APPEND(_leaves,-1);
+  _bvhValid=0;
 }
 
 
-void SimpleLightController::activate(Shader *shd, SceneContext ctx) {
-  GLint loc;
+/** \brief Returns the uniform locations of a shader, looking them up if
+  * the shader is new or was linked again.
+  *
+  * Entries are matched by pointer. As link ids are never reused, a new 
+  * shader at the address of a deleted one is detected as well.
+  */
+const light_locations_t *SimpleLightController::_locate(Shader *shd) {
+  light_locations_t *ploc=0;
   size_t idx;
-  LightSceneNode **pnode;
-  Matrixf V, MV;
+  int i, j;
+  
+  for(idx=0;idx<_locations_n;idx++) 
+    if (_locations_v[idx].shader==shd) {
+      ploc=_locations_v+idx;
+      if (ploc->linkId==shd->linkId()) return ploc;
+      break;
+    }
+  
+  if (!ploc) {
+    ARRAY_SETSIZE(_locations,_locations_n+1);
+    ploc=_locations_v+_locations_n-1;
+  }
+  
+  ploc->shader=shd;
+  ploc->linkId=shd->linkId();
+  ploc->count =shd->locate("u_lightCount");
+  for(i=0;i<MAX_LIGHTS;i++)
+    for(j=0;j<LIGHT_UNIFORM_COUNT;j++)
+      ploc->light[i][j]=
+        shd->locate(light_uniforms[i][j],light_uniform_types[j]);
+  
+  return ploc;
+}
+
+/** \brief Writes up to MAX_LIGHTS lights into the block. */
+void SimpleLightController::_fillBlock(
+  const Matrixf &V, LightSceneNode **lights, size_t n) {
+  size_t idx;
+  unsigned m;
+  Matrixf MV;
   Vector3f p;
   
-  loc=shd->locate("u_lightCount");
+  if (n>MAX_LIGHTS) n=MAX_LIGHTS;
   
-  if (-1==loc) return;
+  _block.set(_u_lightCount,(int)n);
+  for(idx=0;idx<n;idx++) {
+    MV=lights[idx]->absTransform()*V;
+    p.set(MV.a14,MV.a24,MV.a34);
+    m=_u_light+idx*LIGHT_UNIFORM_COUNT;
+    _block.set(m  ,lights[idx]->param.ambient_c);
+    _block.set(m+1,lights[idx]->param.diffuse_c);
+    _block.set(m+2,lights[idx]->param.specular_c);
+    _block.set(m+3,p);
+    _block.set(m+4,lights[idx]->param.falloff_factor);
+    _block.set(m+5,(unsigned)lights[idx]->param.flags);
+  }
+}
+
+/** \brief Binds the lights block, writing it if it was not yet written in
+  * the current frame.
+  */
+void SimpleLightController::_bindBlock() {
+  UniformRing *ring;
+  size_t cb;
+  Matrixf V;
+  void *data;
+  
+  if (!(ring=uniform_ring())) return;
+  cb=_block.cb();
+  
+  if (!_blockFrame || (_blockFrame!=ring->frame())) {
+    if (_contextSource)
+      V=_contextSource->context().V;
+    else
+      V.setIdentity();
+    
+    _fillBlock(V,_nodes_v,_nodes_n);
+    
+    if (!(data=ring->alloc(cb,&_blockOffset))) {
+      _blockFrame=0;
+      return;
+    }
+    memcpy(data,_block.data(),cb);
+    _blockFrame=ring->frame();
+  }
+  
+  ring->bind(UNIFORM_BINDING_LIGHTS,_blockOffset,cb);
+}
+
+/** \brief Transmits up to MAX_LIGHTS lights, through a block written for
+  * this call only if the shader declares the lights block.
+  */
+void SimpleLightController::_apply(
+  Shader *shd, const Matrixf &V, LightSceneNode **lights, size_t n) {
+  const light_locations_t *ploc;
+  const GLint *loc;
+  UniformRing *ring;
+  size_t idx, cb, offset;
+  Matrixf MV;
+  Vector3f p;
+  void *data;
+  
+  if (n>MAX_LIGHTS) n=MAX_LIGHTS;
+  
+  if (shd->usesBlock(UNIFORM_BINDING_LIGHTS)) {
+    if (!(ring=uniform_ring())) return;
+    cb=_block.cb();
+    _fillBlock(V,lights,n);
+    if (!(data=ring->alloc(cb,&offset))) return;
+    memcpy(data,_block.data(),cb);
+    ring->bind(UNIFORM_BINDING_LIGHTS,offset,cb);
+    return;
+  }
   
-  glUniform1i(loc,_nodes_n);
+  ploc=_locate(shd);
+  
+  if (-1==ploc->count) return;
+  
+  glUniform1i(ploc->count,n);
+  
+  for(idx=0;idx<n;idx++) {
+    MV=lights[idx]->absTransform()*V;
+    p.set(MV.a14,MV.a24,MV.a34);
+    loc=ploc->light[idx];
+    glUniform3fv(loc[0],1,&lights[idx]->param.ambient_c.x);
+    glUniform3fv(loc[1],1,&lights[idx]->param.diffuse_c.x);
+    glUniform3fv(loc[2],1,&lights[idx]->param.specular_c.x);
+    glUniform3fv(loc[3],1,&p.x);
+    glUniform1f (loc[4],lights[idx]->param.falloff_factor);
+    glUniform1ui(loc[5],lights[idx]->param.flags);
+  }
+  
+}
+
+/** \brief Updates the boxes around the ranges of all lights, unless it
+  * was done for the same frame time and no transformation changed since.
+  *
+  * Ranges are only picked up here, so changing one takes effect in the
+  * next frame.
+  */
+void SimpleLightController::_refit(double time) {
+  size_t idx;
+  LightSceneNode **pnode;
+  Matrixf M;
+  Vector3f p, r;
+  int *leaf;
+  
+  if (_bvhValid && (_bvhTime==time)
+  && (_bvhVersion==scene_transform_version()))
+    return;
+  
+  _unlimited_n=0;
+  FOREACH(idx,pnode,_nodes) {
+    leaf=_leaves_v+idx;
+    
+    if ((*pnode)->param.range<=0) {
+      if (*leaf!=-1) _bvh.remove(*leaf);
+      *leaf=-1;
+      APPEND(_unlimited,*pnode);
+      continue;
+    }
+    
+    M=(*pnode)->absTransform();
+    p.set(M.a14,M.a24,M.a34);
+    r.set((*pnode)->param.range,(*pnode)->param.range,(*pnode)->param.range);
+    if (*leaf==-1)
+      *leaf=_bvh.insert(p-r,p+r,(void*)*pnode);
+    else
+      _bvh.move(*leaf,p-r,p+r);
+  }
+  
+  _bvhVersion=scene_transform_version();
+  _bvhTime=time;
+  _bvhValid=1;
+}
+
+/** \brief Collects a light found by the tree if its range actually 
+  * reaches the queried box.
+  */
+void SimpleLightController::_select(void *data, void *arg) {
+  SimpleLightController *lc=(SimpleLightController*)arg;
+  LightSceneNode *node=(LightSceneNode*)data;
+  Matrixf M;
+  Vector3f p, d;
+  
+  if (lc->_selected_n>=MAX_LIGHTS) return;
+  
+  // distance from the light to the closest point of the box
+  M=node->absTransform();
+  p.set(M.a14,M.a24,M.a34);
+  d.set(
+    p.x<lc->_selectMin.x?lc->_selectMin.x-p.x:
+    p.x>lc->_selectMax.x?p.x-lc->_selectMax.x:0,
+    p.y<lc->_selectMin.y?lc->_selectMin.y-p.y:
+    p.y>lc->_selectMax.y?p.y-lc->_selectMax.y:0,
+    p.z<lc->_selectMin.z?lc->_selectMin.z-p.z:
+    p.z>lc->_selectMax.z?p.z-lc->_selectMax.z:0);
+  if (d.sqr()>node->param.range*node->param.range) return;
+  
+  APPEND(lc->_selected,node);
+}
+
+void SimpleLightController::activate(Shader *shd, SceneContext /*ctx*/) {
+  Matrixf V;
+  
+  if (shd->usesBlock(UNIFORM_BINDING_LIGHTS)) {
+    _bindBlock();
+    return;
+  }
   
   if (_contextSource)
     V=_contextSource->context().V;
   else
     V.setIdentity();
   
-  FOREACH(idx,pnode,_nodes) {
-    MV=(*pnode)->absTransform()*V;
-    p.set(MV.a14,MV.a24,MV.a34);
-    glUniform3fv(shd->locate(light_uniforms[idx][0]),1,&(*pnode)->param.ambient_c.x);
-    glUniform3fv(shd->locate(light_uniforms[idx][1]),1,&(*pnode)->param.diffuse_c.x);
-    glUniform3fv(shd->locate(light_uniforms[idx][2]),1,&(*pnode)->param.specular_c.x);
-    glUniform3fv(shd->locate(light_uniforms[idx][3]),1,&p.x);
-    glUniform1f (shd->locate(light_uniforms[idx][4]),(*pnode)->param.falloff_factor);
-    glUniform1ui(shd->locate(light_uniforms[idx][5]),(*pnode)->param.flags);
+  _apply(shd,V,_nodes_v,_nodes_n);
+}
+
+void SimpleLightController::activate(Shader *shd, SceneContext ctx, 
+  const Vector3f &bmin, const Vector3f &bmax) {
+  size_t idx;
+  LightSceneNode **pnode;
+  Matrixf V;
+  
+  _refit(ctx.time);
+  if (!_bvh.count()) {
+    activate(shd,ctx);
+    return;
+  }
+  
+  _selected_n=0;
+  FOREACH(idx,pnode,_unlimited) {
+    if (_selected_n>=MAX_LIGHTS) break;
+    APPEND(_selected,*pnode);
+  }
+  _selectMin=bmin;
+  _selectMax=bmax;
+  _bvh.queryBox(bmin,bmax,_select,this);
+  
+  if (_contextSource)
+    V=_contextSource->context().V;
+  else
+    V.setIdentity();
+  
+  _apply(shd,V,_selected_v,_selected_n);
+}
+
+// incremented whenever any absolute transformation may have changed
+static SDL_atomic_t _scene_transform_version;
+
+unsigned scene_transform_version() {
+  return (unsigned)SDL_AtomicGet(&_scene_transform_version);
+}
+
+TransformStore::TransformStore() {
+  ARRAY_INIT(_local);
+  ARRAY_INIT(_world);
+  ARRAY_INIT(_parent);
+  ARRAY_INIT(_handle);
+  ARRAY_INIT(_slot);
+  ARRAY_INIT(_free);
+  _dirty=0;
+  _unsorted=0;
+}
+
+TransformStore::~TransformStore() {
+  ARRAY_DESTROY(_local);
+  ARRAY_DESTROY(_world);
+  ARRAY_DESTROY(_parent);
+  ARRAY_DESTROY(_handle);
+  ARRAY_DESTROY(_slot);
+  ARRAY_DESTROY(_free);
+}
+
+int TransformStore::add(int parent) {
+  int32_t handle;
+  Matrixf m;
+  
+  if (_free_n) {
+    handle=_free_v[--_free_n];
+  } else {
+    handle=_slot_n;
+    APPEND(_slot,-1);
   }
   
+  m.setIdentity();
+  _slot_v[handle]=_local_n;
+  APPEND(_local,m);
+  APPEND(_world,m);
+  APPEND(_parent,parent<0?-1:_slot_v[parent]);
+  APPEND(_handle,handle);
+  
+  // appending keeps parents in front of their children, so this only
+  // affects locality until the next sort.
+  _unsorted=1;
+  _dirty=1;
+  
+  return handle;
+}
+
+void TransformStore::remove(int handle) {
+  // the slot stays in place until the next sort, which drops it.
+  _handle_v[_slot_v[handle]]=-1;
+  _slot_v[handle]=-1;
+  APPEND(_free,handle);
+  _unsorted=1;
+  _dirty=1;
+}
+
+size_t TransformStore::count() {
+  return _slot_n-_free_n;
+}
+
+Matrixf &TransformStore::local(int handle) {
+  _dirty=1;
+  SDL_AtomicAdd(&_scene_transform_version,1);
+  return _local_v[_slot_v[handle]];
+}
+
+const Matrixf &TransformStore::world(int handle) {
+  if (_dirty) update();
+  return _world_v[_slot_v[handle]];
+}
+
+void TransformStore::_sort() {
+  size_t n=_local_n, i, c;
+  int32_t *depth, *order, *count, p;
+  Matrixf *local, *world;
+  int32_t *parent, *handle;
+  int32_t  depth_n=0;
+  
+  // entries are in topological order, so depths are known in one pass.
+  // Children of removed entries become roots.
+  depth=(int32_t*)malloc(sizeof(int32_t)*(n+1)*3);
+  order=depth+n+1;
+  count=order+n+1;
+  for(i=0;i<n;i++) {
+    if (_handle_v[i]<0) continue;
+    p=_parent_v[i];
+    if ((p>=0)&&(_handle_v[p]<0)) p=_parent_v[i]=-1;
+    depth[i]=p<0?0:depth[p]+1;
+    if (depth[i]>=depth_n) depth_n=depth[i]+1;
+  }
+  
+  // stable counting sort by depth, i.e. breadth-first
+  memset(count,0,sizeof(int32_t)*(depth_n+1));
+  for(i=0;i<n;i++) if (_handle_v[i]>=0) count[depth[i]+1]++;
+  for(i=1;i<=(size_t)depth_n;i++) count[i]+=count[i-1];
+  c=count[depth_n];
+  for(i=0;i<n;i++) order[i]=(_handle_v[i]>=0)?count[depth[i]]++:-1;
+  
+  local =(Matrixf*)malloc(sizeof(Matrixf)*c);
+  world =(Matrixf*)malloc(sizeof(Matrixf)*c);
+  parent=(int32_t*)malloc(sizeof(int32_t)*c);
+  handle=(int32_t*)malloc(sizeof(int32_t)*c);
+  for(i=0;i<n;i++) if (order[i]>=0) {
+    local [order[i]]=_local_v[i];
+    world [order[i]]=_world_v[i];
+    parent[order[i]]=_parent_v[i]<0?-1:order[_parent_v[i]];
+    handle[order[i]]=_handle_v[i];
+    _slot_v[_handle_v[i]]=order[i];
+  }
+  free(depth);
+  
+  ARRAY_DESTROY(_local);
+  ARRAY_DESTROY(_world);
+  ARRAY_DESTROY(_parent);
+  ARRAY_DESTROY(_handle);
+  _local_v =local;  _local_n =_local_s =c;
+  _world_v =world;  _world_n =_world_s =c;
+  _parent_v=parent; _parent_n=_parent_s=c;
+  _handle_v=handle; _handle_n=_handle_s=c;
+  
+  _unsorted=0;
+}
+
+/** \brief r=a*b for column-major 4x4 matrices, r must not alias a or b.
+  *
+  * Each column of r is a linear combination of the columns of a, which
+  * vectorizes well. For row-major matrices, swap a and b.
+  */
+static void _matrixMul(float *r, const float *a, const float *b) {
+  int i, j;
+  for(j=0;j<4;j++) for(i=0;i<4;i++)
+    r[j*4+i]=
+      a[i   ]*b[j*4+0]+a[i+ 4]*b[j*4+1]+
+      a[i+ 8]*b[j*4+2]+a[i+12]*b[j*4+3];
+}
+
+void TransformStore::update() {
+  size_t i;
+  int32_t p;
+  
+  if (_unsorted) _sort();
+  
+  // parents precede their children, so their absolute transformation is
+  // always final by the time it is used.
+  for(i=0;i<_local_n;i++) {
+    p=_parent_v[i];
+    if (p<0) _world_v[i]=_local_v[i];
+    #if MATRIX_COLUMN_FIRST
+    else _matrixMul(&_world_v[i].a11,&_world_v[p].a11,&_local_v[i].a11);
+    #else
+    else _matrixMul(&_world_v[i].a11,&_local_v[i].a11,&_world_v[p].a11);
+    #endif
+  }
+  
+  _dirty=0;
+}
+
+
+// scene nodes at which scene_update_transforms starts: those not attached to
+// a TransformStore whose parent is either missing or attached.
+ARRAY_STATIC(ISceneNode*,_scene_roots);
+
+/** \brief A node skipped by the parallel part of scene_update_transforms. 
+  */
+struct scene_deferred_t {
+  ISceneNode *node;
+  int changed; ///< \brief Whether an ancestor changed.
+  int state;   ///< \brief 0: pending, 1: being updated, 2: updated.
+};
+
+ARRAY_STATIC(scene_deferred_t,_scene_deferred);
+
+static void _scene_roots_remove(ISceneNode *node) {
+  size_t idx;
+  for(idx=0;idx<_scene_roots_n;idx++) if (_scene_roots_v[idx]==node) {
+    _scene_roots_v[idx]=_scene_roots_v[--_scene_roots_n];
+    break;
+  }
+  if (!_scene_roots_n) {
+    ARRAY_DESTROY(_scene_roots);
+    ARRAY_DESTROY(_scene_deferred);
+  }
 }
 
 ISceneNode::ISceneNode(ISceneNode *parent) {
   ARRAY_INIT(_children);
+  _localTransform.setIdentity();
+  _absTransform.setIdentity();
+  _transformDirty=1;
+  _store=0;
+  _storeHandle=-1;
   if (parent) {
     grab();
     _parent=parent;
     APPEND(_parent->_children,this);
+    if (_parent->_store) APPEND(_scene_roots,this);
   } else {
     _parent=0;
+    APPEND(_scene_roots,this);
   }
 }
 
@@ -162,27 +620,247 @@ ISceneNode::~ISceneNode() {
     (*pchild)->drop();
   }
   ARRAY_DESTROY(_children);
+  
+  if (_store) {
+    _store->remove(_storeHandle);
+    _store->drop();
+  } else {
+    _scene_roots_remove(this);
+  }
 }
 
 ISceneNode *ISceneNode::parent() { return _parent; }
 
-Matrixf ISceneNode::absTransform() {
-  Matrixf r=transform();
+/** \brief Composes the absolute transformation from a local one.
+  *
+  * All of them are computed here, so the same inputs always give the same
+  * bits, which _parentMoved relies on.
+  */
+Matrixf ISceneNode::_absFromLocal(const Matrixf &local) {
+  return _parent?_parent->absTransform()*local:local;
+}
+
+const Matrixf &ISceneNode::absTransform() {
+  if (_store) return _store->world(_storeHandle);
+  
+  if (_transformDirty) {
+    _localTransform=transform();
+    _absTransform=_absFromLocal(_localTransform);
+    _transformDirty=0;
+    SDL_AtomicAdd(&_scene_transform_version,1);
+  }
+  
+  return _absTransform;
+}
+
+void ISceneNode::_invalidateAbs() {
+  size_t idx;
+  ISceneNode **pchild;
+  
+  // a node is only ever clean if its ancestors are, so whatever lies below
+  // a dirty node is dirty already.
+  if (!_store) {
+    if (_transformDirty) return;
+    _transformDirty=1;
+    SDL_AtomicAdd(&_scene_transform_version,1);
+  }
+  
+  FOREACH(idx,pchild,_children) (*pchild)->_invalidateAbs();
+}
+
+void ISceneNode::invalidateTransform() {
+  if (_store) _store->local(_storeHandle)=transform();
+  _invalidateAbs();
+}
+
+int ISceneNode::attachTransformStore(TransformStore *store) {
+  size_t idx;
+  ISceneNode **pchild;
+  
+  if (!store || _store) return 0;
+  if (_parent && (_parent->_store!=store)) return 0;
+  
+  _scene_roots_remove(this);
+  
+  _store=store;
+  _store->grab();
+  _storeHandle=_store->add(_parent?_parent->_storeHandle:-1);
+  _store->local(_storeHandle)=transform();
+  
+  // children not attached themselves are now updated on their own
+  FOREACH(idx,pchild,_children) 
+    if (!(*pchild)->_store) APPEND(_scene_roots,*pchild);
+  _invalidateAbs();
+  
+  return 1;
+}
+
+TransformStore *ISceneNode::transformStore() { return _store; }
+int ISceneNode::transformStoreHandle() { return _storeHandle; }
+
+int ISceneNode::transformDependency(ISceneNode** /*dependency*/) {
+  return 0;
+}
+
+/** \brief Updates this node and its subtree, unless it depends on other 
+  * nodes, in which case it is deferred to the serial part of 
+  * scene_update_transforms.
+  */
+int ISceneNode::_updateTransform(int changed) {
+  scene_deferred_t entry;
+  ISceneNode *dependency;
   
-  for(ISceneNode *n=_parent;n;n=n->_parent) 
-    r=n->transform()*r;
+  if (transformDependency(&dependency)) {
+    entry.node=this;
+    entry.changed=changed;
+    entry.state=0;
+    job_lock(JOB_LOCK_SCENE);
+    APPEND(_scene_deferred,entry);
+    job_unlock(JOB_LOCK_SCENE);
+    return 0;
+  }
+  
+  return _updateSubtree(changed);
+}
 
+int ISceneNode::_updateSubtree(int changed) {
+  size_t idx;
+  ISceneNode **pchild;
+  Matrixf local=transform();
+  int r;
+  
+  if (changed || _transformDirty 
+  || memcmp(&local,&_localTransform,sizeof(Matrixf))) {
+    _localTransform=local;
+    _absTransform=_absFromLocal(local);
+    _transformDirty=0;
+    changed=1;
+  }
+  
+  r=changed;
+  FOREACH(idx,pchild,_children) 
+    if (!(*pchild)->_store) r|=(*pchild)->_updateTransform(changed);
+  
   return r;
 }
 
+/** \brief Updates a deferred node, after any deferred node it depends on
+  * or below which the node it depends on lies.
+  *
+  * Entries may be appended while doing so, so they are referred to by 
+  * index. Cycles are broken by the state of the entries.
+  */
+int ISceneNode::_updateDeferred(size_t index) {
+  ISceneNode *node=_scene_deferred_v[index].node, *dependency, *p;
+  size_t idx;
+  int r=0;
+  
+  if (_scene_deferred_v[index].state) return 0;
+  _scene_deferred_v[index].state=1;
+  
+  if (node->transformDependency(&dependency) && dependency)
+    for(idx=0;idx<_scene_deferred_n;idx++) {
+      if (_scene_deferred_v[idx].state) continue;
+      for(p=dependency;p;p=p->parent()) 
+        if (p==_scene_deferred_v[idx].node) {
+          r|=_updateDeferred(idx);
+          break;
+        }
+    }
+  
+  r|=node->_updateSubtree(_scene_deferred_v[index].changed);
+  _scene_deferred_v[index].state=2;
+  
+  return r;
+}
+
+/** \brief Checks whether the absolute transformation of the parent changed
+  * since the cached one of this node was computed.
+  *
+  * Used for roots below a parent attached to a TransformStore, which may
+  * have moved them without any of their transformations changing.
+  */
+int ISceneNode::_parentMoved() {
+  Matrixf abs;
+  
+  if (!_parent || _transformDirty) return 0;
+  
+  abs=_absFromLocal(_localTransform);
+  return memcmp(&abs,&_absTransform,sizeof(Matrixf))!=0;
+}
+
+void ISceneNode::_updateRoots(void *arg, size_t begin, size_t end) {
+  ISceneNode **roots=(ISceneNode**)arg;
+  size_t idx;
+  int changed=0;
+  
+  for(idx=begin;idx<end;idx++) 
+    changed|=roots[idx]->_updateTransform(roots[idx]->_parentMoved());
+  
+  if (changed) SDL_AtomicAdd(&_scene_transform_version,1);
+}
+
+/** \brief Minimum number of roots updated per job. */
+#define SCENE_UPDATE_GRAIN 16
+
+void scene_update_transforms() {
+  size_t idx;
+  ISceneNode **proot;
+  int changed;
+  
+  // stores update lazily, which is done here rather than by whichever
+  // thread gets to them first.
+  FOREACH(idx,proot,_scene_roots) 
+    if ((*proot)->_parent) (*proot)->_parent->absTransform();
+  
+  // roots never share nodes, as the recursion stops at attached ones.
+  job_parallel_for(_scene_roots_n,SCENE_UPDATE_GRAIN,
+    ISceneNode::_updateRoots,_scene_roots_v);
+  
+  changed=0;
+  for(idx=0;idx<_scene_deferred_n;idx++) 
+    changed|=ISceneNode::_updateDeferred(idx);
+  _scene_deferred_n=0;
+  
+  if (changed) SDL_AtomicAdd(&_scene_transform_version,1);
+}
+
 
 IRenderableSceneNode::IRenderableSceneNode(ISceneNode *parent):
-  ISceneNode(parent) {
+  ISceneNode(parent), occluder(0) {
   
 }
 IRenderableSceneNode::~IRenderableSceneNode() {
 }
 
+Matrixf IRenderableSceneNode::geometryTransform() {
+  Matrixf r;
+  r.setIdentity();
+  return r;
+}
+
+int IRenderableSceneNode::bounds(Vector3f* /*bmin*/, Vector3f* /*bmax*/) {
+  return 0;
+}
+
+void IRenderableSceneNode::selectLOD(
+  SceneContext /*ctx*/, float /*pixelScale*/, float /*pixelError*/) {
+}
+
+int IRenderableSceneNode::occluderGeometry(
+  const Vector3f** /*positions*/, const u_int32_t** /*indices*/, 
+  size_t* /*indexCount*/) {
+  return 0;
+}
+
+void IRenderableSceneNode::enqueue(RenderQueue *queue) {
+  queue->addCustom(this);
+}
+
+void IRenderableSceneNode::applyQueued(
+  const render_item_t* /*item*/, SceneContext /*ctx*/) {
+}
+
 
 STSceneNode::STSceneNode(ISceneNode *parent) :
   ISceneNode(parent)
@@ -192,6 +870,19 @@ STSceneNode::STSceneNode(ISceneNode *parent) :
 STSceneNode::~STSceneNode() {
 }
 
+LightSceneNode::LightSceneNode(ISceneNode *parent) :
+  STSceneNode(parent)
+  {
+  param.ambient_c.set(0,0,0);
+  param.diffuse_c.set(1,1,1);
+  param.specular_c.set(1,1,1);
+  param.falloff_factor=0;
+  param.flags=0;
+  param.range=0;
+}
+LightSceneNode::~LightSceneNode() {
+}
+
 Matrixf STSceneNode::transform() {
   return staticTransform;
 }
@@ -213,6 +904,11 @@ Matrixf CameraFollowerSceneNode::transform() {
   return M;
 }
 
+int CameraFollowerSceneNode::transformDependency(ISceneNode **dependency) {
+  *dependency=dynamic_cast<ISceneNode*>(_contextSource);
+  return 1;
+}
+
 
 
 LissajousSceneNode::LissajousSceneNode(ISceneNode *parent) :
@@ -243,9 +939,17 @@ void LissajousSceneNode::iterate(double dt, double t) {
   _transform.a34=p.z;
 }
 
+int LissajousSceneNode::concurrent() { return 1; }
+
+void LissajousSceneNode::sync() {
+  invalidateTransform();
+}
+
 #ifdef DEBUG_DIYYMA_SPLINES
 CubicBezierSceneNode::CubicBezierSceneNode(ISceneNode *parent) :
-  IRenderableSceneNode(parent)
+  IRenderableSceneNode(parent),
+  _debugLinkId(0),
+  _u_MVP(-1)
   {
 #else
 CubicBezierSceneNode::CubicBezierSceneNode(ISceneNode *parent) :
@@ -278,9 +982,14 @@ Matrixf CubicBezierSceneNode::transform() {
 }
 
 void CubicBezierSceneNode::iterate(double dt, double t) {
-  if (_path) {
+  if (_path) 
     _transform=_path->transformation((t-timeOffset)*timeScale,loop);
-  }
+}
+
+int CubicBezierSceneNode::concurrent() { return 1; }
+
+void CubicBezierSceneNode::sync() {
+  if (_path) invalidateTransform();
 }
 
 #ifdef DEBUG_DIYYMA_SPLINES
@@ -295,8 +1004,12 @@ void CubicBezierSceneNode::render(SceneContext ctx) {
   if (parent()) ctx.MVP*=parent()->absTransform();
   
   shd=reg_shd()->get("debug-linestrip");
+  if (shd->linkId()!=_debugLinkId) {
+    _debugLinkId=shd->linkId();
+    _u_MVP=shd->locate("u_MVP",GL_FLOAT_MAT4);
+  }
   shd->bind();
-  glUniformMatrix4fv(shd->locate("u_MVP"),1,0,&ctx.MVP.a11);
+  glUniformMatrix4fv(_u_MVP,1,0,&ctx.MVP.a11);
   
   nSegments=_path->segmentCount();
   
@@ -343,6 +1056,21 @@ SceneContext CameraSceneNode::context() {
 void CameraSceneNode::iterate(double dt, double t) { time=t; }
 
 
+/** \brief Activates the lights of a controller which reach the bounds of
+  * a node, or all of them if the node has no bounds.
+  */
+static void _activateLights(ILightController *lc, 
+  IRenderableSceneNode *node, Shader *shd, const SceneContext &ctx) {
+  Vector3f bmin, bmax;
+  
+  if (!node->bounds(&bmin,&bmax)) {
+    lc->activate(shd,ctx);
+    return;
+  }
+  bvh_transform_box(node->absTransform(),&bmin,&bmax);
+  lc->activate(shd,ctx,bmin,bmax);
+}
+
 STSTMSceneNode::STSTMSceneNode(ISceneNode *parent) : 
   IRenderableSceneNode(parent),
   IShaderReferrer(),
@@ -354,7 +1082,8 @@ STSTMSceneNode::STSTMSceneNode(ISceneNode *parent) :
   _u_V(-1),
   _u_P(-1),
   _u_time(-1),
-  _u_camPos_w(-1)
+  _u_camPos_w(-1),
+  _lod(0)
   {
   staticTransform.setIdentity();
   _shaderReferrer=this;
@@ -380,7 +1109,7 @@ void STSTMSceneNode::render(SceneContext ctx) {
   Matrixf M;
   if (!_mesh) return;
   
-  M=absTransform();
+  M=absTransform()*_mesh->positionTransform();
   ctx.M=M;
   ctx.MV*=M;
   ctx.MVP*=M;
@@ -395,7 +1124,7 @@ void STSTMSceneNode::render(SceneContext ctx) {
     if (_textures[i]) _textures[i]->bind();
   
   _mesh->bind();
-  _mesh->send();
+  _mesh->sendLOD(_lod);
   _mesh->unbind();
   
   Texture::Unbind();
@@ -408,10 +1137,59 @@ void STSTMSceneNode::render(SceneContext ctx) {
 void STSTMSceneNode::sendGeometry() {
   if (!_mesh) return;
   _mesh->bind();
-  _mesh->send();
+  _mesh->sendLOD(_lod);
   _mesh->unbind();
 }
 
+Matrixf STSTMSceneNode::geometryTransform() {
+  if (!_mesh) return IRenderableSceneNode::geometryTransform();
+  return _mesh->positionTransform();
+}
+
+int STSTMSceneNode::bounds(Vector3f *bmin, Vector3f *bmax) {
+  if (!_mesh) return 0;
+  _mesh->bounds(bmin,bmax);
+  return 1;
+}
+
+void STSTMSceneNode::selectLOD(
+  SceneContext ctx, float pixelScale, float pixelError) {
+  if (!_mesh) return;
+  _lod=_mesh->selectLOD(ctx.MVP*absTransform(),pixelScale,pixelError,_lod);
+}
+
+int STSTMSceneNode::occluderGeometry(const Vector3f **positions, 
+  const u_int32_t **indices, size_t *indexCount) {
+  if (!_mesh) return 0;
+  return _mesh->occluder(positions,indices,indexCount);
+}
+
+void STSTMSceneNode::enqueue(RenderQueue *queue) {
+  render_item_t *item;
+  int i;
+  
+  if (!_mesh) return;
+  if (!_shader) {
+    queue->addCustom(this);
+    return;
+  }
+  
+  item=queue->add(this);
+  item->shader=_shader;
+  for(i=0;i<RENDERQUEUE_TEXTURES;i++) {
+    item->textures[i]=texture(i);
+    item->textureLocs[i]=textureLocation(i);
+  }
+  item->mesh=_mesh;
+  item->lod=_lod;
+  item->M=absTransform()*_mesh->positionTransform();
+}
+
+void STSTMSceneNode::applyQueued(
+  const render_item_t* /*item*/, SceneContext ctx) {
+  applyUniforms(ctx);
+}
+
 Matrixf STSTMSceneNode::transform() {
   return staticTransform;
 }
@@ -424,13 +1202,14 @@ void STSTMSceneNode::applyUniforms(SceneContext ctx) {
   if (-1!=_u_MVP ) glUniformMatrix4fv(_u_MVP,1,0,&ctx.MVP.a11);
   if (-1!=_u_time) glUniform1f(_u_time,ctx.time);
   if (-1!=_u_camPos_w) glUniform3fv(_u_camPos_w,1,&ctx.camPos_w.x);
-  if (_lightController) _lightController->activate(_shader,ctx);
+  if (_lightController) _activateLights(_lightController,this,_shader,ctx);
   
 }
 
 STMMSceneNode::STMMSceneNode(ISceneNode *parent) : 
   IRenderableSceneNode(parent),
-  IStaticMeshReferrer()
+  IStaticMeshReferrer(),
+  _lod(0)
   {
   staticTransform.setIdentity();
 }
@@ -443,12 +1222,13 @@ void STMMSceneNode::render(SceneContext ctx) {
   Material *mat;
   Matrixf M;
   
-  M=absTransform();
+  if (!_mesh) return;
+  
+  M=absTransform()*_mesh->positionTransform();
   ctx.M=M;
   ctx.MV*=M;
   ctx.MVP*=M;
   
-  if (!_mesh) return;
   if (_lightController) {
     _mesh->bind();
     nmat=_mesh->materialCount();
@@ -456,23 +1236,80 @@ void STMMSceneNode::render(SceneContext ctx) {
       mat=_mesh->material(idx).mat;
       if (!mat->shader()) continue;
       mat->bind(ctx);
-      if (mat->shader()) _lightController->activate(mat->shader(),ctx);
-      _mesh->send(idx);
+      _activateLights(_lightController,this,mat->shader(),ctx);
+      _mesh->send(idx,_lod);
       mat->unbind();
     }
     _mesh->unbind();
   } else {
-    _mesh->render(ctx);
+    _mesh->render(ctx,_lod);
   }
   
 }
 void STMMSceneNode::sendGeometry() {
   if (!_mesh) return;
   _mesh->bind();
-  _mesh->send();
+  _mesh->sendLOD(_lod);
   _mesh->unbind();
 }
 
+Matrixf STMMSceneNode::geometryTransform() {
+  if (!_mesh) return IRenderableSceneNode::geometryTransform();
+  return _mesh->positionTransform();
+}
+
+int STMMSceneNode::bounds(Vector3f *bmin, Vector3f *bmax) {
+  if (!_mesh) return 0;
+  _mesh->bounds(bmin,bmax);
+  return 1;
+}
+
+void STMMSceneNode::selectLOD(
+  SceneContext ctx, float pixelScale, float pixelError) {
+  if (!_mesh) return;
+  _lod=_mesh->selectLOD(ctx.MVP*absTransform(),pixelScale,pixelError,_lod);
+}
+
+int STMMSceneNode::occluderGeometry(const Vector3f **positions, 
+  const u_int32_t **indices, size_t *indexCount) {
+  if (!_mesh) return 0;
+  return _mesh->occluder(positions,indices,indexCount);
+}
+
+void STMMSceneNode::enqueue(RenderQueue *queue) {
+  render_item_t *item;
+  Material *mat;
+  size_t idx, nmat;
+  int i;
+  
+  if (!_mesh) return;
+  
+  nmat=_mesh->materialCount();
+  for(idx=0;idx<nmat;idx++) {
+    mat=_mesh->material(idx).mat;
+    if (!mat->shader()) continue;
+    
+    item=queue->add(this);
+    item->shader=mat->shader();
+    for(i=0;i<RENDERQUEUE_TEXTURES;i++) {
+      item->textures[i]=mat->texture(i);
+      item->textureLocs[i]=mat->textureLocation(i);
+    }
+    item->mesh=_mesh;
+    item->slice=idx;
+    item->lod=_lod;
+    item->M=absTransform()*_mesh->positionTransform();
+    item->data=mat;
+  }
+}
+
+void STMMSceneNode::applyQueued(const render_item_t *item, SceneContext ctx) {
+  Material *mat=(Material*)item->data;
+  mat->applyUniforms(ctx);
+  if (_lightController)
+    _activateLights(_lightController,this,mat->shader(),ctx);
+}
+
 Matrixf STMMSceneNode::transform() {
   return staticTransform;
 }
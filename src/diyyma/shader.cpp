@@ -14,28 +14,38 @@
 #include "GL/glew.h"
 
 #include "diyyma/shader.h"
+#include "diyyma/uniform.h"
+#include "diyyma/preprocessor.h"
 
 
 #include "diyyma/util.h"
 
 
-Shader::Shader(): _linked(0) {
+Shader::Shader(): 
+  _linked(0), _pending(0), _pendingKey(0), _linkId(0), _blocks(0) {
   int i;
   
   for(i=0;i<SHADER_PROGRAM_COUNT;i++) {
     _shader[i]=0;
     _sourceFiles[i]=0;
+    _lineFiles[i]=0;
+    _preparedFiles[i]=0;
+    _preparedCode[i]=0;
   }
   _program=glCreateProgram();
   _transformFeedbackMode=GL_SEPARATE_ATTRIBS;
   ARRAY_INIT(_transformFeedbackVaryings);
 }
 
-Shader::Shader(const char *basename): _linked(0) {
+Shader::Shader(const char *basename): 
+  _linked(0), _pending(0), _pendingKey(0), _linkId(0), _blocks(0) {
   int i;
   for(i=0;i<SHADER_PROGRAM_COUNT;i++) {
     _shader[i]=0;
     _sourceFiles[i]=0;
+    _lineFiles[i]=0;
+    _preparedFiles[i]=0;
+    _preparedCode[i]=0;
   }
   _program=glCreateProgram();
   _transformFeedbackMode=GL_SEPARATE_ATTRIBS;
@@ -43,11 +53,15 @@ Shader::Shader(const char *basename): _linked(0) {
   load(basename,0);
 }
 
-Shader::Shader(const char *vsd, const char *fsd, const char *gsd): _linked(0) {
+Shader::Shader(const char *vsd, const char *fsd, const char *gsd): 
+  _linked(0), _pending(0), _pendingKey(0), _linkId(0), _blocks(0) {
   int i;
   for(i=0;i<SHADER_PROGRAM_COUNT;i++) {
     _shader[i]=0;
     _sourceFiles[i]=0;
+    _lineFiles[i]=0;
+    _preparedFiles[i]=0;
+    _preparedCode[i]=0;
   }
   _program=glCreateProgram();
   _transformFeedbackMode=GL_SEPARATE_ATTRIBS;
@@ -65,6 +79,8 @@ Shader::~Shader() {
   int i;
   size_t idx;
   char **pstr;
+  
+  _cancel();
   for(i=0;i<SHADER_PROGRAM_COUNT;i++) if (_shader[i]) {
     glDetachShader(_program,_shader[i]);
     glDeleteShader(_shader[i]);
@@ -76,293 +92,283 @@ Shader::~Shader() {
     glDeleteProgram(_program);
   }
   
+  _releasePrepared();
+  
   FOREACH(idx,pstr,_transformFeedbackVaryings)
-    free((void*)pstr);
+    free((void*)*pstr);
   ARRAY_DESTROY(_transformFeedbackVaryings);
 }
 
 GLuint Shader::program() {
+  if (_pending) resolve();
   return _program;
 }
 
-GLint Shader::locate(const char *id) {
-  return glGetUniformLocation(_program,id);
-}
-
-
-int Shader::_preprocess(
-  int subject_idx, 
-  void ***code_v, size_t **code_cb_v, char ***files_v, size_t *code_n,
-  int repositoryMask) {
-  
-  LineScanner *ln;
-  SubString str;
-  
-  char *fn_new=0;
-  size_t cb_new;
-  void *data_new;
-  
-  char *p,*e, *fn_start, *q, *fn;
-  char *subject, *include_start, *include_end;
-  size_t cc_fn;
-  size_t i;
-  size_t cc=(*code_cb_v)[subject_idx];
-  
-  int n_added=0;
-  
-  subject=(char*)(*code_v)[subject_idx];
-  p=subject; 
-  e=subject+cc;
-  
-  char *loop_start=0;
-  char *loop_pragma=0;
-  long loop_count=0;
-  
-  while(p+11<e) {
-    if ((*p<' ')&&(*p!='\t')&&(p[1]=='#')) {
-      if (strncmp(p+2,"include ",8)==0) {
-        // remember begin of #include and skip ahead
-        include_start=p+1;
-        p+=9;
-        
-        
-        while((p<e)&&((*p==' ')||(*p=='\t'))) p++;
-        
-        // read file name
-        fn_start=p;
-        while((p<e)&&(*p>' ')) p++;
-        if ((p>=e) || (p==fn_start)) {
-          LOG_WARNING("WARNING: file name expected in #include directive\n");
-          goto next;
-        }
-        include_end=p;
-        cc_fn=(size_t)include_end-(size_t)fn_start;
-        
-        fn=(char*)malloc(cc_fn+1);
-        
-        memcpy(fn,fn_start,cc_fn);
-        fn[cc_fn]=0;
-        
-        // include files only once
-        for(i=0;i<*code_n;i++) if ((*files_v)[i]&&strcmp((*files_v)[i],fn)==0) {
-          goto finalize_stmt;
-        }
-        
-        
-        if (!(fn_new=vfs_locate(fn,repositoryMask))) {
-          LOG_WARNING(
-            "WARNING: unable to located #include'd file '%s'\n",
-            fn);
-          goto finalize_stmt;
-        }
-        
-        
-        
-        if (!readFile(fn_new,&data_new,&cb_new)) {
-          free((void*)fn_new);
-          LOG_WARNING(
-            "WARNING: unable to load #include'd file '%s' ('%s')\n",
-            fn,fn_new);
-          goto finalize_stmt;
-        }
-        
-        
-        // split the code apart:
-        // code_v[ 0 .. subject_idx-1 ]
-        // code before #include
-        // included code
-        // code after #include
-        // code_v [ subject_idx+1 .. $ ]
-        //
-        // this adds two more pieces of code
-        (*code_n)+=2;
-        n_added+=2;
-        
-        
-        // allocate new arrays
-        *code_v   =(void** )realloc((void*)*code_v,   (*code_n)*sizeof(void*));
-        *code_cb_v=(size_t*)realloc((void*)*code_cb_v,(*code_n)*sizeof(size_t*));
-        *files_v  =(char** )realloc((void*)*files_v,  (*code_n)*sizeof(char*));
-        
-        // shift following files down
-        for(i=*code_n-1;i>subject_idx+1;i--) {
-          (*code_v   )[i]=(*code_v   )[i-2];
-          (*code_cb_v)[i]=(*code_cb_v)[i-2];
-          (*files_v  )[i]=(*files_v  )[i-2];
-        }
-        
-        (*code_cb_v)[subject_idx]=(size_t)include_start-(size_t)subject;
-        
-        (*code_v   )[subject_idx+1]=data_new;
-        (*code_cb_v)[subject_idx+1]=cb_new;
-        (*files_v  )[subject_idx+1]=fn_new;
-        
-        (*code_v   )[subject_idx+2]=include_end;
-        (*code_cb_v)[subject_idx+2]=(size_t)e-(size_t)include_end;
-        // set the file name only if it is the beginning and thus can be freed.
-        (*files_v  )[subject_idx+2]=0;
-        
-        subject=include_end;
-        subject_idx+=2;
-        
-        subject_idx+=_preprocess(
-          subject_idx-1,
-          code_v,code_cb_v,files_v,code_n,
-          repositoryMask);
-        
-        finalize_stmt:
-        
-        memset(include_start,' ',(size_t)include_end-(size_t)include_start);
-        
-        free((void*)fn);
-        
-        p--;
-        
-      } else if (strncmp(p+2,"pragma ",7)==0) {
-        ln=LineScanner::GetTemporary();
-        ln->assign(p+9,e);
-        
-        if (!ln->getLnFirstString(&str)) goto finalize_pragma;
-        
-        if (str=="TFB") {
-          if (!ln->getLnString(&str)) goto finalize_pragma;
-          if (str=="mode") {
-            if (!ln->getLnString(&str)) goto finalize_pragma;
-            if (str=="separate") 
-              _transformFeedbackMode=GL_SEPARATE_ATTRIBS;
-            else if (str=="interleaved")
-              _transformFeedbackMode=GL_INTERLEAVED_ATTRIBS;
-            else
-              LOG_WARNING(
-                "WARNING: unrecognized TFB mode '%.*s' in shader source %s.\n",
-                str.length,str.ptr,
-                (*files_v)[subject_idx]);
-                
-          } else if (str=="varying") {
-            if (!ln->getLnString(&str)) goto finalize_pragma;
-            APPEND(_transformFeedbackVaryings,str.dup());
-          }
-          
-        } else if (str=="loop-begin") {
-          if (loop_start) {
-            LOG_WARNING(
-              "WARNING: Nested pragma loops not supported (source: %s)\n",
-              (*files_v)[subject_idx]);
-            goto finalize_pragma;
-          }
-          
-          if (!ln->getLong(&loop_count,1) || (loop_count<1)) {
-            LOG_WARNING(
-              "WARNING: loop-begin without valid loop count (source: %s)\n",
-              (*files_v)[subject_idx]);
-            goto finalize_pragma;
-          }
-          ln->seekNewLine(0);
-          loop_pragma=p;
-          loop_start=p+ln->tell()+8;
-          
-          
-        } else if (str=="loop-end") {
-          if (!loop_start) {
-            LOG_WARNING(
-              "WARNING: loop-end without loop-begin (source: %s)\n",
-              (*files_v)[subject_idx]);
-            goto finalize_pragma;
-          }
-          
-          ln->seekNewLine(9);
-          
-          // insert the looped code loop_count times and append the remainder
-          (*code_n)+=loop_count+1;
-          n_added+=loop_count+1;
-          
-          // allocate new arrays
-          *code_v   =(void** )realloc((void*)*code_v,   (*code_n)*sizeof(void*));
-          *code_cb_v=(size_t*)realloc((void*)*code_cb_v,(*code_n)*sizeof(size_t*));
-          *files_v  =(char** )realloc((void*)*files_v,  (*code_n)*sizeof(char*));
-          
-          // shift following files down
-          for(i=*code_n-1;i>subject_idx+loop_count;i--) {
-            (*code_v   )[i]=(*code_v   )[i-loop_count-1];
-            (*code_cb_v)[i]=(*code_cb_v)[i-loop_count-1];
-            (*files_v  )[i]=(*files_v  )[i-loop_count-1];
-          }
-          
-          (*code_cb_v)[subject_idx]=(size_t)loop_pragma-(size_t)subject;
-          
-          subject_idx++;
-          
-          for(i=0;i<loop_count;i++) {
-            (*code_v   )[subject_idx]=loop_start;
-            (*code_cb_v)[subject_idx]=(size_t)p-(size_t)loop_start+1;
-            (*files_v  )[subject_idx]=0;
-            
-            subject_idx++;
-          }
-          
-          subject=p+ln->tell()+8;
-          
-          (*code_v   )[subject_idx]=subject;
-          (*code_cb_v)[subject_idx]=(size_t)e-(size_t)subject;
-          (*files_v  )[subject_idx]=0;
-          
-          loop_start=0;
-          loop_pragma=0;
-          loop_count=0;
-          
-        }
-        
-        finalize_pragma:
-        ln->seekNewLine(0);
-        p=p+ln->tell()+7;
-        
-        ln->drop();
-      }
-      next: ;
+// source of Shader::linkId, 0 is never handed out
+static unsigned _shader_link_id=0;
+
+// shaders compiled by finish whose status was not checked yet
+ARRAY_STATIC(Shader*,_shader_pending);
+
+ShaderUniforms::ShaderUniforms() {
+  ARRAY_INIT(_uniforms);
+}
+
+ShaderUniforms::~ShaderUniforms() {
+  clear();
+}
+
+void ShaderUniforms::clear() {
+  size_t idx;
+  ShaderUniform *pu;
+  
+  FOREACH(idx,pu,_uniforms)
+    free((void*)pu->name);
+  ARRAY_DESTROY(_uniforms);
+  _index.clear();
+}
+
+void ShaderUniforms::_add(
+  const char *name, GLint location, GLenum type, GLint size) {
+  ShaderUniform u;
+  
+  u.name    =strdup(name);
+  u.location=location;
+  u.type    =type;
+  u.size    =size;
+  APPEND(_uniforms,u);
+  
+  // the index keeps the copied name, which does not move with the array
+  _index.insert(u.name,_uniforms_n-1);
+}
+
+void ShaderUniforms::add(const char *name, GLenum type, GLint size,
+  shader_locate_t locate, void *arg) {
+  size_t length=strlen(name), cc=length+16;
+  char *base, *element;
+  GLint location, j;
+  
+  location=locate(name,arg);
+  _add(name,location,type,size);
+  
+  // arrays are reported as name[0], further elements are looked up here
+  // once, as their locations need not be consecutive.
+  if ((length<4) || (strcmp(name+length-3,"[0]")!=0)) return;
+  
+  base=strdup(name);
+  base[length-3]=0;
+  element=(char*)malloc(cc);
+  
+  _add(base,location,type,size);
+  for(j=1;j<size;j++) {
+    _snprintf(element,cc,"%s[%i]",base,j);
+    _add(element,locate(element,arg),type,size-j);
+  }
+  
+  free((void*)base);
+  free((void*)element);
+}
+
+GLint ShaderUniforms::locate(const char *id) {
+  size_t idx;
+  
+  if (!_index.find(id,&idx)) return -1;
+  return _uniforms_v[idx].location;
+}
+
+GLint ShaderUniforms::locate(const char *id, GLenum type) {
+  size_t idx;
+  ShaderUniform *pu;
+  
+  if (!_index.find(id,&idx)) return -1;
+  
+  pu=_uniforms_v+idx;
+  if (pu->type!=type) {
+    if (pu->location!=-1) {
+      LOG_WARNING(
+        "WARNING: shader uniform '%s' is of type 0x%x, expected 0x%x\n",
+        id,(unsigned)pu->type,(unsigned)type);
+      // stays inactive for all further lookups of this link
+      pu->location=-1;
     }
-    p++;
-    
+    return -1;
   }
   
-  return n_added;
+  return pu->location;
+}
+
+const ShaderUniform *ShaderUniforms::find(const char *id) {
+  size_t idx;
+  
+  if (!_index.find(id,&idx)) return 0;
+  return _uniforms_v+idx;
+}
+
+size_t ShaderUniforms::count() { return _uniforms_n; }
+
+static GLint _locateUniform(const char *name, void *arg) {
+  return glGetUniformLocation(*(GLuint*)arg,name);
 }
 
-void Shader::_preprocess(
-  const char *subject, size_t cc, 
-  void ***code_v, size_t **code_cb_v, char ***files_v, size_t *code_n,
-  int repositoryMask) {
+/** \brief Reads all active uniforms of the linked program into the hashed
+  * uniform table.
+  */
+void Shader::_introspect() {
+  GLint count=0, cc=0, size, i;
+  GLsizei length;
+  GLenum type;
+  char *name;
   
-  if (!cc) cc=strlen(subject);
-  if (!cc) return;
+  _uniforms.clear();
   
-  (*code_n)=1;
+  glGetProgramiv(_program,GL_ACTIVE_UNIFORMS,&count);
+  glGetProgramiv(_program,GL_ACTIVE_UNIFORM_MAX_LENGTH,&cc);
+  if (count<1) return;
   
-  *code_v   =(void** )malloc((*code_n)*sizeof(void*));
-  *code_cb_v=(size_t*)malloc((*code_n)*sizeof(size_t*));
-  *files_v  =(char** )malloc((*code_n)*sizeof(char*));
+  name=(char*)malloc(cc+1);
   
-  (*code_v   )[0]=(void*)strdup(subject);
-  (*code_cb_v)[0]=cc;
-  (*files_v  )[0]=0;
+  for(i=0;i<count;i++) {
+    length=0;
+    glGetActiveUniform(_program,i,cc+1,&length,&size,&type,name);
+    name[length]=0;
+    _uniforms.add(name,type,size,_locateUniform,(void*)&_program);
+  }
   
-  _preprocess(
-    0,
-    code_v,code_cb_v,files_v,code_n,
-    repositoryMask);
+  free((void*)name);
 }
 
-int Shader::attach(const char *code, size_t cc, int mode) {
-  int idx;
+GLint Shader::locate(const char *id) {
+  if (_pending) resolve();
+  return _uniforms.locate(id);
+}
+
+GLint Shader::locate(const char *id, GLenum type) {
+  if (_pending) resolve();
+  return _uniforms.locate(id,type);
+}
+
+const ShaderUniform *Shader::uniform(const char *id) {
+  if (_pending) resolve();
+  return _uniforms.find(id);
+}
+
+unsigned Shader::linkId() {
+  if (_pending) resolve();
+  return _linkId;
+}
+
+void Shader::_bindBlocks() {
+  GLint count=0, cc=0, i, binding;
+  GLsizei length;
+  char *name;
+  
+  _blocks=0;
+  if (!GLEW_VERSION_3_1 && !GLEW_ARB_uniform_buffer_object) return;
+  
+  glGetProgramiv(_program,GL_ACTIVE_UNIFORM_BLOCKS,&count);
+  glGetProgramiv(_program,GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH,&cc);
+  if (count<1) return;
+  
+  name=(char*)malloc(cc+1);
+  for(i=0;i<count;i++) {
+    length=0;
+    glGetActiveUniformBlockName(_program,i,cc+1,&length,name);
+    name[length]=0;
+    if (-1==(binding=uniform_block_binding(name))) continue;
+    glUniformBlockBinding(_program,i,binding);
+    _blocks|=1<<binding;
+  }
+  free((void*)name);
+}
+
+int Shader::usesBlock(GLuint binding) {
+  if (_pending) resolve();
+  return binding<32 && (_blocks&(1u<<binding));
+}
+
+
+/** \brief Takes over the transform feedback setup requested through
+  * pragmas.
+  */
+void Shader::_applyPragmas(ShaderPreprocessor *pp) {
+  size_t idx;
+  
+  if (pp->tfbMode()==PREPROCESSOR_TFB_SEPARATE)
+    _transformFeedbackMode=GL_SEPARATE_ATTRIBS;
+  else if (pp->tfbMode()==PREPROCESSOR_TFB_INTERLEAVED)
+    _transformFeedbackMode=GL_INTERLEAVED_ATTRIBS;
+  
+  for(idx=0;idx<pp->varyingCount();idx++)
+    APPEND(_transformFeedbackVaryings,strdup(pp->varying(idx)));
+}
+
+/** \brief Compiles preprocessed code and attaches it.
+  *
+  * \param wait If zero, the compile status is not checked here but by
+  * resolve, so the driver need not finish compiling right away.
+  */
+int Shader::_compile(int idx, ShaderPreprocessor *pp, int wait) {
   GLuint shd;
+  size_t i, cb=1;
+  char   *p;
+  
+  shd=glCreateShader(SHADER_MODE(idx));
+  glShaderSource(shd,pp->count(),(const GLchar**)pp->strings(),
+    (const GLint*)pp->lengths());
+  
+  glCompileShader(shd);
+  glAttachShader(_program,shd);
+  _shader[idx]=shd;
+  
+  // messages refer to files by their #line source string number, the
+  // names are kept until the status is checked.
+  if (_lineFiles[idx]) free((void*)_lineFiles[idx]);
+  _lineFiles[idx]=0;
+  if (pp->fileCount()>1) {
+    for(i=1;i<pp->fileCount();i++) cb+=strlen(pp->file(i))+16;
+    _lineFiles[idx]=p=(char*)malloc(cb);
+    *p=0;
+    for(i=1;i<pp->fileCount();i++)
+      p+=sprintf(p,"  %i: %s\n",(int)i,pp->file(i));
+  }
+  
+  if (!wait) return 1;
+  return _compileStatus(idx);
+}
+
+/** \brief Checks whether a stage compiled, detaching and deleting it if 
+  * not.
+  */
+int Shader::_compileStatus(int idx) {
   GLint  r = 0;
   GLint  ccLog;
   char   *log;
   
-  size_t i;
-  void **code_v;
-  size_t *code_cb_v;
-  char **files_v;
-  size_t code_n;
+  glGetShaderiv(_shader[idx],GL_COMPILE_STATUS,&r);
+  if (r!=GL_TRUE) {
+    glGetShaderiv(_shader[idx],GL_INFO_LOG_LENGTH,&ccLog);
+    log=(char*)malloc(ccLog+1);
+    glGetShaderInfoLog(_shader[idx],ccLog+1,&ccLog,log);
+    LOG_WARNING(
+      "WARNING: shader %s program %i compilation error:\n  %s\n",
+      _sourceFiles[idx],idx, log);
+    if (_lineFiles[idx]) LOG_WARNING("%s",_lineFiles[idx]);
+    
+    free((void*)log);
+    glDetachShader(_program,_shader[idx]);
+    glDeleteShader(_shader[idx]);
+    _shader[idx]=0;
+  }
+  
+  if (_lineFiles[idx]) free((void*)_lineFiles[idx]);
+  _lineFiles[idx]=0;
+  
+  return r==GL_TRUE;
+}
+
+int Shader::attach(const char *code, size_t cc, int mode) {
+  int idx;
+  ShaderPreprocessor pp(REPOSITORY_MASK_SHADER);
   
   if ((idx=SHADER_INDEX(mode))==-1) {
     LOG_WARNING("WARNING: invalid shader program mode: %i\n",mode);
@@ -380,47 +386,41 @@ int Shader::attach(const char *code, size_t cc, int mode) {
     return 0;
   }
   
-  shd=glCreateShader(mode);
-  
-  _preprocess(
-    code,cc,
-    &code_v,&code_cb_v,&files_v,&code_n,
-    REPOSITORY_MASK_SHADER);
-    
+  if (!pp.run(code,cc,_sourceFiles[idx])) return 0;
+  _applyPragmas(&pp);
   
-  glShaderSource(shd,code_n,(const char**)code_v,(const int*)code_cb_v);
+  return _compile(idx,&pp,1);
+}
+
+/** \brief File name extensions of shader source files by SHADER_INDEX_* */
+static const char *_shaderExtensions[SHADER_PROGRAM_COUNT]={
+  "vsd", "gsd", "fsd"
+};
+
+/** \brief Locates and reads a shader source file.
+  *
+  * \param fn Receives the located file name.
+  * \return 1 on success, 0 otherwise. Nothing is allocated on error.
+  */
+static int _readShaderFile(
+  const char *fn_in, char **fn, void **data, size_t *cb) {
   
-  for(i=0;i<code_n;i++) if (files_v[i]) {
-    free((void*)code_v[i]);
-    if (files_v[i]) free((void*)files_v[i]);
+  if (!(*fn=vfs_locate(fn_in,REPOSITORY_MASK_SHADER))) {
+    LOG_WARNING(
+      "WARNING: unable to find shader source file %s\n",
+      fn_in);
+    return 0;
   }
   
-  free((void*)code_v);
-  free((void*)code_cb_v);
-  free((void*)files_v);
-  
-  
-  //glShaderSource(shd,1,&code,&ccCode);
-  glCompileShader(shd);
-  
-  glGetShaderiv(shd,GL_COMPILE_STATUS,&r);
-  if (r!=GL_TRUE) {
-    glGetShaderiv(shd,GL_INFO_LOG_LENGTH,&ccLog);
-    log=(char*)malloc(ccLog+1);
-    glGetShaderInfoLog(shd,ccLog+1,&ccLog,log);
+  if (!readFile(*fn,data,cb)) {
     LOG_WARNING(
-      "WARNING: shader %s program %i compilation error:\n  %s\n",
-      _sourceFiles[idx],idx, log);
-    
-    free((void*)log);
+      "WARNING: unable to read shader source file %s\n",
+      *fn);
+    free((void*)*fn);
+    *fn=0;
     return 0;
   }
   
-  glAttachShader(_program,shd);
-  
-  
-  _shader[idx]=shd;
-  
   return 1;
 }
 
@@ -433,22 +433,11 @@ int Shader::attachFile(const char *fn_in, int mode) {
   
   if ((idx=SHADER_INDEX(mode))==-1) {
     LOG_WARNING("WARNING: invalid shader program mode: %i\n",mode);
-    goto finalize;
-  }
-  
-  if (!(fn=vfs_locate(fn_in,REPOSITORY_MASK_SHADER))) {
-    LOG_WARNING(
-      "WARNING: unable to find shader source file %s\n",
-      fn_in);
-    goto finalize;
+    return 0;
   }
   
-  if (!(r=readFile(fn,&data,&cb))) {
-    LOG_WARNING(
-      "WARNING: unable to read shader source file %s\n",
-      fn);
-    goto finalize;
-  }
+  if (!_readShaderFile(fn_in,&fn,&data,&cb))
+    return 0;
   
   if (_sourceFiles[idx]) {
     free((void*)_sourceFiles[idx]);
@@ -457,19 +446,13 @@ int Shader::attachFile(const char *fn_in, int mode) {
   
   r=attach((char*)data,cb,mode);
   
-  fn=0;
-  
-  finalize:
-  
-  if (fn) free((void*)fn);
-  if (data) free(data);
+  free(data);
   
   return r;
 }
 
 int Shader::link() {
-  GLint  ccLog=0;
-  char   *log;
+  if (_pending) return resolve();
   
   if (_linked) {
     LOG_WARNING(
@@ -477,6 +460,18 @@ int Shader::link() {
     return 1;
   }
   
+  _submitLink();
+  if (!_linkStatus()) return 0;
+  
+  _onLinked();
+  
+  return 1;
+  
+}
+
+void Shader::_submitLink() {
+  _uniforms.clear();
+  
   if (_transformFeedbackVaryings_n) {
     glTransformFeedbackVaryings(
       _program,
@@ -486,27 +481,94 @@ int Shader::link() {
   }
   
   
+  if (shader_cache_enabled())
+    glProgramParameteri(_program,GL_PROGRAM_BINARY_RETRIEVABLE_HINT,GL_TRUE);
+  
   glLinkProgram(_program);
+}
+  
+int Shader::_linkStatus() {
+  GLint  r=0, ccLog=0;
+  char   *log;
   
-  glGetShaderiv(_program,GL_INFO_LOG_LENGTH,&ccLog);
-  if (ccLog) {
+  glGetProgramiv(_program,GL_LINK_STATUS,&r);
+  if (r!=GL_TRUE) {
+    glGetProgramiv(_program,GL_INFO_LOG_LENGTH,&ccLog);
     log=(char*)malloc(ccLog+1);
-    glGetShaderInfoLog(_program,ccLog,&ccLog,log);
+    *log=0;
+    glGetProgramInfoLog(_program,ccLog+1,&ccLog,log);
     LOG_WARNING(
-      "WARNING: shader program %i link error:\n %i %s %c\n",
-      _program, ccLog, log, *log);
+      "WARNING: shader program %i link error:\n  %s\n",
+      _program, log);
     
     free((void*)log);
     return 0;
   }
   
-  _linked=1;
+  return 1;
+}
+
+int Shader::resolve() {
+  int i, r=1;
+  
+  if (!_pending) return _linked;
+  
+  // checked before _cancel drops the names of included files
+  for(i=0;i<SHADER_PROGRAM_COUNT;i++)
+    if (_shader[i] && !_compileStatus(i)) r=0;
+  _cancel();
+  
+  // a failed compile fails the link as well, without saying much more
+  if (!r || !_linkStatus()) return 0;
+  
+  _onLinked();
+  if (_pendingKey) _storeBinary(_pendingKey);
   
   return 1;
+}
+  
+int Shader::ready() {
+  GLint r=0;
   
+  if (!_pending) return 1;
+  if (!GLEW_KHR_parallel_shader_compile) return 0;
+  
+  glGetProgramiv(_program,GL_COMPLETION_STATUS_KHR,&r);
+  return r==GL_TRUE;
+}
+
+/** \brief Forgets about a submitted compile without checking it. */
+void Shader::_cancel() {
+  size_t idx;
+  int i;
+  
+  if (!_pending) return;
+  _pending=0;
+  
+  for(idx=0;idx<_shader_pending_n;idx++) 
+    if (_shader_pending_v[idx]==this) break;
+  if (idx<_shader_pending_n) {
+    for(idx++;idx<_shader_pending_n;idx++) 
+      _shader_pending_v[idx-1]=_shader_pending_v[idx];
+    _shader_pending_n--;
+  }
+  
+  for(i=0;i<SHADER_PROGRAM_COUNT;i++) if (_lineFiles[i]) {
+    free((void*)_lineFiles[i]);
+    _lineFiles[i]=0;
+  }
+}
+
+void Shader::_onLinked() {
+  _linked=1;
+  if (!++_shader_link_id) ++_shader_link_id;
+  _linkId=_shader_link_id;
+  _introspect();
+  _bindBlocks();
 }
 
 void Shader::bind() {
+  if (_pending) resolve();
   glUseProgram(_program);
 }
 
@@ -524,9 +586,10 @@ void Shader::reload() {
   char **pstr;
   
   FOREACH(idx,pstr,_transformFeedbackVaryings)
-    free((void*)pstr);
+    free((void*)*pstr);
   ARRAY_DESTROY(_transformFeedbackVaryings);
   
+  _cancel();
   _linked=0;
   for(i=0;i<SHADER_PROGRAM_COUNT;i++) if (_sourceFiles[i]) {
     if (_shader[i]) {
@@ -551,35 +614,281 @@ timestamp_t Shader::filesTimestamp() {
 }
 
 int Shader::load(const char *fn, int flags) {
+  if (!prepare(fn,flags)) return 0;
+  return finish(fn,flags);
+}
+
+int Shader::prepare(const char *fn, int /*flags*/) {
   char buf[512];
+  size_t cb;
+  int i;
+  
+  _releasePrepared();
+  
+  for(i=0;i<SHADER_PROGRAM_COUNT;i++) {
+    _snprintf(buf,512,"%s.%s",fn,_shaderExtensions[i]);
+    if (!_readShaderFile(buf,&_preparedFiles[i],&_preparedCode[i],&cb))
+      continue;
+    
+    if (!_preprocessed[i].run(
+      (char*)_preparedCode[i],cb,_preparedFiles[i])) {
+      LOG_WARNING(
+        "WARNING: shader %s program %i is empty\n",_preparedFiles[i],i);
+      _releasePrepared();
+      return 0;
+    }
+  }
+  
+  return 1;
+}
+
+/** \brief Releases the sources read by prepare along with their
+  * preprocessed code.
+  */
+void Shader::_releasePrepared() {
+  int i;
+  
+  for(i=0;i<SHADER_PROGRAM_COUNT;i++) {
+    _preprocessed[i].clear();
+    if (_preparedFiles[i]) free((void*)_preparedFiles[i]);
+    if (_preparedCode[i]) free(_preparedCode[i]);
+    _preparedFiles[i]=0;
+    _preparedCode[i]=0;
+  }
+}
+
+/** \brief Lets the driver use as many threads for compiling as it likes,
+  * once.
+  */
+static void _shader_parallel_init() {
+  static int init=0;
+  
+  if (init) return;
+  init=1;
+  if (GLEW_KHR_parallel_shader_compile)
+    glMaxShaderCompilerThreadsKHR(0xffffffff);
+}
+
+int Shader::finish(const char * /*fn*/, int /*flags*/) {
+  const int order[SHADER_PROGRAM_COUNT]={
+    SHADER_INDEX_VERTEX, SHADER_INDEX_FRAGMENT, SHADER_INDEX_GEOMETRY
+  };
+  ShaderPreprocessor *pp=_preprocessed;
+  u_int64_t key;
   size_t idx;
   char **pstr;
+  int i, j, stages=0, r=0;
   
   FOREACH(idx,pstr,_transformFeedbackVaryings)
-    free((void*)pstr);
+    free((void*)*pstr);
   ARRAY_DESTROY(_transformFeedbackVaryings);
   
-  int i;
+  _cancel();
   _linked=0;
   for(i=0;i<SHADER_PROGRAM_COUNT;i++) if (_shader[i]) {
     glDetachShader(_program,_shader[i]);
     glDeleteShader(_shader[i]);
     _shader[i]=0;
   }
+  if (_program) glDeleteProgram(_program);
   _program=glCreateProgram();
   
-  _snprintf(buf,512,"%s.vsd",fn);
-  attachFile(buf,GL_VERTEX_SHADER);
+  for(j=0;j<SHADER_PROGRAM_COUNT;j++) {
+    i=order[j];
+    if (!pp[i].count()) continue;
+    
+    if (_sourceFiles[i]) free((void*)_sourceFiles[i]);
+    _sourceFiles[i]=_preparedFiles[i];
+    _preparedFiles[i]=0;
+    
+    _applyPragmas(pp+i);
+    stages++;
+  }
+  
+  if (!stages) {
+    LOG_WARNING("WARNING: no shader program to compile\n");
+    goto finalize;
+  }
   
-  _snprintf(buf,512,"%s.fsd",fn);
-  attachFile(buf,GL_FRAGMENT_SHADER);
+  key=_cacheKey(pp);
+  if (key && _loadBinary(key)) {
+    r=1;
+    goto finalize;
+  }
   
-  _snprintf(buf,512,"%s.gsd",fn);
-  attachFile(buf,GL_GEOMETRY_SHADER);
+  _shader_parallel_init();
   
-  link();
+  for(j=0;j<SHADER_PROGRAM_COUNT;j++) {
+    i=order[j];
+    if (pp[i].count() && !_compile(i,pp+i,0)) goto finalize;
+  }
   
-  return 1;
+  // the status is checked once the program is needed, see resolve
+  _submitLink();
+  _pending=1;
+  _pendingKey=key;
+  APPEND(_shader_pending,this);
+  r=1;
+  
+  finalize:
+  _releasePrepared();
+  
+  return r;
+}
+
+/** \brief Bumped whenever the layout of cached binaries or the way keys
+  * are computed changes.
+  */
+#define SHADER_CACHE_VERSION 1
+#define SHADER_CACHE_MAGIC 0x42505344 // "DSPB"
+
+/** \brief Header of a cached program binary, followed by cb bytes of
+  * glGetProgramBinary output.
+  */
+struct shader_binary_header_t {
+  u_int32_t magic;
+  u_int32_t version;
+  u_int64_t key;
+  u_int32_t format;
+  u_int32_t cb;
+};
+
+static char *_shader_cache_path=0;
+
+void shader_cache_setPath(const char *path) {
+  if (_shader_cache_path) free((void*)_shader_cache_path);
+  _shader_cache_path=0;
+  if (!path) return;
+  
+  if (!dir_create(path)) {
+    LOG_WARNING(
+      "WARNING: unable to create shader cache directory %s\n",path);
+    return;
+  }
+  _shader_cache_path=strdup(path);
+}
+
+const char *shader_cache_path() {
+  return _shader_cache_path;
+}
+
+int shader_cache_enabled() {
+  static int formats=-1;
+  GLint n=0;
+  
+  if (!_shader_cache_path) return 0;
+  if (formats==-1) {
+    if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+      glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS,&n);
+    formats=n;
+  }
+  
+  return formats>0;
+}
+
+/** \brief 64 bit FNV-1a, continuing from a previous hash h. */
+static u_int64_t _shader_hash(u_int64_t h, const void *data, size_t cb) {
+  const unsigned char *p=(const unsigned char*)data, *e=p+cb;
+  
+  for(;p<e;p++) {
+    h^=*p;
+    h*=1099511628211ull;
+  }
+  
+  return h;
+}
+
+u_int64_t Shader::_cacheKey(ShaderPreprocessor *pp) {
+  const GLenum strings[4]={
+    GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION
+  };
+  u_int64_t h=14695981039346656037ull;
+  const char *str;
+  u_int32_t v=SHADER_CACHE_VERSION;
+  int i;
+  size_t k;
+  
+  if (!shader_cache_enabled()) return 0;
+  
+  // binaries are only valid for the driver they were obtained from
+  h=_shader_hash(h,&v,sizeof(v));
+  for(i=0;i<4;i++) {
+    if ((str=(const char*)glGetString(strings[i])))
+      h=_shader_hash(h,str,strlen(str)+1);
+  }
+  
+  // GL concatenates the pieces, so only their content counts
+  for(i=0;i<SHADER_PROGRAM_COUNT;i++) {
+    v=i|(pp[i].count()?0x100:0);
+    h=_shader_hash(h,&v,sizeof(v));
+    for(k=0;k<pp[i].count();k++)
+      h=_shader_hash(h,pp[i].strings()[k],pp[i].lengths()[k]);
+  }
+  
+  return h?h:1;
+}
+
+int Shader::_loadBinary(u_int64_t key) {
+  char fn[512];
+  void *data;
+  size_t cb;
+  shader_binary_header_t *hdr;
+  GLint r=0;
+  
+  _snprintf(fn,512,"%s%016llx.spb",
+    _shader_cache_path,(unsigned long long)key);
+  if (!readFile(fn,&data,&cb)) return 0;
+  
+  hdr=(shader_binary_header_t*)data;
+  if ((cb<sizeof(shader_binary_header_t))
+  || (hdr->magic!=SHADER_CACHE_MAGIC) 
+  || (hdr->version!=SHADER_CACHE_VERSION)
+  || (hdr->key!=key)
+  || (hdr->cb!=cb-sizeof(shader_binary_header_t))) {
+    LOG_WARNING("WARNING: ignoring invalid shader cache file %s\n",fn);
+    goto finalize;
+  }
+  
+  glProgramBinary(_program,hdr->format,hdr+1,hdr->cb);
+  glGetProgramiv(_program,GL_LINK_STATUS,&r);
+  
+  // drivers reject binaries of other versions, they are just recompiled
+  if (r==GL_TRUE) _onLinked();
+  
+  finalize:
+  free(data);
+  
+  return r==GL_TRUE;
+}
+
+void Shader::_storeBinary(u_int64_t key) {
+  char fn[512];
+  GLint r=0, cb=0;
+  GLsizei length=0;
+  GLenum format;
+  shader_binary_header_t *hdr;
+  
+  glGetProgramiv(_program,GL_LINK_STATUS,&r);
+  if (r!=GL_TRUE) return;
+  glGetProgramiv(_program,GL_PROGRAM_BINARY_LENGTH,&cb);
+  if (cb<1) return;
+  
+  hdr=(shader_binary_header_t*)malloc(sizeof(shader_binary_header_t)+cb);
+  glGetProgramBinary(_program,cb,&length,&format,hdr+1);
+  
+  hdr->magic  =SHADER_CACHE_MAGIC;
+  hdr->version=SHADER_CACHE_VERSION;
+  hdr->key    =key;
+  hdr->format =format;
+  hdr->cb     =length;
+  
+  _snprintf(fn,512,"%s%016llx.spb",
+    _shader_cache_path,(unsigned long long)key);
+  if (length<1 
+  || !writeFile(fn,hdr,sizeof(shader_binary_header_t)+length))
+    LOG_WARNING("WARNING: unable to write shader cache file %s\n",fn);
+  
+  free((void*)hdr);
 }
 
 
@@ -626,7 +935,31 @@ AssetRegistry<Shader> *reg_shd() {
 
 
 
+int shader_resolve_pending(double budget) {
+  size_t idx;
+  double t0;
+  
+  if (budget<0) {
+    while(_shader_pending_n) _shader_pending_v[0]->resolve();
+    return 0;
+  }
+  
+  // resolving removes the shader from the list
+  t0=clock_seconds();
+  for(idx=0;idx<_shader_pending_n;) {
+    if (!_shader_pending_v[idx]->ready()) {
+      idx++;
+      continue;
+    }
+    _shader_pending_v[idx]->resolve();
+    if (clock_seconds()-t0>=budget) break;
+  }
+  
+  return _shader_pending_n;
+}
+
 void reg_shd_free() {
+  preprocessor_cache_clear();
   if (!_reg_shd) return;
   delete _reg_shd;
   _reg_shd=0;
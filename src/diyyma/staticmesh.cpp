@@ -9,6 +9,7 @@
 #include <string.h>
 #include <math.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include "GL/glew.h"
 
@@ -17,15 +18,41 @@
 
 #include "diyyma/util.h"
 #include "diyyma/xco.h"
+#include "diyyma/jobs.h"
+#include "diyyma/meshopt.h"
+#include "diyyma/quantize.h"
 
 StaticMesh::StaticMesh(): _filename(0) {
   memset(_buffers,0,sizeof(_buffers));
   _vertexCount=0;
+  _indexBuffer=0;
+  _indexType=GL_UNSIGNED_SHORT;
+  _indexCount=0;
+  _vao=0;
+  _loadFlags=0;
+  _prepared=0;
+  _boundsMin.set(0,0,0);
+  _boundsMax.set(0,0,0);
+  _positionTransform.setIdentity();
+  memset(_lods,0,sizeof(_lods));
+  _lodCount=1;
   ARRAY_INIT(_materials);
+  ARRAY_INIT(_lodSlices);
+  ARRAY_INIT(_occluderVertices);
+  ARRAY_INIT(_occluderIndices);
 }
 
+static void _meshDataFree(staticmesh_data_t *d);
+
+// incremented whenever the bounds of any mesh change
+static unsigned _bounds_generation=0;
+
 StaticMesh::~StaticMesh() {
   clear();
+  if (_prepared) {
+    _meshDataFree(_prepared);
+    free((void*)_prepared);
+  }
   /*
   int i;
   for(i=0;i<MAX_ARRAY_BUFFERS;i++) if (_buffers[i].handle)
@@ -33,6 +60,70 @@ StaticMesh::~StaticMesh() {
   */
 }
 
+void StaticMesh::bounds(Vector3f *bmin, Vector3f *bmax) {
+  if (bmin) *bmin=_boundsMin;
+  if (bmax) *bmax=_boundsMax;
+}
+
+unsigned StaticMesh::BoundsGeneration() {
+  return _bounds_generation;
+}
+
+const Matrixf &StaticMesh::positionTransform() {
+  return _positionTransform;
+}
+
+int StaticMesh::occluder(
+  const Vector3f **positions, const u_int32_t **indices, 
+  size_t *indexCount) {
+  if (!_occluderIndices_n) return 0;
+  if (positions) *positions=_occluderVertices_v;
+  if (indices) *indices=_occluderIndices_v;
+  if (indexCount) *indexCount=_occluderIndices_n;
+  return 1;
+}
+
+int StaticMesh::lodCount() {
+  return _lodCount;
+}
+
+float StaticMesh::lodError(int lod) {
+  if ((lod<0)||(lod>=_lodCount)) return 0;
+  return _lods[lod].error;
+}
+
+int StaticMesh::selectLOD(
+  const Matrixf &MVP, float pixelScale, float pixelError, int current) {
+  Vector3f c;
+  float r, w, scale;
+  int lod;
+  
+  if (_lodCount<2) return 0;
+  
+  c=(_boundsMin+_boundsMax)*0.5f;
+  r=(_boundsMax-_boundsMin).length()*0.5f;
+  
+  // clip space w is the depth along the view direction. The rows of MVP 
+  // also carry the scale of the model matrix.
+  w=MVP.a41*c.x+MVP.a42*c.y+MVP.a43*c.z+MVP.a44-
+    r*Vector3f(MVP.a41,MVP.a42,MVP.a43).length();
+  if (w<=0) return 0;
+  
+  scale=max(
+    Vector3f(MVP.a11,MVP.a12,MVP.a13).length(),
+    Vector3f(MVP.a21,MVP.a22,MVP.a23).length())*pixelScale/w;
+  
+  lod=max(0,min(current,_lodCount-1));
+  while((lod>0)
+  && (_lods[lod].error*scale>pixelError*(1+STATICMESH_LOD_HYSTERESIS)))
+    lod--;
+  while((lod+1<_lodCount)
+  && (_lods[lod+1].error*scale<=pixelError*(1-STATICMESH_LOD_HYSTERESIS)))
+    lod++;
+  
+  return lod;
+}
+
 size_t StaticMesh::materialCount() { 
   return _materials_n;
 }
@@ -53,403 +144,1320 @@ union face_t {
   long &operator[](int idx) { return v[idx]; }
 };
 
-void StaticMesh::loadOBJ(char *code, const char *outputDOF) {
-  LineScanner *scanner;
-  SubString str;
-  Vector3f bv;
-  MaterialLibrary *mtlib=0;
-  int imat=-1;
-  SubString smat;
-  MaterialSlice mat;
-  face_t face;
-  AssetRegistry<MaterialLibrary> *mtl;
-  void *buffer=0;
-  Vector3f *pvec3;
-  Vector2f *pvec2;
-  size_t idx, idxo;
-  int i;
-  ArrayBuffer *bufv;
+#define OBJ_EVENT_MTLLIB 0
+#define OBJ_EVENT_USEMTL 1
+
+/** \brief Minimum number of bytes of .obj code to hand to a single worker.
+  */
+#define OBJ_CHUNK_MIN_SIZE (1<<20)
+
+/** \brief Material statement encountered while parsing an .obj chunk.
+  *
+  * These are replayed in order when merging chunks, since material libraries
+  * must be loaded on the main thread.
+  */
+struct obj_event_t {
+  int       type;
+  size_t    face;
+  SubString name;
+};
+
+/** \brief Contiguous range of .obj lines and everything parsed from it.
+  *
+  * Face indices are global in .obj files, so faces can be parsed without
+  * knowing about previous chunks. They are validated after merging.
+  */
+struct obj_chunk_t {
+  const char *p, *end;
   
-  XCOWriterContext *xco=0;
-  DOFArray          dof_array_head;
-  FILE             *fDOF;
+  size_t facesBeforeVertices;
   
-  smat.ptr=0;
   ARRAY(Vector3f,vertices);
   ARRAY(Vector3f,normals);
   ARRAY(Vector2f,texcoords);
   ARRAY(Vector3f,tangents);
   ARRAY(Vector3f,binormals);
   ARRAY(face_t,faces);
+  ARRAY(obj_event_t,events);
+};
+
+/** \brief Content of a mesh file, read and parsed as far as it is possible
+  * without the OpenGL context.
+  */
+struct staticmesh_data_t {
+  char       *fn;
+  int         format;
+  const void *data;
+  size_t      cb;
   
-  // cleanup previously loaded data
-  clear();
+  ARRAY(obj_chunk_t,chunks);
+};
+
+/** \brief Reads the next whitespace-delimited token of a line.
+  *
+  * Quoted tokens are returned without their quotes.
+  */
+static int _objToken(const char **pp, const char *e, SubString *res) {
+  const char *p=*pp;
+  char quote;
+  
+  while((p<e)&&(*p<=' ')) p++;
+  if (p>=e) return 0;
+  
+  if ((*p=='"')||(*p=='\'')) {
+    quote=*p++;
+    res->ptr=p;
+    while((p<e)&&(*p!=quote)) p++;
+    res->length=(size_t)p-(size_t)res->ptr;
+    if (p<e) p++;
+  } else {
+    res->ptr=p;
+    while((p<e)&&(*p>' ')) p++;
+    res->length=(size_t)p-(size_t)res->ptr;
+  }
+
+  *pp=p;
+  return 1;
+}
+
+static int _objFloats(const char **pp, const char *e, float *res, int n) {
+  SubString str;
+  const char *endptr;
+  int i;
   
-  // init temporary structures
-  ARRAY_INIT(vertices);
-  ARRAY_INIT(normals);
-  ARRAY_INIT(texcoords);
-  ARRAY_INIT(tangents);
-  ARRAY_INIT(binormals);
-  ARRAY_INIT(faces);  
-  mtl=reg_mtl();
-  
-  // scan the obj file
-  scanner=new LineScanner();
-  scanner->grab();
-  *scanner=code;
-  
-  while(scanner->getLnFirstString(&str)) {
-    if (str=="v") {
-      if (!scanner->getFloat(&bv.x,1)) continue;
-      if (!scanner->getFloat(&bv.y,1)) continue;
-      if (!scanner->getFloat(&bv.z,1)) continue;
-      APPEND(vertices,bv);
-    } else if ((str=="n")||(str=="vn")) {
-      if (!scanner->getFloat(&bv.x,1)) continue;
-      if (!scanner->getFloat(&bv.y,1)) continue;
-      if (!scanner->getFloat(&bv.z,1)) continue;
-      APPEND(normals,bv);
-    } else if ((str=="#b")||(str=="#vb")) {
-      if (!scanner->getFloat(&bv.x,1)) continue;
-      if (!scanner->getFloat(&bv.y,1)) continue;
-      if (!scanner->getFloat(&bv.z,1)) continue;
-      APPEND(binormals,bv);
-    } else if ((str=="#t")||(str=="#vt")) {
-      if (!scanner->getFloat(&bv.x,1)) continue;
-      if (!scanner->getFloat(&bv.y,1)) continue;
-      if (!scanner->getFloat(&bv.z,1)) continue;
-      APPEND(tangents,bv);
-    } else if (str=="vt") {
-      if (!scanner->getFloat(&bv.x,1)) continue;
-      if (!scanner->getFloat(&bv.y,1)) continue;
-      APPEND(texcoords,*(Vector2f*)&bv);
-    } else if (str=="mtllib") {
-      if (!scanner->getLnString(&str)) continue;
-      if (mtlib) mtlib->drop();
-      mtlib=mtl->get(str);
-      if (mtlib) mtlib->grab();
-    } else if (str=="usemtl") {
-      scanner->getLnString(&smat);
-    } else if (str=="f") {
-      if (vertices_n<1) continue;
-      if (!scanner->getOBJFaceCorner(face.v0,1)) continue;
-      if (!scanner->getOBJFaceCorner(face.v1,1)) continue;
-      if (!scanner->getOBJFaceCorner(face.v2,1)) continue;
-      if ((face[0]<0)||(face[0]>=vertices_n )) face[0]= 0;
-      if ((face[3]<0)||(face[3]>=vertices_n )) face[3]= 0;
-      if ((face[1]<0)||(face[1]>=texcoords_n)) face[1]=-1;
-      if ((face[4]<0)||(face[4]>=texcoords_n)) face[4]=-1;
-      if ((face[2]<0)||(face[2]>=normals_n  )) face[2]=-1;
-      if ((face[5]<0)||(face[5]>=normals_n  )) face[5]=-1;
-      if ((imat<0) || (smat.ptr)) {
-        if (smat.ptr&&mtlib) {
-          mat.mat=mtlib->get(smat,0);
-          if (!mat.mat) {
-            LOG_WARNING(
-              "WARNING: Material '%.*s' not found\n",
-              smat.length,smat.ptr);
-            mat.mat=new Material();
-          }
-        } else {
-          mat.mat=new Material();
-        }
-        mat.mat->grab();
-        mat.vertexCount=0;
-        APPEND(_materials,mat);
-        imat=_materials_n-1;
-        smat.ptr=0;
-        smat.length=0;
+  for(i=0;i<n;i++) {
+    if (!_objToken(pp,e,&str)) return 0;
+    res[i]=(float)strtod_n(str.ptr,str.ptr+str.length,&endptr);
+    if (endptr<=str.ptr) return 0;
+  }
+  return 1;
+}
+
+/** \brief Reads a v/vt/vn face corner, see LineScanner::getOBJFaceCorner.
+  */
+static int _objFaceCorner(const char **pp, const char *e, long *res) {
+  SubString str;
+  const char *p, *pe;
+  int i;
+  
+  if (!_objToken(pp,e,&str)) return 0;
+  
+  p =str.ptr;
+  pe=str.ptr+str.length;
+  for(i=0;i<3;i++) {
+    res[i]=0;
+    while (p<pe) {
+      if ((*p>='0') && (*p<='9')) {
+        res[i]=res[i]*10+(*p-'0');
+      } else if (*p=='/') {
+        p++;
+        break;
+      } else {
+        return 0;
       }
-      
-      face[9]=imat;
-      
-      do {
-        if ((face[6]<0)||(face[6]>=vertices_n )) face[6]= 0;
-        if ((face[7]<0)||(face[7]>=texcoords_n)) face[7]=-1;
-        if ((face[8]<0)||(face[8]>=normals_n  )) face[8]=-1;
-        face[10]=_materials_v[imat].vertexCount;
-        APPEND(faces,face);
-        _materials_v[imat].vertexCount+=3;
-        memcpy(face.v1,face.v2,sizeof(long)*3);
-      } while(scanner->getOBJFaceCorner(face.v2,1));
-      
+      p++;
     }
+    res[i]--;
   }
   
-  if (!_materials_n) goto cleanup;
-  
-  // compute per-material vertex offsets.
-  _materials_v[0].vertexOffset=0;
-  for(idx=1;idx<_materials_n;idx++)
-    _materials_v[idx].vertexOffset=
-      _materials_v[idx-1].vertexOffset+
-      _materials_v[idx-1].vertexCount;
-  // allocate enough buffer space to assemble final vertex buffers.
-  // That is, three vectors per face
-  _vertexCount=faces_n*3;
-  buffer=malloc(sizeof(Vector3f)*_vertexCount);
+  return p>=pe;
+}
+
+/** \brief Parses all lines of an .obj chunk. Runs on worker threads.
+  */
+static void _objParseChunk(void *arg) {
+  obj_chunk_t *c=(obj_chunk_t*)arg;
+  const char *p=c->p, *e=c->end, *le;
+  SubString str;
+  Vector3f bv;
+  face_t face;
+  obj_event_t ev;
   
-  // assemble and send array buffers
-  bufv=_buffers;
+  c->facesBeforeVertices=(size_t)-1;
   
-  if (outputDOF) {
-    if (!xcow_create(&xco)) {
-      xco=0;
-      LOG_WARNING(
-        "WARNING: unable to create XCO writer context!");
-      goto vertices;
-    }
+  while(p<e) {
+    le=p;
+    while((le<e)&&(*le!='\n')&&(*le!='\r')) le++;
+    
+    if (!_objToken(&p,le,&str)) goto next;
     
-    xcow_chunk_new(xco,XCO_DIYYMA_OBJECT);
+    switch(*str.ptr) {
+      case 'v':
+        if (str.length==1) {
+          if (!_objFloats(&p,le,&bv.x,3)) goto next;
+          if (c->facesBeforeVertices==(size_t)-1) 
+            c->facesBeforeVertices=c->faces_n;
+          APPEND(c->vertices,bv);
+        } else if ((str.length==2)&&(str.ptr[1]=='n')) {
+          goto normal;
+        } else if ((str.length==2)&&(str.ptr[1]=='t')) {
+          if (!_objFloats(&p,le,&bv.x,2)) goto next;
+          APPEND(c->texcoords,*(Vector2f*)&bv);
+        }
+        break;
+      
+      case 'n':
+        if (str.length!=1) break;
+        normal:
+        if (!_objFloats(&p,le,&bv.x,3)) goto next;
+        APPEND(c->normals,bv);
+        break;
+      
+      case '#':
+        // #b, #vb, #t and #vt
+        if ((str.length==3)&&(str.ptr[1]=='v')) {
+          str.ptr++;
+          str.length--;
+        }
+        if (str.length!=2) break;
+        if (str.ptr[1]=='b') {
+          if (!_objFloats(&p,le,&bv.x,3)) goto next;
+          APPEND(c->binormals,bv);
+        } else if (str.ptr[1]=='t') {
+          if (!_objFloats(&p,le,&bv.x,3)) goto next;
+          APPEND(c->tangents,bv);
+        }
+        break;
+      
+      case 'm':
+      case 'u':
+        if (str=="mtllib") ev.type=OBJ_EVENT_MTLLIB;
+        else if (str=="usemtl") ev.type=OBJ_EVENT_USEMTL;
+        else break;
+        if (!_objToken(&p,le,&ev.name)) goto next;
+        ev.face=c->faces_n;
+        APPEND(c->events,ev);
+        break;
+      
+      case 'f':
+        if (str.length!=1) break;
+        if (!_objFaceCorner(&p,le,face.v0)) goto next;
+        if (!_objFaceCorner(&p,le,face.v1)) goto next;
+        if (!_objFaceCorner(&p,le,face.v2)) goto next;
+        
+        do {
+          APPEND(c->faces,face);
+          memcpy(face.v1,face.v2,sizeof(long)*3);
+        } while(_objFaceCorner(&p,le,face.v2));
+        
+        break;
+    }
     
+    next:
+    p=le;
+    while((p<e)&&((*p=='\n')||(*p=='\r'))) p++;
   }
   
-  
-  
-  // vertices
-  vertices:
-  for(idx=0;idx<faces_n;idx++) {
-    idxo=faces_v[idx].omat+_materials_v[faces_v[idx].imat].vertexOffset;
-    for(i=0;i<3;i++)
-      ((Vector3f*)buffer)[idxo+i]=vertices_v[faces_v[idx][i*3]];
+  if (c->facesBeforeVertices==(size_t)-1) 
+    c->facesBeforeVertices=c->faces_n;
+}
+
+/** \brief A single (v,vt,vn) face corner, used to assemble final vertices. */
+struct corner_t {
+  long v[3];
+};
+
+static size_t _cornerHash(const long *c) {
+  return 
+    ((size_t)c[0]*73856093u)^
+    ((size_t)c[1]*19349663u)^
+    ((size_t)c[2]*83492791u);
+}
+
+/** \brief Uploads data into a buffer object. 
+  *
+  * Arrays larger than STATICMESH_UPLOAD_SLICE are streamed in slices of that
+  * size, so the driver never needs to stage the whole array at once.
+  */
+static void _uploadBuffer(
+  GLenum target, GLuint handle, const void *data, size_t cb) {
+  size_t offs;
+  
+  glBindBuffer(target,handle);
+  if (cb<=STATICMESH_UPLOAD_SLICE) {
+    glBufferData(target,cb,data,GL_STATIC_DRAW);
+  } else {
+    glBufferData(target,cb,0,GL_STATIC_DRAW);
+    for(offs=0;offs<cb;offs+=STATICMESH_UPLOAD_SLICE)
+      glBufferSubData(
+        target,offs,min(cb-offs,(size_t)STATICMESH_UPLOAD_SLICE),
+        (const char*)data+offs);
+  }
+  glBindBuffer(target,0);
+}
+
+/** \brief Size of a single vertex attribute, in bytes, or zero if the type
+  * is not supported.
+  */
+static size_t _attributeSize(GLenum type, int dimension) {
+  switch(type) {
+    case GL_BYTE: return dimension;
+    case GL_UNSIGNED_BYTE: return dimension;
+    case GL_SHORT: return dimension*2;
+    case GL_UNSIGNED_SHORT: return dimension*2;
+    case GL_HALF_FLOAT: return dimension*2;
+    case GL_INT: return dimension*4;
+    case GL_UNSIGNED_INT: return dimension*4;
+    case GL_FLOAT: return dimension*4;
+    case GL_DOUBLE: return dimension*8;
+    case GL_INT_2_10_10_10_REV:
+    case GL_UNSIGNED_INT_2_10_10_10_REV:
+      // four components packed into 4 bytes
+      return dimension==4?4:0;
+    default:
+      return 0;
+  }
+}
+
+/** \brief Vertex arrays collected for interleaving rather than sent one by
+  * one.
+  */
+struct interleave_t {
+  ArrayBuffer *bufs[MAX_ARRAY_BUFFERS];
+  void        *data[MAX_ARRAY_BUFFERS];
+  int          n;
+  int          count;
+  size_t       stride;
+};
+
+/** \brief Uploads an array buffer and appends it to a DOF, if any.
+  *
+  * If il is non-null, the array is only collected, to be sent by 
+  * _sendInterleaved later on.
+  *
+  * \param flags DOF_ARRAY_* flags.
+  * \param cb Size of data, in bytes.
+  */
+static void _sendArray(
+  ArrayBuffer *bufv, int index, GLenum type, int dimension, int flags,
+  const void *data, size_t cb, XCOWriterContext *xco, interleave_t *il) {
+  DOFArray dof_array_head;
+  
+  bufv->index    =index;
+  bufv->type     =type;
+  bufv->dimension=dimension;
+  bufv->flags    =flags;
+  bufv->stride   =0;
+  bufv->offset   =0;
+  
+  if (il) {
+    bufv->offset=il->stride;
+    il->bufs[il->n]=bufv;
+    il->data[il->n]=malloc(cb);
+    memcpy(il->data[il->n],data,cb);
+    il->n++;
+    // keep every attribute 4 byte aligned
+    il->stride+=(cb/il->count+3)&~(size_t)3;
+    return;
   }
+  
   if (!bufv->handle) glGenBuffers(1,&bufv->handle);
-  bufv->index    =BUFIDX_VERTICES;
-  bufv->type     =GL_FLOAT;
-  bufv->dimension=3;
-  glBindBuffer(GL_ARRAY_BUFFER,bufv->handle);
-  glBufferData(GL_ARRAY_BUFFER,_vertexCount*3*sizeof(float),buffer,GL_STATIC_DRAW);
-  glBindBuffer(GL_ARRAY_BUFFER,0);
+  _uploadBuffer(GL_ARRAY_BUFFER,bufv->handle,data,cb);
   
   if (xco) {
     xcow_chunk_new(xco,XCO_DIYYMA_OBJECT_ARRAY);
     
-    dof_array_head.index=bufv->index;
+    dof_array_head.index=bufv->index|bufv->flags;
     dof_array_head.type =bufv->type;
     dof_array_head.dimension=bufv->dimension;
-    dof_array_head.cbData=sizeof(float)*_vertexCount*bufv->dimension;
+    dof_array_head.cbData=cb;
     
     xcow_data_write(xco,dof_array_head);
-    xcow_data_writearr(xco,buffer,dof_array_head.cbData);
+    xcow_data_writearr(xco,(void*)data,dof_array_head.cbData);
     
     xcow_chunk_close(xco);
-  
   }
+}
+
+/** \brief Interleaves, uploads and frees all arrays collected in il and 
+  * appends them to a DOF, if any.
+  */
+static void _sendInterleaved(interleave_t *il, XCOWriterContext *xco) {
+  DOFInterleaved          dof_head;
+  DOFInterleavedAttribute dof_attribute;
+  ArrayBuffer *bufv;
+  char   *buffer;
+  size_t  cb, idx;
+  GLuint  handle;
+  int     i;
   
-  bufv++;
+  if (!il->n) return;
   
+  buffer=(char*)malloc(il->stride*il->count);
+  memset(buffer,0,il->stride*il->count);
   
-  normals:
-  if (!normals_n) goto texcoords;
-  for(idx=0;idx<faces_n;idx++) {
-    idxo=faces_v[idx].omat+_materials_v[faces_v[idx].imat].vertexOffset;
-    for(i=0;i<3;i++) if (faces_v[idx][i*3+2]>-1)
-      ((Vector3f*)buffer)[idxo+i]=normals_v[faces_v[idx][i*3+2]];
+  glGenBuffers(1,&handle);
+  
+  for(i=0;i<il->n;i++) {
+    bufv=il->bufs[i];
+    cb=_attributeSize(bufv->type,bufv->dimension);
+    for(idx=0;idx<(size_t)il->count;idx++)
+      memcpy(
+        buffer+idx*il->stride+bufv->offset,(char*)il->data[i]+idx*cb,cb);
+    free(il->data[i]);
+    
+    bufv->handle=handle;
+    bufv->stride=il->stride;
   }
-  if (!bufv->handle) glGenBuffers(1,&bufv->handle);
-  bufv->index    =BUFIDX_NORMALS;
-  bufv->type     =GL_FLOAT;
-  bufv->dimension=3;
-  glBindBuffer(GL_ARRAY_BUFFER,bufv->handle);
-  glBufferData(GL_ARRAY_BUFFER,_vertexCount*3*sizeof(float),buffer,GL_STATIC_DRAW);
-  glBindBuffer(GL_ARRAY_BUFFER,0);
+  
+  _uploadBuffer(GL_ARRAY_BUFFER,handle,buffer,il->stride*il->count);
   
   if (xco) {
-    xcow_chunk_new(xco,XCO_DIYYMA_OBJECT_ARRAY);
+    xcow_chunk_new(xco,XCO_DIYYMA_OBJECT_INTERLEAVED);
     
-    dof_array_head.index=bufv->index;
-    dof_array_head.type =bufv->type;
-    dof_array_head.dimension=bufv->dimension;
-    dof_array_head.cbData=sizeof(float)*_vertexCount*bufv->dimension;
+    dof_head.attributes=il->n;
+    dof_head.stride    =il->stride;
+    dof_head.cbData    =il->stride*il->count;
+    xcow_data_write(xco,dof_head);
     
-    xcow_data_write(xco,dof_array_head);
-    xcow_data_writearr(xco,buffer,dof_array_head.cbData);
+    for(i=0;i<il->n;i++) {
+      bufv=il->bufs[i];
+      dof_attribute.index    =bufv->index|bufv->flags;
+      dof_attribute.type     =bufv->type;
+      dof_attribute.dimension=bufv->dimension;
+      dof_attribute.offset   =bufv->offset;
+      xcow_data_write(xco,dof_attribute);
+    }
+    
+    xcow_data_writearr(xco,buffer,dof_head.cbData);
     
     xcow_chunk_close(xco);
+  }
   
+  free(buffer);
+  il->n=0;
+}
+
+/** \brief Uniform scale quantized positions are stored with, relative to
+  * the minimum of the bounding box.
+  */
+static float _positionScale(const Vector3f &bmin, const Vector3f &bmax) {
+  float s=max(bmax.x-bmin.x,max(bmax.y-bmin.y,bmax.z-bmin.z));
+  return s>0?s:1;
+}
+
+/** \brief Sends an array of normals, binormals or tangents, in the format
+  * requested by STATICMESH_LOAD_* flags.
+  *
+  * \param qbuffer Scratch space of at least 4 bytes per vector.
+  */
+static void _sendDirections(
+  ArrayBuffer *bufv, int index, const Vector3f *data, int count, int flags,
+  void *qbuffer, XCOWriterContext *xco, interleave_t *il) {
+  int idx;
+  
+  if (flags&STATICMESH_LOAD_OCTAHEDRAL) {
+    for(idx=0;idx<count;idx++) 
+      quantize_octahedral(data[idx],(int16_t*)qbuffer+idx*2);
+    _sendArray(
+      bufv,index,GL_SHORT,2,DOF_ARRAY_NORMALIZED|DOF_ARRAY_OCTAHEDRAL,
+      qbuffer,sizeof(int16_t)*2*count,xco,il);
+  } else if (flags&STATICMESH_LOAD_QUANTIZE) {
+    for(idx=0;idx<count;idx++) 
+      ((u_int32_t*)qbuffer)[idx]=quantize_1010102(data[idx]);
+    _sendArray(
+      bufv,index,GL_INT_2_10_10_10_REV,4,DOF_ARRAY_NORMALIZED,
+      qbuffer,sizeof(u_int32_t)*count,xco,il);
+  } else {
+    _sendArray(
+      bufv,index,GL_FLOAT,3,0,data,sizeof(Vector3f)*count,xco,il);
+  }
+}
+
+/** \brief Splits .obj code into line-aligned chunks and parses them, in
+  * parallel for large inputs.
+  */
+static void _objParse(staticmesh_data_t *d) {
+  const char  *code=(const char*)d->data;
+  const char  *p;
+  size_t       cb=d->cb;
+  size_t       idx;
+  obj_chunk_t *pchunk;
+  JobCounter   jobs;
+  
+  idx=cb/OBJ_CHUNK_MIN_SIZE;
+  if (idx>1) {
+    jobs_init();
+    idx=min(idx,(size_t)(jobs_thread_count()+1)*4);
+  }
+  ARRAY_SETSIZE(d->chunks,max(idx,(size_t)1));
+  
+  p=code;
+  FOREACH(idx,pchunk,d->chunks) {
+    pchunk->p=p;
+    if (idx+1<d->chunks_n) {
+      p=max(p,code+cb/d->chunks_n*(idx+1));
+      while((*p)&&(*p!='\n')&&(*p!='\r')) p++;
+    } else {
+      p=code+cb;
+    }
+    pchunk->end=p;
+    ARRAY_INIT(pchunk->vertices);
+    ARRAY_INIT(pchunk->normals);
+    ARRAY_INIT(pchunk->texcoords);
+    ARRAY_INIT(pchunk->tangents);
+    ARRAY_INIT(pchunk->binormals);
+    ARRAY_INIT(pchunk->faces);
+    ARRAY_INIT(pchunk->events);
   }
   
-  bufv++;
+  if (d->chunks_n>1) {
+    memset(&jobs,0,sizeof(jobs));
+    FOREACH(idx,pchunk,d->chunks) job_submit(_objParseChunk,pchunk,&jobs);
+    job_wait(&jobs);
+  } else {
+    _objParseChunk(d->chunks_v);
+  }
+}
+
+/** \brief Releases everything held by mesh file content.
+  */
+static void _meshDataFree(staticmesh_data_t *d) {
+  size_t idx;
+  obj_chunk_t *pchunk;
+  
+  FOREACH(idx,pchunk,d->chunks) {
+    ARRAY_DESTROY(pchunk->vertices);
+    ARRAY_DESTROY(pchunk->normals);
+    ARRAY_DESTROY(pchunk->texcoords);
+    ARRAY_DESTROY(pchunk->tangents);
+    ARRAY_DESTROY(pchunk->binormals);
+    ARRAY_DESTROY(pchunk->faces);
+    ARRAY_DESTROY(pchunk->events);
+  }
+  ARRAY_DESTROY(d->chunks);
   
-  binormals:
-  if (binormals_n<normals_n) goto tangents;
-  for(idx=0;idx<faces_n;idx++) {
-    idxo=faces_v[idx].omat+_materials_v[faces_v[idx].imat].vertexOffset;
-    for(i=0;i<3;i++) if (faces_v[idx][i*3+2]>-1)
-      ((Vector3f*)buffer)[idxo+i]=binormals_v[faces_v[idx][i*3+2]];
+  if (d->data) {
+    if (d->format==1) unmapFile(d->data,d->cb);
+    else free((void*)d->data);
   }
-  if (!bufv->handle) glGenBuffers(1,&bufv->handle);
-  bufv->index    =BUFIDX_BINORMALS;
-  bufv->type     =GL_FLOAT;
-  bufv->dimension=3;
-  glBindBuffer(GL_ARRAY_BUFFER,bufv->handle);
-  glBufferData(GL_ARRAY_BUFFER,_vertexCount*3*sizeof(float),buffer,GL_STATIC_DRAW);
-  glBindBuffer(GL_ARRAY_BUFFER,0);
+  if (d->fn) free((void*)d->fn);
+  d->data=0;
+  d->fn=0;
+}
+
+/** \brief Locates and reads a mesh file, parsing .obj content right away.
+  *
+  * This does not touch the OpenGL context and may run on worker threads.
+  * The content must be released with _meshDataFree, even on failure.
+  *
+  * \param format 0 for .obj files, 1 for .dof files.
+  */
+static int _meshRead(staticmesh_data_t *d, const char *fn_in, int format) {
+  void *data;
   
-  if (xco) {
-    xcow_chunk_new(xco,XCO_DIYYMA_OBJECT_ARRAY);
-    
-    dof_array_head.index=bufv->index;
-    dof_array_head.type =bufv->type;
-    dof_array_head.dimension=bufv->dimension;
-    dof_array_head.cbData=sizeof(float)*_vertexCount*bufv->dimension;
-    
-    xcow_data_write(xco,dof_array_head);
-    xcow_data_writearr(xco,buffer,dof_array_head.cbData);
-    
-    xcow_chunk_close(xco);
+  memset(d,0,sizeof(staticmesh_data_t));
+  d->format=format;
   
+  if (!(d->fn=vfs_locate(fn_in,REPOSITORY_MASK_MESH))) {
+    LOG_WARNING(
+      "WARNING: unable to find static mesh file '%s'\n",
+      fn_in)
+    return 0;
   }
   
-  bufv++;
+  if (format==1) {
+    if (!mapFile(d->fn,&d->data,&d->cb)) {
+      LOG_WARNING(
+        "WARNING: unable to load static mesh file '%s'\n",
+        d->fn)
+      return 0;
+    }
+    return 1;
+  }
   
-  tangents:
-  if (tangents_n<normals_n) goto texcoords;
-  for(idx=0;idx<faces_n;idx++) {
-    idxo=faces_v[idx].omat+_materials_v[faces_v[idx].imat].vertexOffset;
-    for(i=0;i<3;i++) if (faces_v[idx][i*3+2]>-1)
-      ((Vector3f*)buffer)[idxo+i]=tangents_v[faces_v[idx][i*3+2]];
+  if (!readFile(d->fn,&data,&d->cb)) {
+    LOG_WARNING(
+      "WARNING: unable to load static mesh file '%s'\n",
+      d->fn)
+    return 0;
   }
-  if (!bufv->handle) glGenBuffers(1,&bufv->handle);
-  bufv->index    =BUFIDX_TANGENTS;
-  bufv->type     =GL_FLOAT;
-  bufv->dimension=3;
-  glBindBuffer(GL_ARRAY_BUFFER,bufv->handle);
-  glBufferData(GL_ARRAY_BUFFER,_vertexCount*3*sizeof(float),buffer,GL_STATIC_DRAW);
-  glBindBuffer(GL_ARRAY_BUFFER,0);
+  d->data=data;
   
-  if (xco) {
-    xcow_chunk_new(xco,XCO_DIYYMA_OBJECT_ARRAY);
-    
-    dof_array_head.index=bufv->index;
-    dof_array_head.type =bufv->type;
-    dof_array_head.dimension=bufv->dimension;
-    dof_array_head.cbData=sizeof(float)*_vertexCount*bufv->dimension;
-    
-    xcow_data_write(xco,dof_array_head);
-    xcow_data_writearr(xco,buffer,dof_array_head.cbData);
-    
-    xcow_chunk_close(xco);
+  _objParse(d);
   
-  }
+  return 1;
+}
+
+void StaticMesh::loadOBJ(char *code, const char *outputDOF, int flags) {
+  staticmesh_data_t d;
   
-  bufv++;
+  memset(&d,0,sizeof(d));
+  d.data=code;
+  d.cb  =strlen(code);
   
+  // cleanup previously loaded data
+  clear();
   
-  texcoords:
-  if (!texcoords_n) goto done_buffers;
-  for(idx=0;idx<faces_n;idx++) {
-    idxo=faces_v[idx].omat+_materials_v[faces_v[idx].imat].vertexOffset;
-    for(i=0;i<3;i++) if (faces_v[idx][i*3+1]>-1)
-      ((Vector2f*)buffer)[idxo+i]=texcoords_v[faces_v[idx][i*3+1]];
-  }
-  if (!bufv->handle) glGenBuffers(1,&bufv->handle);
-  bufv->index    =BUFIDX_TEXCOORDS;
-  bufv->type     =GL_FLOAT;
-  bufv->dimension=2;
-  glBindBuffer(GL_ARRAY_BUFFER,bufv->handle);
-  glBufferData(GL_ARRAY_BUFFER,_vertexCount*2*sizeof(float),buffer,GL_STATIC_DRAW);
-  glBindBuffer(GL_ARRAY_BUFFER,0);
+  _objParse(&d);
+  _assembleOBJ(&d,outputDOF,flags);
   
-  if (xco) {
-    xcow_chunk_new(xco,XCO_DIYYMA_OBJECT_ARRAY);
+  // the code is owned by the caller
+  d.data=0;
+  _meshDataFree(&d);
+}
+
+/** \brief Appends simplified versions of all material slices to the 
+  * indices, each level being simplified from the previous one.
+  *
+  * Levels stay contiguous, so each of them can be drawn at once. Their 
+  * errors add up, as each one is only measured against its predecessor.
+  */
+void StaticMesh::_buildLODs(
+  u_int32_t **indices, const Vector3f *positions, size_t vertexCount,
+  int optimize, const char *fn) {
+  size_t idx, target, count, total, prevTotal;
+  LODSlice src, slice;
+  float error, sliceError;
+  int lod;
+  
+  prevTotal=_indexCount;
+  
+  for(lod=1;lod<STATICMESH_MAX_LODS;lod++) {
+    *indices=(u_int32_t*)realloc(
+      *indices,sizeof(u_int32_t)*(_indexCount+prevTotal));
     
-    dof_array_head.index=bufv->index;
-    dof_array_head.type =bufv->type;
-    dof_array_head.dimension=bufv->dimension;
-    dof_array_head.cbData=sizeof(float)*_vertexCount*bufv->dimension;
+    total=0;
+    error=0;
+    for(idx=0;idx<_materials_n;idx++) {
+      if (lod>1) {
+        src=_lodSlices_v[(lod-2)*_materials_n+idx];
+      } else {
+        src.vertexCount =_materials_v[idx].vertexCount;
+        src.vertexOffset=_materials_v[idx].vertexOffset;
+      }
+      target=(size_t)(src.vertexCount*STATICMESH_LOD_RATIO)/3*3;
+      
+      count=meshopt_simplify(
+        *indices+_indexCount+total,*indices+src.vertexOffset,
+        src.vertexCount,positions,vertexCount,target,&sliceError);
+      if (optimize) 
+        meshopt_optimize_vertex_cache(
+          *indices+_indexCount+total,*indices+_indexCount+total,count,
+          vertexCount);
+      
+      slice.vertexCount =count;
+      slice.vertexOffset=_indexCount+total;
+      APPEND(_lodSlices,slice);
+      
+      total+=count;
+      error=max(error,sliceError);
+    }
     
-    xcow_data_write(xco,dof_array_head);
-    xcow_data_writearr(xco,buffer,dof_array_head.cbData);
+    if (!total || (total>prevTotal*STATICMESH_LOD_MIN_REDUCTION)) {
+      _lodSlices_n-=_materials_n;
+      break;
+    }
     
-    xcow_chunk_close(xco);
+    _lods[lod].error      =_lods[lod-1].error+error;
+    _lods[lod].indexOffset=_indexCount;
+    _lods[lod].indexCount =total;
+    _indexCount+=total;
+    _lodCount=lod+1;
+    prevTotal=total;
     
+    LOG_INFO(
+      "mesh '%s': LOD %i, %i triangles, error %g\n",
+      fn,lod,(int)(total/3),_lods[lod].error);
   }
+}
+
+/** \brief Copies the vertices referenced by a range of indices into the
+  * occluder arrays.
+  */
+void StaticMesh::_buildOccluder(
+  const u_int32_t *indices, size_t indexCount, 
+  const Vector3f *positions, size_t vertexCount) {
+  u_int32_t *remap;
+  size_t idx;
   
-  bufv++;
+  ARRAY_DESTROY(_occluderVertices);
+  ARRAY_DESTROY(_occluderIndices);
+  ARRAY_RESERVE(_occluderIndices,indexCount);
   
-  done_buffers:
-  free(buffer);
+  remap=(u_int32_t*)malloc(sizeof(u_int32_t)*vertexCount);
+  memset(remap,0xff,sizeof(u_int32_t)*vertexCount);
   
+  for(idx=0;idx<indexCount;idx++) {
+    if (remap[indices[idx]]==0xffffffff) {
+      remap[indices[idx]]=(u_int32_t)_occluderVertices_n;
+      APPEND(_occluderVertices,positions[indices[idx]]);
+    }
+    APPEND(_occluderIndices,remap[indices[idx]]);
+  }
   
-  if (xco) {
-    for(idx=0;idx<_materials_n;idx++) {
-      xcow_chunk_new(xco,XCO_DIYYMA_OBJECT_MATERIAL_SLICE);
-      xcow_chunk_new(xco,0x0001);
-      xcow_data_write(xco,(int32_t)_materials_v[idx].vertexCount);
-      xcow_data_write(xco,(int32_t)_materials_v[idx].vertexOffset);
-      xcow_chunk_close(xco);
+  free(remap);
+}
+
+/** \brief State shared by the stages assembling a mesh from .obj content.
+  *
+  * Everything is owned by the build until the mesh takes it over, and is
+  * released by _buildFree otherwise.
+  */
+struct staticmesh_build_t {
+  staticmesh_data_t *d;
+  const char        *fn;
+  int                flags;
+  MaterialLibrary   *mtlib;
+  
+  ARRAY(Vector3f,vertices);
+  ARRAY(Vector3f,normals);
+  ARRAY(Vector2f,texcoords);
+  ARRAY(Vector3f,tangents);
+  ARRAY(Vector3f,binormals);
+  ARRAY(face_t,faces);
+  ARRAY(corner_t,corners);
+  ARRAY(MaterialSlice,materials);
+  
+  u_int32_t *indices;
+  size_t     indexCount;
+  GLuint     indexBuffer;
+  GLenum     indexType;
+  
+  Vector3f   boundsMin, boundsMax;
+  Matrixf    positionTransform;
+  
+  ArrayBuffer      *bufv;
+  void             *buffer, *qbuffer;
+  interleave_t      interleave, *il;
+  XCOWriterContext *xco;
+};
+
+static void _buildInit(
+  staticmesh_build_t *b, staticmesh_data_t *d, int flags) {
+  if (flags&(
+    STATICMESH_LOAD_OPTIMIZE|STATICMESH_LOAD_LOD|STATICMESH_LOAD_OCCLUDER)) 
+    flags|=STATICMESH_LOAD_INDEXED;
+  if (flags&STATICMESH_LOAD_OCTAHEDRAL) flags|=STATICMESH_LOAD_QUANTIZE;
+  
+  b->d    =d;
+  b->fn   =d->fn?d->fn:"<memory>";
+  b->flags=flags;
+  b->mtlib=0;
+  
+  ARRAY_INIT(b->vertices);
+  ARRAY_INIT(b->normals);
+  ARRAY_INIT(b->texcoords);
+  ARRAY_INIT(b->tangents);
+  ARRAY_INIT(b->binormals);
+  ARRAY_INIT(b->faces);
+  ARRAY_INIT(b->corners);
+  ARRAY_INIT(b->materials);
+  
+  b->indices    =0;
+  b->indexCount =0;
+  b->indexBuffer=0;
+  b->indexType  =GL_UNSIGNED_SHORT;
+  
+  b->boundsMin.set(0,0,0);
+  b->boundsMax.set(0,0,0);
+  b->positionTransform.setIdentity();
+  
+  b->bufv   =0;
+  b->buffer =0;
+  b->qbuffer=0;
+  b->il     =0;
+  b->xco    =0;
+}
+
+static void _buildFree(staticmesh_build_t *b) {
+  size_t idx;
+  MaterialSlice *pmat;
+  
+  ARRAY_DESTROY(b->vertices);
+  ARRAY_DESTROY(b->normals);
+  ARRAY_DESTROY(b->texcoords);
+  ARRAY_DESTROY(b->tangents);
+  ARRAY_DESTROY(b->binormals);
+  ARRAY_DESTROY(b->faces);
+  ARRAY_DESTROY(b->corners);
+  FOREACH(idx,pmat,b->materials) pmat->mat->drop();
+  ARRAY_DESTROY(b->materials);
+  if (b->indices) free(b->indices);
+  if (b->buffer) free(b->buffer);
+  if (b->qbuffer) free(b->qbuffer);
+  if (b->xco) xcow_close(&b->xco);
+  if (b->mtlib) b->mtlib->drop();
+}
+
+/** \brief Merges the chunks of parsed .obj content, splitting faces into
+  * material slices.
+  *
+  * \return Number of material slices, zero if there are no faces.
+  */
+static size_t _buildMerge(staticmesh_build_t *b) {
+  AssetRegistry<MaterialLibrary> *mtl=reg_mtl();
+  staticmesh_data_t *d=b->d;
+  obj_chunk_t *pchunk;
+  obj_event_t *pev;
+  size_t       idx, iface, iev;
+  SubString    smat;
+  MaterialSlice mat;
+  face_t       face;
+  long        *pcorner;
+  int          imat=-1, i;
+  
+  smat.ptr=0;
+  smat.length=0;
+  
+  FOREACH(idx,pchunk,d->chunks) {
+    b->vertices_n +=pchunk->vertices_n;
+    b->normals_n  +=pchunk->normals_n;
+    b->texcoords_n+=pchunk->texcoords_n;
+    b->tangents_n +=pchunk->tangents_n;
+    b->binormals_n+=pchunk->binormals_n;
+    b->faces_n    +=pchunk->faces_n;
+  }
+  
+  ARRAY_RESERVE(b->vertices, b->vertices_n);
+  ARRAY_RESERVE(b->normals,  b->normals_n);
+  ARRAY_RESERVE(b->texcoords,b->texcoords_n);
+  ARRAY_RESERVE(b->tangents, b->tangents_n);
+  ARRAY_RESERVE(b->binormals,b->binormals_n);
+  ARRAY_RESERVE(b->faces,    b->faces_n);
+  b->vertices_n=b->normals_n=b->texcoords_n=0;
+  b->tangents_n=b->binormals_n=b->faces_n=0;
+  
+  #define MERGE(n) \
+    memcpy( \
+      b->n##_v+b->n##_n,pchunk->n##_v,sizeof(*b->n##_v)*pchunk->n##_n); \
+    b->n##_n+=pchunk->n##_n;
+  
+  FOREACH(idx,pchunk,d->chunks) {
+    
+    // replay the material statements in between faces, splitting faces into
+    // material slices just like a sequential scan would.
+    iev=0;
+    for(iface=0;iface<=pchunk->faces_n;iface++) {
+      for(;
+        (iev<pchunk->events_n)&&(pchunk->events_v[iev].face<=iface);
+        iev++) {
+        pev=pchunk->events_v+iev;
+        if (pev->type==OBJ_EVENT_MTLLIB) {
+          if (b->mtlib) b->mtlib->drop();
+          b->mtlib=mtl->get(
+            pev->name,(b->flags&STATICMESH_LOAD_ASYNC)?MATLIB_LOAD_ASYNC:0);
+          if (b->mtlib) b->mtlib->grab();
+        } else {
+          smat=pev->name;
+        }
+      }
+      if (iface>=pchunk->faces_n) break;
+      
+      // faces preceding the first vertex are ignored
+      if (!b->vertices_n && (iface<pchunk->facesBeforeVertices)) continue;
       
-      _materials_v[idx].mat->saveXCO(xco);
+      if ((imat<0) || (smat.ptr)) {
+        if (smat.ptr&&b->mtlib) {
+          mat.mat=b->mtlib->get(smat,0);
+          if (!mat.mat) {
+            LOG_WARNING(
+              "WARNING: Material '%.*s' not found\n",
+              smat.length,smat.ptr);
+            mat.mat=new Material();
+          }
+        } else {
+          mat.mat=new Material();
+        }
+        mat.mat->grab();
+        mat.vertexCount=0;
+        APPEND(b->materials,mat);
+        imat=b->materials_n-1;
+        smat.ptr=0;
+        smat.length=0;
+      }
       
-      xcow_chunk_close(xco);
+      face=pchunk->faces_v[iface];
+      face[9] =imat;
+      face[10]=b->materials_v[imat].vertexCount;
+      b->faces_v[b->faces_n++]=face;
+      b->materials_v[imat].vertexCount+=3;
     }
     
-    xcow_finalize(xco);
+    MERGE(vertices);
+    MERGE(normals);
+    MERGE(texcoords);
+    MERGE(tangents);
+    MERGE(binormals);
+  }
+  
+  #undef MERGE
+  
+  // validate face corners against the final attribute counts
+  for(idx=0;idx<b->faces_n;idx++) for(i=0;i<9;i+=3) {
+    pcorner=&b->faces_v[idx][i];
+    if ((pcorner[0]<0)||(pcorner[0]>=b->vertices_n )) pcorner[0]= 0;
+    if ((pcorner[1]<0)||(pcorner[1]>=b->texcoords_n)) pcorner[1]=-1;
+    if ((pcorner[2]<0)||(pcorner[2]>=b->normals_n  )) pcorner[2]=-1;
+  }
+  
+  if (!b->materials_n) return 0;
+  
+  // compute per-material vertex offsets.
+  b->materials_v[0].vertexOffset=0;
+  for(idx=1;idx<b->materials_n;idx++)
+    b->materials_v[idx].vertexOffset=
+      b->materials_v[idx-1].vertexOffset+
+      b->materials_v[idx-1].vertexCount;
+  
+  return b->materials_n;
+}
+
+/** \brief Gathers the face corners making up the final vertices.
+  *
+  * Without indexing, that is three corners per face. Otherwise, each
+  * unique (v,vt,vn) tuple is emitted only once and referenced by index.
+  */
+static void _buildCorners(staticmesh_build_t *b) {
+  long      *cornerTable, *pcorner;
+  size_t     cornerMask, idx, idxo, h;
+  corner_t   corner;
+  face_t    *pface;
+  int        i;
+  
+  if (!(b->flags&STATICMESH_LOAD_INDEXED)) {
+    ARRAY_SETSIZE(b->corners,b->faces_n*3);
+    FOREACH(idx,pface,b->faces) {
+      idxo=pface->omat+b->materials_v[pface->imat].vertexOffset;
+      for(i=0;i<3;i++)
+        memcpy(b->corners_v[idxo+i].v,&(*pface)[i*3],sizeof(long)*3);
+    }
+    return;
+  }
+  
+  b->indexCount=b->faces_n*3;
+  b->indices=(u_int32_t*)malloc(sizeof(u_int32_t)*b->indexCount);
+  
+  ARRAY_RESERVE(b->corners,b->faces_n);
+  for(cornerMask=1;cornerMask<b->indexCount*2;cornerMask<<=1);
+  cornerTable=(long*)malloc(sizeof(long)*cornerMask);
+  memset(cornerTable,0xff,sizeof(long)*cornerMask);
+  cornerMask--;
+  
+  FOREACH(idx,pface,b->faces) {
+    idxo=pface->omat+b->materials_v[pface->imat].vertexOffset;
+    for(i=0;i<3;i++) {
+      pcorner=&(*pface)[i*3];
+      h=_cornerHash(pcorner)&cornerMask;
+      while(cornerTable[h]!=-1) {
+        if (memcmp(b->corners_v[cornerTable[h]].v,pcorner,sizeof(long)*3)==0)
+          break;
+        h=(h+1)&cornerMask;
+      }
+      if (cornerTable[h]==-1) {
+        cornerTable[h]=b->corners_n;
+        memcpy(corner.v,pcorner,sizeof(long)*3);
+        APPEND(b->corners,corner);
+      }
+      b->indices[idxo+i]=cornerTable[h];
+    }
+  }
+  
+  free(cornerTable);
+}
+
+/** \brief Returns the positions of all final vertices, to be freed by the
+  * caller.
+  */
+static Vector3f *_buildPositions(staticmesh_build_t *b) {
+  Vector3f *positions;
+  size_t idx;
+  
+  positions=(Vector3f*)malloc(sizeof(Vector3f)*b->corners_n);
+  for(idx=0;idx<b->corners_n;idx++)
+    positions[idx]=b->vertices_v[b->corners_v[idx].v[0]];
+  
+  return positions;
+}
+
+/** \brief Reorders triangles within each material slice for the vertex 
+  * cache and overdraw, then renumbers the vertices in the order they are
+  * fetched.
+  */
+static void _buildOptimize(staticmesh_build_t *b) {
+  Vector3f  *positions;
+  u_int32_t *remap, *slice;
+  corner_t  *corners_tmp;
+  size_t     idx, count;
+  float      acmr[2], atvr[2];
+  
+  meshopt_analyze_vertex_cache(
+    b->indices,b->indexCount,b->corners_n,MESHOPT_FIFO_SIZE,acmr,atvr);
+  
+  positions=_buildPositions(b);
+  for(idx=0;idx<b->materials_n;idx++) {
+    slice=b->indices+b->materials_v[idx].vertexOffset;
+    count=b->materials_v[idx].vertexCount;
+    meshopt_optimize_vertex_cache(slice,slice,count,b->corners_n);
+    meshopt_optimize_overdraw(
+      slice,slice,count,positions,b->corners_n,MESHOPT_OVERDRAW_THRESHOLD);
+  }
+  free(positions);
+  
+  remap=(u_int32_t*)malloc(sizeof(u_int32_t)*b->corners_n);
+  corners_tmp=(corner_t*)malloc(sizeof(corner_t)*b->corners_n);
+  meshopt_optimize_vertex_fetch(remap,b->indices,b->indexCount,b->corners_n);
+  for(idx=0;idx<b->corners_n;idx++) corners_tmp[remap[idx]]=b->corners_v[idx];
+  memcpy(b->corners_v,corners_tmp,sizeof(corner_t)*b->corners_n);
+  free(corners_tmp);
+  free(remap);
+  
+  meshopt_analyze_vertex_cache(
+    b->indices,b->indexCount,b->corners_n,MESHOPT_FIFO_SIZE,acmr+1,atvr+1);
+  LOG_INFO(
+    "mesh '%s': ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n",
+    b->fn,acmr[0],acmr[1],atvr[0],atvr[1]);
+}
+
+/** \brief Allocates the scratch space to assemble vertex buffers in, and
+  * starts the DOF, if any.
+  */
+static void _buildBuffers(staticmesh_build_t *b, const char *outputDOF) {
+  size_t count=b->corners_n;
+  
+  b->buffer=malloc(sizeof(Vector3f)*count);
+  if (b->flags&STATICMESH_LOAD_QUANTIZE)
+    b->qbuffer=malloc(sizeof(u_int16_t)*4*count);
+  
+  if ((b->flags&STATICMESH_LOAD_INTERLEAVED) && count) {
+    b->il=&b->interleave;
+    b->il->n     =0;
+    b->il->count =count;
+    b->il->stride=0;
+  }
+  
+  if (!outputDOF) return;
+  
+  if (!xcow_create(&b->xco)) {
+    b->xco=0;
+    LOG_WARNING(
+      "WARNING: unable to create XCO writer context!");
+    return;
+  }
+  
+  xcow_chunk_new(b->xco,XCO_DIYYMA_OBJECT);
+}
+
+/** \brief Sends the vertex positions, quantized to the bounding box if
+  * requested, after computing the bounds.
+  */
+static void _buildVertices(staticmesh_build_t *b) {
+  Vector3f  *positions=(Vector3f*)b->buffer, *p;
+  DOFBounds  dof_bounds;
+  float      scale;
+  u_int16_t *q;
+  size_t     idx, count=b->corners_n;
+  
+  for(idx=0;idx<count;idx++)
+    positions[idx]=b->vertices_v[b->corners_v[idx].v[0]];
+  
+  if (count) b->boundsMin=b->boundsMax=positions[0];
+  for(idx=1;idx<count;idx++) {
+    p=positions+idx;
+    b->boundsMin.set(
+      min(b->boundsMin.x,p->x),
+      min(b->boundsMin.y,p->y),
+      min(b->boundsMin.z,p->z));
+    b->boundsMax.set(
+      max(b->boundsMax.x,p->x),
+      max(b->boundsMax.y,p->y),
+      max(b->boundsMax.z,p->z));
+  }
+  
+  if (b->xco) {
+    xcow_chunk_new(b->xco,XCO_DIYYMA_OBJECT_BOUNDS);
+    memcpy(dof_bounds.min,&b->boundsMin.x,sizeof(float)*3);
+    memcpy(dof_bounds.max,&b->boundsMax.x,sizeof(float)*3);
+    xcow_data_write(b->xco,dof_bounds);
+    xcow_chunk_close(b->xco);
+  }
+  
+  if (!(b->flags&STATICMESH_LOAD_QUANTIZE)) {
+    _sendArray(
+      b->bufv++,BUFIDX_VERTICES,GL_FLOAT,3,0,
+      positions,sizeof(Vector3f)*count,b->xco,b->il);
+    return;
+  }
+  
+  scale=_positionScale(b->boundsMin,b->boundsMax);
+  for(idx=0;idx<count;idx++) {
+    p=positions+idx;
+    q=(u_int16_t*)b->qbuffer+idx*4;
+    q[0]=quantize_unorm16((p->x-b->boundsMin.x)/scale);
+    q[1]=quantize_unorm16((p->y-b->boundsMin.y)/scale);
+    q[2]=quantize_unorm16((p->z-b->boundsMin.z)/scale);
+    q[3]=0xffff;
+  }
+  b->positionTransform.set(
+    scale,0,0,b->boundsMin.x,
+    0,scale,0,b->boundsMin.y,
+    0,0,scale,b->boundsMin.z,
+    0,0,0,1);
+  _sendArray(
+    b->bufv++,BUFIDX_VERTICES,GL_UNSIGNED_SHORT,4,DOF_ARRAY_NORMALIZED,
+    b->qbuffer,sizeof(u_int16_t)*4*count,b->xco,b->il);
+}
+
+/** \brief Sends normals, binormals or tangents, looked up through the
+  * normal index of each corner.
+  */
+static void _buildDirections(
+  staticmesh_build_t *b, int index, const Vector3f *data) {
+  Vector3f *buffer=(Vector3f*)b->buffer;
+  size_t idx;
+  
+  memset(b->buffer,0,sizeof(Vector3f)*b->corners_n);
+  for(idx=0;idx<b->corners_n;idx++) if (b->corners_v[idx].v[2]>-1)
+    buffer[idx]=data[b->corners_v[idx].v[2]];
+  _sendDirections(
+    b->bufv++,index,buffer,b->corners_n,b->flags,b->qbuffer,b->xco,b->il);
+}
+
+/** \brief Sends texture coordinates as normalized shorts if they lie
+  * within [0,1], which is more precise, or as half floats otherwise.
+  */
+static void _buildTexcoords(staticmesh_build_t *b) {
+  float  *buffer=(float*)b->buffer;
+  size_t  idx, count=b->corners_n;
+  int     unorm;
+  
+  memset(b->buffer,0,sizeof(Vector2f)*count);
+  for(idx=0;idx<count;idx++) if (b->corners_v[idx].v[1]>-1)
+    ((Vector2f*)buffer)[idx]=b->texcoords_v[b->corners_v[idx].v[1]];
+  
+  if (!(b->flags&STATICMESH_LOAD_QUANTIZE)) {
+    _sendArray(
+      b->bufv++,BUFIDX_TEXCOORDS,GL_FLOAT,2,0,
+      buffer,sizeof(Vector2f)*count,b->xco,b->il);
+    return;
+  }
+  
+  unorm=1;
+  for(idx=0;unorm && (idx<count*2);idx++)
+    unorm=(buffer[idx]>=0) && (buffer[idx]<=1);
+  
+  for(idx=0;idx<count*2;idx++)
+    ((u_int16_t*)b->qbuffer)[idx]=unorm?
+      quantize_unorm16(buffer[idx]):
+      quantize_half(buffer[idx]);
+  _sendArray(
+    b->bufv++,BUFIDX_TEXCOORDS,unorm?GL_UNSIGNED_SHORT:GL_HALF_FLOAT,2,
+    unorm?DOF_ARRAY_NORMALIZED:0,
+    b->qbuffer,sizeof(u_int16_t)*2*count,b->xco,b->il);
+}
+
+/** \brief Sends all vertex attributes, interleaving them if requested. */
+static void _buildAttributes(staticmesh_build_t *b) {
+  _buildVertices(b);
+  
+  if (b->normals_n) {
+    _buildDirections(b,BUFIDX_NORMALS,b->normals_v);
+    if (b->binormals_n>=b->normals_n)
+      _buildDirections(b,BUFIDX_BINORMALS,b->binormals_v);
+    if (b->tangents_n>=b->normals_n)
+      _buildDirections(b,BUFIDX_TANGENTS,b->tangents_v);
+  }
+  
+  if (b->texcoords_n) _buildTexcoords(b);
+  
+  if (b->il) _sendInterleaved(b->il,b->xco);
+}
+
+/** \brief Sends the indices, narrowed to 16 bit wherever possible. */
+static void _buildIndices(staticmesh_build_t *b) {
+  DOFIndexArray dof_index_head;
+  size_t idx;
+  
+  if (b->corners_n<=0x10000) {
+    b->indexType=GL_UNSIGNED_SHORT;
+    for(idx=0;idx<b->indexCount;idx++)
+      ((u_int16_t*)b->indices)[idx]=(u_int16_t)b->indices[idx];
+    dof_index_head.cbData=sizeof(u_int16_t)*b->indexCount;
+  } else {
+    b->indexType=GL_UNSIGNED_INT;
+    dof_index_head.cbData=sizeof(u_int32_t)*b->indexCount;
+  }
+  
+  glGenBuffers(1,&b->indexBuffer);
+  _uploadBuffer(
+    GL_ELEMENT_ARRAY_BUFFER,b->indexBuffer,b->indices,dof_index_head.cbData);
+  
+  if (b->xco) {
+    xcow_chunk_new(b->xco,XCO_DIYYMA_OBJECT_INDICES);
     
-    fDOF=fopen(outputDOF,"wb");
+    dof_index_head.type=b->indexType;
     
-    if (!fDOF) {
-      LOG_WARNING(
-        "WARNING: unable to open output DOF file '%s'!",
-        outputDOF);
-      goto cleanup;
-    }
+    xcow_data_write(b->xco,dof_index_head);
+    xcow_data_writearr(b->xco,b->indices,dof_index_head.cbData);
     
-    fwrite(xco->data,1,(size_t)xco->p-(size_t)xco->data,fDOF);
+    xcow_chunk_close(b->xco);
+  }
+}
+
+/** \brief Finishes the DOF and writes it to a file. */
+static void _buildSave(staticmesh_build_t *b, const char *outputDOF) {
+  FILE *fDOF;
+  
+  xcow_finalize(b->xco);
+  
+  fDOF=fopen(outputDOF,"wb");
+  
+  if (!fDOF) {
+    LOG_WARNING(
+      "WARNING: unable to open output DOF file '%s'!",
+      outputDOF);
+    return;
+  }
+  
+  fwrite(b->xco->data,1,(size_t)b->xco->p-(size_t)b->xco->data,fDOF);
+  
+  fclose(fDOF);
+}
+
+/** \brief Appends the material slices, LODs and the occluder to a DOF. */
+void StaticMesh::_writeXCO(XCOWriterContext *xco) {
+  DOFLOD       dof_lod;
+  DOFOccluder  dof_occluder;
+  LODSlice    *plod;
+  size_t       idx;
+  int          i;
+  
+  for(idx=0;idx<_materials_n;idx++) {
+    xcow_chunk_new(xco,XCO_DIYYMA_OBJECT_MATERIAL_SLICE);
+    xcow_chunk_new(xco,0x0001);
+    xcow_data_write(xco,(int32_t)_materials_v[idx].vertexCount);
+    xcow_data_write(xco,(int32_t)_materials_v[idx].vertexOffset);
+    xcow_chunk_close(xco);
     
-    fclose(fDOF);
+    _materials_v[idx].mat->saveXCO(xco);
     
+    xcow_chunk_close(xco);
+  }
+  
+  for(i=1;i<_lodCount;i++) {
+    xcow_chunk_new(xco,XCO_DIYYMA_OBJECT_LOD);
+    dof_lod.error      =_lods[i].error;
+    dof_lod.indexOffset=_lods[i].indexOffset;
+    dof_lod.indexCount =_lods[i].indexCount;
+    dof_lod.slices     =_materials_n;
+    xcow_data_write(xco,dof_lod);
+    for(idx=0;idx<_materials_n;idx++) {
+      plod=_lodSlices_v+(i-1)*_materials_n+idx;
+      xcow_data_write(xco,(int32_t)plod->vertexCount);
+      xcow_data_write(xco,(int32_t)plod->vertexOffset);
+    }
+    xcow_chunk_close(xco);
+  }
+  
+  if (_occluderIndices_n) {
+    xcow_chunk_new(xco,XCO_DIYYMA_OBJECT_OCCLUDER);
+    dof_occluder.vertexCount=_occluderVertices_n;
+    dof_occluder.indexCount =_occluderIndices_n;
+    xcow_data_write(xco,dof_occluder);
+    xcow_data_writearr(
+      xco,_occluderVertices_v,sizeof(Vector3f)*_occluderVertices_n);
+    xcow_data_writearr(
+      xco,_occluderIndices_v,sizeof(u_int32_t)*_occluderIndices_n);
+    xcow_chunk_close(xco);
+  }
+}
+
+void StaticMesh::_assembleOBJ(
+  staticmesh_data_t *d, const char *outputDOF, int flags) {
+  staticmesh_build_t b;
+  Vector3f *positions;
+  
+  _buildInit(&b,d,flags);
+  
+  if (!_buildMerge(&b)) goto cleanup;
+  _buildCorners(&b);
+  if (b.indices && (b.flags&STATICMESH_LOAD_OPTIMIZE)) _buildOptimize(&b);
+  
+  // the mesh takes over the material slices
+  _materials_v=b.materials_v;
+  _materials_n=b.materials_n;
+  _materials_s=b.materials_s;
+  ARRAY_INIT(b.materials);
+  
+  if (b.indices) {
+    _indexCount=b.indexCount;
+    _lods[0].indexCount=_indexCount;
   }
   
+  // simplified levels reference the same vertices, so they are generated
+  // once the vertices are in their final order.
+  if (b.indices && (b.flags&(STATICMESH_LOAD_LOD|STATICMESH_LOAD_OCCLUDER))) {
+    positions=_buildPositions(&b);
+    if (b.flags&STATICMESH_LOAD_LOD)
+      _buildLODs(
+        &b.indices,positions,b.corners_n,b.flags&STATICMESH_LOAD_OPTIMIZE,
+        b.fn);
+    if (b.flags&STATICMESH_LOAD_OCCLUDER)
+      _buildOccluder(
+        b.indices+_lods[_lodCount-1].indexOffset,
+        _lods[_lodCount-1].indexCount,positions,b.corners_n);
+    free(positions);
+    b.indexCount=_indexCount;
+  }
   
-  // cleanup
+  // assemble and send array buffers
+  _vertexCount=b.corners_n;
+  b.bufv=_buffers;
+  _buildBuffers(&b,outputDOF);
+  _buildAttributes(&b);
+  
+  _boundsMin=b.boundsMin;
+  _boundsMax=b.boundsMax;
+  _positionTransform=b.positionTransform;
+  
+  if (b.indices) {
+    _buildIndices(&b);
+    _indexBuffer=b.indexBuffer;
+    _indexType  =b.indexType;
+  }
   
-  cleanup:
+  _buildVAO();
+  _bounds_generation++;
   
-  scanner->drop();
-  ARRAY_DESTROY(vertices);
-  ARRAY_DESTROY(normals);
-  ARRAY_DESTROY(texcoords);
-  ARRAY_DESTROY(tangents);
-  ARRAY_DESTROY(binormals);
-  ARRAY_DESTROY(faces);
-  if (mtlib) mtlib->drop();
+  if (b.xco) {
+    _writeXCO(b.xco);
+    _buildSave(&b,outputDOF);
+  }
   
+  cleanup:
+  _buildFree(&b);
 }
 
-int StaticMesh::loadDOFFile(const char *fn_in) {
+int StaticMesh::_assembleDOF(staticmesh_data_t *d) {
   
   XCOReaderContext *xco=0;
   DOFArray array_head;
+  DOFIndexArray index_head;
   size_t array_cb_record;
   int array_length;
+  MaterialSlice mat;
+  int32_t slice_count, slice_offset;
+  int64_t limit;
+  MaterialSlice *pmat;
+  DOFBounds bounds;
+  const Vector3f *pv;
+  int hasBounds=0, quantized=0;
+  int i;
+  size_t idx;
+  float scale;
+  DOFInterleaved il_head;
+  DOFInterleavedAttribute il_attribute;
+  GLuint il_handle;
+  DOFLOD lod_head;
+  LODSlice lod_slice;
+  DOFOccluder occluder_head;
   
   int idx_array=0;
   
-  void *data=0;
-  size_t cb;
-  char *fn;
+  const char *fn=d->fn;
   int r=0;
   
-  if (!(fn=vfs_locate(fn_in,REPOSITORY_MASK_MESH))) {
-    LOG_WARNING(
-      "WARNING: unable to find static mesh file '%s'\n",
-      fn_in)
-    goto finalize;
-  }
-  
-  if (!readFile(fn,&data,&cb)) {
-    LOG_WARNING(
-      "WARNING: unable to load static mesh file '%s'\n",
-      fn)
-    goto finalize;
-  }
-  clear();
-  
-  
-  if (!xcor_create(&xco,data,cb)) {
+  if (!xcor_create(&xco,d->data,d->cb)) {
     LOG_WARNING(
       "WARNING: unable to open XCO file '%s'\n",
       fn)
@@ -488,24 +1496,15 @@ int StaticMesh::loadDOFFile(const char *fn_in) {
         goto next;
       }
       
-      switch(array_head.type) {
-        case GL_BYTE: array_cb_record=1; break;
-        case GL_UNSIGNED_BYTE: array_cb_record=1; break;
-        case GL_SHORT: array_cb_record=2; break;
-        case GL_UNSIGNED_SHORT: array_cb_record=2; break;
-        case GL_INT: array_cb_record=4; break;
-        case GL_UNSIGNED_INT: array_cb_record=4; break;
-        case GL_FLOAT: array_cb_record=4; break;
-        case GL_DOUBLE: array_cb_record=8; break;
-        default:
-          LOG_WARNING(
-            "WARNING: XCO file '%s' contains invalid array: "
-            " invalid array type: %lu\n",
-            fn,array_head.type)
-          goto next;
+      array_cb_record=_attributeSize(array_head.type,array_head.dimension);
+      if (!array_cb_record) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid array: "
+          " invalid array type: %lu\n",
+          fn,(unsigned long)array_head.type)
+        goto next;
       }
       
-      array_cb_record*=array_head.dimension;
       array_length    =array_head.cbData/array_cb_record;
       
       if (_vertexCount && (array_length!=_vertexCount)) {
@@ -527,103 +1526,528 @@ int StaticMesh::loadDOFFile(const char *fn_in) {
       
       if (array_head.cbData<1) goto next;
       
+      if (!_vertexCount) _vertexCount=array_length;
+      
       glGenBuffers(1,&_buffers[idx_array].handle);
-      _buffers[idx_array].index=array_head.index;
+      _buffers[idx_array].index=array_head.index&DOF_ARRAY_INDEX_MASK;
       _buffers[idx_array].type=array_head.type;
       _buffers[idx_array].dimension=array_head.dimension;
+      _buffers[idx_array].flags=array_head.index&~DOF_ARRAY_INDEX_MASK;
+      
+      if (_buffers[idx_array].index==BUFIDX_VERTICES) {
+        quantized=(_buffers[idx_array].flags&DOF_ARRAY_NORMALIZED)!=0;
+        
+        // files written before bounds were stored
+        if (!hasBounds && (array_head.type==GL_FLOAT) 
+        && (array_head.dimension==3)) {
+          pv=(const Vector3f*)xco->p;
+          _boundsMin=_boundsMax=pv[0];
+          for(i=1;i<array_length;i++) {
+            _boundsMin.set(
+              min(_boundsMin.x,pv[i].x),
+              min(_boundsMin.y,pv[i].y),
+              min(_boundsMin.z,pv[i].z));
+            _boundsMax.set(
+              max(_boundsMax.x,pv[i].x),
+              max(_boundsMax.y,pv[i].y),
+              max(_boundsMax.z,pv[i].z));
+          }
+        }
+      }
       
-      glBindBuffer(GL_ARRAY_BUFFER,_buffers[idx_array].handle);
-      glBufferData(GL_ARRAY_BUFFER,array_head.cbData,xco->p,GL_STATIC_DRAW);
-      glBindBuffer(GL_ARRAY_BUFFER,0);
+      // uploaded straight from the mapped file
+      _uploadBuffer(
+        GL_ARRAY_BUFFER,_buffers[idx_array].handle,xco->p,array_head.cbData);
       
       idx_array++;
       
       break;
+    
+    case XCO_DIYYMA_OBJECT_INDICES:
+      if (xcor_data_remain(xco)<sizeof(index_head)) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid index head\n",
+          fn)
+        goto next;
+      }
+      xcor_data_read(xco,index_head);
+      
+      if (xcor_data_remain(xco)!=index_head.cbData) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid indices: byte count mismatch\n",
+          fn)
+        goto next;
+      }
+      
+      switch(index_head.type) {
+        case GL_UNSIGNED_SHORT: array_cb_record=2; break;
+        case GL_UNSIGNED_INT: array_cb_record=4; break;
+        default:
+          LOG_WARNING(
+            "WARNING: XCO file '%s' contains invalid indices: "
+            " invalid index type: %lu\n",
+            fn,(unsigned long)index_head.type)
+          goto next;
+      }
+      
+      if ((index_head.cbData<1)||(index_head.cbData%array_cb_record)) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid indices: "
+          " badly aligned data block\n",
+          fn)
+        goto next;
+      }
+      
+      if (_indexBuffer) glDeleteBuffers(1,&_indexBuffer);
+      glGenBuffers(1,&_indexBuffer);
+      _indexType =index_head.type;
+      _indexCount=index_head.cbData/array_cb_record;
+      _lods[0].indexCount=_indexCount;
+      
+      _uploadBuffer(
+        GL_ELEMENT_ARRAY_BUFFER,_indexBuffer,xco->p,index_head.cbData);
+      
+      break;
+    
+    case XCO_DIYYMA_OBJECT_INTERLEAVED:
+      if (xcor_data_remain(xco)<sizeof(il_head)) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid interleaved head\n",
+          fn)
+        goto next;
+      }
+      xcor_data_read(xco,il_head);
+      
+      if (idx_array+il_head.attributes>MAX_ARRAY_BUFFERS) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains too many arrays (max: %i)\n",
+          fn, MAX_ARRAY_BUFFERS)
+        goto next;
+      }
+      
+      if (xcor_data_remain(xco)!=
+        il_head.attributes*sizeof(il_attribute)+il_head.cbData) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid interleaved arrays: "
+          " byte count mismatch\n",
+          fn)
+        goto next;
+      }
+      
+      if ((il_head.stride<1)||(il_head.cbData<1)
+      ||(il_head.cbData%il_head.stride)) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid interleaved arrays: "
+          " badly aligned data block\n",
+          fn)
+        goto next;
+      }
+      
+      array_length=il_head.cbData/il_head.stride;
+      if (_vertexCount && (array_length!=_vertexCount)) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid interleaved arrays: "
+          " array length mismatch\n",
+          fn)
+        goto next;
+      }
+      
+      // validate all attributes before touching any of our buffers
+      for(i=0;i<(int)il_head.attributes;i++) {
+        il_attribute=((const DOFInterleavedAttribute*)xco->p)[i];
+        array_cb_record=
+          _attributeSize(il_attribute.type,il_attribute.dimension);
+        if (!array_cb_record 
+        || (il_attribute.offset+array_cb_record>il_head.stride)) {
+          LOG_WARNING(
+            "WARNING: XCO file '%s' contains invalid interleaved arrays: "
+            " invalid attribute %i\n",
+            fn,i)
+          goto next;
+        }
+      }
+      
+      _vertexCount=array_length;
+      glGenBuffers(1,&il_handle);
+      
+      for(i=0;i<(int)il_head.attributes;i++) {
+        xcor_data_read(xco,il_attribute);
+        _buffers[idx_array].handle=il_handle;
+        _buffers[idx_array].index=il_attribute.index&DOF_ARRAY_INDEX_MASK;
+        _buffers[idx_array].type=il_attribute.type;
+        _buffers[idx_array].dimension=il_attribute.dimension;
+        _buffers[idx_array].flags=il_attribute.index&~DOF_ARRAY_INDEX_MASK;
+        _buffers[idx_array].stride=il_head.stride;
+        _buffers[idx_array].offset=il_attribute.offset;
+        
+        if (_buffers[idx_array].index==BUFIDX_VERTICES)
+          quantized=(_buffers[idx_array].flags&DOF_ARRAY_NORMALIZED)!=0;
+        
+        idx_array++;
+      }
+      
+      _uploadBuffer(GL_ARRAY_BUFFER,il_handle,xco->p,il_head.cbData);
+      
+      break;
+    
+    case XCO_DIYYMA_OBJECT_BOUNDS:
+      if (xcor_data_remain(xco)<sizeof(bounds)) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid bounds\n",
+          fn)
+        goto next;
+      }
+      xcor_data_read(xco,bounds);
+      _boundsMin.set(bounds.min[0],bounds.min[1],bounds.min[2]);
+      _boundsMax.set(bounds.max[0],bounds.max[1],bounds.max[2]);
+      hasBounds=1;
+      break;
+    
+    case XCO_DIYYMA_OBJECT_MATERIAL_SLICE:
+      mat.vertexCount=-1;
+      mat.mat=0;
+      
+      if (xcor_chunk_sub(xco)) {
+        do { switch(xco->head->id) {
+          case 0x0001:
+            if (xcor_data_remain(xco)<sizeof(int32_t)*2) break;
+            xcor_data_read(xco,slice_count);
+            xcor_data_read(xco,slice_offset);
+            mat.vertexCount =slice_count;
+            mat.vertexOffset=slice_offset;
+            break;
+          case XCO_DIYYMA_MATERIAL:
+            if (mat.mat) break;
+            mat.mat=new Material();
+            mat.mat->grab();
+            mat.mat->loadXCO(xco);
+            break;
+          default:
+            break;
+        } } while(xcor_chunk_next(xco));
+        xcor_chunk_close(xco);
+      }
+      
+      if ((mat.vertexCount<0)||(mat.vertexOffset<0)) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid material slice\n",
+          fn)
+        if (mat.mat) mat.mat->drop();
+        goto next;
+      }
+      
+      if (!mat.mat) {
+        mat.mat=new Material();
+        mat.mat->grab();
+      }
+      
+      APPEND(_materials,mat);
+      
+      break;
+    
+    case XCO_DIYYMA_OBJECT_LOD:
+      if (xcor_data_remain(xco)<sizeof(lod_head)) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid LOD head\n",
+          fn)
+        goto next;
+      }
+      xcor_data_read(xco,lod_head);
+      
+      if (_lodCount>=STATICMESH_MAX_LODS) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains too many LODs (max: %i)\n",
+          fn, STATICMESH_MAX_LODS)
+        goto next;
+      }
+      
+      // ranges are summed in 64 bit, so they cannot wrap around. They 
+      // are checked against the element array once all chunks are read.
+      if ((lod_head.slices!=_materials_n)
+      || (xcor_data_remain(xco)!=lod_head.slices*sizeof(int32_t)*2)
+      || ((int64_t)lod_head.indexOffset+lod_head.indexCount>INT_MAX)
+      || (!lod_head.indexOffset)
+      || ((_lodCount>1) && ((int64_t)lod_head.indexOffset<
+          (int64_t)_lods[_lodCount-1].indexOffset+
+          _lods[_lodCount-1].indexCount))) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid LOD\n",
+          fn)
+        goto next;
+      }
+      
+      for(i=0;i<(int)lod_head.slices;i++) {
+        xcor_data_read(xco,slice_count);
+        xcor_data_read(xco,slice_offset);
+        lod_slice.vertexCount =slice_count;
+        lod_slice.vertexOffset=slice_offset;
+        if ((slice_count<0)||((int64_t)slice_offset<lod_head.indexOffset)
+        || ((int64_t)slice_offset+slice_count>
+            (int64_t)lod_head.indexOffset+lod_head.indexCount)) {
+          LOG_WARNING(
+            "WARNING: XCO file '%s' contains invalid LOD slice\n",
+            fn)
+          _lodSlices_n-=i;
+          goto next;
+        }
+        APPEND(_lodSlices,lod_slice);
+      }
+      
+      _lods[_lodCount].error      =lod_head.error;
+      _lods[_lodCount].indexOffset=lod_head.indexOffset;
+      _lods[_lodCount].indexCount =lod_head.indexCount;
+      // the full mesh ends where the first simplified level starts
+      if (_lodCount==1) _lods[0].indexCount=lod_head.indexOffset;
+      _lodCount++;
+      
+      break;
+    
+    case XCO_DIYYMA_OBJECT_OCCLUDER:
+      if (xcor_data_remain(xco)<sizeof(occluder_head)) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid occluder head\n",
+          fn)
+        goto next;
+      }
+      xcor_data_read(xco,occluder_head);
+      
+      if ((occluder_head.indexCount%3)
+      || (xcor_data_remain(xco)!=
+          occluder_head.vertexCount*sizeof(float)*3+
+          occluder_head.indexCount*sizeof(u_int32_t))) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid occluder\n",
+          fn)
+        goto next;
+      }
+      
+      ARRAY_SETSIZE(_occluderVertices,occluder_head.vertexCount);
+      ARRAY_SETSIZE(_occluderIndices,occluder_head.indexCount);
+      memcpy(
+        _occluderVertices_v,xco->p,sizeof(Vector3f)*_occluderVertices_n);
+      memcpy(
+        _occluderIndices_v,xco->p+sizeof(Vector3f)*_occluderVertices_n,
+        sizeof(u_int32_t)*_occluderIndices_n);
+      
+      for(idx=0;idx<_occluderIndices_n;idx++) 
+        if (_occluderIndices_v[idx]>=occluder_head.vertexCount) break;
+      if (idx<_occluderIndices_n) {
+        LOG_WARNING(
+          "WARNING: XCO file '%s' contains invalid occluder indices\n",
+          fn)
+        _occluderVertices_n=0;
+        _occluderIndices_n=0;
+      }
+      
+      break;
+    
     default:
       break;
   } next: ;} while(xcor_chunk_next(xco));
   
+  // the element array may come after the slices referring to it, so their
+  // ranges are only checked now.
+  limit=_indexBuffer?_indexCount:_vertexCount;
+  FOREACH(idx,pmat,_materials) {
+    if ((int64_t)pmat->vertexOffset+pmat->vertexCount<=limit) continue;
+    LOG_WARNING(
+      "WARNING: XCO file '%s' contains material slice beyond the %s\n",
+      fn,_indexBuffer?"indices":"vertices")
+    pmat->vertexCount=0;
+  }
+  
+  for(i=1;i<_lodCount;i++) {
+    if ((int64_t)_lods[i].indexOffset+_lods[i].indexCount<=
+        (_indexBuffer?_indexCount:0)) continue;
+    LOG_WARNING(
+      "WARNING: XCO file '%s' contains LOD beyond the indices\n",
+      fn)
+    _lodCount=i;
+    _lodSlices_n=(i-1)*_materials_n;
+    if (_lodCount==1) _lods[0].indexCount=_indexCount;
+    break;
+  }
+  
+  if (quantized) {
+    if (!hasBounds)
+      LOG_WARNING(
+        "WARNING: XCO file '%s' contains quantized positions but no bounds\n",
+        fn)
+    scale=_positionScale(_boundsMin,_boundsMax);
+    _positionTransform.set(
+      scale,0,0,_boundsMin.x,
+      0,scale,0,_boundsMin.y,
+      0,0,scale,_boundsMin.z,
+      0,0,0,1);
+  }
   
-  _filename=strdup(fn);
-  _fileFormat=1;
+  _buildVAO();
+  _bounds_generation++;
   
   r=1;
   
   finalize:
   
-  if (data) free(data);
   if (xco) xcor_close(&xco);
-  if (fn) free((void*)fn);
   
   return r;
 }
 
-int StaticMesh::loadOBJFile(const char *fn_in) {
-  void *data;
-  size_t cb;
-  char *fn;
+int StaticMesh::loadDOFFile(const char *fn_in) {
+  staticmesh_data_t d;
+  int r=0;
   
+  if (!_meshRead(&d,fn_in,1)) goto finalize;
   
-  if (!(fn=vfs_locate(fn_in,REPOSITORY_MASK_MESH))) {
-    LOG_WARNING(
-      "WARNING: unable to find static mesh file '%s'\n",
-      fn_in)
-    return 0;
+  clear();
+  
+  if ((r=_assembleDOF(&d))) {
+    _filename=d.fn;
+    _fileFormat=1;
+    d.fn=0;
   }
   
-  if (!readFile(fn,&data,&cb)) {
-    LOG_WARNING(
-      "WARNING: unable to load static mesh file '%s'\n",
-      fn)
+  finalize:
+  
+  _meshDataFree(&d);
+  
+  return r;
+}
+
+int StaticMesh::loadOBJFile(const char *fn_in, int flags) {
+  staticmesh_data_t d;
+  
+  if (!_meshRead(&d,fn_in,0)) {
+    _meshDataFree(&d);
     return 0;
   }
   
   clear();
   
-  loadOBJ((char*)data);
+  _assembleOBJ(&d,0,flags);
+  _loadFlags=flags;
   
-  _filename=strdup(fn);
+  _filename=d.fn;
   _fileFormat=0;
-  free(data);
+  d.fn=0;
   
-  free((void*)fn);
+  _meshDataFree(&d);
   
   return 1;
   
 }
 
-void StaticMesh::bind() {
+void StaticMesh::_bindArrays() {
   int i;
+  GLuint bound=0;
+  
+  // interleaved attributes share a buffer, which is bound only once
   for(i=0;i<MAX_ARRAY_BUFFERS;i++) if (_buffers[i].handle) {
-    glBindBuffer(GL_ARRAY_BUFFER,_buffers[i].handle);
+    if (_buffers[i].handle!=bound) {
+      bound=_buffers[i].handle;
+      glBindBuffer(GL_ARRAY_BUFFER,bound);
+    }
     glVertexAttribPointer(
       _buffers[i].index,_buffers[i].dimension,_buffers[i].type,
-      0,0,0);
+      (_buffers[i].flags&DOF_ARRAY_NORMALIZED)?GL_TRUE:GL_FALSE,
+      _buffers[i].stride,(void*)_buffers[i].offset);
     glEnableVertexAttribArray(_buffers[i].index);
-    glBindBuffer(GL_ARRAY_BUFFER,0);
   }
+  if (bound) glBindBuffer(GL_ARRAY_BUFFER,0);
+  if (_indexBuffer)
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,_indexBuffer);
+}
+
+/** \brief Records all array bindings into a vertex array object, if 
+  * supported.
+  */
+void StaticMesh::_buildVAO() {
+  if (_vao) glDeleteVertexArrays(1,&_vao);
+  _vao=0;
+  
+  if (!GLEW_ARB_vertex_array_object && !GLEW_VERSION_3_0) return;
+  
+  glGenVertexArrays(1,&_vao);
+  glBindVertexArray(_vao);
+  _bindArrays();
+  glBindVertexArray(0);
+  
+  // the element array binding is part of the VAO state, but was also
+  // changed for the default one.
+  if (_indexBuffer) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+}
+
+void StaticMesh::bind() {
+  if (_vao) glBindVertexArray(_vao);
+  else _bindArrays();
 }
 
 void StaticMesh::unbind() {
   int i;
+  
+  if (_vao) {
+    glBindVertexArray(0);
+    return;
+  }
+  
   for(i=0;i<MAX_ARRAY_BUFFERS;i++) if (_buffers[i].handle) {
     glDisableVertexAttribArray(_buffers[i].index);
   }
+  if (_indexBuffer)
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+}
+
+void StaticMesh::_draw(int offset, int count, int instances) {
+  if (instances!=1) {
+    if (_indexBuffer) {
+      glDrawElementsInstanced(
+        GL_TRIANGLES,count,_indexType,
+        (void*)(size_t)(offset*(_indexType==GL_UNSIGNED_SHORT?2:4)),
+        instances);
+    } else {
+      glDrawArraysInstanced(GL_TRIANGLES,offset,count,instances);
+    }
+  } else if (_indexBuffer) {
+    glDrawElements(
+      GL_TRIANGLES,count,_indexType,
+      (void*)(size_t)(offset*(_indexType==GL_UNSIGNED_SHORT?2:4)));
+  } else {
+    glDrawArrays(GL_TRIANGLES,offset,count);
+  }
 }
 
 void StaticMesh::send() {
-  glDrawArrays(GL_TRIANGLES,0,_vertexCount);
+  _draw(0,_indexBuffer?_lods[0].indexCount:_vertexCount);
+}
+
+void StaticMesh::sendInstanced(int instances) {
+  if (instances<1) return;
+  _draw(0,_indexBuffer?_lods[0].indexCount:_vertexCount,instances);
 }
 
-void StaticMesh::send(int idx) {
-  if ((idx<0)||(idx>=_materials_n)) return;
-  glDrawArrays(
-    GL_TRIANGLES,
+void StaticMesh::send(int idx, int lod) {
+  LODSlice *plod;
+  
+  if ((idx<0)||((size_t)idx>=_materials_n)) return;
+  if ((lod>0)&&(lod<_lodCount)) {
+    plod=_lodSlices_v+(lod-1)*_materials_n+idx;
+    _draw(plod->vertexOffset,plod->vertexCount);
+    return;
+  }
+  _draw(
     _materials_v[idx].vertexOffset,
     _materials_v[idx].vertexCount);
 }
 
-void StaticMesh::render(SceneContext ctx) {
+void StaticMesh::sendLOD(int lod) {
+  if ((lod<=0)||(lod>=_lodCount)) {
+    send();
+    return;
+  }
+  _draw(_lods[lod].indexOffset,_lods[lod].indexCount);
+}
+
+void StaticMesh::render(SceneContext ctx, int lod) {
   size_t idx;
   MaterialSlice *pmat;
   
@@ -631,10 +2055,7 @@ void StaticMesh::render(SceneContext ctx) {
   FOREACH(idx,pmat,_materials) {
     if (pmat->mat->shader()) {
       pmat->mat->bind(ctx);
-      glDrawArrays(
-        GL_TRIANGLES,
-        pmat->vertexOffset,
-        pmat->vertexCount);
+      send((int)idx,lod);
       pmat->mat->unbind();
     }
   }
@@ -643,18 +2064,34 @@ void StaticMesh::render(SceneContext ctx) {
 }
 
 void StaticMesh::clear() {
-  int i;
+  int i, j;
   size_t idx;
   MaterialSlice *pmat;
   
   _vertexCount=0;
   for(i=0;i<MAX_ARRAY_BUFFERS;i++) if (_buffers[i].handle) {
-    glDeleteBuffers(1,&_buffers[i].handle);
+    // interleaved attributes share their handle
+    for(j=0;(j<i)&&(_buffers[j].handle!=_buffers[i].handle);j++);
+    if (j==i) glDeleteBuffers(1,&_buffers[i].handle);
   }
   memset(_buffers,0,sizeof(_buffers));
+  if (_vao) glDeleteVertexArrays(1,&_vao);
+  _vao=0;
+  _boundsMin.set(0,0,0);
+  _boundsMax.set(0,0,0);
+  _bounds_generation++;
+  _positionTransform.setIdentity();
+  if (_indexBuffer) glDeleteBuffers(1,&_indexBuffer);
+  _indexBuffer=0;
+  _indexCount=0;
   FOREACH(idx,pmat,_materials) 
     pmat->mat->drop();
   ARRAY_DESTROY(_materials);
+  memset(_lods,0,sizeof(_lods));
+  _lodCount=1;
+  ARRAY_DESTROY(_lodSlices);
+  ARRAY_DESTROY(_occluderVertices);
+  ARRAY_DESTROY(_occluderIndices);
   
   
   if (_filename) free((void*)_filename);
@@ -664,7 +2101,7 @@ void StaticMesh::clear() {
 void StaticMesh::reload() {
   if (_filename) {
     switch(_fileFormat) {
-      case 0: loadOBJFile(_filename); break;
+      case 0: loadOBJFile(_filename,_loadFlags); break;
       case 1: loadDOFFile(_filename); break;
     }
   }
@@ -677,17 +2114,74 @@ timestamp_t StaticMesh::filesTimestamp() {
 
 
 int StaticMesh::load(const char *fn, int flags) {
-  
-  size_t len=strlen(fn);
-  clear();
+  if (!prepare(fn,flags)) return 0;
+  return finish(fn,flags);
+}
+
+int StaticMesh::prepare(const char *fn, int /*flags*/) {
+  size_t len=strlen(fn), i;
+  int format;
+  
+  if (_prepared) {
+    _meshDataFree(_prepared);
+    free((void*)_prepared);
+    _prepared=0;
+  }
   
   if (len<4) return 0;
   if (strcmp_ic(fn+len-4,".obj")==0) {
-    loadOBJFile(fn);
+    format=0;
   } else if (strcmp_ic(fn+len-4,".dof")==0) {
-    loadDOFFile(fn);
+    format=1;
+  } else {
+    return 1;
+  }
+  
+  _prepared=(staticmesh_data_t*)malloc(sizeof(staticmesh_data_t));
+  if (!_meshRead(_prepared,fn,format)) {
+    _meshDataFree(_prepared);
+    free((void*)_prepared);
+    _prepared=0;
+    return 1;
+  }
+  
+  // fault in the mapped pages here rather than during the upload
+  if (format==1)
+    for(i=0;i<_prepared->cb;i+=4096)
+      (void)((const volatile char*)_prepared->data)[i];
+  
+  return 1;
+}
+
+int StaticMesh::finish(const char * /*fn*/, int flags) {
+  staticmesh_data_t *d=_prepared;
+  int r=1;
+  
+  _prepared=0;
+  clear();
+  
+  // unknown or missing files leave the mesh empty, just like load did
+  if (!d) return 1;
+  
+  switch(d->format) {
+    case 0: 
+      _assembleOBJ(d,0,flags);
+      _loadFlags=flags;
+      break;
+    case 1: 
+      r=_assembleDOF(d); 
+      break;
+  }
+  
+  if (r) {
+    _filename=d->fn;
+    _fileFormat=d->format;
+    d->fn=0;
   }
   
+  _meshDataFree(d);
+  free((void*)d);
+  
   return 1;
 }
 
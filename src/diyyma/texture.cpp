@@ -16,27 +16,36 @@
 #include "diyyma/config.h"
 #include "diyyma/util.h"
 #include "diyyma/texture.h"
+#include "diyyma/jobs.h"
+
+/** \brief Image decoded into memory, ready to be uploaded. */
+struct texture_image_t {
+  char *fn;
+  void *data;
+  int   width, height;
+  int   HDR;
+};
 
 #if DIYYMA_TEXTURE_IL
-GLuint loadTextureFile(const char *fn_in, GLuint tex_in, 
-  GLenum target_texture, GLenum target_image,
-  int HDR) {
-  ILuint img=0;
-  GLuint tex=tex_in;
-  char *fn=0;
+/** \brief Decodes an already located image file.
+  *
+  * This does not touch the OpenGL context and may run on worker threads.
+  */
+static int _decodeTextureFile(const char *fn, int HDR, texture_image_t *img) {
+  ILuint id=0;
+  size_t cb;
+  int r=0;
   
+  img->data=0;
+  img->HDR =HDR;
   
-  if (!(fn=vfs_locate(fn_in,REPOSITORY_MASK_TEXTURE))) {
-    LOG_WARNING(
-      "WARNING: unable to find texture file '%s'\n",
-      fn_in);
-    goto finalize;
-  }
+  // DevIL keeps its state globally
+  job_lock(JOB_LOCK_IMAGE);
   
   ilEnable(IL_ORIGIN_SET);
   ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
-  ilGenImages(1,&img);
-  ilBindImage(img);
+  ilGenImages(1,&id);
+  ilBindImage(id);
   
   if (ilLoadImage(fn)!=1) {
     LOG_WARNING(
@@ -51,42 +60,77 @@ GLuint loadTextureFile(const char *fn_in, GLuint tex_in,
   
   ilConvertImage(HDR?IL_RGB:IL_RGBA,HDR?IL_FLOAT:IL_UNSIGNED_BYTE);
   
-  if (!tex) glGenTextures(1,&tex);
-  glBindTexture(target_texture,tex);
-  glTexImage2D(
-    target_image,0,HDR?GL_R11F_G11F_B10F:GL_RGBA,
-    ilGetInteger(IL_IMAGE_WIDTH),ilGetInteger(IL_IMAGE_HEIGHT),
-    0,HDR?GL_RGB:GL_RGBA,HDR?GL_FLOAT:GL_UNSIGNED_BYTE,
-    ilGetData());
-  glTexParameteri(target_texture,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
-  glTexParameteri(target_texture,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+  img->width =ilGetInteger(IL_IMAGE_WIDTH);
+  img->height=ilGetInteger(IL_IMAGE_HEIGHT);
+  cb=ilGetInteger(IL_IMAGE_SIZE_OF_DATA);
+  img->data=malloc(cb);
+  memcpy(img->data,ilGetData(),cb);
+  
+  r=1;
+  
   finalize:
   
-  if (fn) free((void*)fn);
-  if (img) ilDeleteImages(1,&img);
+  if (id) ilDeleteImages(1,&id);
+  job_unlock(JOB_LOCK_IMAGE);
   
-  return tex;
+  return r;
 }
 #else
-GLuint loadTextureFile(const char *fn_in, GLuint tex_in, 
-  GLenum target_texture, GLenum target_image,
-  int HDR) {
+static int _decodeTextureFile(const char *fn, int HDR, texture_image_t *img) {
   LOG_WARNING("WARNING: No texture loading backend implemented\n");
   return 0;
 }
 #endif
 
+static void _uploadTexture(
+  const texture_image_t *img, GLuint tex, 
+  GLenum target_texture, GLenum target_image) {
+  glBindTexture(target_texture,tex);
+  glTexImage2D(
+    target_image,0,img->HDR?GL_R11F_G11F_B10F:GL_RGBA,
+    img->width,img->height,
+    0,img->HDR?GL_RGB:GL_RGBA,img->HDR?GL_FLOAT:GL_UNSIGNED_BYTE,
+    img->data);
+  glTexParameteri(target_texture,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+  glTexParameteri(target_texture,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+}
+
+GLuint loadTextureFile(const char *fn_in, GLuint tex_in, 
+  GLenum target_texture, GLenum target_image,
+  int HDR) {
+  texture_image_t img;
+  GLuint tex=tex_in;
+  char *fn=0;
+  
+  if (!(fn=vfs_locate(fn_in,REPOSITORY_MASK_TEXTURE))) {
+    LOG_WARNING(
+      "WARNING: unable to find texture file '%s'\n",
+      fn_in);
+    return tex;
+  }
+  
+  if (_decodeTextureFile(fn,HDR,&img)) {
+    if (!tex) glGenTextures(1,&tex);
+    _uploadTexture(&img,tex,target_texture,target_image);
+    free(img.data);
+  }
+  
+  free((void*)fn);
+  
+  return tex;
+}
+
 #ifdef _MSC_VER
 Texture::Texture(): 
   _filename(0), _slot(-1),
-  _target(GL_TEXTURE_2D), _loadHDR(0) {
+  _target(GL_TEXTURE_2D), _loadHDR(0), _prepared(0) {
   _filename_cube[0] = 0; _filename_cube[1] = 0; _filename_cube[2] = 0;
   _filename_cube[3] = 0; _filename_cube[4] = 0; _filename_cube[5] = 0; 
   glGenTextures(1,&_name);
 }
 Texture::Texture(GLenum target): 
   _filename(0), _slot(-1),
-  _target(target), _loadHDR(0) {
+  _target(target), _loadHDR(0), _prepared(0) {
   _filename_cube[0] = 0; _filename_cube[1] = 0; _filename_cube[2] = 0;
   _filename_cube[3] = 0; _filename_cube[4] = 0; _filename_cube[5] = 0; 
   glGenTextures(1,&_name);
@@ -95,13 +139,13 @@ Texture::Texture(GLenum target):
 Texture::Texture(): 
   _filename(0), _filename_cube{0,0,0,0,0,0},
    _slot(-1), _target(GL_TEXTURE_2D),
-  _loadHDR(0) {
+  _loadHDR(0), _prepared(0) {
   glGenTextures(1,&_name);
 }
 Texture::Texture(GLenum target): 
   _filename(0), _filename_cube{0,0,0,0,0,0},
    _slot(-1), _target(target),
-  _loadHDR(0) {
+  _loadHDR(0), _prepared(0) {
   glGenTextures(1,&_name);
 }
 
@@ -110,7 +154,7 @@ Texture::Texture(GLenum target):
 #ifdef _MSC_VER
 Texture::Texture(const char *fn_in): 
   _filename(0), _slot(-1), 
-  _target(GL_TEXTURE_2D), _loadHDR(0) {
+  _target(GL_TEXTURE_2D), _loadHDR(0), _prepared(0) {
   _filename_cube[0] = 0; _filename_cube[1] = 0; _filename_cube[2] = 0;
   _filename_cube[3] = 0; _filename_cube[4] = 0; _filename_cube[5] = 0; 
   glGenTextures(1,&_name);
@@ -120,7 +164,7 @@ Texture::Texture(const char *fn_in):
 Texture::Texture(const char *fn_in): 
   _filename(0), _filename_cube{0,0,0,0,0,0},
    _slot(-1), _target(GL_TEXTURE_2D),
-  _loadHDR(0) {
+  _loadHDR(0), _prepared(0) {
   
   glGenTextures(1,&_name);
   load(fn_in,0);
@@ -130,6 +174,11 @@ Texture::Texture(const char *fn_in):
 
 Texture::~Texture() {
   if (_filename) free((void*)_filename);
+  if (_prepared) {
+    free((void*)_prepared->fn);
+    free(_prepared->data);
+    free((void*)_prepared);
+  }
   
   if (_name) glDeleteTextures(1,&_name);
 }
@@ -333,6 +382,47 @@ int Texture::load(const char *fn, int flags) {
   return 1;
 }
 
+int Texture::prepare(const char *fn, int flags) {
+  texture_image_t *img;
+  char *fn_located;
+  
+  if (flags&TEXTURE_LOAD_CUBEMAP) return 1;
+  
+  if (!(fn_located=vfs_locate(fn,REPOSITORY_MASK_TEXTURE))) {
+    LOG_WARNING(
+      "WARNING: unable to locate texture file '%s'\n",fn);
+    return 0;
+  }
+  
+  img=(texture_image_t*)malloc(sizeof(texture_image_t));
+  img->fn=fn_located;
+  if (!_decodeTextureFile(fn_located,flags&TEXTURE_LOAD_HDR,img)) {
+    free((void*)fn_located);
+    free((void*)img);
+    return 0;
+  }
+  
+  _prepared=img;
+  
+  return 1;
+}
+
+int Texture::finish(const char *fn, int flags) {
+  if (!_prepared) return load(fn,flags);
+  
+  _loadHDR=flags&TEXTURE_LOAD_HDR;
+  
+  if (_filename) free((void*)_filename);
+  _filename=_prepared->fn;
+  
+  _uploadTexture(_prepared,_name,_target,_target);
+  
+  free(_prepared->data);
+  free((void*)_prepared);
+  _prepared=0;
+  
+  return 1;
+}
 
 AssetRegistry<Texture> *_reg_tex=0;
 AssetRegistry<Texture> *reg_tex() {
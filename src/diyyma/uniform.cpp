@@ -1,34 +1,114 @@
-
-/** \file manager.h
+/** \file uniform.cpp
   * \author Peter Wagener
-  * \brief Management of asset loading, scene composition and modification.
-  *
+  * \brief Uniform blocks and their storage in uniform buffers.
   *
   */
 
+#include <string.h>
+
+#include "diyyma/config.h"
 #include "diyyma/uniform.h"
 
-UniformBlock::UniformBlock() {
+/** \brief Bytes per component, columns and rows of a uniform format. */
+struct uniform_shape_t {
+  unsigned char component, columns, rows;
+};
+
+static const uniform_shape_t UNIFORM_SHAPE[UNIFORM_FORMAT_COUNT]={
+  {4,1,1},{4,1,1},{4,1,1},{4,1,1},{8,1,1},
+  {4,1,2},{4,1,3},{4,1,4},
+  {4,1,2},{4,1,3},{4,1,4},
+  {4,1,2},{4,1,3},{4,1,4},
+  {4,1,2},{4,1,3},{4,1,4},
+  {8,1,2},{8,1,3},{8,1,4},
+  {4,2,2},{4,3,3},{4,4,4},
+  {4,2,3},{4,2,4},
+  {4,3,2},{4,3,4},
+  {4,4,2},{4,4,3},
+  
+  {8,2,2},{8,3,3},{8,4,4},
+  {8,2,3},{8,2,4},
+  {8,3,2},{8,3,4},
+  {8,4,2},{8,4,3}
+};
+
+#define UNIFORM_ALIGN(v,a) (((v)+(a)-1)/(a)*(a))
+
+/** \brief Base alignment of a single column of a format, which for
+  * vectors is also the alignment of the whole value.
+  */
+static size_t uniform_column_alignment(GLenum fmt) {
+  const uniform_shape_t *s=UNIFORM_SHAPE+fmt;
+  return s->component*(s->rows==1?1:s->rows==2?2:4);
+}
+
+/** \brief Distance between the columns of a matrix format. */
+static size_t uniform_column_stride(GLenum fmt, int layout) {
+  size_t a=uniform_column_alignment(fmt);
+  if (layout==UNIFORM_LAYOUT_STD140) a=UNIFORM_ALIGN(a,16);
+  return a;
+}
+
+UniformBlock::UniformBlock(int layout) :
+  _layout(layout), _end(0), _cb(0), _data(0), _ubo(0), _uboCb(0) {
   ARRAY_INIT(_formats);
-  _data=0;
-  glGenBuffers(1,&_ubo);
+  ARRAY_INIT(_offsets);
+  ARRAY_INIT(_strides);
+  ARRAY_INIT(_counts);
 }
 UniformBlock::~UniformBlock() {
-  glDeleteBuffers(1,&_ubo);
+  if (_ubo) glDeleteBuffers(1,&_ubo);
   if (_data) free(_data);
   ARRAY_DESTROY(_formats);
+  ARRAY_DESTROY(_offsets);
+  ARRAY_DESTROY(_strides);
+  ARRAY_DESTROY(_counts);
 }
 
-void UniformBlock::operator+(GLenum fmt) {
-  size_t cbf;
-  if (fmt>=UNIFORM_FORMAT_COUNT) return;
+unsigned UniformBlock::add(GLenum fmt, unsigned count) {
+  const uniform_shape_t *s;
+  size_t align, size, stride, offset, cb;
+  
+  if ((fmt>=UNIFORM_FORMAT_COUNT) || !count) return (unsigned)-1;
+  s=UNIFORM_SHAPE+fmt;
+  
+  if (s->columns>1) {
+    // matrices are laid out as arrays of their columns
+    align=uniform_column_stride(fmt,_layout);
+    size=align*s->columns;
+  } else {
+    align=uniform_column_alignment(fmt);
+    size=s->component*s->rows;
+  }
+  
+  stride=size;
+  if (count>1) {
+    if (_layout==UNIFORM_LAYOUT_STD140) align=UNIFORM_ALIGN(align,16);
+    stride=UNIFORM_ALIGN(size,align);
+    size=stride*count;
+  }
   
-  cbf=UNIFORM_SIZE[fmt];
+  offset=UNIFORM_ALIGN(_end,align);
+  _end=offset+size;
   
-  _cb+=cbf;
-  _data=realloc(_data,_cb);
+  // the block is a struct, whose size is a multiple of its alignment
+  cb=UNIFORM_ALIGN(_end,16);
+  if (cb!=_cb) {
+    _data=realloc(_data,cb);
+    memset((char*)_data+_cb,0,cb-_cb);
+    _cb=cb;
+  }
   
   APPEND(_formats,fmt);
+  APPEND(_offsets,offset);
+  APPEND(_strides,stride);
+  APPEND(_counts,count);
+  
+  return _formats_n-1;
+}
+
+void UniformBlock::operator+(GLenum fmt) {
+  add(fmt,1);
 }
 
 GLenum UniformBlock::operator[](unsigned int idx) const {
@@ -38,12 +118,293 @@ size_t UniformBlock::count() const { return _formats_n; }
 size_t UniformBlock::cb() const { return _cb; }
 void *UniformBlock::data() const { return _data; }
 
+size_t UniformBlock::offset(unsigned idx, unsigned element) const {
+  return _offsets_v[idx]+_strides_v[idx]*element;
+}
+
+size_t UniformBlock::stride(unsigned idx) const {
+  return _strides_v[idx];
+}
+
+void *UniformBlock::member(unsigned idx, unsigned element) const {
+  return (char*)_data+offset(idx,element);
+}
+
+void UniformBlock::set(unsigned idx, const void *value, unsigned element) {
+  GLenum fmt;
+  const uniform_shape_t *s;
+  const unsigned char *src=(const unsigned char*)value;
+  unsigned char *dst;
+  size_t cs, cc;
+  GLuint b;
+  int i;
+  
+  if ((idx>=_formats_n) || (element>=_counts_v[idx])) return;
+  
+  fmt=_formats_v[idx];
+  s=UNIFORM_SHAPE+fmt;
+  dst=(unsigned char*)member(idx,element);
+  
+  if (((fmt>=UNIFORM_BVEC2) && (fmt<=UNIFORM_BVEC4)) || (fmt==UNIFORM_BOOL)) {
+    // packed booleans are bytes, in a block they take up a uint each
+    for(i=0;i<s->rows;i++) {
+      b=src[i]?1:0;
+      memcpy(dst+i*4,&b,4);
+    }
+    return;
+  }
+  
+  cc=s->component*s->rows;
+  if (s->columns==1) {
+    memcpy(dst,src,cc);
+    return;
+  }
+  
+  cs=uniform_column_stride(fmt,_layout);
+  for(i=0;i<s->columns;i++)
+    memcpy(dst+cs*i,src+cc*i,cc);
+}
+
+void UniformBlock::set(unsigned idx, float v, unsigned element) {
+  if ((idx<_formats_n) && (_formats_v[idx]==UNIFORM_FLOAT))
+    set(idx,(const void*)&v,element);
+}
+
+void UniformBlock::set(unsigned idx, int v, unsigned element) {
+  if ((idx<_formats_n) && (_formats_v[idx]==UNIFORM_INT))
+    set(idx,(const void*)&v,element);
+}
+
+void UniformBlock::set(unsigned idx, unsigned v, unsigned element) {
+  if ((idx<_formats_n) && (_formats_v[idx]==UNIFORM_UINT))
+    set(idx,(const void*)&v,element);
+}
+
+void UniformBlock::set(unsigned idx, const Vector3f &v, unsigned element) {
+  if ((idx<_formats_n) && (_formats_v[idx]==UNIFORM_VEC3))
+    set(idx,(const void*)&v.x,element);
+}
+
+void UniformBlock::set(unsigned idx, const Vector4f &v, unsigned element) {
+  if ((idx<_formats_n) && (_formats_v[idx]==UNIFORM_VEC4))
+    set(idx,(const void*)&v.x,element);
+}
+
+void UniformBlock::set(unsigned idx, const Matrixf &m, unsigned element) {
+  const uniform_shape_t *s;
+  const float *src=&m.a11;
+  float column[4];
+  unsigned char *dst;
+  size_t cs;
+  int i, j;
+  
+  if ((idx>=_formats_n) || (element>=_counts_v[idx])) return;
+  if ((_formats_v[idx]<UNIFORM_MAT2) || (_formats_v[idx]>UNIFORM_MAT4x3))
+    return;
+  
+  s=UNIFORM_SHAPE+_formats_v[idx];
+  cs=uniform_column_stride(_formats_v[idx],_layout);
+  dst=(unsigned char*)member(idx,element);
+  
+  // the upper left part of the matrix, column by column
+  for(j=0;j<s->columns;j++) {
+    for(i=0;i<s->rows;i++)
+      #if MATRIX_COLUMN_FIRST
+        column[i]=src[j*4+i];
+      #else
+        column[i]=src[i*4+j];
+      #endif
+    memcpy(dst+cs*j,column,s->rows*sizeof(float));
+  }
+}
+
 void UniformBlock::update() {
+  if (!_cb) return;
+  if (!_ubo) glGenBuffers(1,&_ubo);
+  
   glBindBuffer(GL_UNIFORM_BUFFER,_ubo);
-  glBufferData(GL_UNIFORM_BUFFER,_cb,_data,GL_DYNAMIC_DRAW);
+  if (_uboCb!=_cb) {
+    glBufferData(GL_UNIFORM_BUFFER,_cb,_data,GL_DYNAMIC_DRAW);
+    _uboCb=_cb;
+  } else
+    glBufferSubData(GL_UNIFORM_BUFFER,0,_cb,_data);
   glBindBuffer(GL_UNIFORM_BUFFER,0);
 }
 
 void UniformBlock::bind(GLuint idx) const {
-  glBindBufferBase(GL_UNIFORM_BUFFER,idx,_ubo);
-}
\ No newline at end of file
+  if (_ubo) glBindBufferBase(GL_UNIFORM_BUFFER,idx,_ubo);
+}
+
+int UniformBlock::submit(UniformRing *ring, GLuint idx) const {
+  size_t offset;
+  void *p;
+  
+  if (!ring || !_cb) return 0;
+  if (!(p=ring->alloc(_cb,&offset))) return 0;
+  
+  memcpy(p,_data,_cb);
+  ring->bind(idx,offset,_cb);
+  return 1;
+}
+
+
+UniformRing::UniformRing(size_t cb) :
+  _ubo(0), _mapped(0), _shadow(0), _persistent(0),
+  _region(UNIFORM_RING_FRAMES-1), _used(0), _frame(0),
+  _full(0) {
+  GLint alignment=0;
+  GLbitfield flags;
+  size_t total;
+  int i;
+  
+  for(i=0;i<UNIFORM_RING_FRAMES;i++) _fences[i]=0;
+  for(i=0;i<UNIFORM_RING_BINDINGS;i++) _boundCb[i]=0;
+  
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT,&alignment);
+  _alignment=alignment>0?alignment:256;
+  _frameCb=UNIFORM_ALIGN(cb,_alignment);
+  total=_frameCb*UNIFORM_RING_FRAMES;
+  
+  glGenBuffers(1,&_ubo);
+  glBindBuffer(GL_UNIFORM_BUFFER,_ubo);
+  
+  if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+    flags=GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_UNIFORM_BUFFER,total,0,flags);
+    _mapped=(unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER,0,total,flags);
+    if (_mapped) {
+      _persistent=1;
+    } else {
+      // the storage is immutable, so start over with a new buffer
+      LOG_WARNING(
+        "WARNING: could not map uniform ring, falling back to copies\n");
+      glBindBuffer(GL_UNIFORM_BUFFER,0);
+      glDeleteBuffers(1,&_ubo);
+      glGenBuffers(1,&_ubo);
+      glBindBuffer(GL_UNIFORM_BUFFER,_ubo);
+    }
+  }
+  
+  if (!_persistent) {
+    glBufferData(GL_UNIFORM_BUFFER,total,0,GL_STREAM_DRAW);
+    _shadow=(unsigned char*)malloc(_frameCb);
+  }
+  
+  glBindBuffer(GL_UNIFORM_BUFFER,0);
+}
+
+UniformRing::~UniformRing() {
+  int i;
+  
+  for(i=0;i<UNIFORM_RING_FRAMES;i++)
+    if (_fences[i]) glDeleteSync(_fences[i]);
+  
+  if (_mapped) {
+    glBindBuffer(GL_UNIFORM_BUFFER,_ubo);
+    glUnmapBuffer(GL_UNIFORM_BUFFER);
+    glBindBuffer(GL_UNIFORM_BUFFER,0);
+  }
+  glDeleteBuffers(1,&_ubo);
+  if (_shadow) free(_shadow);
+}
+
+void UniformRing::beginFrame() {
+  GLsync fence;
+  int i;
+  
+  _region=(_region+1)%UNIFORM_RING_FRAMES;
+  
+  if ((fence=_fences[_region])) {
+    while(glClientWaitSync(fence,GL_SYNC_FLUSH_COMMANDS_BIT,1000000000)
+      ==GL_TIMEOUT_EXPIRED);
+    glDeleteSync(fence);
+    _fences[_region]=0;
+  }
+  
+  _used=0;
+  _full=0;
+  _frame++;
+  for(i=0;i<UNIFORM_RING_BINDINGS;i++) _boundCb[i]=0;
+}
+
+void UniformRing::endFrame() {
+  // copies made by glBufferSubData are synchronized by the driver
+  if (!_persistent) return;
+  if (_fences[_region]) glDeleteSync(_fences[_region]);
+  _fences[_region]=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE,0);
+}
+
+unsigned UniformRing::frame() {
+  return _frame;
+}
+
+void *UniformRing::alloc(size_t cb, size_t *offset) {
+  size_t start;
+  
+  start=UNIFORM_ALIGN(_used,_alignment);
+  if (start+cb>_frameCb) {
+    if (!_full) LOG_WARNING(
+      "WARNING: uniform ring out of space, %lu bytes per frame\n",
+      (unsigned long)_frameCb);
+    _full=1;
+    return 0;
+  }
+  
+  _used=start+cb;
+  *offset=_region*_frameCb+start;
+  
+  return (_mapped?_mapped+*offset:_shadow+start);
+}
+
+void UniformRing::bind(GLuint idx, size_t offset, size_t cb) {
+  if (idx<UNIFORM_RING_BINDINGS) {
+    if ((_boundCb[idx]==cb) && (_boundOffset[idx]==offset)) return;
+    _boundOffset[idx]=offset;
+    _boundCb[idx]=cb;
+  }
+  
+  // only the bound range, other allocations may not be written yet
+  if (!_persistent) {
+    glBindBuffer(GL_UNIFORM_BUFFER,_ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER,offset,cb,
+      _shadow+(offset-_region*_frameCb));
+    glBindBuffer(GL_UNIFORM_BUFFER,0);
+  }
+  
+  glBindBufferRange(GL_UNIFORM_BUFFER,idx,_ubo,offset,cb);
+}
+
+GLuint UniformRing::buffer() {
+  return _ubo;
+}
+
+
+static UniformRing *_uniform_ring=0;
+
+UniformRing *uniform_ring() {
+  if (!_uniform_ring) {
+    if (!GLEW_VERSION_3_1 && !GLEW_ARB_uniform_buffer_object) return 0;
+    _uniform_ring=new UniformRing();
+  }
+  return _uniform_ring;
+}
+
+void uniform_ring_free() {
+  if (_uniform_ring) delete _uniform_ring;
+  _uniform_ring=0;
+}
+
+void uniform_frame_begin() {
+  UniformRing *ring;
+  if ((ring=uniform_ring())) ring->beginFrame();
+}
+
+void uniform_frame_end() {
+  if (_uniform_ring) _uniform_ring->endFrame();
+}
+
+int uniform_block_binding(const char *name) {
+  if (strcmp(name,UNIFORM_BLOCK_FRAME)==0) return UNIFORM_BINDING_FRAME;
+  if (strcmp(name,UNIFORM_BLOCK_LIGHTS)==0) return UNIFORM_BINDING_LIGHTS;
+  return -1;
+}
@@ -9,6 +9,7 @@
 #include <string.h>
 #include "diyyma/config.h"
 #include "diyyma/util.h"
+#include "diyyma/jobs.h"
 
 int _logMask=LOG_MASK_ERROR|LOG_MASK_WARNING|LOG_MASK_INFO;
 int logMask() { return _logMask; }
@@ -49,6 +50,20 @@ int readFile(const char *fn,void **data, size_t *cb) {
   return 1;
 }
 
+int writeFile(const char *fn, const void *data, size_t cb) {
+  FILE *f;
+  size_t cbWritten;
+  
+  f=fopen(fn,"wb");
+  if (!f) return 0;
+  
+  cbWritten=fwrite(data,1,cb,f);
+  
+  if (fclose(f)!=0) return 0;
+  
+  return cbWritten==cb;
+}
+
 #ifdef _WIN32
 #include <windows.h>
 
@@ -70,16 +85,22 @@ struct file_list_t {
 };
 file_list_t *_file_list_v=0;
 size_t       _file_list_n=0;
+size_t       _file_list_s=0;
 
 void file_list_append(const char *fn) {
   size_t idx;
   file_list_t *pfile;
+  
+  // files are also read on worker threads
+  job_lock(JOB_LOCK_FILE_LIST);
   FOREACH(idx,pfile,_file_list) 
     if (strcmp(fn,pfile->name)==0) {
       pfile->refcount++;
+      job_unlock(JOB_LOCK_FILE_LIST);
       return;
     }
   APPEND(_file_list,file_list_t(fn));
+  job_unlock(JOB_LOCK_FILE_LIST);
 }
 
 void file_list_print(FILE *f) {
@@ -124,33 +145,145 @@ timestamp_t file_timestamp(const char *fn) {
   return r;
 }
 
+double clock_seconds() {
+  LARGE_INTEGER t, f;
+  
+  QueryPerformanceCounter(&t);
+  QueryPerformanceFrequency(&f);
+  
+  return (double)t.QuadPart/(double)f.QuadPart;
+}
+
+int mapFile(const char *fn, const void **data, size_t *cb) {
+  HANDLE h=INVALID_HANDLE_VALUE, hMap=0;
+  LARGE_INTEGER size;
+  int r=0;
+  
+  if (INVALID_HANDLE_VALUE==(h=CreateFileA(
+    fn,GENERIC_READ,FILE_SHARE_READ,
+    0,OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,0)))
+    goto finalize;
+  
+  if (!GetFileSizeEx(h,&size) || (size.QuadPart<1)) 
+    goto finalize;
+  
+  if (!(hMap=CreateFileMappingA(h,0,PAGE_READONLY,0,0,0)))
+    goto finalize;
+  
+  if (!(*data=MapViewOfFile(hMap,FILE_MAP_READ,0,0,0)))
+    goto finalize;
+  
+  *cb=(size_t)size.QuadPart;
+  r=1;
+  
+  #if DIYYMA_FILE_LIST>=2
+  file_list_append(fn);
+  #endif
+  
+  finalize:
+  // the view keeps the mapping alive on its own.
+  if (hMap) CloseHandle(hMap);
+  if (h!=INVALID_HANDLE_VALUE) CloseHandle(h);
+  
+  return r;
+}
+
+void unmapFile(const void *data, size_t cb) {
+  if (data) UnmapViewOfFile(data);
+}
+
+int dir_create(const char *path) {
+  if (CreateDirectoryA(path,0)) return 1;
+  return GetLastError()==ERROR_ALREADY_EXISTS;
+}
+
 
 #else
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
 
 int file_exists(const char *str) {
-  return access(str,F_OK);
+  return access(str,F_OK)==0;
 }
 
 timestamp_t file_timestamp(const char *fn) {
-#pragma message "WARNING: file_timestamp not yet implemented for this environment!"
-  return 0;
+  struct stat st;
+  
+  if (stat(fn,&st)!=0) return 0;
+  
+  // nanoseconds, so that changes within the same second are noticed
+  #ifdef __APPLE__
+    return (timestamp_t)st.st_mtimespec.tv_sec*1000000000ull
+      +st.st_mtimespec.tv_nsec;
+  #else
+    return (timestamp_t)st.st_mtim.tv_sec*1000000000ull+st.st_mtim.tv_nsec;
+  #endif
+}
+
+double clock_seconds() {
+  struct timespec t;
+  
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  
+  return (double)t.tv_sec+(double)t.tv_nsec*1e-9;
+}
+
+int mapFile(const char *fn, const void **data, size_t *cb) {
+  struct stat st;
+  void *p;
+  int fd;
+  
+  if ((fd=open(fn,O_RDONLY))<0) return 0;
+  
+  if ((fstat(fd,&st)!=0) || (st.st_size<1)) {
+    close(fd);
+    return 0;
+  }
+  
+  p=mmap(0,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (p==MAP_FAILED) return 0;
+  
+  #ifdef MADV_SEQUENTIAL
+  madvise(p,(size_t)st.st_size,MADV_SEQUENTIAL);
+  #endif
+  
+  #if DIYYMA_FILE_LIST>=2
+  file_list_append(fn);
+  #endif
+  
+  *data=p;
+  *cb  =(size_t)st.st_size;
+  
+  return 1;
+}
+
+void unmapFile(const void *data, size_t cb) {
+  if (data) munmap((void*)data,cb);
+}
+
+int dir_create(const char *path) {
+  if (mkdir(path,0755)==0) return 1;
+  return errno==EEXIST;
 }
 
 #endif
 
 
 struct Repository {
-  char **path_v;
-  size_t path_n;
+  ARRAY(char*,path);
 };
 
 Repository _repositories[REPOSITORY_COUNT]= {
-  {0,0}, {0,0}, {0,0}, {0,0},
-  {0,0}, {0,0}, {0,0}, {0,0},
-  {0,0}, {0,0}, {0,0}, {0,0},
-  {0,0}, {0,0}, {0,0}, {0,0}
+  {0,0,0}, {0,0,0}, {0,0,0}, {0,0,0},
+  {0,0,0}, {0,0,0}, {0,0,0}, {0,0,0},
+  {0,0,0}, {0,0,0}, {0,0,0}, {0,0,0},
+  {0,0,0}, {0,0,0}, {0,0,0}, {0,0,0}
 };
 
 
@@ -158,10 +291,7 @@ void vfs_registerPath(const char *path, int mask) {
   int i;
   
   for(i=0;i<REPOSITORY_COUNT;i++) if (mask&(1<<i)) {
-    _repositories[i].path_v=(char**)realloc(
-      (void*)_repositories[i].path_v,
-      sizeof(char*)*(_repositories[i].path_n+1));
-    _repositories[i].path_v[_repositories[i].path_n++]=strdup(path);
+    APPEND(_repositories[i].path,strdup(path));
   }
   
 }
@@ -237,6 +367,7 @@ size_t vfs_locate_all(const char *fn, int mask, char ***files) {
 #if DIYYMA_RC_NO_AUTODELETE||DIYYMA_RC_GLOBAL_LIST
 RCObject **__rcobjects_v=0;
 size_t     __rcobjects_n=0;
+size_t     __rcobjects_s=0;
 #endif
 RCObject::RCObject() {
   #if DIYYMA_RC_NO_AUTODELETE||DIYYMA_RC_GLOBAL_LIST
@@ -358,6 +489,78 @@ char *strdup(const char *str) throw() {
   
 }
 
+double strtod_n(const char *p, const char *e, const char **endptr) {
+  static const double pow10[]={
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22 };
+  const char *p0=p, *q;
+  unsigned long long m=0;
+  int neg=0, digits=0, e10=0, exp=0, eneg=0;
+  double res;
+  char buf[64];
+  char *bufend;
+  size_t cb;
+  
+  if ((p<e)&&((*p=='+')||(*p=='-'))) {
+    neg=*p=='-';
+    p++;
+  }
+  
+  // hexadecimal literals are left to strtod
+  if ((p+1<e)&&(*p=='0')&&((p[1]|0x20)=='x')) goto fallback;
+  
+  // mantissa, keeping only as many digits as fit into 64 bits
+  for(;(p<e)&&(*p>='0')&&(*p<='9');p++,digits++) {
+    if (m<100000000000000000ull) m=m*10+(*p-'0');
+    else e10++;
+  }
+  if ((p<e)&&(*p=='.')) {
+    for(p++;(p<e)&&(*p>='0')&&(*p<='9');p++,digits++) {
+      if (m<100000000000000000ull) {
+        m=m*10+(*p-'0');
+        e10--;
+      }
+    }
+  }
+  
+  // inf, nan and the like
+  if (!digits) goto fallback;
+  
+  if ((p<e)&&((*p|0x20)=='e')) {
+    q=p+1;
+    if ((q<e)&&((*q=='+')||(*q=='-'))) {
+      eneg=*q=='-';
+      q++;
+    }
+    if ((q<e)&&(*q>='0')&&(*q<='9')) {
+      for(;(q<e)&&(*q>='0')&&(*q<='9');q++) 
+        if (exp<10000) exp=exp*10+(*q-'0');
+      p=q;
+    }
+  }
+  e10+=eneg?-exp:exp;
+  
+  // beyond this, the result would not be exact anymore
+  if ((m>(1ull<<53))||(e10<-22)||(e10>22)) goto fallback;
+  
+  res=(double)m;
+  if (e10<0) res/=pow10[-e10];
+  else       res*=pow10[e10];
+  
+  if (endptr) *endptr=p;
+  return neg?-res:res;
+  
+  fallback:
+  cb=(size_t)e-(size_t)p0;
+  if (cb>sizeof(buf)-1) cb=sizeof(buf)-1;
+  memcpy(buf,p0,cb);
+  buf[cb]=0;
+  
+  res=strtod(buf,&bufend);
+  if (endptr) *endptr=p0+(bufend-buf);
+  return res;
+}
+
 int strcmp_ic(const char *a, const char *b) {
   
   do {
@@ -375,6 +578,120 @@ int strcmp_ic(const char *a, const char *b) {
   return 0;
 }
 
+StringIndex::StringIndex() : _table(0), _mask(0), _count(0) {
+}
+
+StringIndex::~StringIndex() {
+  if (_table) free((void*)_table);
+}
+
+size_t StringIndex::Hash(const char *key, size_t length) {
+  size_t h=(size_t)2166136261u;
+  const char *e=key+length;
+  
+  for(;key<e;key++) {
+    h^=(unsigned char)*key;
+    h*=16777619u;
+  }
+  
+  return h;
+}
+
+/** \brief Returns the slot holding a key, or the empty slot it would go to.
+  */
+size_t StringIndex::_slot(const char *key, size_t length, size_t hash) const {
+  size_t i=hash&_mask;
+  StringIndexEntry *e;
+  
+  while((e=_table+i)->key) {
+    if ((e->hash==hash) && (e->length==length) 
+    && (memcmp(e->key,key,length)==0))
+      break;
+    i=(i+1)&_mask;
+  }
+  
+  return i;
+}
+
+void StringIndex::_grow() {
+  StringIndexEntry *old=_table;
+  size_t i, n=_table?_mask+1:0, s=n?n*2:16;
+  
+  _table=(StringIndexEntry*)malloc(sizeof(StringIndexEntry)*s);
+  memset(_table,0,sizeof(StringIndexEntry)*s);
+  _mask=s-1;
+  
+  for(i=0;i<n;i++) if (old[i].key)
+    _table[_slot(old[i].key,old[i].length,old[i].hash)]=old[i];
+  
+  if (old) free((void*)old);
+}
+
+int StringIndex::find(const SubString &key, size_t *value) const {
+  size_t i;
+  
+  if (!_count) return 0;
+  
+  i=_slot(key.ptr,key.length,Hash(key.ptr,key.length));
+  if (!_table[i].key) return 0;
+  
+  *value=_table[i].value;
+  return 1;
+}
+
+int StringIndex::find(const char *key, size_t *value) const {
+  SubString str;
+  
+  str.ptr   =key;
+  str.length=strlen(key);
+  
+  return find(str,value);
+}
+
+void StringIndex::insert(const char *key, size_t value) {
+  size_t length=strlen(key), hash=Hash(key,length), i;
+  
+  // keep the load factor at or below one half
+  if ((_count+1)*2>(_table?_mask+1:0)) _grow();
+  
+  i=_slot(key,length,hash);
+  if (!_table[i].key) _count++;
+  
+  _table[i].key   =key;
+  _table[i].length=length;
+  _table[i].hash  =hash;
+  _table[i].value =value;
+}
+
+int StringIndex::remove(const char *key) {
+  size_t length=strlen(key), i, j, k;
+  
+  if (!_count) return 0;
+  
+  i=_slot(key,length,Hash(key,length));
+  if (!_table[i].key) return 0;
+  
+  // shift back any following entries which would no longer be reachable
+  for(j=(i+1)&_mask;_table[j].key;j=(j+1)&_mask) {
+    k=_table[j].hash&_mask;
+    if (((j>i)&&((k<=i)||(k>j))) || ((j<i)&&((k<=i)&&(k>j)))) {
+      _table[i]=_table[j];
+      i=j;
+    }
+  }
+  _table[i].key=0;
+  _count--;
+  
+  return 1;
+}
+
+void StringIndex::clear() {
+  if (_table) free((void*)_table);
+  _table=0;
+  _mask=0;
+  _count=0;
+}
+
 LineScanner::LineScanner() :
   _data(0), _p(0), _end(0), _newLine(1) {
   
@@ -588,9 +905,8 @@ int LineScanner::getULong(unsigned long *pres, int nonl) {
 }
 
 int LineScanner::getDouble(double *pres, int nonl) {
-  char buf[32];
   double res;
-  char *endptr=0;
+  const char *endptr=0;
   
   SubString str;
   if (nonl) {
@@ -598,17 +914,10 @@ int LineScanner::getDouble(double *pres, int nonl) {
   } else {
     if (!getString(&str)) return 0;
   }
-  if (str.length>31) {
-    memcpy(buf,str.ptr,31);
-    buf[31]=0;
-  } else {
-    memcpy(buf,str.ptr,str.length);
-    buf[str.length]=0;
-  }
   
-  res=strtod(buf,&endptr);
+  res=strtod_n(str.ptr,str.ptr+str.length,&endptr);
   
-  if (endptr<=buf) 
+  if (endptr<=str.ptr) 
     return 0;
   
   *pres=res;
@@ -617,9 +926,8 @@ int LineScanner::getDouble(double *pres, int nonl) {
 
 
 int LineScanner::getFloat(float *pres, int nonl) {
-  char buf[32];
   double res;
-  char *endptr=0;
+  const char *endptr=0;
   
   SubString str;
   if (nonl) {
@@ -627,17 +935,10 @@ int LineScanner::getFloat(float *pres, int nonl) {
   } else {
     if (!getString(&str)) return 0;
   }
-  if (str.length>31) {
-    memcpy(buf,str.ptr,31);
-    buf[31]=0;
-  } else {
-    memcpy(buf,str.ptr,str.length);
-    buf[str.length]=0;
-  }
   
-  res=strtod(buf,&endptr);
+  res=strtod_n(str.ptr,str.ptr+str.length,&endptr);
   
-  if (endptr<=buf) 
+  if (endptr<=str.ptr) 
     return 0;
   
   *pres=(float)res;
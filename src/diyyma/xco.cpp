@@ -138,6 +138,29 @@ const char *xco_getErrorString() {
   *       
   */
   
+/** \brief Returns the chunk header at a given offset if it is consistent.
+  *
+  * Since the reader works on the XCO in place, including memory-mapped files,
+  * every header is checked to lie within the stream, and within its parent
+  * if specified, before it is used. 
+  */
+static XCOChunkHead *_xcor_head_at(
+  XCOReaderContext *ctx, size_t offs, const XCOChunkHead *parent) {
+  size_t cb=(size_t)ctx->end-(size_t)ctx->data;
+  XCOChunkHead *head;
+  
+  if ((offs>cb)||(cb-offs<sizeof(XCOChunkHead))) return 0;
+  head=(XCOChunkHead*)(ctx->data+offs);
+  
+  if (head->offsData  <offs+sizeof(XCOChunkHead)) return 0;
+  if (head->offsData  >head->offsChunks) return 0;
+  if (head->offsChunks>head->offsEnd) return 0;
+  if (head->offsEnd   >cb) return 0;
+  if (parent && (head->offsEnd>parent->offsEnd)) return 0;
+  
+  return head;
+}
+
 /** \brief Allocates an XCOReaderContext for reading a single XCO 
   * 
   * \param ctx Pointer to a XCOReaderContext reference to be allocated
@@ -160,6 +183,12 @@ int xcor_create(XCOReaderContext **ctx, const void *data, size_t cb) {
   (*ctx)->p   =(char*)data+sizeof(XCOChunkHead);
   (*ctx)->end =(char*)data+cb;
   
+  if (!_xcor_head_at(*ctx,0,0)) {
+    free(*ctx);
+    *ctx=0;
+    XCOERR(XCO_ERR_INVALID_STREAM,0);
+  }
+  
   (*ctx)->head=(XCOChunkHead*)data;
   (*ctx)->idxSubChunk=0;
   (*ctx)->sHeads=XCO_DEFAULT_SHEADS;
@@ -352,7 +381,7 @@ int xcor_data_readarr_i(XCOReaderContext *ctx, void **arr, size_t *pcb) {
 int _xcor_subchunk_push(XCOReaderContext *ctx, int idx) {
   if (ctx->sSubChunks<=ctx->nSubChunks) {
     ctx->sSubChunks=ctx->nSubChunks+1;
-    ctx->subChunks=(uint*)realloc((void*)ctx->heads,ctx->sSubChunks*sizeof(uint));
+    ctx->subChunks=(uint*)realloc((void*)ctx->subChunks,ctx->sSubChunks*sizeof(uint));
   }
   ctx->subChunks[ctx->nSubChunks++]=idx;
   return 1;
@@ -371,12 +400,9 @@ int xcor_chunk_sub(XCOReaderContext *ctx) {
   if (!ctx->data) XCOERR(XCO_ERR_INVALID_CONTEXT,0);
   if (ctx->head->nChunks<1) XCOERR(XCO_ERR_NO_CHILDREN,0);
   
-  XCOChunkHead *head=(XCOChunkHead*)(ctx->data+ctx->head->offsChunks);
+  XCOChunkHead *head=_xcor_head_at(ctx,ctx->head->offsChunks,ctx->head);
   
-  if (head->size>=ctx->head->size) XCOERR(XCO_ERR_INVALID_STREAM,0);
-  if (head->offsData  >ctx->head->offsChunks+head->size) XCOERR(XCO_ERR_INVALID_STREAM,0);
-  if (head->offsChunks>ctx->head->offsChunks+head->size) XCOERR(XCO_ERR_INVALID_STREAM,0);
-  if (head->offsEnd   >ctx->head->offsChunks+head->size) XCOERR(XCO_ERR_INVALID_STREAM,0);
+  if (!head) XCOERR(XCO_ERR_INVALID_STREAM,0);
   
   ctx->head=head;
   
@@ -397,12 +423,9 @@ int xcor_chunk_next(XCOReaderContext *ctx) {
   XCOChunkHead *head=ctx->heads[ctx->nHeads-2];
   if (*ctx->idxSubChunk+1>=head->nChunks) XCOERR(XCO_ERR_NO_SIBLING,0);
   
-  XCOChunkHead *newHead=(XCOChunkHead*)(ctx->data+ctx->head->offsEnd);
+  XCOChunkHead *newHead=_xcor_head_at(ctx,ctx->head->offsEnd,head);
   
-  if (newHead->size+ctx->head->offsEnd>head->offsEnd) XCOERR(XCO_ERR_INVALID_STREAM,0);
-  if (newHead->offsData  >newHead->offsChunks   ) XCOERR(XCO_ERR_INVALID_STREAM,0);
-  if (newHead->offsChunks>newHead->offsEnd      ) XCOERR(XCO_ERR_INVALID_STREAM,0);
-  if (newHead->offsEnd   >head->offsEnd         ) XCOERR(XCO_ERR_INVALID_STREAM,0);
+  if (!newHead) XCOERR(XCO_ERR_INVALID_STREAM,0);
   
   ctx->heads[ctx->nHeads-1]=newHead;
   ctx->head=newHead;
@@ -0,0 +1,197 @@
+
+/** \file array.cpp
+  * \author Peter Wagener
+  * \brief Tests of the dynamic array macros of util.h.
+  *
+  * Checked are
+  * - ARRAY_INIT, ARRAY_INIT2 and ARRAY_STATIC starting out empty,
+  * - APPEND doubling the capacity from ARRAY_MIN_CAPACITY on, keeping all
+  *   elements,
+  * - ARRAY_RESERVE only ever growing the storage, without changing the
+  *   size,
+  * - ARRAY_SETSIZE keeping elements when growing and shrinking,
+  * - ARRAY_SHRINK releasing unused storage, all of it for empty arrays,
+  * - ARRAY_DESTROY resetting an array so it can be used again.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "diyyma/util.h"
+#include "test.h"
+
+ARRAY_STATIC(int,test_static);
+
+struct test_element_t {
+  int    i;
+  double d;
+};
+
+/** \brief Holds an array initialized in the constructor's list. */
+class TestOwner {
+  public:
+    ARRAY(test_element_t,elements);
+    
+    TestOwner() : ARRAY_INIT2(elements) { }
+    ~TestOwner() { ARRAY_DESTROY(elements); }
+};
+
+/** \brief Returns non-zero if an array holds 0 to n-1. */
+static int test_sequence(const int *v, size_t n) {
+  size_t idx;
+  
+  for(idx=0;idx<n;idx++) if (v[idx]!=(int)idx) return 0;
+  
+  return 1;
+}
+
+static void test_append() {
+  ARRAY(int,a);
+  size_t idx, capacity=0;
+  int *p, grew=0, wrong=0;
+  
+  ARRAY_INIT(a);
+  CHECK(a_v==0 && a_n==0 && a_s==0);
+  
+  for(idx=0;idx<1000;idx++) {
+    APPEND(a,(int)idx);
+    if (a_s!=capacity) {
+      // the first append allocates the minimum, later ones double
+      wrong+=a_s!=(capacity?capacity*2:ARRAY_MIN_CAPACITY);
+      capacity=a_s;
+      grew++;
+    }
+    wrong+=a_n!=idx+1;
+    wrong+=a_s<a_n;
+  }
+  CHECK(wrong==0);
+  CHECK(grew==8);
+  CHECK(a_s==1024);
+  CHECK(test_sequence(a_v,a_n));
+  
+  FOREACH(idx,p,a) wrong+=*p!=(int)idx;
+  CHECK(wrong==0);
+  
+  ARRAY_DESTROY(a);
+  CHECK(a_v==0 && a_n==0 && a_s==0);
+  
+  // and it can be used again
+  APPEND(a,7);
+  CHECK(a_n==1 && a_s==ARRAY_MIN_CAPACITY && a_v[0]==7);
+  ARRAY_DESTROY(a);
+}
+
+static void test_reserve() {
+  ARRAY(int,a);
+  size_t idx;
+  int *v;
+  
+  ARRAY_INIT(a);
+  ARRAY_RESERVE(a,100);
+  CHECK(a_v!=0 && a_n==0 && a_s==100);
+  
+  // never shrinks, and appending within the capacity keeps the storage
+  ARRAY_RESERVE(a,10);
+  CHECK(a_s==100);
+  v=a_v;
+  for(idx=0;idx<100;idx++) APPEND(a,(int)idx);
+  CHECK(a_v==v && a_s==100);
+  
+  ARRAY_RESERVE(a,300);
+  CHECK(a_s==300 && a_n==100);
+  CHECK(test_sequence(a_v,a_n));
+  
+  // a full array grows by doubling, also from an odd capacity
+  ARRAY_SETSIZE(a,300);
+  APPEND(a,0);
+  CHECK(a_s==600);
+  
+  ARRAY_DESTROY(a);
+}
+
+static void test_setSize() {
+  ARRAY(int,a);
+  size_t idx;
+  
+  ARRAY_INIT(a);
+  ARRAY_SETSIZE(a,50);
+  CHECK(a_n==50 && a_s>=50);
+  for(idx=0;idx<a_n;idx++) a_v[idx]=(int)idx;
+  
+  ARRAY_SETSIZE(a,20);
+  CHECK(a_n==20 && a_s>=50);
+  CHECK(test_sequence(a_v,a_n));
+  
+  ARRAY_SETSIZE(a,5000);
+  CHECK(a_n==5000 && a_s>=5000);
+  CHECK(test_sequence(a_v,20));
+  
+  ARRAY_SETSIZE(a,0);
+  CHECK(a_n==0);
+  
+  ARRAY_DESTROY(a);
+}
+
+static void test_shrink() {
+  ARRAY(test_element_t,a);
+  test_element_t e;
+  size_t idx;
+  int wrong=0;
+  
+  ARRAY_INIT(a);
+  for(idx=0;idx<100;idx++) {
+    e.i=(int)idx;
+    e.d=idx*0.5;
+    APPEND(a,e);
+  }
+  CHECK(a_s==128);
+  
+  ARRAY_SHRINK(a);
+  CHECK(a_n==100 && a_s==100);
+  for(idx=0;idx<a_n;idx++)
+    wrong+=(a_v[idx].i!=(int)idx) || (a_v[idx].d!=idx*0.5);
+  CHECK(wrong==0);
+  
+  // nothing to release
+  ARRAY_SHRINK(a);
+  CHECK(a_s==100);
+  
+  // an empty array releases its storage altogether
+  a_n=0;
+  ARRAY_SHRINK(a);
+  CHECK(a_v==0 && a_s==0);
+  
+  APPEND(a,e);
+  CHECK(a_n==1 && a_v[0].i==99);
+  ARRAY_DESTROY(a);
+}
+
+static void test_members() {
+  TestOwner owner;
+  test_element_t e;
+  size_t idx;
+  
+  CHECK(owner.elements_v==0 && owner.elements_n==0);
+  CHECK(owner.elements_s==0);
+  for(idx=0;idx<20;idx++) {
+    e.i=(int)idx;
+    e.d=0;
+    APPEND(owner.elements,e);
+  }
+  CHECK(owner.elements_n==20 && owner.elements_v[19].i==19);
+  
+  CHECK(test_static_v==0 && test_static_n==0 && test_static_s==0);
+  APPEND(test_static,1);
+  CHECK(test_static_n==1 && test_static_v[0]==1);
+  ARRAY_DESTROY(test_static);
+}
+
+int main(int argn, char **argv) {
+  test_append();
+  test_reserve();
+  test_setSize();
+  test_shrink();
+  test_members();
+  
+  return TEST_RESULT("array");
+}
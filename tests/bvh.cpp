@@ -0,0 +1,348 @@
+
+/** \file bvh.cpp
+  * \author Peter Wagener
+  * \brief Tests of Frustum and BVH.
+  *
+  * Checked are
+  * - the planes Frustum::set extracts from orthogonal and perspective
+  *   projections, and that they agree with clipping in clip space,
+  * - Frustum::cullBox and Frustum::cullSphere against the corners of the
+  *   box and the closest points of the sphere,
+  * - that BVH queries after random inserts, moves and removes report the
+  *   same leaves as testing every leaf on its own,
+  * - that the tree stays balanced, even for leaves inserted in order.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "diyyma/bvh.h"
+#include "test.h"
+
+#define TEST_LEAVES 2000
+#define TEST_STEPS 50
+
+static float test_random(float a, float b) {
+  return a+(b-a)*(rand()/(float)RAND_MAX);
+}
+
+static Vector3f test_randomPoint(float extent) {
+  return Vector3f(
+    test_random(-extent,extent),
+    test_random(-extent,extent),
+    test_random(-extent,extent));
+}
+
+static float test_plane(const Vector4f &p, const Vector3f &v) {
+  return p.x*v.x+p.y*v.y+p.z*v.z+p.w;
+}
+
+static int test_samePlane(const Vector4f &p, const Vector4f &q) {
+  return fabsf(p.x-q.x)<1e-5f && fabsf(p.y-q.y)<1e-5f
+    && fabsf(p.z-q.z)<1e-5f && fabsf(p.w-q.w)<1e-5f;
+}
+
+/** \brief Returns non-zero if a point is inside a frustum, by its clip
+  * space coordinates.
+  */
+static int test_clipped(const Matrixf &MVP, const Vector3f &v) {
+  Vector4f c=MVP*Vector4f(v.x,v.y,v.z,1);
+  return c.w>0 && fabsf(c.x)<=c.w && fabsf(c.y)<=c.w && fabsf(c.z)<=c.w;
+}
+
+static Matrixf test_camera() {
+  return
+    Matrixf::Perspective(60,0.75f,0.5f,50)*
+    Matrixf::RotationZ(0.3f)*
+    Matrixf::Translation(-2,1,0.5f);
+}
+
+static void test_frustumPlanes() {
+  Frustum f;
+  Matrixf M=test_camera();
+  Vector3f v;
+  int i, k, inside, wrong=0;
+  
+  // left, right, bottom, top, near and far, facing inwards
+  f.set(Matrixf::OrthogonalProjection(-1,2,-3,4,1,10));
+  CHECK(test_samePlane(f.planes[0],Vector4f( 1, 0, 0, 1)));
+  CHECK(test_samePlane(f.planes[1],Vector4f(-1, 0, 0, 2)));
+  CHECK(test_samePlane(f.planes[2],Vector4f( 0, 1, 0, 3)));
+  CHECK(test_samePlane(f.planes[3],Vector4f( 0,-1, 0, 4)));
+  CHECK(test_samePlane(f.planes[4],Vector4f( 0, 0,-1,-1)));
+  CHECK(test_samePlane(f.planes[5],Vector4f( 0, 0, 1,10)));
+  
+  // points away from the planes are inside exactly if they are clipped
+  f.set(M);
+  srand(1);
+  for(i=0;i<100000;i++) {
+    v=test_randomPoint(60);
+    inside=1;
+    for(k=0;k<6;k++) {
+      if (fabsf(test_plane(f.planes[k],v))<1e-3f) break;
+      if (test_plane(f.planes[k],v)<0) inside=0;
+    }
+    if (k<6) continue;
+    wrong+=inside!=test_clipped(M,v);
+  }
+  CHECK(wrong==0);
+}
+
+/** \brief Boxes and spheres are culled exactly if one plane has all of
+  * them behind it.
+  */
+static void test_frustumCull() {
+  Frustum f;
+  Vector3f a, b, bmin, bmax, corner, c;
+  float r, d, dmax;
+  int i, k, j, culled, wrong=0, count=0;
+  
+  f.set(test_camera());
+  srand(2);
+  for(i=0;i<20000;i++) {
+    a=test_randomPoint(60);
+    b=a+test_randomPoint(5);
+    bmin.set(min(a.x,b.x),min(a.y,b.y),min(a.z,b.z));
+    bmax.set(max(a.x,b.x),max(a.y,b.y),max(a.z,b.z));
+    
+    culled=0;
+    for(k=0;k<6;k++) {
+      dmax=-INFINITY;
+      for(j=0;j<8;j++) {
+        corner.set(
+          (j&1)?bmax.x:bmin.x,(j&2)?bmax.y:bmin.y,(j&4)?bmax.z:bmin.z);
+        dmax=max(dmax,test_plane(f.planes[k],corner));
+      }
+      if (fabsf(dmax)<1e-3f) break;
+      if (dmax<0) culled=1;
+    }
+    if (k<6) continue;
+    wrong+=culled!=f.cullBox(bmin,bmax);
+    count+=culled;
+    
+    c=a;
+    r=test_random(0,5);
+    culled=0;
+    for(k=0;k<6;k++) {
+      d=test_plane(f.planes[k],c)+r;
+      if (fabsf(d)<1e-3f) break;
+      if (d<0) culled=1;
+    }
+    if (k<6) continue;
+    wrong+=culled!=f.cullSphere(c,r);
+  }
+  CHECK(wrong==0);
+  CHECK(count>0);
+}
+
+/** \brief Leaf as the tree stores it, enlarged by the margin. */
+struct test_leaf_t {
+  int      handle;
+  Vector3f bmin, bmax;
+};
+
+static test_leaf_t test_leaves[TEST_LEAVES];
+static unsigned char test_found[TEST_LEAVES];
+
+static void test_collect(void *data, void * /*arg*/) {
+  test_found[(size_t)data]++;
+}
+
+static void test_box(Vector3f *bmin, Vector3f *bmax) {
+  *bmin=test_randomPoint(100);
+  *bmax=*bmin+Vector3f(
+    test_random(0.1f,4),test_random(0.1f,4),test_random(0.1f,4));
+}
+
+static void test_insert(BVH *bvh, size_t idx) {
+  test_leaf_t *l=test_leaves+idx;
+  Vector3f bmin, bmax, m;
+  
+  test_box(&bmin,&bmax);
+  l->handle=bvh->insert(bmin,bmax,(void*)idx);
+  m=(bmax-bmin)*bvh->margin;
+  l->bmin=bmin-m;
+  l->bmax=bmax+m;
+}
+
+/** \brief Moves a leaf a little or far, returning non-zero if the tree
+  * did what the stored box implies.
+  */
+static int test_move(BVH *bvh, size_t idx) {
+  test_leaf_t *l=test_leaves+idx;
+  Vector3f bmin, bmax, d, m;
+  int contained;
+  
+  if (rand()%4) {
+    d=test_randomPoint(0.2f);
+    bmin=l->bmin+d;
+    bmax=l->bmax+d;
+    m=(bmax-bmin)*(bvh->margin/(1+2*bvh->margin));
+    bmin+=m;
+    bmax-=m;
+  } else {
+    test_box(&bmin,&bmax);
+  }
+  
+  contained=(l->bmin.x<=bmin.x)&&(l->bmin.y<=bmin.y)&&(l->bmin.z<=bmin.z)
+    &&      (l->bmax.x>=bmax.x)&&(l->bmax.y>=bmax.y)&&(l->bmax.z>=bmax.z);
+  
+  if (bvh->move(l->handle,bmin,bmax)==contained) return 0;
+  if (!contained) {
+    m=(bmax-bmin)*bvh->margin;
+    l->bmin=bmin-m;
+    l->bmax=bmax+m;
+  }
+  
+  return 1;
+}
+
+/** \brief Height of a tree of n leaves which keeps the subtrees of every
+  * node within one level of each other.
+  */
+static int test_balanced(BVH *bvh) {
+  double n=(double)bvh->count();
+  return bvh->height()<=(int)(1.4405*log2(n+2));
+}
+
+/** \brief Runs all queries at random, comparing the leaves found to those
+  * found by testing every stored box.
+  */
+static int test_queries(BVH *bvh, const unsigned char *live) {
+  Frustum f;
+  Vector3f a, b, bmin, bmax, c, d;
+  test_leaf_t *l;
+  float r;
+  size_t idx;
+  int q, expected, wrong=0;
+  
+  for(q=0;q<3;q++) {
+    memset(test_found,0,sizeof(test_found));
+    switch(q) {
+      case 0:
+        f.set(
+          Matrixf::Perspective(test_random(30,90),0.75f,0.5f,150)*
+          Matrixf::RotationZ(test_random(0,6.28f))*
+          Matrixf::RotationY(test_random(-0.5f,0.5f)));
+        bvh->queryFrustum(f,test_collect,0);
+        break;
+      case 1:
+        c=test_randomPoint(80);
+        r=test_random(1,40);
+        bvh->querySphere(c,r,test_collect,0);
+        break;
+      case 2:
+        a=test_randomPoint(100);
+        b=test_randomPoint(100);
+        bmin.set(min(a.x,b.x),min(a.y,b.y),min(a.z,b.z));
+        bmax.set(max(a.x,b.x),max(a.y,b.y),max(a.z,b.z));
+        bvh->queryBox(bmin,bmax,test_collect,0);
+        break;
+    }
+    
+    for(idx=0;idx<TEST_LEAVES;idx++) {
+      l=test_leaves+idx;
+      if (!live[idx]) {
+        expected=0;
+      } else if (q==0) {
+        expected=!f.cullBox(l->bmin,l->bmax);
+      } else if (q==1) {
+        d.set(
+          max(0.0f,max(l->bmin.x-c.x,c.x-l->bmax.x)),
+          max(0.0f,max(l->bmin.y-c.y,c.y-l->bmax.y)),
+          max(0.0f,max(l->bmin.z-c.z,c.z-l->bmax.z)));
+        expected=d*d<=r*r;
+      } else {
+        expected=
+          (l->bmin.x<=bmax.x)&&(l->bmin.y<=bmax.y)&&(l->bmin.z<=bmax.z)&&
+          (l->bmax.x>=bmin.x)&&(l->bmax.y>=bmin.y)&&(l->bmax.z>=bmin.z);
+      }
+      wrong+=test_found[idx]!=expected;
+    }
+  }
+  
+  return wrong;
+}
+
+static void test_tree() {
+  static unsigned char live[TEST_LEAVES];
+  BVH bvh;
+  size_t idx, n=0;
+  int step, i, wrong=0, wrongMoves=0, unbalanced=0;
+  
+  srand(3);
+  memset(live,0,sizeof(live));
+  for(idx=0;idx<TEST_LEAVES;idx+=2) {
+    test_insert(&bvh,idx);
+    live[idx]=1;
+    n++;
+  }
+  CHECK(bvh.count()==n);
+  CHECK(test_queries(&bvh,live)==0);
+  
+  for(step=0;step<TEST_STEPS;step++) {
+    for(i=0;i<TEST_LEAVES/4;i++) {
+      idx=rand()%TEST_LEAVES;
+      if (!live[idx]) {
+        test_insert(&bvh,idx);
+        live[idx]=1;
+        n++;
+      } else if (rand()%3) {
+        wrongMoves+=!test_move(&bvh,idx);
+      } else {
+        bvh.remove(test_leaves[idx].handle);
+        live[idx]=0;
+        n--;
+      }
+    }
+    wrong+=test_queries(&bvh,live);
+    wrong+=bvh.count()!=n;
+    unbalanced+=!test_balanced(&bvh);
+  }
+  CHECK(wrong==0);
+  CHECK(wrongMoves==0);
+  CHECK(unbalanced==0);
+  
+  // handles stay valid and data follows them
+  for(idx=0;idx<TEST_LEAVES;idx++) if (live[idx]) {
+    wrong+=bvh.data(test_leaves[idx].handle)!=(void*)idx;
+  }
+  CHECK(wrong==0);
+  
+  for(idx=0;idx<TEST_LEAVES;idx++) if (live[idx]) {
+    bvh.remove(test_leaves[idx].handle);
+    live[idx]=0;
+  }
+  CHECK(bvh.count()==0);
+  CHECK(bvh.height()==-1);
+  CHECK(test_queries(&bvh,live)==0);
+}
+
+/** \brief Leaves inserted along a line would make a list of an unbalanced
+  * tree.
+  */
+static void test_ordered() {
+  BVH bvh;
+  int i, unbalanced=0;
+  
+  for(i=0;i<4096;i++) {
+    bvh.insert(Vector3f((float)i,0,0),Vector3f(i+0.5f,1,1),(void*)0);
+    unbalanced+=!test_balanced(&bvh);
+  }
+  CHECK(unbalanced==0);
+  printf("4096 leaves in order: height %i\n",bvh.height());
+  
+  bvh.clear();
+  CHECK(bvh.count()==0);
+  CHECK(bvh.height()==-1);
+}
+
+int main(int argn, char **argv) {
+  test_frustumPlanes();
+  test_frustumCull();
+  test_tree();
+  test_ordered();
+  
+  return TEST_RESULT("bvh");
+}
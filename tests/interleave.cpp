@@ -0,0 +1,276 @@
+
+/** \file interleave.cpp
+  * \author Peter Wagener
+  * \brief Tests of the interleaved vertex layout of StaticMesh.
+  *
+  * The same .obj grid is assembled with and without
+  * STATICMESH_LOAD_INTERLEAVED, combined with indexing, optimizing and
+  * quantizing, and both .dof files are read back with the XCO reader.
+  * Checked are
+  * - the interleaved file holding one interleaved chunk and no separate
+  *   arrays, and the other file the reverse,
+  * - attributes of the interleaved chunk being aligned to 4 bytes, within
+  *   the stride and not overlapping,
+  * - every attribute, taken out of the interleaved vertices, being the
+  *   same as the separate array of the same index, type and flags,
+  * - indices and bounds being the same in both files.
+  *
+  * Assembling only writes to the GL through calls which do nothing without
+  * a context, so none is needed.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "diyyma/staticmesh.h"
+#include "diyyma/xco.h"
+#include "diyyma/util.h"
+#include "test.h"
+
+#define TEST_DIR "interleave_test/"
+#define TEST_GRID 24
+#define TEST_ARRAYS 16
+
+/** \brief An attribute array found in a .dof file. */
+struct test_array_t {
+  u_int32_t   index, type, dimension;
+  size_t      cb;
+  const char *data;
+  size_t      stride, offset;
+};
+
+/** \brief The chunks of a .dof file the test compares. data points into
+  * the file, which stays loaded.
+  */
+struct test_dof_t {
+  void        *file;
+  test_array_t arrays[TEST_ARRAYS];
+  int          arrayCount;
+  int          interleavedCount;
+  u_int32_t    interleavedStride;
+  const char  *indices;
+  size_t       cbIndices;
+  DOFBounds    bounds;
+  int          hasBounds;
+};
+
+/** \brief Returns the .obj code of a grid with normals, texture coordinates
+  * and tangents, and three materials.
+  */
+static char *test_obj() {
+  ARRAY(char,text);
+  char line[256];
+  int x, y, a, cc;
+  
+  ARRAY_INIT(text);
+  #define TEST_PRINT(...) { \
+    cc=snprintf(line,sizeof(line),__VA_ARGS__); \
+    ARRAY_SETSIZE(text,text_n+cc); \
+    memcpy(text_v+text_n-cc,line,cc); \
+  }
+  
+  for(y=0;y<=TEST_GRID;y++) for(x=0;x<=TEST_GRID;x++)
+    TEST_PRINT("v %g %g %g\n",x*0.1,y*0.1,0.01*((x*7+y*3)%5));
+  for(y=0;y<=TEST_GRID;y++) for(x=0;x<=TEST_GRID;x++)
+    TEST_PRINT("vt %g %g\n",x*0.025,y*0.03);
+  TEST_PRINT("vn 0 0 1\nvn 0 1 0\n#t 1 0 0\n#b 0 1 0\n#t 1 0 0\n#b 0 0 1\n");
+  for(y=0;y<TEST_GRID;y++) for(x=0;x<TEST_GRID;x++) {
+    a=y*(TEST_GRID+1)+x+1;
+    if (x==TEST_GRID/2) TEST_PRINT("usemtl m%d\n",y%3);
+    TEST_PRINT("f %d/%d/1 %d/%d/1 %d/%d/2 %d/%d/2\n",
+      a,a,a+1,a+1,a+TEST_GRID+2,a+TEST_GRID+2,a+TEST_GRID+1,a+TEST_GRID+1);
+  }
+  TEST_PRINT("%c",0);
+  
+  #undef TEST_PRINT
+  
+  return text_v;
+}
+
+/** \brief Reads the chunks of a .dof file, splitting interleaved chunks
+  * into one array per attribute.
+  */
+static int test_read(const char *fn, test_dof_t *dof) {
+  XCOReaderContext *xco=0;
+  DOFArray array;
+  DOFInterleaved il;
+  const DOFInterleavedAttribute *attributes;
+  test_array_t *pa;
+  size_t cb;
+  u_int32_t i;
+  int r=0;
+  
+  memset(dof,0,sizeof(test_dof_t));
+  if (!readFile(fn,&dof->file,&cb)) return 0;
+  if (!xcor_create(&xco,dof->file,cb)) return 0;
+  if (!xcor_chunk_sub(xco) || (xco->head->id!=XCO_DIYYMA_OBJECT)
+  || !xcor_chunk_sub(xco)) goto finalize;
+  
+  do { switch(xco->head->id) {
+    case XCO_DIYYMA_OBJECT_ARRAY:
+      if (dof->arrayCount>=TEST_ARRAYS) goto finalize;
+      xcor_data_read(xco,array);
+      pa=dof->arrays+dof->arrayCount++;
+      pa->index    =array.index;
+      pa->type     =array.type;
+      pa->dimension=array.dimension;
+      pa->cb       =array.cbData;
+      pa->data     =xco->p;
+      pa->stride   =0;
+      pa->offset   =0;
+      break;
+    
+    case XCO_DIYYMA_OBJECT_INTERLEAVED:
+      xcor_data_read(xco,il);
+      attributes=(const DOFInterleavedAttribute*)xco->p;
+      dof->interleavedCount++;
+      dof->interleavedStride=il.stride;
+      for(i=0;i<il.attributes;i++) {
+        if (dof->arrayCount>=TEST_ARRAYS) goto finalize;
+        pa=dof->arrays+dof->arrayCount++;
+        pa->index    =attributes[i].index;
+        pa->type     =attributes[i].type;
+        pa->dimension=attributes[i].dimension;
+        pa->cb       =il.cbData/il.stride;
+        pa->data     =xco->p+il.attributes*sizeof(DOFInterleavedAttribute)
+          +attributes[i].offset;
+        pa->stride   =il.stride;
+        pa->offset   =attributes[i].offset;
+      }
+      break;
+    
+    case XCO_DIYYMA_OBJECT_INDICES:
+      dof->indices  =xco->p;
+      dof->cbIndices=xcor_data_remain(xco);
+      break;
+    
+    case XCO_DIYYMA_OBJECT_BOUNDS:
+      xcor_data_read(xco,dof->bounds);
+      dof->hasBounds=1;
+      break;
+  } } while(xcor_chunk_next(xco));
+  
+  r=1;
+  
+  finalize:
+  xcor_close(&xco);
+  return r;
+}
+
+/** \brief Size of one element of an attribute. */
+static size_t test_size(const test_array_t *a) {
+  switch(a->type) {
+    case GL_SHORT: case GL_UNSIGNED_SHORT: case GL_HALF_FLOAT:
+      return a->dimension*2;
+    case GL_INT_2_10_10_10_REV: case GL_UNSIGNED_INT_2_10_10_10_REV:
+      return 4;
+    default:
+      return a->dimension*4;
+  }
+}
+
+/** \brief Returns non-zero if the interleaved layout of a file is sound:
+  * attributes 4 byte aligned and neither overlapping each other nor
+  * reaching past the stride.
+  */
+static int test_layout(const test_dof_t *dof) {
+  const test_array_t *a, *b;
+  int i, j;
+  
+  if (dof->interleavedStride%4) return 0;
+  
+  for(i=0;i<dof->arrayCount;i++) {
+    a=dof->arrays+i;
+    if (a->offset%4 || a->offset+test_size(a)>dof->interleavedStride)
+      return 0;
+    for(j=i+1;j<dof->arrayCount;j++) {
+      b=dof->arrays+j;
+      if ((a->offset<b->offset+test_size(b))
+      &&  (b->offset<a->offset+test_size(a))) return 0;
+    }
+  }
+  
+  return 1;
+}
+
+/** \brief Compares an interleaved attribute with a separate array. */
+static int test_sameArray(const test_array_t *il, const test_array_t *sep) {
+  size_t cb=test_size(sep), idx;
+  
+  if ((il->index!=sep->index) || (il->type!=sep->type)
+  || (il->dimension!=sep->dimension) || (il->cb*cb!=sep->cb)) return 0;
+  
+  for(idx=0;idx<il->cb;idx++)
+    if (memcmp(il->data+idx*il->stride,sep->data+idx*cb,cb)) return 0;
+  
+  return 1;
+}
+
+static void test_layouts(const char *obj, int flags) {
+  test_dof_t sep, il;
+  char fnSep[64], fnIl[64], *code;
+  int i, j, found, wrong=0;
+  
+  snprintf(fnSep,sizeof(fnSep),TEST_DIR "separate_%02x.dof",flags);
+  snprintf(fnIl,sizeof(fnIl),TEST_DIR "interleaved_%02x.dof",flags);
+  
+  // assembling changes the code
+  code=strdup(obj);
+  {
+    StaticMesh mesh;
+    mesh.loadOBJ(code,fnSep,flags);
+  }
+  strcpy(code,obj);
+  {
+    StaticMesh mesh;
+    mesh.loadOBJ(code,fnIl,flags|STATICMESH_LOAD_INTERLEAVED);
+  }
+  free((void*)code);
+  
+  CHECK(test_read(fnSep,&sep));
+  CHECK(test_read(fnIl,&il));
+  
+  CHECK(sep.interleavedCount==0);
+  CHECK(il.interleavedCount==1);
+  CHECK(il.arrayCount==sep.arrayCount);
+  CHECK(sep.arrayCount>=3);
+  CHECK(test_layout(&il));
+  
+  for(i=0;i<il.arrayCount;i++) {
+    for(j=0,found=0;j<sep.arrayCount;j++)
+      if (sep.arrays[j].index==il.arrays[i].index)
+        found+=test_sameArray(il.arrays+i,sep.arrays+j);
+    wrong+=found!=1;
+  }
+  CHECK(wrong==0);
+  
+  CHECK(il.cbIndices==sep.cbIndices);
+  CHECK(!il.cbIndices || !memcmp(il.indices,sep.indices,il.cbIndices));
+  CHECK(il.hasBounds==sep.hasBounds);
+  CHECK(!memcmp(&il.bounds,&sep.bounds,sizeof(DOFBounds)));
+  
+  printf("flags 0x%02x: %i attributes, stride %u\n",
+    flags,il.arrayCount,(unsigned)il.interleavedStride);
+  
+  free(sep.file);
+  free(il.file);
+}
+
+int main(int argn, char **argv) {
+  char *obj;
+  
+  dir_create(TEST_DIR);
+  obj=test_obj();
+  
+  test_layouts(obj,0);
+  test_layouts(obj,STATICMESH_LOAD_INDEXED);
+  test_layouts(obj,STATICMESH_LOAD_INDEXED|STATICMESH_LOAD_OPTIMIZE);
+  test_layouts(obj,STATICMESH_LOAD_INDEXED|STATICMESH_LOAD_QUANTIZE);
+  test_layouts(obj,
+    STATICMESH_LOAD_INDEXED|STATICMESH_LOAD_QUANTIZE|
+    STATICMESH_LOAD_OCTAHEDRAL);
+  
+  free((void*)obj);
+  
+  return TEST_RESULT("interleave");
+}
@@ -0,0 +1,214 @@
+
+/** \file meshopt.cpp
+  * \author Peter Wagener
+  * \brief Tests of the reordering functions of meshopt.
+  *
+  * A bumpy grid is reordered, both with its triangles row by row and
+  * shuffled, checking that
+  * - meshopt_optimize_vertex_cache and meshopt_optimize_overdraw output a
+  *   permutation of the input triangles, each keeping its winding,
+  * - the vertex cache miss ratio does not get worse, or no worse than the
+  *   threshold allows for overdraw,
+  * - the remap of meshopt_optimize_vertex_fetch is a bijection numbering
+  *   vertices in the order they are first referenced, and the triangles
+  *   drawn from the moved vertices are the same as before,
+  * - meshopt_analyze_vertex_cache reports what a FIFO cache does.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "diyyma/meshopt.h"
+#include "diyyma/util.h"
+#include "test.h"
+
+#define TEST_GRID 32
+#define TEST_VERTICES ((TEST_GRID+1)*(TEST_GRID+1))
+#define TEST_INDICES (TEST_GRID*TEST_GRID*6)
+
+/** \brief Triangle with its indices rotated to start at the smallest one,
+  * so equal triangles of the same winding compare equal.
+  */
+struct test_triangle_t {
+  u_int32_t v[3];
+};
+
+static int test_compareTriangles(const void *a, const void *b) {
+  return memcmp(a,b,sizeof(test_triangle_t));
+}
+
+/** \brief Returns the triangles of an index list in canonical form,
+  * sorted. To be freed by the caller.
+  */
+static test_triangle_t *test_triangles(const u_int32_t *indices) {
+  test_triangle_t *r;
+  const u_int32_t *t;
+  int i, k;
+  
+  r=(test_triangle_t*)malloc(sizeof(test_triangle_t)*TEST_INDICES/3);
+  for(i=0;i<TEST_INDICES/3;i++) {
+    t=indices+i*3;
+    k=(t[1]<t[0])?((t[2]<t[1])?2:1):((t[2]<t[0])?2:0);
+    r[i].v[0]=t[k];
+    r[i].v[1]=t[(k+1)%3];
+    r[i].v[2]=t[(k+2)%3];
+  }
+  qsort(r,TEST_INDICES/3,sizeof(test_triangle_t),test_compareTriangles);
+  
+  return r;
+}
+
+/** \brief Checks that b holds the same triangles as a. */
+static int test_permutation(const u_int32_t *a, const u_int32_t *b) {
+  test_triangle_t *ta=test_triangles(a), *tb=test_triangles(b);
+  int r;
+  
+  r=!memcmp(ta,tb,sizeof(test_triangle_t)*TEST_INDICES/3);
+  free(ta);
+  free(tb);
+  
+  return r;
+}
+
+static float test_acmr(const u_int32_t *indices) {
+  float acmr, atvr;
+  meshopt_analyze_vertex_cache(
+    indices,TEST_INDICES,TEST_VERTICES,MESHOPT_FIFO_SIZE,&acmr,&atvr);
+  return acmr;
+}
+
+/** \brief Builds the grid, two triangles per cell row by row, or shuffled
+  * with a fixed seed.
+  */
+static void test_grid(u_int32_t *indices, Vector3f *positions, int shuffle) {
+  u_int32_t a, t[3];
+  int x, y, i, j, k;
+  
+  for(y=0;y<=TEST_GRID;y++) for(x=0;x<=TEST_GRID;x++)
+    positions[y*(TEST_GRID+1)+x]=Vector3f(
+      (float)x,(float)y,0.25f*((x*7+y*3)%5));
+  
+  for(y=0;y<TEST_GRID;y++) for(x=0;x<TEST_GRID;x++) {
+    a=y*(TEST_GRID+1)+x;
+    i=(y*TEST_GRID+x)*6;
+    indices[i+0]=a;
+    indices[i+1]=a+1;
+    indices[i+2]=a+TEST_GRID+2;
+    indices[i+3]=a;
+    indices[i+4]=a+TEST_GRID+2;
+    indices[i+5]=a+TEST_GRID+1;
+  }
+  
+  if (!shuffle) return;
+  
+  srand(1);
+  for(i=TEST_INDICES/3-1;i>0;i--) {
+    j=rand()%(i+1);
+    memcpy(t,indices+i*3,sizeof(t));
+    for(k=0;k<3;k++) indices[i*3+k]=indices[j*3+k];
+    memcpy(indices+j*3,t,sizeof(t));
+  }
+}
+
+static void test_reorder(int shuffle) {
+  static u_int32_t input[TEST_INDICES], cache[TEST_INDICES];
+  static u_int32_t overdraw[TEST_INDICES];
+  static Vector3f positions[TEST_VERTICES];
+  float acmr[3];
+  
+  test_grid(input,positions,shuffle);
+  acmr[0]=test_acmr(input);
+  
+  meshopt_optimize_vertex_cache(cache,input,TEST_INDICES,TEST_VERTICES);
+  acmr[1]=test_acmr(cache);
+  CHECK(test_permutation(input,cache));
+  CHECK(acmr[1]<=acmr[0]);
+  // a grid can be drawn with little more than one vertex per two triangles
+  CHECK(acmr[1]<0.75f);
+  
+  memcpy(overdraw,cache,sizeof(overdraw));
+  meshopt_optimize_overdraw(
+    overdraw,overdraw,TEST_INDICES,positions,TEST_VERTICES,
+    MESHOPT_OVERDRAW_THRESHOLD);
+  acmr[2]=test_acmr(overdraw);
+  CHECK(test_permutation(input,overdraw));
+  CHECK(acmr[2]<=acmr[1]*MESHOPT_OVERDRAW_THRESHOLD);
+  
+  printf("ACMR %s: %.3f, cache %.3f, overdraw %.3f\n",
+    shuffle?"shuffled":"rows",acmr[0],acmr[1],acmr[2]);
+}
+
+/** \brief The fetch order of the optimized grid, with one more vertex that
+  * is not referenced at all.
+  */
+static void test_fetch() {
+  static u_int32_t input[TEST_INDICES], indices[TEST_INDICES];
+  static Vector3f positions[TEST_VERTICES+1], moved[TEST_VERTICES+1];
+  static u_int32_t remap[TEST_VERTICES+1];
+  static int seen[TEST_VERTICES+1];
+  int i, valid=1, drawn=1, ordered=1;
+  u_int32_t next=0;
+  size_t referenced;
+  
+  test_grid(input,positions,1);
+  meshopt_optimize_vertex_cache(input,input,TEST_INDICES,TEST_VERTICES);
+  memcpy(indices,input,sizeof(indices));
+  
+  // the unreferenced vertex comes first, so it has to move
+  memmove(positions+1,positions,sizeof(Vector3f)*TEST_VERTICES);
+  positions[0]=Vector3f(-1,-1,-1);
+  for(i=0;i<TEST_INDICES;i++) input[i]=++indices[i];
+  
+  referenced=meshopt_optimize_vertex_fetch(
+    remap,indices,TEST_INDICES,TEST_VERTICES+1);
+  CHECK(referenced==TEST_VERTICES);
+  
+  memset(seen,0,sizeof(seen));
+  for(i=0;i<=TEST_VERTICES;i++) {
+    if (remap[i]>TEST_VERTICES || seen[remap[i]]) valid=0;
+    else seen[remap[i]]=1;
+  }
+  CHECK(valid);
+  if (!valid) return;
+  CHECK(remap[0]==TEST_VERTICES);
+  
+  for(i=0;i<=TEST_VERTICES;i++) moved[remap[i]]=positions[i];
+  for(i=0;i<TEST_INDICES;i++) {
+    if (indices[i]!=remap[input[i]]) drawn=0;
+    if (memcmp(&moved[indices[i]],&positions[input[i]],sizeof(Vector3f)))
+      drawn=0;
+    if (indices[i]>next) ordered=0;
+    if (indices[i]==next) next++;
+  }
+  CHECK(drawn);
+  CHECK(ordered);
+}
+
+/** \brief Hand counted misses of a three entry FIFO. */
+static void test_analyze() {
+  // hits do not move vertices to the front, so 0 is evicted by 3 rather
+  // than 1, as a least recently used cache would
+  static const u_int32_t fifo[]={ 0,1,2, 0,2,3, 0,2,3 };
+  static const u_int32_t twice[]={ 0,1,2, 0,2,1 };
+  float acmr, atvr;
+  
+  meshopt_analyze_vertex_cache(fifo,9,4,3,&acmr,&atvr);
+  CHECK(acmr==5.0f/3);
+  CHECK(atvr==5.0f/4);
+  
+  meshopt_analyze_vertex_cache(twice,6,3,3,&acmr,&atvr);
+  CHECK(acmr==1.5f);
+  CHECK(atvr==1.0f);
+  
+  meshopt_analyze_vertex_cache(twice,0,3,3,&acmr,&atvr);
+  CHECK(acmr==0);
+}
+
+int main(int argn, char **argv) {
+  test_reorder(0);
+  test_reorder(1);
+  test_fetch();
+  test_analyze();
+  
+  return TEST_RESULT("meshopt");
+}
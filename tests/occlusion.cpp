@@ -0,0 +1,143 @@
+
+/** \file occlusion.cpp
+  * \author Peter Wagener
+  * \brief Tests of OcclusionCuller.
+  *
+  * The view projection is the identity, so occluders and boxes are given in
+  * normalized device coordinates. The 64 by 64 depth buffer makes a pixel
+  * 1/32 wide. Checked are
+  * - boxes behind, in front of and beside an occluder,
+  * - boxes peeking past the edge of an occluder within a single pixel,
+  * - boxes in front of a sloped occluder within a single pixel,
+  * - occluders crossing the near plane.
+  */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "diyyma/occlusion.h"
+#include "test.h"
+
+#define TEST_SIZE 64
+
+static const u_int32_t test_quadIndices[6]={ 0,1,2, 0,2,3 };
+
+/** \brief Adds the quad x0..x1 by y0..y1, with depth z0 along the left
+  * and z1 along the right edge.
+  */
+static void test_quad(OcclusionCuller *oc,
+  float x0, float x1, float y0, float y1, float z0, float z1) {
+  Vector3f p[4]={
+    Vector3f(x0,y0,z0), Vector3f(x1,y0,z1),
+    Vector3f(x1,y1,z1), Vector3f(x0,y1,z0) };
+  Matrixf I;
+  
+  oc->addOccluder(I,p,test_quadIndices,6);
+}
+
+static int test_box(OcclusionCuller *oc,
+  float x0, float x1, float y0, float y1, float z0, float z1) {
+  Matrixf I;
+  return oc->test(I,Vector3f(x0,y0,z0),Vector3f(x1,y1,z1));
+}
+
+static void test_begin(OcclusionCuller *oc) {
+  Matrixf I;
+  oc->resize(TEST_SIZE,TEST_SIZE);
+  oc->begin(I);
+}
+
+/** \brief A flat quad hides what is behind it, with its two triangles
+  * covering every pixel within it.
+  */
+static void test_hidden() {
+  OcclusionCuller oc;
+  const float *depth;
+  int x, y, holes=0, outside=0;
+  
+  test_begin(&oc);
+  test_quad(&oc,-0.5f,0.5f,-0.5f,0.5f,0,0);
+  oc.end();
+  
+  // pixels 16 through 47 lie within the quad
+  depth=oc.depth();
+  for(y=0;y<TEST_SIZE;y++) for(x=0;x<TEST_SIZE;x++) {
+    if ((x>=16)&&(x<48)&&(y>=16)&&(y<48)) holes+=depth[y*TEST_SIZE+x]>=1;
+    else outside+=depth[y*TEST_SIZE+x]<1;
+  }
+  CHECK(holes==0);
+  CHECK(outside==0);
+  CHECK(oc.stats().triangles==2);
+  
+  CHECK(!test_box(&oc,-0.25f,0.25f,-0.25f,0.25f,0.5f,0.6f));
+  CHECK(!test_box(&oc,-0.45f,0.45f,-0.45f,-0.4f,0.1f,0.2f));
+  CHECK( test_box(&oc,-0.25f,0.25f,-0.25f,0.25f,-0.5f,-0.4f));
+  CHECK( test_box(&oc,0.3f,0.7f,-0.25f,0.25f,0.5f,0.6f));
+  CHECK( test_box(&oc,-0.25f,0.25f,-0.25f,0.25f,-2.0f,0.6f));
+  CHECK(oc.stats().culled==2);
+}
+
+/** \brief The right edge of the occluder lies at 0.6 of pixel 32. Sampling
+  * at the centre would cover the pixel, hiding a box in its right part.
+  */
+static void test_edge() {
+  OcclusionCuller oc;
+  
+  test_begin(&oc);
+  test_quad(&oc,-1,32.6f/32-1,-1,1,0,0);
+  oc.end();
+  
+  CHECK(oc.depth()[32*TEST_SIZE+31]<1);
+  CHECK(oc.depth()[32*TEST_SIZE+32]>=1);
+  CHECK( test_box(&oc,32.7f/32-1,32.9f/32-1,0.01f,0.02f,0.5f,0.6f));
+  CHECK(!test_box(&oc,-0.5f,-0.1f,-0.25f,0.25f,0.5f,0.6f));
+}
+
+/** \brief Depth rises by 1/64 across each pixel of the sloped occluder,
+  * which has to be stored with its farthest value.
+  */
+static void test_slope() {
+  OcclusionCuller oc;
+  const float *depth;
+  int x, y, holes=0, nearer=0;
+  
+  test_begin(&oc);
+  test_quad(&oc,-1,1,-1,1,-0.5f,0.5f);
+  oc.end();
+  
+  depth=oc.depth();
+  for(y=0;y<TEST_SIZE;y++) for(x=0;x<TEST_SIZE;x++) {
+    holes+=depth[y*TEST_SIZE+x]>=1;
+    nearer+=depth[y*TEST_SIZE+x]<0.5f*((x+1)/32.0f-1)-1e-5f;
+  }
+  CHECK(holes==0);
+  CHECK(nearer==0);
+  
+  // pixel 40 spans depths 0.125 to 0.140625, so the box is in front of the
+  // occluder in the right part of the pixel.
+  CHECK( test_box(&oc,0.251f,0.28f,0.01f,0.02f,0.135f,0.2f));
+  CHECK(!test_box(&oc,0.251f,0.28f,0.01f,0.02f,0.6f,0.7f));
+}
+
+/** \brief Occluders reaching behind the near plane are clipped. */
+static void test_nearPlane() {
+  OcclusionCuller oc;
+  
+  test_begin(&oc);
+  test_quad(&oc,-1,1,-1,1,-1.5f,0.5f);
+  oc.end();
+  
+  CHECK(oc.stats().triangles>0);
+  CHECK(oc.depth()[0]>=1);
+  CHECK(!test_box(&oc,0.5f,0.9f,-0.9f,-0.5f,0.6f,0.7f));
+  CHECK( test_box(&oc,0.5f,0.9f,-0.9f,-0.5f,0.0f,0.7f));
+}
+
+int main(int argn, char **argv) {
+  test_hidden();
+  test_edge();
+  test_slope();
+  test_nearPlane();
+  
+  return TEST_RESULT("occlusion");
+}
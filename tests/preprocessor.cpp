@@ -0,0 +1,207 @@
+
+/** \file preprocessor.cpp
+  * \author Peter Wagener
+  * \brief Tests of ShaderPreprocessor.
+  *
+  * Included files are written to a directory of their own, registered as
+  * shader repository. Checked are
+  * - #line directives around includes and loops,
+  * - files included only once, even when including each other,
+  * - nested loops,
+  * - transform feedback pragmas, also within included files,
+  * - output staying valid while included files change or the cache is
+  *   cleared.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <utime.h>
+
+#include "diyyma/preprocessor.h"
+#include "diyyma/util.h"
+#include "test.h"
+
+#define TEST_DIR "preprocessor_test/"
+
+static void test_write(const char *name, const char *text) {
+  char path[256];
+  snprintf(path,sizeof(path),TEST_DIR "%s",name);
+  writeFile(path,text,strlen(text));
+}
+
+/** \brief Concatenates the output of the last run. */
+static char *test_output(ShaderPreprocessor *pp) {
+  char *r, *p;
+  size_t idx;
+  
+  p=r=(char*)malloc(pp->cc()+1);
+  for(idx=0;idx<pp->count();idx++) {
+    memcpy(p,pp->strings()[idx],pp->lengths()[idx]);
+    p+=pp->lengths()[idx];
+  }
+  *p=0;
+  
+  return r;
+}
+
+/** \brief Runs the preprocessor on code, checking its output. */
+static void test_expect(const char *code, const char *expected) {
+  ShaderPreprocessor pp;
+  char *out;
+  
+  pp.run(code,0,"main");
+  out=test_output(&pp);
+  if (strcmp(out,expected))
+    printf("output:\n%s\nexpected:\n%s\n",out,expected);
+  CHECK(!strcmp(out,expected));
+  CHECK(pp.cc()==strlen(expected));
+  free((void*)out);
+}
+
+/** \brief Included files get source string numbers, and the lines after
+  * an include map back to the including file.
+  */
+static void test_lines() {
+  test_write("lines_a.glsl","a1\na2\n");
+  test_write("lines_b.glsl","b1\n#include \"lines_a.glsl\"\nb3");
+  
+  test_expect(
+    "l1\n#include \"lines_a.glsl\"\nl3\n",
+    "l1\n#line 1 1\na1\na2\n#line 3 0\nl3\n");
+  
+  // without a final line break, one is added before going back
+  test_expect(
+    "l1\n#include <lines_b.glsl>\nl3\n",
+    "l1\n#line 1 1\nb1\n#line 1 2\na1\na2\n#line 3 1\nb3\n#line 3 0\nl3\n");
+  
+  // unknown files are dropped, keeping the line count
+  test_expect(
+    "l1\n#include \"missing.glsl\"\nl3\n",
+    "l1\n\nl3\n");
+}
+
+/** \brief Files including each other, or included twice, appear once. */
+static void test_once() {
+  ShaderPreprocessor pp;
+  char *out;
+  
+  test_write("once_a.glsl","a\n#include \"once_b.glsl\"\n");
+  test_write("once_b.glsl","b\n#include \"once_a.glsl\"\n");
+  
+  pp.run(
+    "#include \"once_a.glsl\"\n#include \"once_b.glsl\"\n"
+    "#include \"once_a.glsl\"\nm\n",0,"main");
+  out=test_output(&pp);
+  
+  CHECK(pp.fileCount()==3);
+  CHECK(!strcmp(pp.file(0),"main"));
+  CHECK(strstr(pp.file(1),"once_a.glsl")!=0);
+  CHECK(strstr(pp.file(2),"once_b.glsl")!=0);
+  CHECK(pp.file(3)==0);
+  CHECK(!strcmp(out,
+    "#line 1 1\na\n#line 1 2\nb\n\n#line 3 1\n#line 2 0\n\n\nm\n"));
+  
+  free((void*)out);
+}
+
+/** \brief Loop bodies are repeated with their #line directives, so each
+  * pass maps to the same lines.
+  */
+static void test_loops() {
+  const char *outer=
+    "#line 3 0\na\n"
+    "#line 5 0\nb\n#line 5 0\nb\n#line 5 0\nb\n"
+    "#line 7 0\nc\n";
+  char expected[256];
+  
+  snprintf(expected,sizeof(expected),"x\n%s%s#line 9 0\ny\n",outer,outer);
+  test_expect(
+    "x\n"
+    "#pragma loop-begin 2\n"
+    "a\n"
+    "  #pragma loop-begin 3\n"
+    "b\n"
+    "  #pragma loop-end\n"
+    "c\n"
+    "#pragma loop-end\n"
+    "y\n",
+    expected);
+  
+  // invalid counts and unmatched ends are left alone
+  test_expect(
+    "#pragma loop-begin 0\n#pragma loop-end\nx\n",
+    "#pragma loop-begin 0\n#pragma loop-end\nx\n");
+}
+
+static void test_tfb() {
+  ShaderPreprocessor pp;
+  
+  test_write("tfb.glsl","#pragma TFB varying v_b\n");
+  
+  pp.run(
+    "#pragma TFB mode interleaved\n"
+    "#pragma TFB varying v_a\n"
+    "#include \"tfb.glsl\"\n"
+    "#pragma TFB mode sideways\n"
+    "#pragma other\n",0,"main");
+  
+  CHECK(pp.tfbMode()==PREPROCESSOR_TFB_INTERLEAVED);
+  CHECK(pp.varyingCount()==2);
+  CHECK(pp.varying(0) && !strcmp(pp.varying(0),"v_a"));
+  CHECK(pp.varying(1) && !strcmp(pp.varying(1),"v_b"));
+  CHECK(pp.varying(2)==0);
+  
+  pp.run("#pragma TFB mode separate\n",0,"main");
+  CHECK(pp.tfbMode()==PREPROCESSOR_TFB_SEPARATE);
+  CHECK(pp.varyingCount()==0);
+  
+  pp.clear();
+  CHECK(pp.tfbMode()==PREPROCESSOR_TFB_UNSET);
+}
+
+/** \brief Output keeps referring to the version of a file it was made
+  * from, while other runs pick up changes.
+  */
+static void test_changes() {
+  ShaderPreprocessor pp1, pp2, pp3;
+  struct utimbuf t;
+  char *out;
+  
+  test_write("change.glsl","old\n");
+  pp1.run("#include \"change.glsl\"\n",0,"main");
+  
+  // a different length and modification time
+  test_write("change.glsl","new version\n");
+  t.actime=t.modtime=1000000000;
+  utime(TEST_DIR "change.glsl",&t);
+  pp2.run("#include \"change.glsl\"\n",0,"main");
+  
+  preprocessor_cache_clear();
+  test_write("change.glsl","newest\n");
+  pp3.run("#include \"change.glsl\"\n",0,"main");
+  
+  out=test_output(&pp1);
+  CHECK(!strcmp(out,"#line 1 1\nold\n#line 2 0\n"));
+  free((void*)out);
+  out=test_output(&pp2);
+  CHECK(!strcmp(out,"#line 1 1\nnew version\n#line 2 0\n"));
+  free((void*)out);
+  out=test_output(&pp3);
+  CHECK(!strcmp(out,"#line 1 1\nnewest\n#line 2 0\n"));
+  free((void*)out);
+}
+
+int main(int argn, char **argv) {
+  dir_create(TEST_DIR);
+  vfs_registerPath(TEST_DIR,REPOSITORY_MASK_SHADER);
+  
+  test_lines();
+  test_once();
+  test_loops();
+  test_tfb();
+  test_changes();
+  
+  preprocessor_cache_clear();
+  
+  return TEST_RESULT("preprocessor");
+}
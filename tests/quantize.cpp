@@ -0,0 +1,242 @@
+
+/** \file quantize.cpp
+  * \author Peter Wagener
+  * \brief Tests of the vertex attribute conversions of quantize.h.
+  *
+  * Values are decoded the way the GL does and compared to what was
+  * encoded. Checked are
+  * - the angle between unit vectors and their octahedral encoding, over
+  *   both hemispheres and the seams in between,
+  * - half floats of all magnitudes, including denormals, overflow to
+  *   infinity, NaN and rounding,
+  * - the signs and ranges of the 10/10/10/2 components,
+  * - clamping of normalized shorts.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "diyyma/quantize.h"
+#include "test.h"
+
+/** \brief Largest angle between a unit vector and its octahedral encoding,
+  * in radians. Encoded components are 1/32767 apart. Rounding them moves
+  * the vector the most near the centres of the faces of the octahedron,
+  * where the sphere is farthest from it, by up to about 6.5e-5.
+  */
+#define TEST_OCTAHEDRAL_ERROR 7e-5f
+
+/** \brief Angle between unit vectors. acosf of the dot product is off by
+  * about 3e-4 for small angles.
+  */
+static float test_angle(const Vector3f &a, const Vector3f &b) {
+  return atan2f((a%b).length(),a*b);
+}
+
+static float test_snorm16(int16_t s) {
+  return max(s/32767.0f,-1.0f);
+}
+
+/** \brief Decodes an octahedral encoding as the shader in the description
+  * of STATICMESH_LOAD_OCTAHEDRAL does.
+  */
+static Vector3f test_octDecode(const int16_t *e) {
+  Vector3f n(test_snorm16(e[0]),test_snorm16(e[1]),0);
+  float x=n.x;
+  
+  n.z=1-fabsf(n.x)-fabsf(n.y);
+  if (n.z<0) {
+    n.x=(1-fabsf(n.y))*(x<0?-1:1);
+    n.y=(1-fabsf(x))*(n.y<0?-1:1);
+  }
+  
+  return n*(1/n.length());
+}
+
+static float test_half(u_int16_t h) {
+  int exp=(h>>10)&0x1f, mant=h&0x3ff;
+  float r;
+  
+  if (exp==31) r=mant?NAN:INFINITY;
+  else if (exp) r=ldexpf((float)(mant|0x400),exp-25);
+  else r=ldexpf((float)mant,-24);
+  
+  return (h&0x8000)?-r:r;
+}
+
+/** \brief Returns component i of a GL_INT_2_10_10_10_REV value, sign
+  * extended.
+  */
+static int test_component(u_int32_t p, int i) {
+  int c=(int)((p>>(i*10))&0x3ff);
+  return c>=0x200?c-0x400:c;
+}
+
+static void test_octahedral() {
+  Vector3f v, d;
+  int16_t e[2];
+  float error, worst=0;
+  int i, j;
+  
+  srand(1);
+  for(i=0;i<200000;i++) {
+    if (i<100000) {
+      v.set(
+        rand()/(float)RAND_MAX-0.5f,
+        rand()/(float)RAND_MAX-0.5f,
+        rand()/(float)RAND_MAX-0.5f);
+    } else {
+      // close to the seams, where the lower hemisphere is folded
+      v.set(
+        rand()/(float)RAND_MAX-0.5f,
+        rand()/(float)RAND_MAX-0.5f,
+        (rand()/(float)RAND_MAX-0.5f)*1e-3f);
+    }
+    if (v.length()<1e-3f) continue;
+    v=v*(1/v.length());
+    
+    quantize_octahedral(v,e);
+    d=test_octDecode(e);
+    error=test_angle(d,v);
+    worst=max(worst,error);
+  }
+  printf("octahedral: largest error %g\n",worst);
+  CHECK(worst<=TEST_OCTAHEDRAL_ERROR);
+  
+  // axes and the corners of the octahedron
+  for(i=0;i<6;i++) for(j=0;j<2;j++) {
+    v.set(0,0,0);
+    (&v.x)[i%3]=(i<3)?1.0f:-1.0f;
+    if (j) {
+      (&v.x)[(i+1)%3]=-0.5f;
+      v=v*(1/v.length());
+    }
+    quantize_octahedral(v,e);
+    d=test_octDecode(e);
+    CHECK(test_angle(d,v)<=TEST_OCTAHEDRAL_ERROR);
+  }
+  
+  quantize_octahedral(Vector3f(0,0,0),e);
+  CHECK(e[0]==0 && e[1]==0);
+}
+
+static void test_halfExact() {
+  // zeros, ones, the largest half and the smallest normal one
+  CHECK(quantize_half(0.0f)==0x0000);
+  CHECK(quantize_half(-0.0f)==0x8000);
+  CHECK(quantize_half(1.0f)==0x3c00);
+  CHECK(quantize_half(-2.0f)==0xc000);
+  CHECK(quantize_half(65504.0f)==0x7bff);
+  CHECK(quantize_half(ldexpf(1,-14))==0x0400);
+  
+  // denormals
+  CHECK(quantize_half(ldexpf(1,-24))==0x0001);
+  CHECK(quantize_half(-ldexpf(1,-24))==0x8001);
+  CHECK(quantize_half(ldexpf(1023,-24))==0x03ff);
+  CHECK(quantize_half(ldexpf(3,-16))==0x0300);
+  
+  // overflow, infinity and NaN
+  CHECK(quantize_half(65520.0f)==0x7c00);
+  CHECK(quantize_half(1e6f)==0x7c00);
+  CHECK(quantize_half(-1e6f)==0xfc00);
+  CHECK(quantize_half(INFINITY)==0x7c00);
+  CHECK(quantize_half(-INFINITY)==0xfc00);
+  CHECK((quantize_half(NAN)&0x7c00)==0x7c00);
+  CHECK((quantize_half(NAN)&0x03ff)!=0);
+  CHECK(quantize_half(1e-10f)==0x0000);
+  CHECK(quantize_half(-1e-10f)==0x8000);
+}
+
+/** \brief Values in between halves round to the nearest one, ties away
+  * from zero.
+  */
+static void test_halfRounding() {
+  int h, wrong=0;
+  float f, lo, hi;
+  
+  CHECK(quantize_half(1+ldexpf(1,-11))==0x3c01);
+  CHECK(quantize_half(1+ldexpf(1,-11)-ldexpf(1,-20))==0x3c00);
+  CHECK(quantize_half(1+ldexpf(3,-11))==0x3c02);
+  CHECK(quantize_half(-1-ldexpf(1,-11))==0xbc01);
+  
+  // ties between denormals, including the carry into the normal range
+  CHECK(quantize_half(ldexpf(1,-25))==0x0001);
+  CHECK(quantize_half(ldexpf(1,-26))==0x0000);
+  CHECK(quantize_half(ldexpf(3,-26))==0x0001);
+  CHECK(quantize_half(ldexpf(2047,-25))==0x0400);
+  
+  // every finite half comes back, and so do values just short of half way
+  // to its neighbours
+  for(h=0;h<0x10000;h++) {
+    if (((h>>10)&0x1f)==31) continue;
+    f=test_half((u_int16_t)h);
+    wrong+=quantize_half(f)!=h;
+    if ((h&0x7fff)==0 || (h&0x7fff)>=0x7bff) continue;
+    lo=test_half((u_int16_t)(h-1));
+    hi=test_half((u_int16_t)(h+1));
+    wrong+=quantize_half(f+(lo-f)*0.49f)!=h;
+    wrong+=quantize_half(f+(hi-f)*0.49f)!=h;
+  }
+  CHECK(wrong==0);
+}
+
+static void test_1010102() {
+  u_int32_t p;
+  Vector3f v;
+  float c;
+  int i, k, wrong=0;
+  
+  p=quantize_1010102(Vector3f(1,-1,0));
+  CHECK(test_component(p,0)==511);
+  CHECK(test_component(p,1)==-511);
+  CHECK(test_component(p,2)==0);
+  CHECK((p>>30)==0);
+  
+  // negative components do not reach into their neighbours or w
+  p=quantize_1010102(Vector3f(-1,0,-1));
+  CHECK(p==((0x201u<<20)|0x201u));
+  
+  p=quantize_1010102(Vector3f(2,-3,-0.5f));
+  CHECK(test_component(p,0)==511);
+  CHECK(test_component(p,1)==-511);
+  CHECK(test_component(p,2)==-256 || test_component(p,2)==-255);
+  
+  srand(2);
+  for(i=0;i<10000;i++) {
+    v.set(
+      rand()/(float)RAND_MAX*2-1,
+      rand()/(float)RAND_MAX*2-1,
+      rand()/(float)RAND_MAX*2-1);
+    p=quantize_1010102(v);
+    wrong+=(p>>30)!=0;
+    for(k=0;k<3;k++) {
+      c=test_component(p,k)/511.0f;
+      wrong+=fabsf(c-(&v.x)[k])>0.5f/511+1e-6f;
+      wrong+=test_component(p,k)==-512;
+    }
+  }
+  CHECK(wrong==0);
+}
+
+static void test_norm16() {
+  CHECK(quantize_unorm16(-1)==0);
+  CHECK(quantize_unorm16(NAN)==0);
+  CHECK(quantize_unorm16(0.5f)==32768);
+  CHECK(quantize_unorm16(2)==0xffff);
+  CHECK(quantize_snorm16(-2)==-32767);
+  CHECK(quantize_snorm16(-1)==-32767);
+  CHECK(quantize_snorm16(-0.5f)==-16383);
+  CHECK(quantize_snorm16(0)==0);
+  CHECK(quantize_snorm16(2)==32767);
+}
+
+int main(int argn, char **argv) {
+  test_octahedral();
+  test_halfExact();
+  test_halfRounding();
+  test_1010102();
+  test_norm16();
+  
+  return TEST_RESULT("quantize");
+}
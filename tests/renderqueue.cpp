@@ -0,0 +1,243 @@
+
+/** \file renderqueue.cpp
+  * \author Peter Wagener
+  * \brief Tests of the order RenderQueue::sort puts items in.
+  *
+  * Sorting only looks at the addresses of shaders, textures and meshes, so
+  * items point into an array standing in for them and no GL context is
+  * needed. Checked are
+  * - custom items going first, in the order they were added,
+  * - opaque items forming one run per shader, per material, i.e. set of
+  *   textures, within it and per mesh within that, front to back,
+  * - translucent items going back to front,
+  * - items with equal keys keeping the order they were added in.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "diyyma/renderqueue.h"
+#include "test.h"
+
+#define TEST_SHADERS 3
+#define TEST_MATERIALS 4
+#define TEST_MESHES 2
+#define TEST_CUSTOM 5
+
+/** \brief More than RENDERQUEUE_KEY_GRAIN, so keys are computed by
+  * several jobs.
+  */
+#define TEST_ITEMS 1000
+
+/** \brief Stands in for the shaders, textures and meshes of the items. */
+static char test_states[TEST_SHADERS+TEST_MATERIALS*2+TEST_MESHES];
+
+/** \brief Index of the item as added, and its state. */
+struct test_item_t {
+  size_t index;
+  int    shader, material, mesh;
+  float  depth;
+};
+
+static test_item_t test_items[TEST_ITEMS+TEST_CUSTOM];
+
+static Shader *test_shader(int i) {
+  return (Shader*)(test_states+i);
+}
+
+static Texture *test_texture(int material, int i) {
+  return (Texture*)(test_states+TEST_SHADERS+material*2+i);
+}
+
+static StaticMesh *test_mesh(int i) {
+  return (StaticMesh*)(test_states+TEST_SHADERS+TEST_MATERIALS*2+i);
+}
+
+/** \brief Fills a queue with items of random state and depth, custom
+  * items spread among them.
+  *
+  * Depths are powers of 2^(1/4), which differ by more than the precision
+  * keys keep, and repeat, as do states.
+  */
+static void test_fill(RenderQueue *queue) {
+  render_item_t *item;
+  test_item_t *t;
+  size_t idx;
+  int custom=0;
+  
+  srand(1);
+  queue->clear();
+  for(idx=0;idx<TEST_ITEMS+TEST_CUSTOM;idx++) {
+    t=test_items+idx;
+    t->index=idx;
+    
+    if ((custom<TEST_CUSTOM) && (idx%(TEST_ITEMS/TEST_CUSTOM)==7)) {
+      t->shader=-1;
+      queue->addCustom((IRenderableSceneNode*)t);
+      custom++;
+      continue;
+    }
+    
+    t->shader  =rand()%TEST_SHADERS;
+    t->material=rand()%TEST_MATERIALS;
+    t->mesh    =rand()%TEST_MESHES;
+    t->depth   =powf(2,(rand()%40)*0.25f);
+    
+    item=queue->add(0);
+    item->shader=test_shader(t->shader);
+    item->textures[0]=test_texture(t->material,0);
+    item->textures[2]=test_texture(t->material,1);
+    item->mesh=test_mesh(t->mesh);
+    item->M.setTranslation(0,0,-t->depth);
+    item->data=(void*)t;
+  }
+}
+
+/** \brief Returns the item at position idx after sorting. Custom items
+  * only have their node, which stands in for the item as well.
+  */
+static test_item_t *test_sorted(RenderQueue *queue, size_t idx) {
+  render_item_t *item=queue->sorted(idx);
+  return (test_item_t*)(item->shader?item->data:(void*)item->node);
+}
+
+/** \brief Checks that custom items go first, in the order they were added.
+  *
+  * \return Number of custom items.
+  */
+static size_t test_custom(RenderQueue *queue) {
+  size_t idx;
+  int wrong=0;
+  
+  for(idx=0;idx<TEST_CUSTOM;idx++) {
+    wrong+=test_sorted(queue,idx)->shader!=-1;
+    if (idx) wrong+=test_sorted(queue,idx)->index<
+      test_sorted(queue,idx-1)->index;
+  }
+  CHECK(wrong==0);
+  
+  return TEST_CUSTOM;
+}
+
+/** \brief Returns an index telling apart the first n state fields. */
+static int test_group(const test_item_t *t, int n) {
+  int r=t->shader;
+  if (n>1) r=r*TEST_MATERIALS+t->material;
+  if (n>2) r=r*TEST_MESHES+t->mesh;
+  return r;
+}
+
+static int test_sameState(const test_item_t *a, const test_item_t *b) {
+  return test_group(a,3)==test_group(b,3);
+}
+
+static void test_opaque() {
+  static int seen[TEST_SHADERS*TEST_MATERIALS*TEST_MESHES];
+  RenderQueue queue;
+  test_item_t *a, *b;
+  Matrixf I;
+  size_t idx, first;
+  int n, wrong=0, ties=0;
+  
+  I.setIdentity();
+  test_fill(&queue);
+  queue.sort(I,0);
+  first=test_custom(&queue);
+  
+  // a group which ended never appears again
+  for(n=1;n<=3;n++) {
+    memset(seen,0,sizeof(seen));
+    for(idx=first;idx<queue.count();idx++) {
+      a=test_sorted(&queue,idx);
+      if ((idx>first) && (test_group(a,n)==
+        test_group(test_sorted(&queue,idx-1),n))) continue;
+      wrong+=seen[test_group(a,n)]++;
+    }
+  }
+  CHECK(wrong==0);
+  
+  // front to back within a group, in the order added if equally far
+  for(idx=first+1;idx<queue.count();idx++) {
+    a=test_sorted(&queue,idx-1);
+    b=test_sorted(&queue,idx);
+    if (!test_sameState(a,b)) continue;
+    wrong+=a->depth>b->depth;
+    if (a->depth==b->depth) {
+      wrong+=a->index>b->index;
+      ties++;
+    }
+  }
+  CHECK(wrong==0);
+  CHECK(ties>0);
+}
+
+static void test_translucent() {
+  RenderQueue queue;
+  test_item_t *a, *b;
+  Matrixf I;
+  size_t idx, first;
+  int wrong=0, ties=0;
+  
+  I.setIdentity();
+  test_fill(&queue);
+  queue.sort(I,1);
+  first=test_custom(&queue);
+  
+  for(idx=first+1;idx<queue.count();idx++) {
+    a=test_sorted(&queue,idx-1);
+    b=test_sorted(&queue,idx);
+    wrong+=a->depth<b->depth;
+    if ((a->depth==b->depth) && test_sameState(a,b)) {
+      wrong+=a->index>b->index;
+      ties++;
+    }
+  }
+  CHECK(wrong==0);
+  CHECK(ties>0);
+}
+
+/** \brief Items all sharing one key, which no radix pass tells apart. */
+static void test_equal() {
+  static test_item_t items[TEST_ITEMS];
+  RenderQueue queue;
+  render_item_t *item;
+  Matrixf I;
+  size_t idx;
+  int translucent, wrong=0;
+  
+  I.setIdentity();
+  for(translucent=0;translucent<2;translucent++) {
+    queue.clear();
+    for(idx=0;idx<TEST_ITEMS;idx++) {
+      items[idx].index=idx;
+      item=queue.add(0);
+      item->shader=test_shader(0);
+      item->mesh=test_mesh(0);
+      item->M.setTranslation(0,0,-2);
+      item->data=(void*)(items+idx);
+    }
+    queue.sort(I,translucent);
+    for(idx=0;idx<TEST_ITEMS;idx++)
+      wrong+=test_sorted(&queue,idx)->index!=idx;
+  }
+  CHECK(wrong==0);
+  
+  // nothing, and a single item
+  queue.clear();
+  queue.sort(I,0);
+  CHECK(queue.count()==0);
+  item=queue.add(0);
+  item->shader=test_shader(1);
+  item->data=(void*)items;
+  queue.sort(I,0);
+  CHECK(queue.count()==1);
+  CHECK(queue.sorted(0)==item);
+}
+
+int main(int argn, char **argv) {
+  test_opaque();
+  test_translucent();
+  test_equal();
+  
+  return TEST_RESULT("renderqueue");
+}
@@ -0,0 +1,171 @@
+
+/** \file shaderuniforms.cpp
+  * \author Peter Wagener
+  * \brief Tests of ShaderUniforms, the uniform table of Shader.
+  *
+  * Uniforms are added as glGetActiveUniform reports them, with locations
+  * coming from a table of the test rather than from a program, so no GL
+  * context is needed. Checked are
+  * - lookups by name, with and without type,
+  * - uniforms of a different type turning inactive once looked up,
+  * - arrays added by their plain name and by every element, each element
+  *   located once,
+  * - a table large enough for its index to grow, and clearing it.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "diyyma/shader.h"
+#include "test.h"
+
+/** \brief Locations the test program hands out, not consecutive for the
+  * elements of arrays.
+  */
+struct test_location_t {
+  const char *name;
+  GLint       location;
+  int         calls;
+};
+
+static test_location_t test_locations[]={
+  { "color",     3,  0 },
+  { "M",         0,  0 },
+  { "lights[0]", 10, 0 },
+  { "lights[1]", 14, 0 },
+  { "lights[2]", 12, 0 },
+  { "lights[3]", 20, 0 },
+  { "w[0]",      7,  0 },
+  { "[0]",       8,  0 },
+  { 0,           -1, 0 } };
+
+static GLint test_locate(const char *name, void *arg) {
+  test_location_t *l=(test_location_t*)arg;
+  
+  for(;l->name;l++) if (!strcmp(l->name,name)) {
+    l->calls++;
+    return l->location;
+  }
+  
+  return -1;
+}
+
+static void test_fill(ShaderUniforms *u) {
+  u->clear();
+  u->add("color",GL_FLOAT_VEC4,1,test_locate,test_locations);
+  u->add("M",GL_FLOAT_MAT4,1,test_locate,test_locations);
+  u->add("lights[0]",GL_FLOAT_VEC3,4,test_locate,test_locations);
+  u->add("w[0]",GL_FLOAT,1,test_locate,test_locations);
+  u->add("[0]",GL_FLOAT,2,test_locate,test_locations);
+  // in a uniform block, so without a location
+  u->add("blocked",GL_FLOAT,1,test_locate,test_locations);
+}
+
+static void test_lookup() {
+  ShaderUniforms u;
+  const ShaderUniform *pu;
+  
+  test_fill(&u);
+  CHECK(u.locate("color")==3);
+  CHECK(u.locate("M")==0);
+  CHECK(u.locate("missing")==-1);
+  CHECK(u.locate("colo")==-1);
+  CHECK(u.locate("")==-1);
+  CHECK(u.locate("color",GL_FLOAT_VEC4)==3);
+  CHECK(u.locate("M",GL_FLOAT_MAT4)==0);
+  CHECK(u.locate("missing",GL_FLOAT)==-1);
+  CHECK(u.locate("blocked")==-1);
+  CHECK(u.find("blocked")!=0);
+  
+  pu=u.find("M");
+  CHECK(pu && !strcmp(pu->name,"M"));
+  CHECK(pu && pu->type==GL_FLOAT_MAT4 && pu->size==1);
+}
+
+/** \brief A type mismatch is reported once, the uniform then stays
+  * inactive, also for lookups of its actual type.
+  */
+static void test_mismatch() {
+  ShaderUniforms u;
+  
+  test_fill(&u);
+  CHECK(u.locate("color",GL_FLOAT_VEC3)==-1);
+  CHECK(u.locate("color",GL_FLOAT_VEC4)==-1);
+  CHECK(u.locate("color")==-1);
+  CHECK(u.locate("M")==0);
+  CHECK(u.locate("blocked",GL_INT)==-1);
+  
+  // until the program is linked again
+  test_fill(&u);
+  CHECK(u.locate("color",GL_FLOAT_VEC4)==3);
+}
+
+static void test_arrays() {
+  ShaderUniforms u;
+  const ShaderUniform *pu;
+  test_location_t *l;
+  
+  for(l=test_locations;l->name;l++) l->calls=0;
+  test_fill(&u);
+  
+  // each element was located exactly once
+  for(l=test_locations;l->name;l++) CHECK(l->calls==1);
+  
+  CHECK(u.locate("lights")==10);
+  CHECK(u.locate("lights[0]")==10);
+  CHECK(u.locate("lights[1]")==14);
+  CHECK(u.locate("lights[2]",GL_FLOAT_VEC3)==12);
+  CHECK(u.locate("lights[3]")==20);
+  CHECK(u.locate("lights[4]")==-1);
+  
+  // sizes count the elements from there on
+  pu=u.find("lights");
+  CHECK(pu && pu->size==4);
+  pu=u.find("lights[1]");
+  CHECK(pu && pu->size==3);
+  pu=u.find("lights[3]");
+  CHECK(pu && pu->size==1);
+  
+  // an array of one element, and one without a name to strip
+  CHECK(u.locate("w")==7);
+  CHECK(u.locate("w[1]")==-1);
+  CHECK(u.locate("[0]")==8);
+  CHECK(u.find("")==0);
+  CHECK(u.find("[1]")==0);
+  
+  // 6 uniforms reported, 5 names added for the arrays
+  CHECK(u.count()==11);
+}
+
+static void test_many() {
+  ShaderUniforms u;
+  char name[32];
+  int i, wrong=0;
+  
+  for(i=0;i<1000;i++) {
+    _snprintf(name,sizeof(name),"u%i",i);
+    u.add(name,GL_INT,1,test_locate,test_locations);
+  }
+  CHECK(u.count()==1000);
+  
+  for(i=0;i<1000;i++) {
+    _snprintf(name,sizeof(name),"u%i",i);
+    wrong+=u.find(name)==0;
+    wrong+=u.find(name) && strcmp(u.find(name)->name,name);
+  }
+  CHECK(wrong==0);
+  
+  u.clear();
+  CHECK(u.count()==0);
+  CHECK(u.find("u1")==0);
+  CHECK(u.locate("u1")==-1);
+}
+
+int main(int argn, char **argv) {
+  test_lookup();
+  test_mismatch();
+  test_arrays();
+  test_many();
+  
+  return TEST_RESULT("shaderuniforms");
+}
@@ -0,0 +1,287 @@
+
+/** \file simplify.cpp
+  * \author Peter Wagener
+  * \brief Tests of meshopt_simplify.
+  *
+  * Simplifies spheres with and without a texture seam, a flat shaded
+  * sphere and a bordered grid, checking that
+  * - the target is reached where nothing is locked,
+  * - no triangle flips,
+  * - closed surfaces stay closed, i.e. seams do not tear open,
+  * - borders and shared corners stay in place.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "diyyma/meshopt.h"
+#include "diyyma/util.h"
+#include "test.h"
+
+struct test_mesh_t {
+  ARRAY(Vector3f,positions);
+  ARRAY(u_int32_t,indices);
+};
+
+static void test_mesh_init(test_mesh_t *mesh) {
+  ARRAY_INIT(mesh->positions);
+  ARRAY_INIT(mesh->indices);
+}
+
+static void test_mesh_destroy(test_mesh_t *mesh) {
+  ARRAY_DESTROY(mesh->positions);
+  ARRAY_DESTROY(mesh->indices);
+}
+
+static void test_triangle(
+  test_mesh_t *mesh, u_int32_t a, u_int32_t b, u_int32_t c) {
+  APPEND(mesh->indices,a);
+  APPEND(mesh->indices,b);
+  APPEND(mesh->indices,c);
+}
+
+/** \brief Unit sphere with one vertex per pole. With seam, the first
+  * column of every ring is repeated as a last one, as texture coordinates
+  * wrapping around would require.
+  */
+static void test_sphere(test_mesh_t *mesh, int rings, int segments,
+  int seam) {
+  int r, s, columns=segments+(seam?1:0);
+  float theta, phi;
+  u_int32_t south, a, b;
+  
+  APPEND(mesh->positions,Vector3f(0,0,1));
+  for(r=1;r<rings;r++) for(s=0;s<columns;s++) {
+    theta=(float)M_PI*r/rings;
+    phi=2*(float)M_PI*(s%segments)/segments;
+    APPEND(mesh->positions,Vector3f(
+      sinf(theta)*cosf(phi),sinf(theta)*sinf(phi),cosf(theta)));
+  }
+  south=mesh->positions_n;
+  APPEND(mesh->positions,Vector3f(0,0,-1));
+  
+  for(s=0;s<segments;s++) {
+    a=1+s;
+    b=1+(seam?s+1:(s+1)%segments);
+    test_triangle(mesh,0,a,b);
+    a=1+(rings-2)*columns+s;
+    b=1+(rings-2)*columns+(seam?s+1:(s+1)%segments);
+    test_triangle(mesh,south,b,a);
+  }
+  for(r=1;r<rings-1;r++) for(s=0;s<segments;s++) {
+    a=1+(r-1)*columns;
+    b=1+r*columns;
+    test_triangle(mesh,
+      a+s,b+s,b+(seam?s+1:(s+1)%segments));
+    test_triangle(mesh,
+      a+s,b+(seam?s+1:(s+1)%segments),a+(seam?s+1:(s+1)%segments));
+  }
+}
+
+/** \brief Gives every triangle vertices of its own, as flat shading
+  * requires.
+  */
+static void test_unweld(test_mesh_t *mesh) {
+  test_mesh_t flat;
+  size_t idx;
+  
+  test_mesh_init(&flat);
+  for(idx=0;idx<mesh->indices_n;idx++) {
+    APPEND(flat.positions,mesh->positions_v[mesh->indices_v[idx]]);
+    APPEND(flat.indices,(u_int32_t)idx);
+  }
+  test_mesh_destroy(mesh);
+  *mesh=flat;
+}
+
+/** \brief Grid of n by n quads in the xy plane. */
+static void test_grid(test_mesh_t *mesh, int n) {
+  int x, y;
+  u_int32_t a;
+  
+  for(y=0;y<=n;y++) for(x=0;x<=n;x++)
+    APPEND(mesh->positions,Vector3f((float)x,(float)y,0));
+  for(y=0;y<n;y++) for(x=0;x<n;x++) {
+    a=y*(n+1)+x;
+    test_triangle(mesh,a,a+1,a+n+2);
+    test_triangle(mesh,a,a+n+2,a+n+1);
+  }
+}
+
+/** \brief Counts triangles whose normal points away from a reference
+  * direction: outwards for spheres, +z for grids.
+  */
+static size_t test_flipped(
+  const test_mesh_t *mesh, const u_int32_t *indices, size_t count,
+  int sphere) {
+  const Vector3f *p=mesh->positions_v;
+  const u_int32_t *tri;
+  Vector3f n, ref(0,0,1);
+  size_t f, flipped=0;
+  
+  for(f=0;f<count/3;f++) {
+    tri=indices+f*3;
+    n=(p[tri[1]]-p[tri[0]])%(p[tri[2]]-p[tri[0]]);
+    if (sphere) ref=p[tri[0]]+p[tri[1]]+p[tri[2]];
+    if (n*ref<=0) flipped++;
+  }
+  
+  return flipped;
+}
+
+static int test_compareEdges(const void *a, const void *b) {
+  u_int64_t ea=*(const u_int64_t*)a, eb=*(const u_int64_t*)b;
+  return ea<eb?-1:ea>eb?1:0;
+}
+
+/** \brief Counts edges, by position, not shared by exactly two
+  * triangles.
+  */
+static size_t test_openEdges(
+  const test_mesh_t *mesh, const u_int32_t *indices, size_t count) {
+  u_int32_t *weld, a, b;
+  u_int64_t *edges;
+  size_t i, j, open=0;
+  
+  weld=(u_int32_t*)malloc(sizeof(u_int32_t)*mesh->positions_n);
+  for(i=0;i<mesh->positions_n;i++) {
+    for(j=0;j<i;j++)
+      if (!memcmp(mesh->positions_v+i,mesh->positions_v+j,
+        sizeof(Vector3f))) break;
+    weld[i]=(u_int32_t)j;
+  }
+  
+  edges=(u_int64_t*)malloc(sizeof(u_int64_t)*count);
+  for(i=0;i<count;i++) {
+    a=weld[indices[i]];
+    b=weld[indices[i-i%3+(i+1)%3]];
+    edges[i]=a<b?((u_int64_t)a<<32)|b:((u_int64_t)b<<32)|a;
+  }
+  qsort(edges,count,sizeof(u_int64_t),test_compareEdges);
+  for(i=0;i<count;i=j) {
+    for(j=i+1;(j<count)&&(edges[j]==edges[i]);j++);
+    if (j-i!=2) open++;
+  }
+  
+  free(edges);
+  free(weld);
+  return open;
+}
+
+/** \brief Simplifies a closed sphere to a quarter, which has to be reached
+  * without flipping or opening anything.
+  */
+static void test_closedSphere(int seam) {
+  const int rings=32, segments=64;
+  test_mesh_t mesh;
+  u_int32_t *out;
+  char *used;
+  size_t count, target, idx, seamUsed=0;
+  float error;
+  int r;
+  
+  test_mesh_init(&mesh);
+  test_sphere(&mesh,rings,segments,seam);
+  target=mesh.indices_n/4/3*3;
+  
+  out=(u_int32_t*)malloc(sizeof(u_int32_t)*mesh.indices_n);
+  count=meshopt_simplify(out,mesh.indices_v,mesh.indices_n,
+    mesh.positions_v,mesh.positions_n,target,&error);
+  
+  printf("sphere%s: %lu -> %lu indices (target %lu), error %g\n",
+    seam?" with seam":"",(unsigned long)mesh.indices_n,
+    (unsigned long)count,(unsigned long)target,error);
+  
+  CHECK(count<=target);
+  CHECK(count>=target-6);
+  CHECK(test_flipped(&mesh,out,count,1)==0);
+  CHECK(test_openEdges(&mesh,out,count)==0);
+  CHECK((error>0)&&(error<0.1f));
+  
+  // the seam has to be simplified along with everything else, both of its
+  // sides alike
+  if (seam) {
+    used=(char*)malloc(mesh.positions_n);
+    memset(used,0,mesh.positions_n);
+    for(idx=0;idx<count;idx++) used[out[idx]]=1;
+    for(r=1;r<rings;r++) {
+      CHECK(used[1+(r-1)*(segments+1)]==used[r*(segments+1)]);
+      seamUsed+=used[1+(r-1)*(segments+1)];
+    }
+    printf("  %lu of %i seam positions left\n",
+      (unsigned long)seamUsed,rings-1);
+    CHECK((int)seamUsed*4<(rings-1)*3);
+    free(used);
+  }
+  
+  free(out);
+  test_mesh_destroy(&mesh);
+}
+
+/** \brief Flat shaded meshes have every position shared by several
+  * vertices, which are all locked.
+  */
+static void test_flatSphere() {
+  test_mesh_t mesh;
+  u_int32_t *out;
+  size_t count;
+  
+  test_mesh_init(&mesh);
+  test_sphere(&mesh,8,16,0);
+  test_unweld(&mesh);
+  
+  out=(u_int32_t*)malloc(sizeof(u_int32_t)*mesh.indices_n);
+  count=meshopt_simplify(out,mesh.indices_v,mesh.indices_n,
+    mesh.positions_v,mesh.positions_n,mesh.indices_n/4,0);
+  
+  CHECK(count==mesh.indices_n);
+  CHECK(!memcmp(out,mesh.indices_v,sizeof(u_int32_t)*count));
+  
+  free(out);
+  test_mesh_destroy(&mesh);
+}
+
+/** \brief A flat grid loses interior vertices only, without any error. */
+static void test_borderedGrid() {
+  test_mesh_t mesh;
+  u_int32_t *out;
+  char *used;
+  size_t count, idx;
+  int n=16, x, y, border=1;
+  float error;
+  
+  test_mesh_init(&mesh);
+  test_grid(&mesh,n);
+  
+  out=(u_int32_t*)malloc(sizeof(u_int32_t)*mesh.indices_n);
+  count=meshopt_simplify(out,mesh.indices_v,mesh.indices_n,
+    mesh.positions_v,mesh.positions_n,0,&error);
+  
+  printf("grid: %lu -> %lu indices, error %g\n",
+    (unsigned long)mesh.indices_n,(unsigned long)count,error);
+  
+  used=(char*)malloc(mesh.positions_n);
+  memset(used,0,mesh.positions_n);
+  for(idx=0;idx<count;idx++) used[out[idx]]=1;
+  for(y=0;y<=n;y++) for(x=0;x<=n;x++)
+    if ((x==0)||(y==0)||(x==n)||(y==n)) border&=used[y*(n+1)+x];
+  
+  CHECK(border);
+  CHECK(count<mesh.indices_n/2);
+  CHECK(test_flipped(&mesh,out,count,0)==0);
+  CHECK(error<1e-3f);
+  
+  free(used);
+  free(out);
+  test_mesh_destroy(&mesh);
+}
+
+int main(int argn, char **argv) {
+  test_closedSphere(0);
+  test_closedSphere(1);
+  test_flatSphere();
+  test_borderedGrid();
+  
+  return TEST_RESULT("simplify");
+}
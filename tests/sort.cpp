@@ -0,0 +1,179 @@
+
+/** \file sort.cpp
+  * \author Peter Wagener
+  * \brief Tests of sortByKeys and sortByFloatKeys.
+  *
+  * Objects are the indices of their keys in the input, so both can be
+  * checked against a copy of it. Keys come in sizes around the insertion
+  * sort threshold and up to 100k, and in orders which take every path:
+  * random, few distinct values, sorted, reversed, nearly sorted, sorted up
+  * to half of them, special values such as infinities, denormals and
+  * both zeros, all equal, differing only in the lowest bits and only in
+  * the highest. Checked are
+  * - keys being in order and objects following their keys,
+  * - sortByFloatKeys keeping keys of the same bits in the order they came
+  *   in, and keeping the bits, i.e. the sign of zeros,
+  * - sortByKeys also for integer keys,
+  * - keys and objects staying together for NaN keys, which have no place
+  *   to be sorted to.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "diyyma/util.h"
+#include "test.h"
+
+#define TEST_MAX 100000
+#define TEST_PATTERNS 10
+
+static const size_t test_sizes[]={
+  0, 1, 2, 3, SORT_INSERTION_THRESHOLD, SORT_INSERTION_THRESHOLD+1,
+  1000, TEST_MAX };
+
+static const float test_specials[]={
+  -INFINITY, -1e30f, -1, -1e-40f, -0.0f, 0.0f, 1e-40f, 1, 1e30f,
+  INFINITY };
+
+static float    test_input[TEST_MAX];
+static float    test_keys[TEST_MAX];
+static int      test_intInput[TEST_MAX];
+static int      test_intKeys[TEST_MAX];
+static size_t   test_objects[TEST_MAX];
+static size_t   test_tmpObjects[TEST_MAX];
+static u_int32_t test_tmpKeys[TEST_MAX*2];
+static unsigned char test_seen[TEST_MAX];
+
+static float test_random(float a, float b) {
+  return a+(b-a)*(rand()/(float)RAND_MAX);
+}
+
+static void test_fill(size_t n, int pattern) {
+  size_t i;
+  
+  for(i=0;i<n;i++) switch(pattern) {
+    case 0: test_input[i]=test_random(-1000,1000); break;
+    case 1: test_input[i]=(float)(rand()%8-4); break;
+    case 2: test_input[i]=i*0.5f-n*0.25f; break;
+    case 3: test_input[i]=n*0.25f-i*0.5f; break;
+    case 4: test_input[i]=(float)i+test_random(0,4); break;
+    case 5:
+      test_input[i]=i<n/2?(float)i:test_random(-(float)n,(float)n);
+      break;
+    case 6:
+      test_input[i]=test_specials[rand()%
+        (sizeof(test_specials)/sizeof(float))];
+      break;
+    case 7: test_input[i]=3.5f; break;
+    case 8: test_input[i]=1+(rand()%2048)*FLT_EPSILON; break;
+    default: test_input[i]=-(float)(rand()%(1<<20))*(1<<10); break;
+  }
+  
+  for(i=0;i<n;i++) test_objects[i]=i;
+  memcpy(test_keys,test_input,sizeof(float)*n);
+}
+
+/** \brief Checks that objects are a permutation of the input and that each
+  * key is the one of its object.
+  */
+template<class K> static int test_together(
+  const K *input, const K *keys, size_t n) {
+  size_t i;
+  
+  memset(test_seen,0,n);
+  for(i=0;i<n;i++) {
+    if ((test_objects[i]>=n) || test_seen[test_objects[i]]++) return 0;
+    if (memcmp(keys+i,input+test_objects[i],sizeof(K))) return 0;
+  }
+  
+  return 1;
+}
+
+template<class K> static int test_sorted(
+  const K *input, const K *keys, size_t n, int stable) {
+  size_t i;
+  
+  if (!test_together<K>(input,keys,n)) return 0;
+  
+  for(i=1;i<n;i++) {
+    if (keys[i]<keys[i-1]) return 0;
+    if (stable && !memcmp(keys+i,keys+i-1,sizeof(K))
+    && (test_objects[i]<test_objects[i-1])) return 0;
+  }
+  
+  return 1;
+}
+
+static void test_float() {
+  size_t s, n;
+  int pattern, wrong=0, wrongStable=0;
+  
+  srand(1);
+  for(s=0;s<sizeof(test_sizes)/sizeof(size_t);s++) {
+    n=test_sizes[s];
+    for(pattern=0;pattern<TEST_PATTERNS;pattern++) {
+      test_fill(n,pattern);
+      sortByKeys<size_t,float>(test_objects,test_keys,n);
+      wrong+=!test_sorted<float>(test_input,test_keys,n,0);
+      
+      test_fill(n,pattern);
+      sortByFloatKeys<size_t>(test_objects,test_keys,n,
+        test_tmpObjects,test_tmpKeys);
+      wrongStable+=!test_sorted<float>(test_input,test_keys,n,1);
+      
+      // sorting again changes nothing
+      sortByFloatKeys<size_t>(test_objects,test_keys,n,
+        test_tmpObjects,test_tmpKeys);
+      wrongStable+=!test_sorted<float>(test_input,test_keys,n,1);
+    }
+  }
+  CHECK(wrong==0);
+  CHECK(wrongStable==0);
+}
+
+static void test_int() {
+  size_t s, n, i;
+  int pattern, wrong=0;
+  
+  srand(2);
+  for(s=0;s<sizeof(test_sizes)/sizeof(size_t);s++) {
+    n=test_sizes[s];
+    for(pattern=0;pattern<TEST_PATTERNS;pattern++) {
+      // special values do not convert
+      if (pattern==6) continue;
+      test_fill(n,pattern);
+      for(i=0;i<n;i++) test_intInput[i]=(int)floorf(test_input[i]);
+      memcpy(test_intKeys,test_intInput,sizeof(int)*n);
+      sortByKeys<size_t,int>(test_objects,test_intKeys,n);
+      wrong+=!test_sorted<int>(test_intInput,test_intKeys,n,0);
+    }
+  }
+  CHECK(wrong==0);
+}
+
+static void test_nan() {
+  size_t s, n, i;
+  int wrong=0;
+  
+  srand(3);
+  for(s=0;s<sizeof(test_sizes)/sizeof(size_t);s++) {
+    n=test_sizes[s];
+    test_fill(n,0);
+    for(i=0;i<n;i+=7) test_input[i]=(i%2)?NAN:-NAN;
+    memcpy(test_keys,test_input,sizeof(float)*n);
+    sortByFloatKeys<size_t>(test_objects,test_keys,n,
+      test_tmpObjects,test_tmpKeys);
+    wrong+=!test_together<float>(test_input,test_keys,n);
+  }
+  CHECK(wrong==0);
+}
+
+int main(int argn, char **argv) {
+  test_float();
+  test_int();
+  test_nan();
+  
+  return TEST_RESULT("sort");
+}
@@ -0,0 +1,30 @@
+
+/** \file test.h
+  * \author Peter Wagener
+  * \brief Minimal checks shared by the tests.
+  *
+  * Each test is a program of its own, returning non-zero if any check
+  * failed.
+  */
+
+#ifndef _DIYYMA_TEST_H
+#define _DIYYMA_TEST_H
+
+#include <stdio.h>
+
+static int test_failures=0;
+
+/** \brief Reports a failed check along with its location. */
+#define CHECK(cond) { \
+  if (!(cond)) { \
+    printf("FAILED: %s:%i: %s\n",__FILE__,__LINE__,#cond); \
+    test_failures++; \
+  } \
+}
+
+/** \brief Prints a summary, to be returned from main. */
+#define TEST_RESULT(name) ( \
+  printf("%s: %s\n",name,test_failures?"FAILED":"passed"), \
+  test_failures?1:0)
+
+#endif
@@ -0,0 +1,241 @@
+
+/** \file transformstore.cpp
+  * \author Peter Wagener
+  * \brief Tests of TransformStore and the absolute transformations of scene
+  * nodes attached to it.
+  *
+  * Checked are
+  * - that the absolute transformations of a store on its own are those of
+  *   multiplying the local ones up to the root, after random adds, removes
+  *   and changes, with children of removed entries becoming roots and
+  *   handles staying valid,
+  * - that ISceneNode::absTransform, for a tree of which only some nodes are
+  *   attached to a store, is the same as walking up to the root, whether
+  *   attached nodes are changed by invalidateTransform or by writing to the
+  *   store directly,
+  * - that nodes below attached ones follow them when only the store
+  *   changed, and that the transformation version stays the same if
+  *   nothing did.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "diyyma/scenegraph.h"
+#include "test.h"
+
+#define TEST_HANDLES 1000
+#define TEST_STEPS 50
+#define TEST_NODES 2000
+#define TEST_FRAMES 20
+
+static Matrixf test_random() {
+  float a=(rand()%628)*0.01f, c=cosf(a), s=sinf(a);
+  return Matrixf(
+    c,-s,0,(rand()%100)*0.01f,
+    0, 0,1,(rand()%100)*0.01f,
+    s, c,0,(rand()%100)*0.01f,
+    0, 0,0,1);
+}
+
+/** \brief Returns non-zero if two matrices are the same, but for rounding
+  * due to being multiplied in a different order.
+  */
+static int test_same(const Matrixf &a, const Matrixf &b) {
+  const float *pa=&a.a11, *pb=&b.a11;
+  int i;
+  
+  for(i=0;i<16;i++) if (fabsf(pa[i]-pb[i])>1e-4f*(1+fabsf(pb[i])))
+    return 0;
+  
+  return 1;
+}
+
+/** \brief Entry of a store as the test expects it. */
+struct test_entry_t {
+  int     live;
+  int     parent;
+  Matrixf local;
+};
+
+static test_entry_t test_entries[TEST_HANDLES];
+
+/** \brief Absolute transformation of an entry, multiplied up to the root.
+  */
+static Matrixf test_world(int handle) {
+  Matrixf M=test_entries[handle].local;
+  int p;
+  
+  for(p=test_entries[handle].parent;p>=0;p=test_entries[p].parent)
+    M=test_entries[p].local*M;
+  
+  return M;
+}
+
+static int test_pickLive() {
+  int h;
+  
+  do h=rand()%TEST_HANDLES; while(!test_entries[h].live);
+  
+  return h;
+}
+
+static void test_store() {
+  TransformStore *store=new TransformStore();
+  int step, i, h, p, n=0, wrong=0, wrongHandles=0;
+  
+  store->grab();
+  srand(1);
+  for(h=0;h<TEST_HANDLES;h++) test_entries[h].live=0;
+  
+  for(step=0;step<TEST_STEPS;step++) {
+    for(i=0;i<TEST_HANDLES/4;i++) {
+      if ((n<TEST_HANDLES/2) && (!n || rand()%3)) {
+        p=(n && rand()%4)?test_pickLive():-1;
+        h=store->add(p);
+        wrongHandles+=(h<0) || (h>=TEST_HANDLES) || test_entries[h].live;
+        if (wrongHandles) break;
+        test_entries[h].live=1;
+        test_entries[h].parent=p;
+        test_entries[h].local.setIdentity();
+        n++;
+        if (rand()%2) {
+          test_entries[h].local=test_random();
+          store->local(h)=test_entries[h].local;
+        }
+      } else if (rand()%2) {
+        h=test_pickLive();
+        store->remove(h);
+        test_entries[h].live=0;
+        n--;
+        for(p=0;p<TEST_HANDLES;p++)
+          if (test_entries[p].parent==h) test_entries[p].parent=-1;
+      } else {
+        h=test_pickLive();
+        test_entries[h].local=test_random();
+        store->local(h)=test_entries[h].local;
+      }
+    }
+    
+    // every other step, leave updating to world
+    if (step%2) store->update();
+    for(h=0;h<TEST_HANDLES;h++) if (test_entries[h].live)
+      wrong+=!test_same(store->world(h),test_world(h));
+    wrong+=store->count()!=(size_t)n;
+  }
+  CHECK(wrongHandles==0);
+  CHECK(wrong==0);
+  
+  for(h=0;h<TEST_HANDLES;h++) if (test_entries[h].live) store->remove(h);
+  store->update();
+  CHECK(store->count()==0);
+  
+  store->drop();
+}
+
+/** \brief Absolute transformation of a node without any caching. */
+static Matrixf test_walk(ISceneNode *node) {
+  Matrixf M=node->transform();
+  ISceneNode *p;
+  for(p=node->parent();p;p=p->parent()) M=p->transform()*M;
+  return M;
+}
+
+static int test_compare(STSceneNode **nodes) {
+  size_t idx;
+  int wrong=0;
+  
+  for(idx=0;idx<TEST_NODES;idx++)
+    wrong+=!test_same(nodes[idx]->absTransform(),test_walk(nodes[idx]));
+  
+  return wrong;
+}
+
+static void test_nodes() {
+  static STSceneNode *nodes[TEST_NODES];
+  static int attached[TEST_NODES];
+  TransformStore *store=new TransformStore();
+  size_t idx, p, count=0;
+  unsigned version;
+  int frame, wrong=0;
+  
+  store->grab();
+  srand(2);
+  
+  // two trees, the second of which is never attached
+  nodes[0]=new STSceneNode(0);
+  nodes[1]=new STSceneNode(0);
+  nodes[0]->grab();
+  nodes[1]->grab();
+  attached[0]=nodes[0]->attachTransformStore(store);
+  attached[1]=0;
+  for(idx=2;idx<TEST_NODES;idx++) {
+    p=rand()%idx;
+    nodes[idx]=new STSceneNode(nodes[p]);
+    nodes[idx]->staticTransform=test_random();
+    attached[idx]=attached[p] && (rand()%8) &&
+      nodes[idx]->attachTransformStore(store);
+    count+=attached[idx];
+  }
+  CHECK(attached[0]);
+  CHECK(count>TEST_NODES/4);
+  CHECK(store->count()==count+1);
+  
+  // a node can only be attached below attached nodes, and once
+  for(idx=2;idx<TEST_NODES;idx++)
+    if (!attached[idx] && !nodes[idx]->parent()->transformStore()) {
+      wrong+=nodes[idx]->attachTransformStore(store)!=0;
+      break;
+    }
+  wrong+=nodes[0]->attachTransformStore(store)!=0;
+  CHECK(wrong==0);
+  
+  scene_update_transforms();
+  CHECK(test_compare(nodes)==0);
+  
+  for(frame=0;frame<TEST_FRAMES;frame++) {
+    for(idx=0;idx<TEST_NODES;idx++) {
+      if (rand()%4) continue;
+      nodes[idx]->staticTransform=test_random();
+      if (!attached[idx]) continue;
+      if (frame%2) {
+        store->local(nodes[idx]->transformStoreHandle())=
+          nodes[idx]->staticTransform;
+      } else {
+        nodes[idx]->invalidateTransform();
+      }
+    }
+    scene_update_transforms();
+    wrong+=test_compare(nodes);
+  }
+  CHECK(wrong==0);
+  
+  // only the store changes, which moves all nodes below attached ones
+  for(idx=0;idx<TEST_NODES;idx++) if (attached[idx]) {
+    nodes[idx]->staticTransform=test_random();
+    store->local(nodes[idx]->transformStoreHandle())=
+      nodes[idx]->staticTransform;
+  }
+  store->update();
+  scene_update_transforms();
+  CHECK(test_compare(nodes)==0);
+  
+  // and nothing changes
+  version=scene_transform_version();
+  scene_update_transforms();
+  CHECK(scene_transform_version()==version);
+  CHECK(test_compare(nodes)==0);
+  
+  nodes[0]->drop();
+  nodes[1]->drop();
+  CHECK(store->count()==0);
+  store->drop();
+}
+
+int main(int argn, char **argv) {
+  test_store();
+  test_nodes();
+  
+  return TEST_RESULT("transformstore");
+}
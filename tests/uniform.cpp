@@ -0,0 +1,131 @@
+
+/** \file uniform.cpp
+  * \author Peter Wagener
+  * \brief Tests of the std140 and std430 layouts of UniformBlock.
+  *
+  * Offsets and strides are checked against the values worked out by hand
+  * from the rules of section 7.6.2.2 of the GL 4.5 specification, which
+  * GLSL reports for the same declarations. Neither needs a GL context, as
+  * blocks only touch the GL once they are uploaded.
+  */
+
+#include <string.h>
+
+#include "diyyma/uniform.h"
+#include "test.h"
+
+/** \brief Members of the tested block, declared in GLSL as
+  *
+  * \code
+  * float  a;
+  * vec3   b;
+  * float  c;
+  * vec2   d;
+  * mat3   e;
+  * float  f[3];
+  * vec3   g;
+  * int    h;
+  * dvec3  i;
+  * vec4   j[2];
+  * vec2   k[3];
+  * mat2   l[2];
+  * bool   m;
+  * \endcode
+  */
+static const GLenum test_formats[]={
+  UNIFORM_FLOAT, UNIFORM_VEC3, UNIFORM_FLOAT, UNIFORM_VEC2, UNIFORM_MAT3,
+  UNIFORM_FLOAT, UNIFORM_VEC3, UNIFORM_INT, UNIFORM_DVEC3, UNIFORM_VEC4,
+  UNIFORM_VEC2, UNIFORM_MAT2, UNIFORM_BOOL };
+static const unsigned test_counts[]={ 1,1,1,1,1, 3,1,1,1,2, 3,2,1 };
+
+#define TEST_MEMBERS (sizeof(test_counts)/sizeof(test_counts[0]))
+
+static const size_t test_std140Offsets[TEST_MEMBERS]={
+  0, 16, 28, 32, 48, 96, 144, 156, 160, 192, 224, 272, 336 };
+static const size_t test_std140Strides[TEST_MEMBERS]={
+  4, 12, 4, 8, 48, 16, 12, 4, 24, 16, 16, 32, 4 };
+
+static const size_t test_std430Offsets[TEST_MEMBERS]={
+  0, 16, 28, 32, 48, 96, 112, 124, 128, 160, 192, 216, 248 };
+static const size_t test_std430Strides[TEST_MEMBERS]={
+  4, 12, 4, 8, 48, 4, 12, 4, 24, 16, 8, 16, 4 };
+
+static void test_layout(int layout,
+  const size_t *offsets, const size_t *strides, size_t cb) {
+  UniformBlock block(layout);
+  unsigned idx;
+  
+  for(idx=0;idx<TEST_MEMBERS;idx++)
+    CHECK(block.add(test_formats[idx],test_counts[idx])==idx);
+  
+  for(idx=0;idx<TEST_MEMBERS;idx++) {
+    if (block.offset(idx)!=offsets[idx])
+      printf("member %u: offset %lu, expected %lu\n",idx,
+        (unsigned long)block.offset(idx),(unsigned long)offsets[idx]);
+    CHECK(block.offset(idx)==offsets[idx]);
+    CHECK(block.stride(idx)==strides[idx]);
+  }
+  
+  CHECK(block.offset(5,2)==offsets[5]+2*strides[5]);
+  CHECK(block.cb()==cb);
+  CHECK(block.add(UNIFORM_FORMAT_COUNT)==(unsigned)-1);
+  CHECK(block.add(UNIFORM_FLOAT,0)==(unsigned)-1);
+}
+
+/** \brief Values are spread out to their offsets, matrices column by
+  * column.
+  */
+static void test_set(int layout) {
+  UniformBlock block(layout);
+  Matrixf M(
+    11,12,13,14,
+    21,22,23,24,
+    31,32,33,34,
+    41,42,43,44);
+  unsigned f, mat3, mat2, flag;
+  unsigned char yes=1, *data;
+  size_t cs=layout==UNIFORM_LAYOUT_STD140?16:8;
+  float v;
+  GLuint b;
+  int i, j, wrong=0;
+  
+  f   =block.add(UNIFORM_FLOAT,3);
+  mat3=block.add(UNIFORM_MAT3);
+  mat2=block.add(UNIFORM_MAT2);
+  flag=block.add(UNIFORM_BOOL);
+  data=(unsigned char*)block.data();
+  
+  block.set(f,2.5f,2);
+  block.set(mat3,M);
+  block.set(mat2,M);
+  block.set(flag,(const void*)&yes);
+  
+  memcpy(&v,data+block.offset(f,2),4);
+  CHECK(v==2.5f);
+  memcpy(&v,data+block.offset(f,1),4);
+  CHECK(v==0);
+  
+  for(j=0;j<3;j++) for(i=0;i<3;i++) {
+    memcpy(&v,data+block.offset(mat3)+16*j+4*i,4);
+    wrong+=v!=(float)(10*(i+1)+j+1);
+  }
+  for(j=0;j<2;j++) for(i=0;i<2;i++) {
+    memcpy(&v,data+block.offset(mat2)+cs*j+4*i,4);
+    wrong+=v!=(float)(10*(i+1)+j+1);
+  }
+  CHECK(wrong==0);
+  
+  memcpy(&b,data+block.offset(flag),4);
+  CHECK(b==1);
+}
+
+int main(int argn, char **argv) {
+  test_layout(UNIFORM_LAYOUT_STD140,test_std140Offsets,test_std140Strides,
+    352);
+  test_layout(UNIFORM_LAYOUT_STD430,test_std430Offsets,test_std430Strides,
+    256);
+  test_set(UNIFORM_LAYOUT_STD140);
+  test_set(UNIFORM_LAYOUT_STD430);
+  
+  return TEST_RESULT("uniform");
+}